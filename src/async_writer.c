@@ -0,0 +1,487 @@
+#include "async_writer.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define handle_error(msg) \
+        do { perror(msg); exit(EXIT_FAILURE); } while (0)
+
+// user_data of the no-op that tells the thread to stop
+#define STOP_TOKEN 0
+
+
+/*
+ * A buffer of a stream's bytes, written at offset. Several writes to the
+ * stream may be merged into one buffer while the one ahead is in flight.
+ */
+typedef struct AsyncWrite {
+    AsyncStream *stream;
+    char *data;
+    size_t length;         // bytes in data
+    size_t landed;         // bytes of it written so far
+    off_t offset;
+    int in_flight;
+    struct AsyncWrite *next;
+} AsyncWrite;
+
+
+// The parts of the rings mapped from the kernel
+typedef struct {
+    unsigned *head;
+    unsigned *tail;
+    unsigned mask;
+} Ring;
+
+
+/*
+ * AsyncWriter - one io_uring; writers submit to it under the mutex and the
+ * thread reaps its completions. Each stream's head write is in flight, so
+ * the submission ring never holds more than num_buffers writes and the
+ * stop.
+ */
+typedef struct AsyncWriterStruct {
+    int ring_fd;
+    Ring sq;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    Ring cq;
+    struct io_uring_cqe *cqes;
+    void *sq_map;             // the mappings, to unmap
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+
+    size_t buffer_size;
+    char *slab;               // num_buffers buffers of buffer_size
+    AsyncWrite *writes;       // one for each buffer
+    AsyncWrite *free;         // writes not in use
+    pthread_mutex_t mutex;    // protects streams, writes and submission
+    pthread_cond_t freed;     // a write was returned to free
+    pthread_t thread;
+} AsyncWriter;
+
+
+static int ring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+
+static int ring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                      unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+
+/**
+ * Map the rings of a new io_uring into the writer.
+ * @return 0 on success, -1 on failure
+ */
+static int map_rings(AsyncWriter *writer, struct io_uring_params *params) {
+    int fd = writer->ring_fd;
+
+    writer->sq_map_size = params->sq_off.array +
+                          params->sq_entries * sizeof(unsigned);
+    writer->cq_map_size = params->cq_off.cqes +
+                          params->cq_entries * sizeof(struct io_uring_cqe);
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        if (writer->cq_map_size > writer->sq_map_size) {
+            writer->sq_map_size = writer->cq_map_size;
+        }
+    }
+
+    writer->sq_map = mmap(NULL, writer->sq_map_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (writer->sq_map == MAP_FAILED) {
+        return -1;
+    }
+
+    writer->cq_map = writer->sq_map;
+    if (!(params->features & IORING_FEAT_SINGLE_MMAP)) {
+        writer->cq_map = mmap(NULL, writer->cq_map_size,
+                              PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, fd,
+                              IORING_OFF_CQ_RING);
+        if (writer->cq_map == MAP_FAILED) {
+            munmap(writer->sq_map, writer->sq_map_size);
+            return -1;
+        }
+    }
+
+    writer->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    writer->sqes = mmap(NULL, writer->sqes_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (writer->sqes == MAP_FAILED) {
+        if (writer->cq_map != writer->sq_map) {
+            munmap(writer->cq_map, writer->cq_map_size);
+        }
+        munmap(writer->sq_map, writer->sq_map_size);
+        return -1;
+    }
+
+    char *sq = writer->sq_map;
+    writer->sq.head = (unsigned *)(sq + params->sq_off.head);
+    writer->sq.tail = (unsigned *)(sq + params->sq_off.tail);
+    writer->sq.mask = *(unsigned *)(sq + params->sq_off.ring_mask);
+    writer->sq_array = (unsigned *)(sq + params->sq_off.array);
+
+    char *cq = writer->cq_map;
+    writer->cq.head = (unsigned *)(cq + params->cq_off.head);
+    writer->cq.tail = (unsigned *)(cq + params->cq_off.tail);
+    writer->cq.mask = *(unsigned *)(cq + params->cq_off.ring_mask);
+    writer->cqes = (struct io_uring_cqe *)(cq + params->cq_off.cqes);
+
+    return 0;
+}
+
+
+/**
+ * Put one operation on the submission ring and submit it. Call with the
+ * mutex held.
+ */
+static void submit(AsyncWriter *writer, int opcode, int fd, const char *data,
+                   size_t length, off_t offset, uint64_t user_data) {
+    unsigned tail = *writer->sq.tail;
+    unsigned index = tail & writer->sq.mask;
+    struct io_uring_sqe *sqe = &writer->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = (unsigned)length;
+    sqe->off = (uint64_t)offset;
+    sqe->user_data = user_data;
+    writer->sq_array[index] = index;
+
+    // The kernel must see the entry before the new tail
+    __atomic_store_n(writer->sq.tail, tail + 1, __ATOMIC_RELEASE);
+
+    while (ring_enter(writer->ring_fd, 1, 0, 0) == -1) {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            handle_error("io_uring_enter");
+        }
+    }
+}
+
+
+/**
+ * Start the rest of a stream's head write. Call with the mutex held.
+ */
+static void submit_head(AsyncWriter *writer, AsyncStream *stream) {
+    AsyncWrite *write = stream->head;
+    write->in_flight = 1;
+    submit(writer, IORING_OP_WRITE, stream->fd, write->data + write->landed,
+           write->length - write->landed, write->offset + write->landed,
+           (uint64_t)(uintptr_t)write);
+}
+
+
+/**
+ * Return a write to the free list. Call with the mutex held.
+ */
+static void release(AsyncWriter *writer, AsyncWrite *write) {
+    write->next = writer->free;
+    writer->free = write;
+    pthread_cond_signal(&writer->freed);
+}
+
+
+/**
+ * Handle the completion of a stream's head write: go on to its next write,
+ * or the rest of this one if it was short. On failure the writes queued
+ * behind it are dropped.
+ * @param writer - The writer
+ * @param write - The completed write
+ * @param result - Bytes written, or minus the errno
+ */
+static void complete(AsyncWriter *writer, AsyncWrite *write, int result) {
+    AsyncStream *stream = write->stream;
+    int finished = 0;
+
+    pthread_mutex_lock(&writer->mutex);
+    write->in_flight = 0;
+
+    if (result == -EINTR || result == -EAGAIN) {
+        submit_head(writer, stream);
+    } else if (result <= 0) {
+        // A write that makes no progress would only be tried forever
+        stream->error = result < 0 ? -result : EIO;
+        while (stream->head) {
+            AsyncWrite *next = stream->head->next;
+            release(writer, stream->head);
+            stream->head = next;
+        }
+        stream->tail = NULL;
+    } else {
+        // Under the mutex, so a close can't finish the stream first
+        if (stream->landed) {
+            stream->landed(stream, result);
+        }
+
+        write->landed += result;
+        if (write->landed < write->length) {
+            submit_head(writer, stream);
+        } else {
+            stream->head = write->next;
+            if (!stream->head) {
+                stream->tail = NULL;
+            }
+            release(writer, write);
+            if (stream->head) {
+                submit_head(writer, stream);
+            }
+        }
+    }
+
+    finished = stream->closed && !stream->head;
+    pthread_mutex_unlock(&writer->mutex);
+
+    if (finished) {
+        stream->done(stream, stream->error);
+    }
+}
+
+
+/**
+ * Reaps completions from the ring, until the stop no-op comes back.
+ */
+static void *writer_thread(void *arg) {
+    AsyncWriter *writer = (AsyncWriter *)arg;
+
+    for (;;) {
+        if (ring_enter(writer->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) == -1 &&
+            errno != EINTR) {
+            handle_error("io_uring_enter");
+        }
+
+        unsigned head = *writer->cq.head;
+        unsigned tail = __atomic_load_n(writer->cq.tail, __ATOMIC_ACQUIRE);
+
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &writer->cqes[head & writer->cq.mask];
+            uint64_t user_data = cqe->user_data;
+            int result = cqe->res;
+
+            // Give the entry back before the callbacks run
+            ++head;
+            __atomic_store_n(writer->cq.head, head, __ATOMIC_RELEASE);
+
+            if (user_data == STOP_TOKEN) {
+                return NULL;
+            }
+            complete(writer, (AsyncWrite *)(uintptr_t)user_data, result);
+        }
+    }
+}
+
+
+/**
+ * Allocate a writer and start its thread
+ * @param num_buffers - The most buffers in flight at once
+ * @param buffer_size - The size in bytes of each buffer
+ * @return writer - Pointer to the allocated writer, or NULL if io_uring is
+ *                  not available
+ */
+AsyncWriter *async_writer_alloc(int num_buffers, size_t buffer_size) {
+    AsyncWriter *writer = malloc(sizeof(AsyncWriter));
+    if (!writer) {
+        handle_error("malloc");
+    }
+
+    // Room for every buffer's write and the stop
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    writer->ring_fd = ring_setup(num_buffers + 1, &params);
+    if (writer->ring_fd == -1) {
+        free(writer);
+        return NULL;
+    }
+    if (map_rings(writer, &params) != 0) {
+        close(writer->ring_fd);
+        free(writer);
+        return NULL;
+    }
+
+    writer->buffer_size = buffer_size;
+    writer->slab = malloc(num_buffers * buffer_size);
+    writer->writes = malloc(num_buffers * sizeof(AsyncWrite));
+    if (!writer->slab || !writer->writes) {
+        handle_error("malloc");
+    }
+
+    writer->free = NULL;
+    for (int i = num_buffers - 1; i >= 0; i--) {
+        writer->writes[i].data = writer->slab + i * buffer_size;
+        writer->writes[i].next = writer->free;
+        writer->free = &writer->writes[i];
+    }
+
+    pthread_mutex_init(&writer->mutex, NULL);
+    pthread_cond_init(&writer->freed, NULL);
+
+    if (pthread_create(&writer->thread, NULL, writer_thread, writer) != 0) {
+        handle_error("pthread_create");
+    }
+
+    return writer;
+}
+
+
+/**
+ * Stop a writer's thread and free it
+ *
+ * Don't call this function while streams are still open.
+ *
+ * @param writer - Pointer to the writer to free
+ */
+void async_writer_free(AsyncWriter *writer) {
+    pthread_mutex_lock(&writer->mutex);
+    submit(writer, IORING_OP_NOP, -1, NULL, 0, 0, STOP_TOKEN);
+    pthread_mutex_unlock(&writer->mutex);
+
+    if (pthread_join(writer->thread, NULL) != 0) {
+        handle_error("pthread_join");
+    }
+
+    munmap(writer->sqes, writer->sqes_size);
+    if (writer->cq_map != writer->sq_map) {
+        munmap(writer->cq_map, writer->cq_map_size);
+    }
+    munmap(writer->sq_map, writer->sq_map_size);
+    close(writer->ring_fd);
+
+    pthread_cond_destroy(&writer->freed);
+    pthread_mutex_destroy(&writer->mutex);
+    free(writer->writes);
+    free(writer->slab);
+    free(writer);
+}
+
+
+/**
+ * Open a stream of writes into a file.
+ * @param writer - The writer
+ * @param stream - The stream to open
+ * @param fd - The file to write to, kept open until done is called
+ * @param offset - Offset in the file of the stream's first byte
+ * @param landed - Called as bytes reach the file, or NULL
+ * @param done - Called once the stream is closed and has landed
+ * @param arg - For the callbacks
+ */
+void async_stream_open(AsyncWriter *writer, AsyncStream *stream, int fd,
+                       off_t offset,
+                       void (*landed)(AsyncStream *stream, size_t length),
+                       void (*done)(AsyncStream *stream, int error),
+                       void *arg) {
+    stream->writer = writer;
+    stream->fd = fd;
+    stream->offset = offset;
+    stream->landed = landed;
+    stream->done = done;
+    stream->arg = arg;
+    stream->head = NULL;
+    stream->tail = NULL;
+    stream->closed = 0;
+    stream->error = 0;
+}
+
+
+/**
+ * Write the next bytes of a stream. They are copied, so data can be
+ * reused at once. Blocks while every buffer is in flight.
+ * @param stream - The open stream
+ * @param data - The bytes to write
+ * @param length - Number of bytes of data
+ * @return 0 on success, -1 if a write of the stream has failed
+ */
+int async_write(AsyncStream *stream, const char *data, size_t length) {
+    AsyncWriter *writer = stream->writer;
+
+    pthread_mutex_lock(&writer->mutex);
+    while (length > 0 && !stream->error) {
+        AsyncWrite *tail = stream->tail;
+
+        // Top up the last write, if it is still waiting its turn
+        if (tail && !tail->in_flight && tail->length < writer->buffer_size) {
+            size_t take = writer->buffer_size - tail->length;
+            if (take > length) {
+                take = length;
+            }
+            memcpy(tail->data + tail->length, data, take);
+            tail->length += take;
+            stream->offset += take;
+            data += take;
+            length -= take;
+            continue;
+        }
+
+        if (!writer->free) {
+            pthread_cond_wait(&writer->freed, &writer->mutex);
+            continue;
+        }
+
+        AsyncWrite *write = writer->free;
+        writer->free = write->next;
+        write->stream = stream;
+        write->length = 0;
+        write->landed = 0;
+        write->offset = stream->offset;
+        write->in_flight = 0;
+        write->next = NULL;
+
+        size_t take = length < writer->buffer_size ? length :
+                                                     writer->buffer_size;
+        memcpy(write->data, data, take);
+        write->length = take;
+        stream->offset += take;
+        data += take;
+        length -= take;
+
+        if (tail) {
+            tail->next = write;
+        } else {
+            stream->head = write;
+        }
+        stream->tail = write;
+
+        // Nothing ahead of it, so it goes at once
+        if (stream->head == write) {
+            submit_head(writer, stream);
+        }
+    }
+
+    int rc = stream->error ? -1 : 0;
+    pthread_mutex_unlock(&writer->mutex);
+
+    return rc;
+}
+
+
+/**
+ * Close a stream. Nothing more may be written to it; done is called once
+ * its writes have landed, which may be before this returns.
+ * @param stream - The open stream
+ */
+void async_stream_close(AsyncStream *stream) {
+    AsyncWriter *writer = stream->writer;
+
+    pthread_mutex_lock(&writer->mutex);
+    stream->closed = 1;
+    int finished = !stream->head;
+    pthread_mutex_unlock(&writer->mutex);
+
+    // Nothing left in flight for the thread to finish it with
+    if (finished) {
+        stream->done(stream, stream->error);
+    }
+}
@@ -0,0 +1,109 @@
+#ifndef ASYNC_WRITER_H
+#define ASYNC_WRITER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+
+/*
+ * AsyncWriter - writes to files at given offsets completed in the
+ * background through io_uring, so whoever has the bytes goes on while the
+ * disk catches up. Bytes are copied into a bounded set of buffers; once
+ * every buffer is in flight, writers wait for one to land, so a slow disk
+ * holds the network back instead of memory growing without bound.
+ *
+ * Writes go through streams, one per range of a file being filled in
+ * order. A stream has at most one write in flight, and its bytes land in
+ * the order they were written, so what has landed is always a prefix.
+ * Small writes queued behind the one in flight are merged into one.
+ * Callbacks are run on the writer's thread, but for the done of a stream
+ * with nothing left in flight when it is closed.
+ * The implementation is hidden from the outside.
+ */
+typedef struct AsyncWriterStruct AsyncWriter;
+
+
+/*
+ * A stream of writes into a file, filled in by async_stream_open. The
+ * caller keeps it alive until done has been called for it.
+ */
+typedef struct AsyncStream {
+    AsyncWriter *writer;
+    int fd;
+    off_t offset;          // where the next write goes
+
+    // Called as bytes reach the file, in order, with the writer's mutex
+    // held, so it must not call into the writer
+    void (*landed)(struct AsyncStream *stream, size_t length);
+
+    // Called once the stream is closed and its last write has landed, with
+    // 0, or the errno of the write that failed
+    void (*done)(struct AsyncStream *stream, int error);
+
+    void *arg;             // for the callbacks
+
+    // Private to the writer
+    struct AsyncWrite *head;  // writes not yet landed; the head in flight
+    struct AsyncWrite *tail;
+    int closed;
+    int error;
+} AsyncStream;
+
+
+/**
+ * Allocate a writer and start its thread
+ * @param num_buffers - The most buffers in flight at once
+ * @param buffer_size - The size in bytes of each buffer
+ * @return writer - Pointer to the allocated writer, or NULL if io_uring is
+ *                  not available
+ */
+AsyncWriter *async_writer_alloc(int num_buffers, size_t buffer_size);
+
+
+/**
+ * Stop a writer's thread and free it
+ *
+ * Don't call this function while streams are still open.
+ *
+ * @param writer - Pointer to the writer to free
+ */
+void async_writer_free(AsyncWriter *writer);
+
+
+/**
+ * Open a stream of writes into a file.
+ * @param writer - The writer
+ * @param stream - The stream to open
+ * @param fd - The file to write to, kept open until done is called
+ * @param offset - Offset in the file of the stream's first byte
+ * @param landed - Called as bytes reach the file, or NULL
+ * @param done - Called once the stream is closed and has landed
+ * @param arg - For the callbacks
+ */
+void async_stream_open(AsyncWriter *writer, AsyncStream *stream, int fd,
+                       off_t offset,
+                       void (*landed)(AsyncStream *stream, size_t length),
+                       void (*done)(AsyncStream *stream, int error),
+                       void *arg);
+
+
+/**
+ * Write the next bytes of a stream. They are copied, so data can be
+ * reused at once. Blocks while every buffer is in flight.
+ * @param stream - The open stream
+ * @param data - The bytes to write
+ * @param length - Number of bytes of data
+ * @return 0 on success, -1 if a write of the stream has failed
+ */
+int async_write(AsyncStream *stream, const char *data, size_t length);
+
+
+/**
+ * Close a stream. Nothing more may be written to it; done is called once
+ * its writes have landed, which may be before this returns.
+ * @param stream - The open stream
+ */
+void async_stream_close(AsyncStream *stream);
+
+
+#endif
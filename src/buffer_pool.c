@@ -0,0 +1,147 @@
+#include "buffer_pool.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+// Buffers in the slab start on this boundary, so they can hold any type
+#define BUFFER_ALIGN 64
+
+#define handle_error(msg) \
+        do { perror(msg); exit(EXIT_FAILURE); } while (0)
+
+
+/*
+ * BufferPool - a thread-safe pool of equal sized buffers.
+ * The free buffers of the slab are kept on a stack, so the buffer handed
+ * out is the one most recently returned, and likely still in cache.
+ */
+typedef struct BufferPoolStruct {
+    char *slab;            // count buffers, each stride bytes apart
+    size_t buffer_size;    // size of a buffer as asked for
+    size_t stride;         // buffer_size rounded up to BUFFER_ALIGN
+    int count;             // buffers in the slab
+    void **free;           // stack of slab buffers not handed out
+    int num_free;
+    pthread_mutex_t mutex; // for mutual exclusion of accessing the stack
+} BufferPool;
+
+
+/**
+ * Allocate a buffer pool
+ * @param buffer_size - The size in bytes of each buffer
+ * @param count - The number of buffers in the slab, usually the most that
+ *                are in use at once
+ * @return pool - Pointer to the allocated pool
+ */
+BufferPool *buffer_pool_alloc(size_t buffer_size, int count) {
+    BufferPool *pool = malloc(sizeof(BufferPool));
+    if (!pool) {
+        handle_error("malloc");
+    }
+
+    pool->buffer_size = buffer_size;
+    pool->stride = (buffer_size + BUFFER_ALIGN - 1) &
+                   ~(size_t)(BUFFER_ALIGN - 1);
+    pool->count = count;
+    pool->num_free = count;
+
+    if (posix_memalign((void **)&pool->slab, BUFFER_ALIGN,
+                       pool->stride * count) != 0) {
+        handle_error("posix_memalign");
+    }
+
+    pool->free = malloc(sizeof(void *) * count);
+    if (!pool->free) {
+        handle_error("malloc");
+    }
+
+    // Handed out lowest address first
+    for (int i = 0; i < count; i++) {
+        pool->free[i] = &pool->slab[(count - 1 - i) * pool->stride];
+    }
+
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0) {
+        handle_error("pthread_mutex_init");
+    }
+
+    return pool;
+}
+
+
+/**
+ * Free a buffer pool and its slab
+ *
+ * Don't call this function while buffers from the slab are still in use.
+ *
+ * @param pool - Pointer to the pool to free
+ */
+void buffer_pool_free(BufferPool *pool) {
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->free);
+    free(pool->slab);
+    free(pool);
+}
+
+
+/**
+ * Take a buffer out of the pool. Its contents are whatever its last user
+ * left in it.
+ * @param pool - Pointer to the pool
+ * @return A buffer of the pool's buffer size, owned by the caller until it
+ *         is returned with buffer_pool_put
+ */
+void *buffer_pool_get(BufferPool *pool) {
+    void *buffer = NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->num_free > 0) {
+        buffer = pool->free[--pool->num_free];
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    // The slab is used up: fall back to the heap
+    if (!buffer) {
+        buffer = malloc(pool->buffer_size);
+        if (!buffer) {
+            handle_error("malloc");
+        }
+    }
+
+    return buffer;
+}
+
+
+/**
+ * Return a buffer taken with buffer_pool_get, to be handed out again.
+ * @param pool - Pointer to the pool the buffer came from
+ * @param buffer - The buffer to return, or NULL to do nothing
+ */
+void buffer_pool_put(BufferPool *pool, void *buffer) {
+    uintptr_t start = (uintptr_t)pool->slab;
+    uintptr_t address = (uintptr_t)buffer;
+
+    if (!buffer) {
+        return;
+    }
+
+    if (address < start || address >= start + pool->stride * pool->count) {
+        free(buffer);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->free[pool->num_free++] = buffer;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+
+/**
+ * Get the size of the buffers of a pool.
+ * @param pool - Pointer to the pool
+ * @return The size in bytes of each buffer
+ */
+size_t buffer_pool_buffer_size(BufferPool *pool) {
+    return pool->buffer_size;
+}
@@ -0,0 +1,64 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+
+
+/*
+ * BufferPool - a thread-safe pool of equal sized buffers, carved out of one
+ * slab allocated up front and recycled through a free list, so buffers
+ * needed for every request or chunk are not malloc'd and freed each time.
+ * When every buffer of the slab is in use, further buffers are malloc'd,
+ * and freed again when they are returned.
+ * The implementation is hidden from the outside.
+ */
+typedef struct BufferPoolStruct BufferPool;
+
+
+/**
+ * Allocate a buffer pool
+ * @param buffer_size - The size in bytes of each buffer
+ * @param count - The number of buffers in the slab, usually the most that
+ *                are in use at once
+ * @return pool - Pointer to the allocated pool
+ */
+BufferPool *buffer_pool_alloc(size_t buffer_size, int count);
+
+
+/**
+ * Free a buffer pool and its slab
+ *
+ * Don't call this function while buffers from the slab are still in use.
+ *
+ * @param pool - Pointer to the pool to free
+ */
+void buffer_pool_free(BufferPool *pool);
+
+
+/**
+ * Take a buffer out of the pool. Its contents are whatever its last user
+ * left in it.
+ * @param pool - Pointer to the pool
+ * @return A buffer of the pool's buffer size, owned by the caller until it
+ *         is returned with buffer_pool_put
+ */
+void *buffer_pool_get(BufferPool *pool);
+
+
+/**
+ * Return a buffer taken with buffer_pool_get, to be handed out again.
+ * @param pool - Pointer to the pool the buffer came from
+ * @param buffer - The buffer to return, or NULL to do nothing
+ */
+void buffer_pool_put(BufferPool *pool, void *buffer);
+
+
+/**
+ * Get the size of the buffers of a pool.
+ * @param pool - Pointer to the pool
+ * @return The size in bytes of each buffer
+ */
+size_t buffer_pool_buffer_size(BufferPool *pool);
+
+
+#endif
@@ -0,0 +1,243 @@
+#define _GNU_SOURCE
+
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "manifest.h"
+
+#define PATH_SIZE 1024
+
+// Size of the buffer used to copy a file where copy_file_range can't
+#define COPY_BUF_SIZE (64 * 1024)
+
+
+/**
+ * Work out the paths of a url's entry: the body, and its manifest.
+ * @return 0 on success, -1 if the paths don't fit
+ */
+static int entry_paths(const char *cache_dir, const char *url, char *body,
+                       char *meta) {
+    // 64-bit FNV-1a of the url
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *c = url; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    }
+
+    int length = snprintf(body, PATH_SIZE, "%s/%016llx", cache_dir,
+                          (unsigned long long)hash);
+    if (length < 0 || length + 5 >= PATH_SIZE) {
+        fprintf(stderr, "cache path too long: %s\n", cache_dir);
+        return -1;
+    }
+    snprintf(meta, PATH_SIZE, "%s.meta", body);
+
+    return 0;
+}
+
+
+/**
+ * Copy the contents of one open file to another, in the kernel where
+ * possible.
+ * @return 0 on success, -1 on failure
+ */
+static int copy_contents(int in, int out) {
+    for (;;) {
+        ssize_t copied = copy_file_range(in, NULL, out, NULL, 1 << 30, 0);
+        if (copied == 0) {
+            return 0;
+        }
+        if (copied > 0) {
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+            errno != EOPNOTSUPP) {
+            perror("copy_file_range");
+            return -1;
+        }
+        break;
+    }
+
+    char buf[COPY_BUF_SIZE];
+    ssize_t got;
+    while ((got = read(in, buf, COPY_BUF_SIZE)) != 0) {
+        if (got == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            return -1;
+        }
+
+        for (ssize_t put = 0; put < got; ) {
+            ssize_t written = write(out, buf + put, got - put);
+            if (written == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("write");
+                return -1;
+            }
+            put += written;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Give the contents of from a second name, to, replacing whatever is
+ * there: a reflink if the filesystem can clone files, which shares the
+ * blocks but not the inode; otherwise a hard link; otherwise a copy.
+ * Built under a temporary name and renamed into place, so to is never
+ * seen half made.
+ * @return 0 on success, -1 on failure
+ */
+static int share_file(const char *from, const char *to) {
+    char temp_path[PATH_SIZE];
+    if (snprintf(temp_path, PATH_SIZE, "%s.tmp", to) >= PATH_SIZE) {
+        fprintf(stderr, "path too long: %s\n", to);
+        return -1;
+    }
+    unlink(temp_path);
+
+    int in = open(from, O_RDONLY);
+    if (in == -1) {
+        perror("open");
+        return -1;
+    }
+
+    int rc = -1;
+    int out = open(temp_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (out != -1) {
+#ifdef FICLONE
+        rc = ioctl(out, FICLONE, in);
+#endif
+        close(out);
+    }
+
+    if (rc != 0) {
+        unlink(temp_path);
+        rc = link(from, temp_path);
+    }
+
+    if (rc != 0) {
+        out = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out == -1) {
+            perror("open");
+        } else {
+            rc = copy_contents(in, out);
+            if (close(out) != 0) {
+                perror("close");
+                rc = -1;
+            }
+        }
+    }
+    close(in);
+
+    if (rc == 0 && rename(temp_path, to) != 0) {
+        perror("rename");
+        rc = -1;
+    }
+
+    // Left behind on failure, or when to was already a link to from,
+    // which rename leaves alone
+    unlink(temp_path);
+
+    return rc;
+}
+
+
+/**
+ * Look up the cached copy of a url.
+ * @param cache_dir - The cache directory
+ * @param url - The url
+ * @param length - Set to the length of the cached copy
+ * @param validator - Set to the validators it was served with
+ * @return 0 if there is a complete copy, -1 otherwise
+ */
+int cache_lookup(const char *cache_dir, const char *url, off_t *length,
+                 HttpValidator *validator) {
+    char body[PATH_SIZE], meta[PATH_SIZE];
+    if (entry_paths(cache_dir, url, body, meta) != 0) {
+        return -1;
+    }
+
+    Manifest manifest;
+    if (manifest_load(&manifest, meta) != 0) {
+        return -1;
+    }
+    manifest_clear(&manifest);
+
+    // Another url with the same hash, or a body that was lost or cut short
+    struct stat st;
+    if (strcmp(manifest.url, url) != 0 || stat(body, &st) != 0 ||
+        st.st_size != manifest.content_length) {
+        return -1;
+    }
+
+    *length = manifest.content_length;
+    *validator = manifest.validator;
+    return 0;
+}
+
+
+/**
+ * Keep a completed download in the cache, replacing any older copy of the
+ * url. A resource without validators isn't kept, as there would be no way
+ * to revalidate it.
+ * @param cache_dir - The cache directory
+ * @param url - The url the file was downloaded from
+ * @param path - The downloaded file
+ * @param length - Length of the file in bytes
+ * @param validator - Validators the resource was served with
+ * @return 0 on success, -1 if the file was not kept
+ */
+int cache_store(const char *cache_dir, const char *url, const char *path,
+                off_t length, const HttpValidator *validator) {
+    char body[PATH_SIZE], meta[PATH_SIZE];
+    if ((!validator->etag[0] && !validator->last_modified[0]) ||
+        strlen(url) >= MANIFEST_URL_SIZE ||
+        entry_paths(cache_dir, url, body, meta) != 0) {
+        return -1;
+    }
+
+    // Without its manifest the old body is never used, even half replaced
+    unlink(meta);
+    if (share_file(path, body) != 0) {
+        return -1;
+    }
+
+    Manifest manifest;
+    manifest_init(&manifest, url, length, validator);
+    return manifest_save(&manifest, meta);
+}
+
+
+/**
+ * Put the cached copy of a url at path, replacing whatever is there.
+ * @param cache_dir - The cache directory
+ * @param url - The url, which cache_lookup found
+ * @param path - Where to put the copy
+ * @return 0 on success, -1 on failure
+ */
+int cache_place(const char *cache_dir, const char *url, const char *path) {
+    char body[PATH_SIZE], meta[PATH_SIZE];
+    if (entry_paths(cache_dir, url, body, meta) != 0) {
+        return -1;
+    }
+
+    return share_file(body, path);
+}
@@ -0,0 +1,60 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <sys/types.h>
+
+#include "http.h"
+
+
+/*
+ * Cache - completed downloads kept in a directory between runs, so a later
+ * run can revalidate them with a conditional request instead of fetching
+ * them again. Entries are keyed by url: the body is stored under a hash of
+ * the url, beside a manifest with no chunks recording the url, length and
+ * validators it was served with.
+ *
+ * Bodies are shared with the destinations they came from or were placed
+ * in: by a reflink where the filesystem can clone files, otherwise by a
+ * hard link, falling back to a copy across filesystems. So a destination
+ * must be replaced, never written over in place.
+ */
+
+
+/**
+ * Look up the cached copy of a url.
+ * @param cache_dir - The cache directory
+ * @param url - The url
+ * @param length - Set to the length of the cached copy
+ * @param validator - Set to the validators it was served with
+ * @return 0 if there is a complete copy, -1 otherwise
+ */
+int cache_lookup(const char *cache_dir, const char *url, off_t *length,
+                 HttpValidator *validator);
+
+
+/**
+ * Keep a completed download in the cache, replacing any older copy of the
+ * url. A resource without validators isn't kept, as there would be no way
+ * to revalidate it.
+ * @param cache_dir - The cache directory
+ * @param url - The url the file was downloaded from
+ * @param path - The downloaded file
+ * @param length - Length of the file in bytes
+ * @param validator - Validators the resource was served with
+ * @return 0 on success, -1 if the file was not kept
+ */
+int cache_store(const char *cache_dir, const char *url, const char *path,
+                off_t length, const HttpValidator *validator);
+
+
+/**
+ * Put the cached copy of a url at path, replacing whatever is there.
+ * @param cache_dir - The cache directory
+ * @param url - The url, which cache_lookup found
+ * @param path - Where to put the copy
+ * @return 0 on success, -1 on failure
+ */
+int cache_place(const char *cache_dir, const char *url, const char *path);
+
+
+#endif
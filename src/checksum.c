@@ -0,0 +1,485 @@
+#include "checksum.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CHECKSUM_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+// Reflected polynomial of CRC32C (Castagnoli)
+#define CRC32C_POLY 0x82f63b78
+
+
+// Tables for the portable CRC32C, eight bytes at a time
+static uint32_t crc_table[8][256];
+
+static pthread_once_t setup_once = PTHREAD_ONCE_INIT;
+static int have_crc_instructions;   // SSE4.2
+static int have_sha_instructions;   // SHA extensions, with SSSE3 and SSE4.1
+static int use_hardware = 1;
+
+
+static const uint32_t sha_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+
+/**
+ * Build the CRC tables and find out what the CPU can do. Run once.
+ */
+static void setup(void) {
+    for (int i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc_table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            uint32_t prev = crc_table[t - 1][i];
+            crc_table[t][i] = (prev >> 8) ^ crc_table[0][prev & 0xff];
+        }
+    }
+
+#ifdef CHECKSUM_X86
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        have_crc_instructions = (ecx & bit_SSE4_2) != 0;
+        int ssse3 = (ecx & bit_SSSE3) && (ecx & bit_SSE4_1);
+
+        if (ssse3 && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+            have_sha_instructions = (ebx & bit_SHA) != 0;
+        }
+    }
+#endif
+}
+
+
+/**
+ * Choose whether the CPU's checksum instructions are used, where it has
+ * them. They are by default; turning them off is for comparing the two.
+ * @param enabled - 1 to use them, 0 for the portable code
+ */
+void checksum_use_hardware(int enabled) {
+    use_hardware = enabled;
+}
+
+
+/**
+ * Portable CRC32C of a buffer, on the raw (not inverted) register.
+ */
+static uint32_t crc32c_portable(uint32_t crc, const uint8_t *data,
+                                size_t length) {
+    while (length >= 8) {
+        uint32_t low, high;
+        memcpy(&low, data, 4);
+        memcpy(&high, data + 4, 4);
+        low ^= crc;
+
+        // Byte order: the tables take the bytes in the order they come
+        crc = crc_table[7][low & 0xff] ^ crc_table[6][(low >> 8) & 0xff] ^
+              crc_table[5][(low >> 16) & 0xff] ^ crc_table[4][low >> 24] ^
+              crc_table[3][high & 0xff] ^ crc_table[2][(high >> 8) & 0xff] ^
+              crc_table[1][(high >> 16) & 0xff] ^ crc_table[0][high >> 24];
+        data += 8;
+        length -= 8;
+    }
+
+    while (length-- > 0) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *data++) & 0xff];
+    }
+    return crc;
+}
+
+
+#ifdef CHECKSUM_X86
+/**
+ * CRC32C of a buffer with the SSE4.2 crc32 instruction, on the raw
+ * register.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data,
+                             size_t length) {
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)crc64;
+#endif
+
+    while (length-- > 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+
+/**
+ * Continue a CRC32C over more data.
+ * @param crc - CRC32C of the data so far, 0 for none
+ * @param data - The data that follows
+ * @param length - Number of bytes of data
+ * @return CRC32C of the data so far followed by data
+ */
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t length) {
+    pthread_once(&setup_once, setup);
+    crc = ~crc;
+
+#ifdef CHECKSUM_X86
+    if (use_hardware && have_crc_instructions) {
+        return ~crc32c_sse42(crc, data, length);
+    }
+#endif
+    return ~crc32c_portable(crc, data, length);
+}
+
+
+/**
+ * Multiply a vector over GF(2) by a 32x32 matrix, one word per column.
+ */
+static uint32_t gf2_times(const uint32_t *matrix, uint32_t vector) {
+    uint32_t sum = 0;
+    for (; vector; vector >>= 1, matrix++) {
+        if (vector & 1) {
+            sum ^= *matrix;
+        }
+    }
+    return sum;
+}
+
+
+static void gf2_square(uint32_t *square, const uint32_t *matrix) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = gf2_times(matrix, matrix[n]);
+    }
+}
+
+
+/**
+ * Combine the CRC32Cs of two adjacent ranges into that of both together.
+ *
+ * Appending length2 zero bytes to the first range is a linear map of its
+ * CRC, applied by squaring the map for one zero bit, as in zlib's
+ * crc32_combine; the second CRC is then added in.
+ *
+ * @param crc1 - CRC32C of the first range
+ * @param crc2 - CRC32C of the second range
+ * @param length2 - Number of bytes in the second range
+ * @return CRC32C of the first range followed by the second
+ */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, off_t length2) {
+    if (length2 <= 0) {
+        return crc1;
+    }
+
+    uint32_t even[32];  // maps for even powers of two zero bits
+    uint32_t odd[32];   // and for odd ones
+
+    // One zero bit
+    odd[0] = CRC32C_POLY;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = 1u << (n - 1);
+    }
+
+    gf2_square(even, odd);  // two zero bits
+    gf2_square(odd, even);  // four zero bits
+
+    // The first square below gives one zero byte
+    do {
+        gf2_square(even, odd);
+        if (length2 & 1) {
+            crc1 = gf2_times(even, crc1);
+        }
+        length2 >>= 1;
+        if (length2 == 0) {
+            break;
+        }
+
+        gf2_square(odd, even);
+        if (length2 & 1) {
+            crc1 = gf2_times(odd, crc1);
+        }
+        length2 >>= 1;
+    } while (length2 != 0);
+
+    return crc1 ^ crc2;
+}
+
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+
+/**
+ * Portable SHA-256 of whole 64 byte blocks.
+ */
+static void sha256_blocks_portable(uint32_t *state, const uint8_t *data,
+                                   size_t blocks) {
+    for (; blocks > 0; blocks--, data += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)data[i * 4] << 24 |
+                   (uint32_t)data[i * 4 + 1] << 16 |
+                   (uint32_t)data[i * 4 + 2] << 8 | data[i * 4 + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^
+                          (w[i - 15] >> 3);
+            uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^
+                          (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (int i = 0; i < 64; i++) {
+            uint32_t s1 = ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25);
+            uint32_t choose = (e & f) ^ (~e & g);
+            uint32_t t1 = h + s1 + choose + sha_k[i] + w[i];
+            uint32_t s0 = ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22);
+            uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t t2 = s0 + majority;
+
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+
+#ifdef CHECKSUM_X86
+/**
+ * SHA-256 of whole 64 byte blocks with the SHA extensions. Each
+ * sha256rnds2 does two rounds on the state held as ABEF and CDGH; the
+ * message schedule is four words to a register, extended with
+ * sha256msg1 and sha256msg2 four at a time.
+ */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_blocks_shani(uint32_t *state, const uint8_t *data,
+                                size_t blocks) {
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                             0x0405060700010203ULL);
+
+    // From ABCD and EFGH to the ABEF and CDGH the instructions use
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)&state[0]),
+                                    0xb1);                      // CDAB
+    __m128i state1 = _mm_shuffle_epi32(
+                         _mm_loadu_si128((__m128i *)&state[4]), 0x1b); // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);           // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);                // CDGH
+
+    for (; blocks > 0; blocks--, data += 64) {
+        __m128i abef = state0;
+        __m128i cdgh = state1;
+        __m128i msg[4];
+
+        for (int i = 0; i < 4; i++) {
+            msg[i] = _mm_shuffle_epi8(
+                         _mm_loadu_si128((__m128i *)(data + i * 16)),
+                         byte_swap);
+        }
+
+        // Sixteen groups of four rounds; the schedule for group g + 1 is
+        // finished during group g, from group 3 onwards
+        for (int g = 0; g < 16; g++) {
+            __m128i *cur = &msg[g % 4];
+            __m128i *prev = &msg[(g + 3) % 4];
+            __m128i *next = &msg[(g + 1) % 4];
+
+            __m128i k = _mm_loadu_si128((__m128i *)&sha_k[g * 4]);
+            __m128i words = _mm_add_epi32(*cur, k);
+            state1 = _mm_sha256rnds2_epu32(state1, state0, words);
+
+            if (g >= 3 && g < 15) {
+                *next = _mm_add_epi32(*next, _mm_alignr_epi8(*cur, *prev, 4));
+                *next = _mm_sha256msg2_epu32(*next, *cur);
+            }
+
+            words = _mm_shuffle_epi32(words, 0x0e);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, words);
+
+            if (g >= 1 && g < 13) {
+                *prev = _mm_sha256msg1_epu32(*prev, *cur);
+            }
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    // And back again
+    tmp = _mm_shuffle_epi32(state0, 0x1b);                      // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xb1);                   // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);                // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);                   // HGFE
+
+    _mm_storeu_si128((__m128i *)&state[0], state0);
+    _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+#endif
+
+
+static void sha256_blocks(uint32_t *state, const uint8_t *data,
+                          size_t blocks) {
+#ifdef CHECKSUM_X86
+    if (use_hardware && have_sha_instructions) {
+        sha256_blocks_shani(state, data, blocks);
+        return;
+    }
+#endif
+    sha256_blocks_portable(state, data, blocks);
+}
+
+
+/**
+ * Start a SHA-256
+ * @param sha - The hash to start
+ */
+void sha256_init(Sha256 *sha) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    pthread_once(&setup_once, setup);
+    memcpy(sha->state, initial, sizeof(initial));
+    sha->length = 0;
+    sha->used = 0;
+}
+
+
+/**
+ * Add data to a SHA-256
+ * @param sha - The hash
+ * @param data - The data to add
+ * @param length - Number of bytes of data
+ */
+void sha256_update(Sha256 *sha, const void *data, size_t length) {
+    const uint8_t *bytes = data;
+    sha->length += length;
+
+    // Top up a partly filled block first
+    if (sha->used > 0) {
+        size_t take = 64 - sha->used;
+        if (take > length) {
+            take = length;
+        }
+        memcpy(sha->block + sha->used, bytes, take);
+        sha->used += take;
+        bytes += take;
+        length -= take;
+
+        if (sha->used < 64) {
+            return;
+        }
+        sha256_blocks(sha->state, sha->block, 1);
+        sha->used = 0;
+    }
+
+    sha256_blocks(sha->state, bytes, length / 64);
+    bytes += length / 64 * 64;
+    length %= 64;
+
+    memcpy(sha->block, bytes, length);
+    sha->used = length;
+}
+
+
+/**
+ * Finish a SHA-256
+ * @param sha - The hash, which can't be added to afterwards
+ * @param digest - Set to the SHA256_SIZE byte digest
+ */
+void sha256_final(Sha256 *sha, uint8_t *digest) {
+    uint64_t bits = sha->length * 8;
+
+    // A one bit, zeros up to the last eight bytes, then the length in bits
+    uint8_t padding[72] = { 0x80 };
+    size_t pad = sha->used < 56 ? 56 - sha->used : 120 - sha->used;
+    for (int i = 0; i < 8; i++) {
+        padding[pad + i] = (uint8_t)(bits >> (56 - 8 * i));
+    }
+    sha256_update(sha, padding, pad + 8);
+
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = (uint8_t)(sha->state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(sha->state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(sha->state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)sha->state[i];
+    }
+}
+
+
+/**
+ * Parse a digest written in hex, either case.
+ * @param hex - The digest e.g. e3069283
+ * @param digest - Set to the bytes of the digest
+ * @param size - Number of bytes expected
+ * @return 0 on success, -1 if hex isn't exactly size bytes of hex
+ */
+int checksum_parse_hex(const char *hex, uint8_t *digest, size_t size) {
+    if (strlen(hex) != size * 2) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        unsigned int byte;
+        if (!strchr("0123456789abcdefABCDEF", hex[i * 2]) ||
+            !strchr("0123456789abcdefABCDEF", hex[i * 2 + 1]) ||
+            sscanf(&hex[i * 2], "%2x", &byte) != 1) {
+            return -1;
+        }
+        digest[i] = (uint8_t)byte;
+    }
+    return 0;
+}
+
+
+/**
+ * Write a digest in lower case hex.
+ * @param digest - The bytes of the digest
+ * @param size - Number of bytes
+ * @param hex - Buffer of at least 2 * size + 1 bytes
+ */
+void checksum_format_hex(const uint8_t *digest, size_t size, char *hex) {
+    for (size_t i = 0; i < size; i++) {
+        sprintf(&hex[i * 2], "%02x", digest[i]);
+    }
+    hex[size * 2] = '\0';
+}
@@ -0,0 +1,104 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Bytes in a SHA-256 digest
+#define SHA256_SIZE 32
+
+
+/*
+ * Checksum - CRC32C and SHA-256, computed incrementally. Both use the
+ * CPU's instructions for them where it has them (SSE4.2 crc32 and the SHA
+ * extensions on x86), chosen at run time, and portable code otherwise.
+ *
+ * A CRC32C is that of the iSCSI standard: crc32c_update of 0 over
+ * "123456789" gives 0xe3069283. CRCs of adjacent ranges computed
+ * separately can be combined into that of the whole, so chunks can be
+ * checksummed as they arrive, in any order.
+ */
+
+
+/**
+ * Continue a CRC32C over more data.
+ * @param crc - CRC32C of the data so far, 0 for none
+ * @param data - The data that follows
+ * @param length - Number of bytes of data
+ * @return CRC32C of the data so far followed by data
+ */
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t length);
+
+
+/**
+ * Combine the CRC32Cs of two adjacent ranges into that of both together.
+ * @param crc1 - CRC32C of the first range
+ * @param crc2 - CRC32C of the second range
+ * @param length2 - Number of bytes in the second range
+ * @return CRC32C of the first range followed by the second
+ */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, off_t length2);
+
+
+// A SHA-256 in progress
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;       // bytes hashed so far
+    uint8_t block[64];     // bytes not yet making up a whole block
+    size_t used;
+} Sha256;
+
+
+/**
+ * Start a SHA-256
+ * @param sha - The hash to start
+ */
+void sha256_init(Sha256 *sha);
+
+
+/**
+ * Add data to a SHA-256
+ * @param sha - The hash
+ * @param data - The data to add
+ * @param length - Number of bytes of data
+ */
+void sha256_update(Sha256 *sha, const void *data, size_t length);
+
+
+/**
+ * Finish a SHA-256
+ * @param sha - The hash, which can't be added to afterwards
+ * @param digest - Set to the SHA256_SIZE byte digest
+ */
+void sha256_final(Sha256 *sha, uint8_t *digest);
+
+
+/**
+ * Choose whether the CPU's checksum instructions are used, where it has
+ * them. They are by default; turning them off is for comparing the two.
+ * @param enabled - 1 to use them, 0 for the portable code
+ */
+void checksum_use_hardware(int enabled);
+
+
+/**
+ * Parse a digest written in hex, either case.
+ * @param hex - The digest e.g. e3069283
+ * @param digest - Set to the bytes of the digest
+ * @param size - Number of bytes expected
+ * @return 0 on success, -1 if hex isn't exactly size bytes of hex
+ */
+int checksum_parse_hex(const char *hex, uint8_t *digest, size_t size);
+
+
+/**
+ * Write a digest in lower case hex.
+ * @param digest - The bytes of the digest
+ * @param size - Number of bytes
+ * @param hex - Buffer of at least 2 * size + 1 bytes
+ */
+void checksum_format_hex(const uint8_t *digest, size_t size, char *hex);
+
+
+#endif
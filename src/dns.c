@@ -0,0 +1,286 @@
+
+#include "dns.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <netdb.h>
+
+#define HOST_SIZE 256
+#define MAX_ADDRS 16
+
+#define handle_error(msg) \
+        do { perror(msg); exit(EXIT_FAILURE); } while (0)
+
+
+// The resolved addresses of one host and port
+typedef struct DnsEntry {
+    char host[HOST_SIZE];
+    int port;
+    DnsAddress addrs[MAX_ADDRS];
+    int num_addrs;           // number of valid addrs, -1 if lookup failed
+    int resolving;           // a thread is currently calling getaddrinfo
+    time_t expires;          // when the addresses must be looked up again
+    struct DnsEntry *next;
+} DnsEntry;
+
+
+/*
+ * DnsCache - a thread-safe cache of resolved server addresses.
+ * Entries are kept in a list; the number of distinct hosts a download
+ * touches is small. While one thread resolves a host, others asking for
+ * the same host wait on resolved rather than issuing their own lookup.
+ */
+typedef struct DnsCacheStruct {
+    DnsEntry *entries;
+    int ttl;                  // seconds a resolved host stays cached
+    int family;               // address family passed to getaddrinfo
+    pthread_mutex_t mutex;    // for mutual exclusion of accessing entries
+    pthread_cond_t resolved;  // signalled when a lookup completes
+} DnsCache;
+
+
+/**
+ * Allocate a DNS cache
+ * @param ttl - Seconds a resolved host stays cached
+ * @param family - Address family to resolve, e.g. AF_INET or AF_UNSPEC
+ * @return cache - Pointer to the allocated cache
+ */
+DnsCache *dns_alloc(int ttl, int family) {
+    DnsCache *cache = malloc(sizeof(DnsCache));
+    if (!cache) {
+        handle_error("malloc");
+    }
+
+    cache->entries = NULL;
+    cache->ttl = ttl;
+    cache->family = family;
+
+    if (pthread_mutex_init(&cache->mutex, NULL) != 0) {
+        handle_error("pthread_mutex_init");
+    }
+
+    if (pthread_cond_init(&cache->resolved, NULL) != 0) {
+        handle_error("pthread_cond_init");
+    }
+
+    return cache;
+}
+
+
+/**
+ * Free a DNS cache and all of its entries
+ *
+ * Don't call this function while the cache is still in use.
+ *
+ * @param cache - Pointer to the cache to free
+ */
+void dns_free(DnsCache *cache) {
+    DnsEntry *entry = cache->entries;
+
+    while (entry) {
+        DnsEntry *next = entry->next;
+        free(entry);
+        entry = next;
+    }
+
+    pthread_cond_destroy(&cache->resolved);
+    pthread_mutex_destroy(&cache->mutex);
+    free(cache);
+}
+
+
+/**
+ * Find the entry for a host and port. Must be called with the mutex held.
+ * @return The entry, or NULL if the host has never been looked up
+ */
+static DnsEntry *find_entry(DnsCache *cache, const char *host, int port) {
+    for (DnsEntry *entry = cache->entries; entry; entry = entry->next) {
+        if (entry->port == port && strcmp(entry->host, host) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Look up a host with getaddrinfo, filling in the entry's addresses.
+ * Called without the mutex held, so other hosts can be resolved meanwhile.
+ */
+static void lookup(DnsCache *cache, DnsEntry *entry) {
+    char port_string[16];
+    snprintf(port_string, sizeof(port_string), "%d", entry->port);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = cache->family;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *result;
+    int status = getaddrinfo(entry->host, port_string, &hints, &result);
+    if (status != 0) {
+        fprintf(stderr, "getaddrinfo %s: %s\n", entry->host,
+                gai_strerror(status));
+        entry->num_addrs = -1;
+        return;
+    }
+
+    int n = 0;
+    for (struct addrinfo *ai = result; ai && n < MAX_ADDRS; ai = ai->ai_next) {
+        if (ai->ai_addrlen > sizeof(struct sockaddr_storage)) {
+            continue;
+        }
+        entry->addrs[n].family = ai->ai_family;
+        entry->addrs[n].length = ai->ai_addrlen;
+        memcpy(&entry->addrs[n].addr, ai->ai_addr, ai->ai_addrlen);
+        ++n;
+    }
+
+    freeaddrinfo(result);
+    entry->num_addrs = n > 0 ? n : -1;
+    if (n > 0) {
+        dns_interleave(entry->addrs, n);
+    }
+}
+
+
+/**
+ * Find the next address at or after from whose family is, or if same is 0
+ * isn't, the given one.
+ * @return Its index, or num_addrs if there is none
+ */
+static int next_address(const DnsAddress *addrs, int num_addrs, int from,
+                        int family, int same) {
+    while (from < num_addrs && (addrs[from].family == family) != same) {
+        ++from;
+    }
+    return from;
+}
+
+
+/**
+ * Reorder addresses so that their families alternate, starting with the
+ * family of the first, and otherwise keeping their order. Connecting to
+ * them in turn then tries an IPv4 address second after an IPv6 one, or
+ * the other way around, as happy eyeballs (RFC 8305) does.
+ *
+ * @param addrs - The addresses to reorder
+ * @param num_addrs - Number of addresses
+ */
+void dns_interleave(DnsAddress *addrs, int num_addrs) {
+    if (num_addrs < 2) {
+        return;
+    }
+
+    DnsAddress ordered[num_addrs];
+    int family = addrs[0].family;
+    int same = 0;
+    int other = next_address(addrs, num_addrs, 0, family, 0);
+
+    for (int i = 0; i < num_addrs; i++) {
+        if ((i % 2 == 0 && same < num_addrs) || other == num_addrs) {
+            ordered[i] = addrs[same];
+            same = next_address(addrs, num_addrs, same + 1, family, 1);
+        } else {
+            ordered[i] = addrs[other];
+            other = next_address(addrs, num_addrs, other + 1, family, 0);
+        }
+    }
+
+    memcpy(addrs, ordered, sizeof(ordered));
+}
+
+
+/**
+ * Resolve a host and port to its addresses, in the order getaddrinfo
+ * returned them but with their families interleaved by dns_interleave,
+ * using the cached result if it has not expired.
+ *
+ * @param cache - Pointer to the cache
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param port - The port number e.g. 80
+ * @param addrs - Array to copy up to max_addrs addresses into
+ * @param max_addrs - Capacity of addrs
+ * @return The number of addresses copied into addrs, or -1 on failure
+ */
+int dns_resolve(DnsCache *cache, const char *host, int port,
+                DnsAddress *addrs, int max_addrs) {
+    if (strlen(host) >= HOST_SIZE) {
+        fprintf(stderr, "host name too long: %s\n", host);
+        return -1;
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+
+    DnsEntry *entry = find_entry(cache, host, port);
+    if (!entry) {
+        entry = calloc(1, sizeof(DnsEntry));
+        if (!entry) {
+            handle_error("calloc");
+        }
+        strcpy(entry->host, host);
+        entry->port = port;
+        entry->next = cache->entries;
+        cache->entries = entry;
+    }
+
+    // Wait out a lookup of the same host already in progress, and share
+    // its result rather than repeating it
+    int joined = 0;
+    while (entry->resolving) {
+        joined = 1;
+        pthread_cond_wait(&cache->resolved, &cache->mutex);
+    }
+
+    int fresh = entry->num_addrs > 0 && time(NULL) < entry->expires;
+
+    if (!fresh && !joined) {
+        entry->resolving = 1;
+        pthread_mutex_unlock(&cache->mutex);
+
+        lookup(cache, entry);
+
+        pthread_mutex_lock(&cache->mutex);
+        entry->resolving = 0;
+        // Failed lookups are not cached beyond the threads that joined them
+        entry->expires = entry->num_addrs > 0 ? time(NULL) + cache->ttl : 0;
+        pthread_cond_broadcast(&cache->resolved);
+    }
+
+    int n = entry->num_addrs;
+    if (n > max_addrs) {
+        n = max_addrs;
+    }
+    if (n > 0) {
+        memcpy(addrs, entry->addrs, n * sizeof(DnsAddress));
+    }
+
+    pthread_mutex_unlock(&cache->mutex);
+
+    return n > 0 ? n : -1;
+}
+
+
+/**
+ * Drop the cached addresses of a host, e.g. after none of them could be
+ * connected to, so the next dns_resolve asks the resolver again.
+ *
+ * @param cache - Pointer to the cache
+ * @param host - The host name
+ * @param port - The port number
+ */
+void dns_invalidate(DnsCache *cache, const char *host, int port) {
+    pthread_mutex_lock(&cache->mutex);
+
+    DnsEntry *entry = find_entry(cache, host, port);
+    if (entry && !entry->resolving) {
+        entry->num_addrs = 0;
+        entry->expires = 0;
+    }
+
+    pthread_mutex_unlock(&cache->mutex);
+}
@@ -0,0 +1,82 @@
+#ifndef DNS_H
+#define DNS_H
+
+#include <sys/socket.h>
+
+
+/*
+ * DnsCache - a thread-safe cache of resolved server addresses, keyed by
+ * host and port. Entries expire after a fixed time to live. Concurrent
+ * lookups of the same uncached host share a single getaddrinfo call.
+ * The implementation is hidden from the outside.
+ */
+typedef struct DnsCacheStruct DnsCache;
+
+
+// One resolved address of a host, ready to pass to socket() and connect()
+typedef struct {
+    int family;                   // address family e.g. AF_INET
+    socklen_t length;             // length of addr in bytes
+    struct sockaddr_storage addr; // the socket address
+} DnsAddress;
+
+
+/**
+ * Allocate a DNS cache
+ * @param ttl - Seconds a resolved host stays cached
+ * @param family - Address family to resolve, e.g. AF_INET or AF_UNSPEC
+ * @return cache - Pointer to the allocated cache
+ */
+DnsCache *dns_alloc(int ttl, int family);
+
+
+/**
+ * Free a DNS cache and all of its entries
+ *
+ * Don't call this function while the cache is still in use.
+ *
+ * @param cache - Pointer to the cache to free
+ */
+void dns_free(DnsCache *cache);
+
+
+/**
+ * Resolve a host and port to its addresses, in the order getaddrinfo
+ * returned them but with their families interleaved by dns_interleave,
+ * using the cached result if it has not expired.
+ *
+ * @param cache - Pointer to the cache
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param port - The port number e.g. 80
+ * @param addrs - Array to copy up to max_addrs addresses into
+ * @param max_addrs - Capacity of addrs
+ * @return The number of addresses copied into addrs, or -1 on failure
+ */
+int dns_resolve(DnsCache *cache, const char *host, int port,
+                DnsAddress *addrs, int max_addrs);
+
+
+/**
+ * Reorder addresses so that their families alternate, starting with the
+ * family of the first, and otherwise keeping their order. Connecting to
+ * them in turn then tries an IPv4 address second after an IPv6 one, or
+ * the other way around, as happy eyeballs (RFC 8305) does.
+ *
+ * @param addrs - The addresses to reorder
+ * @param num_addrs - Number of addresses
+ */
+void dns_interleave(DnsAddress *addrs, int num_addrs);
+
+
+/**
+ * Drop the cached addresses of a host, e.g. after none of them could be
+ * connected to, so the next dns_resolve asks the resolver again.
+ *
+ * @param cache - Pointer to the cache
+ * @param host - The host name
+ * @param port - The port number
+ */
+void dns_invalidate(DnsCache *cache, const char *host, int port);
+
+
+#endif
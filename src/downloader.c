@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -5,32 +7,426 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <dirent.h>
+#include <time.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
 
 #include "http.h"
 #include "queue.h"
+#include "engine.h"
+#include "manifest.h"
+#include "buffer_pool.h"
+#include "stats.h"
+#include "cache.h"
+#include "checksum.h"
+#include "async_writer.h"
 
 #define FILE_SIZE 256
 
+// Default maximum number of URLs being probed, fetched or merged at once
+#define DEFAULT_MAX_DOWNLOADS 4
+
+// Default smallest chunk a download is split into; files no larger than
+// this are fetched in a single request
+#define DEFAULT_MIN_CHUNK (256 * 1024)
+
+// Adaptive chunks are sized to take about this long on one connection
+#define TARGET_CHUNK_SECONDS 1.0
+
+// Weight of the newest sample in the per-connection throughput average
+#define THROUGHPUT_ALPHA 0.3
+
+// Size of the buffer used to copy part files into the destination
+#define MERGE_BUF_SIZE (64 * 1024)
+
+// Room for the longest suffix put on a destination's path, a part file's
+// ".<offset>" or the manifest's ".manifest.tmp" while it is saved
+#define PATH_SUFFIX_SIZE 24
+
+// Most part files handed to the writer thread at once
+#define MERGE_QUEUE_SIZE 16
+
+// Buffers of chunk bodies in flight to the disk at once with -i, and the
+// size of each
+#define ASYNC_BUFFERS 64
+#define ASYNC_BUFFER_SIZE (128 * 1024)
+
+// Size of a task's range string e.g. 0-500
+#define RANGE_SIZE 64
+
+// Most often, in seconds, a download's manifest is saved while it runs
+#define MANIFEST_SAVE_INTERVAL 1.0
+
+// Size of the reason kept for a failed download
+#define ERROR_SIZE 128
+
+// Default number of times a chunk or probe that failed for a reason that
+// may pass is tried again, resuming a chunk from its first missing byte
+#define DEFAULT_MAX_RETRIES 4
+
+// Default most seconds spent connecting to a server
+#define DEFAULT_CONNECT_TIMEOUT 10
+
+// The pause before a retry doubles from RETRY_BASE_DELAY seconds with each
+// attempt, up to RETRY_MAX_DELAY, and is jittered
+#define RETRY_BASE_DELAY 0.25
+#define RETRY_MAX_DELAY  8.0
+
+// Failed chunks in a row after which a mirror is given no more work
+#define MIRROR_MAX_FAILURES 3
+
+// Buckets of the set of destinations already named in the url_file
+#define SEEN_BUCKETS 1024
+
+// Seconds the daemon waits for the rest of a job being submitted
+#define JOB_READ_TIMEOUT 10
+
+// Seconds a line to a submitter waits for it to read, before it is dropped
+#define JOB_SEND_TIMEOUT 5
+
+
+typedef enum {
+    WORKERS_THREADS, // one blocking connection per worker thread
+    WORKERS_EPOLL    // many non-blocking connections per event loop thread
+} WorkerMode;
+
+
+typedef enum {
+    ASSEMBLE_DIRECT, // pwrite each chunk at its offset in the destination
+    ASSEMBLE_PARTS   // write part files, copying each into the destination
+                     // as it completes, and remove them once all are in
+} AssemblyMode;
+
+
+typedef enum {
+    POLICY_FIFO,     // in the order of the url_file
+    POLICY_SMALLEST, // the download with the fewest bytes left to assign
+                     // first, for the least mean time to completion
+    POLICY_PRIORITY, // the highest priority= first
+    POLICY_DEADLINE  // the earliest deadline= first, those without last
+} SchedulePolicy;
+
+
+// A byte range of a download: a completed chunk, whose part file for
+// ASSEMBLE_PARTS is named after its offset, or a gap still to be fetched
+typedef struct {
+    off_t offset;  // offset of the range in the destination
+    off_t length;  // bytes in the range (written, for a completed chunk)
+    uint32_t crc;  // CRC32C of a completed chunk's bytes, if has_crc
+    int has_crc;   // 0 for a chunk resumed from an earlier run, whose
+                   // bytes didn't pass through this one
+} Part;
+
+
+// One of the origins a download can be fetched from, with how it has done
 typedef struct {
     char *url;
-    int min_range;
-    int max_range;
-    Buffer *result;
+    double throughput;        // average bytes/s of one connection to it, 0
+                              // if nothing has been measured yet
+    int inflight;             // chunks handed to it and not yet returned
+    int failures;             // chunks failed in a row
+    int dropped;              // it failed, ignored ranges or served a
+                              // different resource, so gets no more chunks
+} Mirror;
+
+
+struct Task;
+struct Context;
+struct Job;
+
+
+/*
+ * A single line of the url_file, tracked from the HEAD probe until its
+ * last part is in place. Several downloads may be in flight at once.
+ * Chunks are cut from the front of the unassigned range as workers become
+ * free, so each chunk can be sized from the latest throughput
+ * measurements.
+ *
+ * Progress is saved to a manifest beside the destination as chunks
+ * complete. A download resumed from one has several unassigned ranges,
+ * the gaps between the chunks already on disk; they are cut into chunks
+ * one after another.
+ *
+ * A download may list several mirrors of the same resource. Only the
+ * origin, the mirror it was probed from, is trusted for the length and
+ * validators; the chunks are spread over every mirror by how fast each
+ * has been.
+ */
+typedef struct Download {
+    char *url;                // the first mirror's url, naming the download
+    Mirror *mirrors;
+    int num_mirrors;
+    int origin;               // index of the mirror probed
+    char filename[FILE_SIZE]; // destination name, url without its scheme
+                              // and with '/' replaced
+    const char *dir;          // directory the destination is written in
+    struct Job *job;          // in daemon mode, the job it came in, or NULL
+    off_t content_length;     // from the probe task, -1 on failure
+    HttpValidator validator;  // from the probe task
+    int single;               // the server ignores ranges, so the download
+                              // is fetched whole in one stream
+    int falling_back;         // set when a chunk found ranges ignored: the
+                              // download starts over in one stream once its
+                              // chunks in flight have returned
+    off_t next_offset;        // start of the range not yet given to a chunk
+    off_t range_end;          // end (exclusive) of that unassigned range
+    Part *gaps;               // further unassigned ranges, when resuming
+    int num_gaps;
+    int next_gap;             // index of the gap after the current range
+    struct Task *inflight;    // chunk tasks handed out and not yet returned
+    int failed;               // a chunk of the download failed
+    int changed;              // the resource changed during the download
+    int restarts;             // times started over after a change
+    int retrying;             // its tasks waiting out a retry's backoff
+    char error[ERROR_SIZE];   // why the download failed, for the report
+    struct timespec started;  // when the download was admitted
+    RequestTotals totals;     // the download's requests so far
+    int cached;               // there is a copy in the cache, to revalidate
+    off_t cached_length;      // its length and validators
+    HttpValidator cached_validator;
+    int priority;             // from the url_file, higher served first
+                              // with POLICY_PRIORITY
+    double deadline;          // from the url_file, seconds into the run it
+                              // should be done by, 0 for none
+    int check_crc;            // the url_file gave a CRC32C to check
+    uint32_t expected_crc;
+    int check_sha;            // the url_file gave a SHA-256 to check
+    uint8_t expected_sha[SHA256_SIZE];
+    Sha256 sha;               // of the destination up to hashed, by the
+    off_t hashed;             // writer thread, which hashes the bytes in
+                              // order as they become contiguous
+    int corrupt;              // the completed download failed its check
+    int fd;                   // destination file
+    double manifest_saved;    // when its manifest was last saved
+    int merging;              // part files queued for, or being copied by,
+                              // the writer thread, for ASSEMBLE_PARTS, and
+                              // ranges queued for it to hash
+    Part *parts;              // completed chunks
+    int num_parts;
+    int parts_capacity;
+    struct Download *next;    // link in the scheduler's list of downloads,
+                              // or its backlog
+} Download;
+
+
+/*
+ * A url_file submitted to the daemon, with the directory its downloads are
+ * written in and a priority among the other jobs. Its downloads wait in
+ * the job until there is room to admit them, and each one reports back
+ * to the submitter as it finishes.
+ */
+typedef struct Job {
+    int id;
+    int client;               // the submitter's socket, -1 once it is gone
+    char dir[PATH_MAX];       // absolute path of the download directory
+    int priority;             // higher jobs are served first
+    Download *waiting;        // downloads not yet admitted, in file order
+    int total;                // downloads in the job
+    int active;               // admitted and not yet finished
+    int finished;             // finished, including those that failed
+    int failed;
+    long long bytes;          // body bytes received for the job so far
+    struct Job *next;         // link in the daemon's inbox, or the
+                              // scheduler's jobs
+} Job;
+
+
+typedef enum {
+    TASK_PROBE,  // HEAD request, or ranged GET of the first chunk, to find
+                 // the content length of a download
+    TASK_CHUNK,  // ranged GET for one chunk of a download
+    TASK_MERGE,  // copy of a completed part file into the destination, run
+                 // by the writer thread; min_range and max_range are the
+                 // bytes it holds
+    TASK_HASH    // SHA-256 of the next bytes of the destination, from
+                 // min_range to max_range, run by the writer thread
+} TaskType;
+
+
+/*
+ * A unit of work for a worker thread. The end of a chunk's range may be
+ * pulled in by the scheduler while the chunk is being downloaded, to hand
+ * its tail to an idle worker; lock protects max_range and received, which
+ * the worker claims before writing so a split never lands inside bytes
+ * that are already being written.
+ */
+typedef struct Task {
+    TaskType type;
+    Download *download;
+    char *url;          // url of the mirror it is fetched from
+    int mirror;         // index of that mirror in the download
+    off_t min_range;
+    off_t max_range;    // inclusive end of the range, may shrink when stolen
+    int status;         // HTTP status of the chunk response, -1 on failure
+    off_t content_length; // result of a probe, -1 on failure; copied
+                          // into the download by main so it is only read
+                          // there
+    HttpResource resource;   // from the probe, or the chunk's response
+    char *probe_data;   // for a GET probe, first bytes of the download,
+                        // max_range + 1 of them at most; NULL for HEAD
+    const HttpValidator *cached; // for a probe, validators of the cached
+                        // copy to revalidate, or NULL
+    const char *if_range;    // validator sent with the chunk's range, or NULL
+    int whole;          // fetch the whole resource, for a single stream
+    size_t received;    // body bytes of the chunk claimed for writing
+    size_t written;     // body bytes of the chunk written to disk
+    uint32_t crc;       // CRC32C of the bytes written
+    int write_error;    // writing the body to disk failed
+    int fd;             // file the chunk body is streamed into
+    off_t base;         // offset in fd that the chunk starts at
+    int async;          // the body is written through the context's disk
+    AsyncStream stream; // writer, its writes in flight
+    struct timespec started;  // when the worker began the request
+    struct timespec finished; // when the worker finished the request
+    HttpTiming timing;  // where the time of the request went
+    int worker;         // index of the thread or engine that ran it
+    int attempts;       // times the range was tried before this
+    double ready_at;    // for a retry, when it may be dispatched
+    pthread_mutex_t lock;
+    struct Task *next;  // link in a pending list or a download's inflight
+
+    // For WORKERS_EPOLL: the request run on an engine for this task
+    struct Context *context;
+    EngineRequest request;
+    char range[RANGE_SIZE];
 }  Task;
 
 
-typedef struct {
+typedef struct Context {
     Queue *todo;
     Queue *done;
 
     pthread_t *threads;
-    int num_workers;
+    int num_threads;
+    int num_workers;          // concurrent connections
+
+    Engine **engines;         // for WORKERS_EPOLL, one per thread
+    int num_engines;
+
+    Queue *merges;            // merge and hash tasks for the writer thread
+    pthread_t writer;
+
+    AssemblyMode assembly;
+    int splice;               // splice chunk bodies into their files
+    AsyncWriter *disk;        // writes chunk bodies in the background, or
+                              // NULL to write them as they arrive
+    int get_probe;            // probe with the first chunk's ranged GET
 
 } Context;
 
+
+// What a worker thread needs to run tasks
+typedef struct {
+    Context *context;
+    int id;                   // index of the thread, for its stats
+} Worker;
+
+
+// What a feeder thread needs to pass tasks to its engine
+typedef struct {
+    Context *context;
+    Engine *engine;
+    int id;                   // index of the engine, for its stats
+} Feeder;
+
+
+/*
+ * FIFO of tasks created by the scheduler but not yet put on the todo queue.
+ * Keeping these local to main means main never blocks on a full todo queue
+ * while workers are blocked on a full done queue.
+ */
+typedef struct {
+    Task *head;
+    Task *tail;
+} TaskList;
+
+
+/*
+ * State of the scheduler, owned by the main thread. Up to max_downloads
+ * urls are in flight at once, so the HEAD probe of one url, the chunks of
+ * another and the merge of a third all overlap. The number of tasks handed
+ * to the workers is capped at capacity, and of merges handed to the writer
+ * at MERGE_QUEUE_SIZE; the done queue has room for both, so neither the
+ * workers nor the writer block on done, and main never blocks on todo or
+ * merges.
+ */
+typedef struct {
+    Context *context;
+    const char *cache_dir;    // where completed downloads are kept between
+                              // runs, or NULL for no cache
+
+    Download *downloads;      // active downloads, oldest first
+    TaskList pending;         // probes and stolen tails awaiting dispatch
+    TaskList retries;         // failed tasks tried again once ready_at
+                              // has passed, in no particular order
+    TaskList merges;          // merges waiting for room on the merge queue
+
+    int max_downloads;        // limit on active downloads
+    int active;               // number of active downloads
+    int capacity;             // limit on outstanding tasks
+    int outstanding;          // tasks on todo, being worked on, or on done
+    int merging;              // merges on the merge queue, being copied, or
+                              // on done
+
+    SchedulePolicy policy;    // which download's chunks are cut first
+    Download *backlog;        // for POLICY_PRIORITY and POLICY_DEADLINE,
+                              // the downloads of the whole url_file not
+                              // yet admitted, in the order they will be
+    double started;           // when the run started, for deadlines
+
+    int min_chunk;            // smallest chunk to split a download into
+    int max_retries;          // times a failed task is tried again
+    unsigned int seed;        // for jittering retries
+    double throughput;        // average bytes/s of one connection, 0 if
+                              // nothing has been measured yet
+
+    BufferPool *tasks;        // Tasks, recycled once their results are in
+    BufferPool *probe_buffers; // bodies of GET probes, min_chunk bytes each;
+                               // NULL without get_probe
+
+    Stats *stats;             // requests, downloads and workers, for the
+                              // progress line and summary
+
+    Job *jobs;                // in daemon mode, the jobs taken from the
+                              // inbox and not yet finished, oldest first
+} Scheduler;
+
+
+/*
+ * The daemon's listener thread, which accepts jobs on a unix socket and
+ * passes them to main through the inbox, waking it with wake_task on the
+ * done queue. SIGINT and SIGTERM stop it taking new jobs; main exits once
+ * the jobs it already has are finished.
+ */
+typedef struct {
+    int listener;             // the listening socket
+    const char *path;         // where it is bound
+    int signals;              // signalfd of SIGINT and SIGTERM
+    Queue *done;              // main's done queue, to wake it
+    int next_id;              // of the next job, for the listener only
+    pthread_t thread;
+
+    pthread_mutex_t mutex;    // protects inbox and stopping
+    Job *inbox;               // jobs received and not yet taken by main,
+                              // oldest first
+    int stopping;             // no more jobs will be received
+} Daemon;
+
+
+// Put on the done queue to wake main, rather than as the result of a task
+static Task wake_task;
+
+
 void create_directory(const char *dir) {
     struct stat st = { 0 };
 
@@ -44,274 +440,4097 @@ void create_directory(const char *dir) {
 }
 
 
-void *worker_thread(void *arg) {
-    Context *context = (Context *)arg;
-
-    Task *task = (Task *)queue_get(context->todo);
-    char *range = (char *)malloc(1024 * sizeof(char));
-    
-    while (task) {
-        snprintf(range, 1024 * sizeof(char), "%d-%d", task->min_range, 
-                 task->max_range);
-    
-        task->result = http_url(task->url, range);
-
-        queue_put(context->done, task);
-        task = (Task *)queue_get(context->todo);
+/**
+ * Write all of data to fd at the given offset, retrying short writes.
+ * @param fd - The file descriptor to write to
+ * @param data - The data to write
+ * @param length - Number of bytes of data
+ * @param offset - Offset in the file to write the data at
+ * @return 0 on success, -1 on failure
+ */
+int write_at(int fd, const char *data, size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t written = pwrite(fd, data, length, offset);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pwrite");
+            return -1;
+        }
+        data += written;
+        length -= written;
+        offset += written;
     }
-    
-    free(range);
-    return NULL;
+    return 0;
 }
 
 
-Context *spawn_workers(int num_workers) {
-    Context *context = (Context*)malloc(sizeof(Context));
+/**
+ * Gets the current length of a chunk task's range, which the scheduler may
+ * shrink while the chunk is in flight.
+ * @param task - The chunk task
+ * @return Length of the range in bytes
+ */
+size_t chunk_length(Task *task) {
+    pthread_mutex_lock(&task->lock);
+    size_t length = task->max_range - task->min_range + 1;
+    pthread_mutex_unlock(&task->lock);
 
-    context->todo = queue_alloc(num_workers * 2);
-    context->done = queue_alloc(num_workers * 2);
+    return length;
+}
 
-    context->num_workers = num_workers;
 
-    context->threads = (pthread_t*)malloc(sizeof(pthread_t) * num_workers);
-    int i = 0;
+/**
+ * Move length bytes from a pipe into fd at the given offset without them
+ * passing through user space, falling back to reading and writing them
+ * for files that can't be spliced into.
+ * @param pipe_fd - The read end of a pipe holding at least length bytes
+ * @param fd - The file descriptor to write to
+ * @param length - Number of bytes to move
+ * @param offset - Offset in the file to write the bytes at
+ * @return 0 on success, -1 on failure
+ */
+int splice_at(int pipe_fd, int fd, size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t moved = splice(pipe_fd, NULL, fd, &offset, length,
+                               SPLICE_F_MOVE);
+        if (moved == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EINVAL) {
+                perror("splice");
+                return -1;
+            }
 
-    for (i = 0; i < num_workers; ++i) {
-        if (pthread_create(&context->threads[i], NULL, worker_thread, context) != 0) {
-            perror("pthread_create");
-            exit(1);
+            char buf[MERGE_BUF_SIZE];
+            size_t want = length < MERGE_BUF_SIZE ? length : MERGE_BUF_SIZE;
+            moved = read(pipe_fd, buf, want);
+            if (moved == -1 && errno == EINTR) {
+                continue;
+            }
+            if (moved == -1) {
+                perror("read");
+                return -1;
+            }
+            if (moved > 0 && write_at(fd, buf, moved, offset) != 0) {
+                return -1;
+            }
+            offset += moved;
         }
+        if (moved == 0) {
+            fprintf(stderr, "splice: unexpected end of pipe\n");
+            return -1;
+        }
+        length -= moved;
     }
-
-    return context;
+    return 0;
 }
 
-void free_workers(Context *context) {
-    int num_workers = context->num_workers;
-    int i = 0;
 
-    for (i = 0; i < num_workers; ++i) {
-        queue_put(context->todo, NULL);
+/**
+ * Claim the next body bytes of a chunk to be written, so a steal cannot
+ * split inside them. Bytes beyond the task's range are not claimed,
+ * whether the server sent more than was asked for or the tail of the range
+ * was stolen by another worker.
+ * @param task - The chunk task being downloaded
+ * @param length - Number of body bytes just received
+ * @param offset - Set to the offset of the claimed bytes in the range
+ * @return Number of bytes claimed
+ */
+size_t claim_bytes(Task *task, size_t length, size_t *offset) {
+    pthread_mutex_lock(&task->lock);
+    size_t expected = task->max_range - task->min_range + 1;
+    *offset = task->received;
+    size_t take = length;
+    if (*offset + take > expected) {
+        take = expected - *offset;
     }
+    task->received += take;
+    pthread_mutex_unlock(&task->lock);
 
-    for (i = 0; i < num_workers; ++i) {
-        if (pthread_join(context->threads[i], NULL) != 0) {
-            perror("pthread_join");
-            exit(1);
-        }
+    return take;
+}
+
+
+/**
+ * Record that bytes claimed with claim_bytes are on disk.
+ */
+void commit_bytes(Task *task, size_t length) {
+    // Bytes are claimed and written in order, so written is a prefix
+    pthread_mutex_lock(&task->lock);
+    task->written += length;
+    pthread_mutex_unlock(&task->lock);
+}
+
+
+/**
+ * BodySink writing the body of a chunk response into the task's file as it
+ * arrives, and for a download with a CRC32C to check, adding the bytes to
+ * the chunk's CRC. Once the range is complete the transfer is stopped.
+ * @param arg - The chunk task being downloaded
+ * @param data - Body bytes just received
+ * @param length - Number of bytes in data
+ * @return 0 to continue, -1 if the range is complete or the write failed
+ */
+int chunk_sink(void *arg, const char *data, size_t length) {
+    Task *task = (Task *)arg;
+
+    size_t offset;
+    size_t take = claim_bytes(task, length, &offset);
+
+    if (take > 0 && write_at(task->fd, data, take, task->base + offset) != 0) {
+        task->write_error = 1;
+        return -1;
     }
 
-    queue_free(context->todo);
-    queue_free(context->done);
+    // Only this worker touches the CRC until the chunk is returned
+    if (task->download->check_crc) {
+        task->crc = crc32c_update(task->crc, data, take);
+    }
+    commit_bytes(task, take);
 
-    free(context->threads);
-    free(context);
+    return take < length ? -1 : 0;
 }
 
 
-Task *new_task(char *url, int min_range, int max_range) {
-    Task *task = malloc(sizeof(Task));
-    task->result = NULL;
-    task->url = malloc(strlen(url) + 1);
-    task->min_range = min_range;
-    task->max_range = max_range;
+/**
+ * BodySink handing the body of a chunk response to the disk writer as it
+ * arrives, like chunk_sink; the bytes are committed as they land.
+ * @param arg - The chunk task being downloaded
+ * @param data - Body bytes just received
+ * @param length - Number of bytes in data
+ * @return 0 to continue, -1 if the range is complete or a write failed
+ */
+int chunk_async_sink(void *arg, const char *data, size_t length) {
+    Task *task = (Task *)arg;
 
-    strcpy(task->url, url);
+    size_t offset;
+    size_t take = claim_bytes(task, length, &offset);
 
-    return task;
+    if (take > 0 && async_write(&task->stream, data, take) != 0) {
+        task->write_error = 1;
+        return -1;
+    }
+
+    if (task->download->check_crc) {
+        task->crc = crc32c_update(task->crc, data, take);
+    }
+
+    return take < length ? -1 : 0;
 }
 
-void free_task(Task *task) {
 
-    if (task->result) {
-        free(task->result->data);
-        free(task->result);
+/**
+ * Called by the disk writer as bytes of a chunk reach the file.
+ */
+void chunk_landed(AsyncStream *stream, size_t length) {
+    commit_bytes((Task *)stream->arg, length);
+}
+
+
+/**
+ * Hand a chunk task back to main, once nothing more is written for it.
+ * @param context - The worker context
+ * @param task - The finished chunk task
+ */
+void return_chunk(Context *context, Task *task) {
+    if (context->assembly == ASSEMBLE_PARTS) {
+        close(task->fd);
     }
+    task->fd = -1;
 
-    free(task->url);
-    free(task);
+    queue_put(context->done, task);
 }
 
 
-void wait_task(const char *download_dir, Context *context) {
-    char filename[FILE_SIZE], url_file[FILE_SIZE];
-    Task *task = (Task*)queue_get(context->done);
+/**
+ * Called by the disk writer once the last bytes of a chunk have landed, or
+ * one of its writes failed, to hand the chunk back to main.
+ */
+void chunk_stored(AsyncStream *stream, int error) {
+    Task *task = (Task *)stream->arg;
 
-    if (task->result) {
+    if (error) {
+        fprintf(stderr, "write: %s\n", strerror(error));
+        task->write_error = 1;
+        task->status = -1;
+    }
+    return_chunk(task->context, task);
+}
 
-        snprintf(url_file, FILE_SIZE * sizeof(char), "%d", task->min_range);
-        size_t len = strlen(url_file);
-        for (int i = 0; i < len; ++i) {
-            if (url_file[i] == '/') {
-                url_file[i] = '|';
-            }
-        }
 
+/**
+ * SpliceSink moving the body of a chunk response from the socket's pipe
+ * into the task's file, like chunk_sink but without copying it.
+ * @param arg - The chunk task being downloaded
+ * @param pipe_fd - The pipe holding body bytes just received
+ * @param length - Number of bytes in the pipe
+ * @return 0 to continue, -1 if the range is complete or the write failed
+ */
+int chunk_splice(void *arg, int pipe_fd, size_t length) {
+    Task *task = (Task *)arg;
 
-        snprintf(filename, FILE_SIZE, "%s/%s", download_dir, url_file);
-        FILE *fp = fopen(filename, "w");
+    size_t offset;
+    size_t take = claim_bytes(task, length, &offset);
 
-        if (fp == NULL) {
-            fprintf(stderr, "error writing to: %s\n", filename);
-            exit(EXIT_FAILURE);
-        }
+    if (take > 0 &&
+        splice_at(pipe_fd, task->fd, take, task->base + offset) != 0) {
+        task->write_error = 1;
+        return -1;
+    }
+    commit_bytes(task, take);
+
+    return take < length ? -1 : 0;
+}
 
-        char *data = http_get_content(task->result);
-        if (data) {
-            size_t length = task->result->length - (data - task->result->data);
 
-            fwrite(data, 1, length, fp);
-            fclose(fp);
+/**
+ * Get a chunk task ready to be downloaded: open the file its body is
+ * streamed into, and its stream to the disk writer if there is one, and
+ * format its range string into task->range.
+ * @param context - The worker context
+ * @param task - The chunk task to download
+ * @return 0 on success, -1 on failure with task->status set to -1
+ */
+int prepare_chunk(Context *context, Task *task) {
+    char filename[PATH_MAX];
 
-            printf("downloaded %d bytes from %s\n", (int)length, task->url);
-        }
-        else {
-            printf("error in response from %s\n", task->url);
+    if (context->assembly == ASSEMBLE_DIRECT) {
+        task->fd = task->download->fd;
+        task->base = task->min_range;
+    } else {
+        snprintf(filename, PATH_MAX, "%s/%s.%lld", task->download->dir,
+                 task->download->filename, (long long)task->min_range);
+        task->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        task->base = 0;
+
+        if (task->fd == -1) {
+            perror("open");
+            task->status = -1;
+            return -1;
         }
+    }
 
+    task->context = context;
+    task->async = context->disk != NULL;
+    if (task->async) {
+        async_stream_open(context->disk, &task->stream, task->fd, task->base,
+                          chunk_landed, chunk_stored, task);
     }
-    else {
 
-        fprintf(stderr, "error downloading: %s\n", task->url);
+    // A single stream asks for the whole resource, as a plain GET
+    if (task->whole) {
+        task->range[0] = '\0';
+        task->if_range = NULL;
+    } else {
+        pthread_mutex_lock(&task->lock);
+        snprintf(task->range, RANGE_SIZE, "%lld-%lld",
+                 (long long)task->min_range, (long long)task->max_range);
+        pthread_mutex_unlock(&task->lock);
 
+        // Fixed by main before the download's chunks are handed out. Other
+        // mirrors needn't share the origin's validators, so aren't sent them.
+        Download *download = task->download;
+        task->if_range = task->mirror == download->origin ?
+                         http_if_range(&download->validator) : NULL;
     }
 
-    free_task(task);
+    clock_gettime(CLOCK_MONOTONIC, &task->started);
+    return 0;
 }
 
 
 /**
- * Merge all files in from src to file with name dest synchronously
- * by reading each file, and writing its contents to the dest file.
- * @param src - char pointer to src directory holding files to merge
- * @param dest - char pointer to name of file resulting from merge
- * @param bytes - The maximum byte size downloaded
- * @param tasks - The tasks needed for the multipart download
+ * Wrap up a chunk task once its request has finished with task->status,
+ * and hand it back to main: at once, or with the disk writer once its
+ * last bytes have landed.
+ * @param context - The worker context
+ * @param task - The downloaded chunk task
  */
-void merge_files(char *src, char *dest, int bytes, int tasks) {
-    // Open destination file for writing.
-    char write_filename[FILE_SIZE];
-    snprintf(write_filename, FILE_SIZE, "%s/%s", src, dest);
+void finish_chunk(Context *context, Task *task) {
+    clock_gettime(CLOCK_MONOTONIC, &task->finished);
 
-    FILE* write_file = fopen(write_filename, "w");
-    if (!write_file) {
-        perror("fopen");
-        exit(1);
+    // The sink stops the transfer early once a stolen range is complete
+    if (task->status == -1 && !task->write_error &&
+        task->received == chunk_length(task)) {
+        task->status = 206;
     }
 
-    // Buffer to store data read from files.
-    char* buffer = (char*)malloc(bytes);
+    if (task->async) {
+        async_stream_close(&task->stream);
+    } else {
+        return_chunk(context, task);
+    }
+}
 
-    // Iterate over all the partial file names.
-    for (int i = 0; i < tasks; i++) {
-        // Open the file for reading.
-        char read_filename[FILE_SIZE];
-        snprintf(read_filename, FILE_SIZE, "%s/%d", src, i * bytes);
 
-        FILE* read_file = fopen(read_filename, "r");
-        if (!read_file) {
-            perror("fopen");
-            exit(1);
-        }
+/**
+ * Whether a chunk's body can be spliced into its file. Spliced bytes never
+ * reach user space, so can't be added to the chunk's CRC or copied to the
+ * disk writer.
+ */
+int can_splice(Context *context, Task *task) {
+    return context->splice && !task->download->check_crc && !task->async;
+}
+
+
+/**
+ * Get the BodySink for a chunk's body.
+ */
+BodySink chunk_body_sink(Task *task) {
+    return task->async ? chunk_async_sink : chunk_sink;
+}
 
-        // Read data from file into buffer and write to destination file.
-        int bytes_read = fread(buffer, 1, bytes, read_file);
-        fwrite(buffer, 1, bytes_read, write_file);
-        fclose(read_file);
+
+/**
+ * Download the byte range of a chunk task, streaming the body straight to
+ * its offset in the destination, or to its part file. Sets task->status,
+ * and hands the task back to main.
+ * @param context - The worker context
+ * @param task - The chunk task to download
+ */
+void fetch_chunk(Context *context, Task *task) {
+    if (prepare_chunk(context, task) != 0) {
+        queue_put(context->done, task);
+        return;
     }
 
-    fclose(write_file);
-    free(buffer);
+    task->status = http_url_splice(task->url, task->range, task->if_range,
+                                   &task->resource, chunk_body_sink(task),
+                                   can_splice(context, task) ?
+                                   chunk_splice : NULL,
+                                   task);
+    http_last_timing(&task->timing);
+    finish_chunk(context, task);
+}
+
+
+/**
+ * BodySink keeping the body of a GET probe in its task, up to the end of
+ * the probe's range.
+ * @return 0 to continue, -1 once the range is full
+ */
+int probe_data_sink(void *arg, const char *data, size_t length) {
+    Task *task = (Task *)arg;
+    size_t room = task->max_range + 1 - task->received;
+    size_t take = length < room ? length : room;
+
+    memcpy(&task->probe_data[task->received], data, take);
+    task->received += take;
 
-    printf("---Merges files successfully to: %s---\n", write_filename);
+    return take < length ? -1 : 0;
 }
 
 
 /**
- * Remove files caused by chunk downloading
- * @param dir - The directory holding the chunked files
- * @param bytes - The maximum byte size per file. Assumed to be filename
- * @param files - The number of chunked files to remove.
- */
-void remove_chunk_files(char *dir, int bytes, int files) {
-    for (int i = 0; i < files; i++) {
-        char filename[FILE_SIZE];
-        snprintf(filename, FILE_SIZE, "%s/%d", dir, i * bytes);
-        if (remove(filename) != 0) {
-            perror("remove");
-            exit(1);
+ * Work out the content length of a download from the response to its GET
+ * probe, checking that the probe holds the first bytes of the resource.
+ * @param task - The probe task, with its body received
+ * @param status - HTTP status of the response, or -1 on failure
+ * @param length - Length of the whole resource from the response header,
+ *                 or -1 if unknown
+ * @return The content length, or -1 on failure
+ */
+off_t finish_range_probe(Task *task, int status, off_t length) {
+    size_t wanted = task->max_range + 1;
+
+    // The cached copy is still current, and has the length
+    if (status == 304) {
+        return -1;
+    }
+
+    // The sink stops a 200 carrying the whole resource once it has the
+    // probe's range. Without a length, e.g. chunked, a HEAD probe is left
+    // to find it.
+    if (status == -1 && task->received == wanted) {
+        if (length < 0) {
+            task->resource.accept_ranges = 0;
+            task->received = 0;
+            return -1;
         }
+        status = 200;
     }
-}
 
+    // A whole resource without a length, e.g. chunked, that fit the range
+    if (status == 200 && length < 0) {
+        length = task->received;
+    }
 
-int main(int argc, char **argv) {
-    if (argc != 4) {
-        fprintf(stderr, "usage: ./downloader url_file num_workers download_dir\n");
-        exit(1);
+    // A 200 with more than the range means the server ignores ranges: the
+    // bytes are dropped, and the download is fetched in one stream instead
+    if (status == 200 && length > (off_t)wanted) {
+        task->resource.accept_ranges = 0;
+        task->received = 0;
+        return length;
     }
 
-    char *url_file = argv[1];
-    int num_workers = atoi(argv[2]);
-    char *download_dir = argv[3];
+    // A 416 is how an empty resource answers any range
+    if (status == 416 && length == 0) {
+        return 0;
+    }
 
-    create_directory(download_dir);
-    FILE *fp = fopen(url_file, "r");
-    char *line = NULL;
-    size_t len = 0;
+    if ((status != 200 && status != 206) || length < 0) {
+        fprintf(stderr, "No resource length in response from: %s "
+                        "(status %d)\n", task->url, status);
+        return -1;
+    }
 
-    if (fp == NULL) {
-        exit(EXIT_FAILURE);
+    if (task->received > (size_t)length ||
+        (task->received != wanted && task->received != (size_t)length)) {
+        fprintf(stderr, "error probing: %s (%zu bytes of the first chunk)\n",
+                task->url, task->received);
+        return -1;
     }
 
-    // spawn threads and create work queue(s)
-    Context *context = spawn_workers(num_workers);
+    return length;
+}
 
-    int work = 0, bytes = 0, num_tasks = 0;
-    while ((len = getline(&line, &len, fp)) != -1) {
 
-        if (line[len - 1] == '\n') {
-            line[len - 1] = '\0';
-        }
+/**
+ * Run a GET probe: fetch the first chunk of a download, keeping its bytes
+ * in the task, and learn the content length from the same response.
+ * @param task - The probe task
+ */
+void fetch_range_probe(Task *task) {
+    snprintf(task->range, RANGE_SIZE, "0-%lld", (long long)task->max_range);
+    int status = http_probe_range(task->url, task->range, task->cached,
+                                  &task->resource, probe_data_sink, task);
+    http_last_timing(&task->timing);
+    task->status = status;
+    task->content_length = finish_range_probe(task, status,
+                                              task->resource.length);
+}
+
+
+void *worker_thread(void *arg) {
+    Worker *worker = (Worker *)arg;
+    Context *context = worker->context;
+
+    Task *task = (Task *)queue_get(context->todo);
 
-        num_tasks = get_num_tasks(line, num_workers);
-        bytes = get_max_chunk_size();
+    while (task) {
+        task->worker = worker->id;
 
-        for (int i  = 0; i < num_tasks; i ++) {
-            ++work;
-            queue_put(context->todo, new_task(line, i * bytes, (i+1) * bytes));
+        if (task->type == TASK_PROBE && task->probe_data) {
+            fetch_range_probe(task);
+            queue_put(context->done, task);
+        } else if (task->type == TASK_PROBE) {
+            task->content_length = http_probe(task->url, task->cached,
+                                              &task->resource);
+            task->status = task->resource.status;
+            http_last_timing(&task->timing);
+            queue_put(context->done, task);
+        } else {
+            // Handed back once its body is on disk
+            fetch_chunk(context, task);
         }
-      
-        // Get results back
-        while (work > 0) {
-            --work;
-            wait_task(download_dir, context);
+
+        task = (Task *)queue_get(context->todo);
+    }
+
+    free(worker);
+    return NULL;
+}
+
+
+/**
+ * EngineRequest callback for a finished task, run on the engine's thread.
+ * Records the result the way worker_thread would and returns the task.
+ */
+void engine_task_done(EngineRequest *request, int status) {
+    Task *task = (Task *)request->arg;
+    task->timing = request->timing;
+    task->status = status;
+
+    if (task->type == TASK_PROBE && task->probe_data) {
+        task->content_length = finish_range_probe(task, status,
+                                                  task->resource.length);
+    } else if (task->type == TASK_PROBE) {
+        // A 304 has no length to give: the cached copy has it
+        if (status == 304) {
+            task->content_length = -1;
+        } else if (status < 200 || status >= 300 ||
+                   request->content_length < 0) {
+            fprintf(stderr, "No Content-Length in response from: %s "
+                            "(status %d)\n", task->url, status);
+            task->content_length = -1;
+        } else {
+            task->content_length = request->content_length;
         }
+    } else {
+        finish_chunk(task->context, task);
+        return;
+    }
+
+    queue_put(task->context->done, task);
+}
+
 
+/**
+ * BodySink for probe responses, which have no body.
+ */
+int probe_sink(void *arg, const char *data, size_t length) {
+    return 0;
+}
+
+
+/**
+ * Feeder thread for WORKERS_EPOLL: takes tasks from the todo queue and
+ * submits them to its engine, which blocks while the engine is at its
+ * connection limit. Results come back on the done queue from the engine.
+ */
+void *feeder_thread(void *arg) {
+    Feeder *feeder = (Feeder *)arg;
+    Context *context = feeder->context;
 
-        /* Merge the files -- simple synchronous method
-         * Then remove the chunked download files
-         * Beware, this is not an efficient method
-         */
+    Task *task = (Task *)queue_get(context->todo);
+
+    while (task) {
+        EngineRequest *request = &task->request;
+        task->context = context;
+        task->worker = feeder->id;
+        request->url = task->url;
+        request->range = NULL;
+        request->if_range = NULL;
+        request->cached = task->cached;
+        request->range_only = 0;
+        request->resource = &task->resource;
+        request->splice_sink = NULL;
+        request->arg = task;
+        request->done = engine_task_done;
 
-        // Replace forward slashes in the url with underscores, to allow it
-        // to be used as a filename
-        for (int i = 0; i < len; i++) {
-            if (line[i] == '/') {
-                line[i] = '_';
+        if (task->type == TASK_PROBE && task->probe_data) {
+            snprintf(task->range, RANGE_SIZE, "0-%lld",
+                     (long long)task->max_range);
+            request->method = "GET";
+            request->range = task->range;
+            request->sink = probe_data_sink;
+            engine_submit(feeder->engine, request);
+        } else if (task->type == TASK_PROBE) {
+            request->method = "HEAD";
+            request->sink = probe_sink;
+            engine_submit(feeder->engine, request);
+        } else if (prepare_chunk(context, task) == 0) {
+            request->method = "GET";
+            request->range = task->range;
+            request->if_range = task->if_range;
+            request->range_only = 1;
+            request->sink = chunk_body_sink(task);
+            if (can_splice(context, task)) {
+                request->splice_sink = chunk_splice;
             }
+            engine_submit(feeder->engine, request);
+        } else {
+            queue_put(context->done, task);
         }
 
-        merge_files(download_dir, line, bytes, num_tasks);
-        remove_chunk_files(download_dir, bytes, num_tasks);
+        task = (Task *)queue_get(context->todo);
     }
-   
-
-    //cleanup
-    fclose(fp);
-    free(line);
+
+    free(feeder);
+    return NULL;
+}
+
+
+/**
+ * Copy a completed part file into the destination at its offset, in the
+ * kernel where the filesystem allows it, otherwise through a buffer of
+ * MERGE_BUF_SIZE bytes. Counts the bytes copied in task->written.
+ * @param context - The worker context, giving the download directory
+ * @param task - The merge task, with fd set to the destination
+ * @return 0 on success, -1 if the part file is missing or short, or the
+ *         destination could not be written
+ */
+int merge_part(Context *context, Task *task) {
+    char filename[PATH_MAX];
+    snprintf(filename, PATH_MAX, "%s/%s.%lld", task->download->dir,
+             task->download->filename, (long long)task->min_range);
+
+    int part_fd = open(filename, O_RDONLY);
+    if (part_fd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    size_t length = chunk_length(task);
+    loff_t in = 0;
+    loff_t out = task->min_range;
+
+    while (task->written < length) {
+        ssize_t copied = copy_file_range(part_fd, &in, task->fd, &out,
+                                         length - task->written, 0);
+        if (copied <= 0) {
+            break;
+        }
+        task->written += copied;
+    }
+
+    char buffer[MERGE_BUF_SIZE];
+    while (task->written < length) {
+        size_t want = length - task->written;
+        if (want > MERGE_BUF_SIZE) {
+            want = MERGE_BUF_SIZE;
+        }
+
+        ssize_t bytes_read = pread(part_fd, buffer, want, task->written);
+        if (bytes_read <= 0 ||
+            write_at(task->fd, buffer, bytes_read,
+                     task->min_range + task->written) != 0) {
+            break;
+        }
+        task->written += bytes_read;
+    }
+    close(part_fd);
+
+    if (task->written < length) {
+        fprintf(stderr, "error merging: %s (%zu bytes missing)\n", filename,
+                length - task->written);
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Add the next bytes of a download's destination to its SHA-256. They are
+ * read back rather than hashed as they arrive, since chunks arrive out of
+ * order and a SHA-256 can only be taken in order; having just been
+ * written, they are usually still in the page cache.
+ * @param task - The hash task, with fd set to the destination
+ * @return 0 on success, -1 if the destination could not be read
+ */
+int hash_range(Task *task) {
+    char buffer[MERGE_BUF_SIZE];
+    off_t offset = task->min_range;
+
+    while (offset <= task->max_range) {
+        size_t want = task->max_range + 1 - offset;
+        if (want > MERGE_BUF_SIZE) {
+            want = MERGE_BUF_SIZE;
+        }
+
+        ssize_t bytes_read = pread(task->fd, buffer, want, offset);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            perror("pread");
+            return -1;
+        }
+        sha256_update(&task->download->sha, buffer, bytes_read);
+        offset += bytes_read;
+    }
+    return 0;
+}
+
+
+/**
+ * Copies part files into their destinations as main hands them over, so a
+ * download is assembled while the rest of its chunks are still arriving.
+ * Hashes downloads with a SHA-256 to check as their bytes fall into place;
+ * a hash task is queued after the merges of the bytes it covers, so they
+ * are in the destination by the time it runs.
+ */
+void *writer_thread(void *arg) {
+    Context *context = (Context *)arg;
+
+    Task *task = (Task *)queue_get(context->merges);
+
+    while (task) {
+        if (task->type == TASK_HASH) {
+            task->write_error = hash_range(task) != 0;
+        } else {
+            task->write_error = merge_part(context, task) != 0;
+        }
+        queue_put(context->done, task);
+        task = (Task *)queue_get(context->merges);
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Start the workers and create the work queues.
+ * @param num_workers - Number of concurrent connections
+ * @param mode - Whether each connection gets a thread, or connections are
+ *               spread over event loop engines
+ * @param num_engines - Number of engines and feeder threads, for WORKERS_EPOLL
+ * @return The worker context
+ */
+Context *spawn_workers(int num_workers, WorkerMode mode, int num_engines) {
+    Context *context = (Context*)malloc(sizeof(Context));
+
+    context->todo = queue_alloc(num_workers * 2);
+    context->done = queue_alloc(num_workers * 2 + MERGE_QUEUE_SIZE);
+    context->merges = NULL;
+    context->disk = NULL;
+
+    context->num_workers = num_workers;
+    context->engines = NULL;
+    context->num_engines = 0;
+    context->num_threads = num_workers;
+
+    if (mode == WORKERS_EPOLL) {
+        if (num_engines > num_workers) {
+            num_engines = num_workers;
+        }
+        context->num_engines = num_engines;
+        context->num_threads = num_engines;
+        context->engines = (Engine**)malloc(sizeof(Engine*) * num_engines);
+    }
+
+    context->threads = (pthread_t*)malloc(sizeof(pthread_t) *
+                                          context->num_threads);
+    int i = 0;
+
+    for (i = 0; i < context->num_threads; ++i) {
+        int rc;
+
+        if (mode == WORKERS_EPOLL) {
+            // Spread the connections over the engines as evenly as possible
+            int connections = num_workers / num_engines +
+                              (i < num_workers % num_engines);
+            context->engines[i] = engine_alloc(connections);
+
+            Feeder *feeder = (Feeder*)malloc(sizeof(Feeder));
+            feeder->context = context;
+            feeder->engine = context->engines[i];
+            feeder->id = i;
+            rc = pthread_create(&context->threads[i], NULL, feeder_thread,
+                                feeder);
+        } else {
+            Worker *worker = (Worker*)malloc(sizeof(Worker));
+            worker->context = context;
+            worker->id = i;
+            rc = pthread_create(&context->threads[i], NULL, worker_thread,
+                                worker);
+        }
+
+        if (rc != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    return context;
+}
+
+
+/**
+ * Start the writer thread that copies part files into place for
+ * ASSEMBLE_PARTS, and hashes downloads with a SHA-256 to check. Call once
+ * the context's download_dir is set.
+ * @param context - The worker context
+ */
+void spawn_writer(Context *context) {
+    context->merges = queue_alloc(MERGE_QUEUE_SIZE);
+
+    if (pthread_create(&context->writer, NULL, writer_thread, context) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+}
+
+void free_workers(Context *context) {
+    int num_threads = context->num_threads;
+    int i = 0;
+
+    // Workers see NULL from the closed todo queue once it is drained
+    queue_close(context->todo);
+
+    for (i = 0; i < num_threads; ++i) {
+        if (pthread_join(context->threads[i], NULL) != 0) {
+            perror("pthread_join");
+            exit(1);
+        }
+    }
+
+    for (i = 0; i < context->num_engines; ++i) {
+        engine_free(context->engines[i]);
+    }
+
+    // Every chunk has landed, since main has had them all back
+    if (context->disk) {
+        async_writer_free(context->disk);
+    }
+
+    if (context->merges) {
+        queue_close(context->merges);
+        if (pthread_join(context->writer, NULL) != 0) {
+            perror("pthread_join");
+            exit(1);
+        }
+        queue_free(context->merges);
+    }
+
+    queue_free(context->todo);
+    queue_free(context->done);
+
+    free(context->engines);
+    free(context->threads);
+    free(context);
+}
+
+
+Task *new_task(Scheduler *scheduler, TaskType type, Download *download,
+               off_t min_range, off_t max_range) {
+    Task *task = buffer_pool_get(scheduler->tasks);
+    task->type = type;
+    task->download = download;
+    task->status = -1;
+    task->content_length = -1;
+    task->resource.status = -1;
+    task->resource.length = -1;
+    task->resource.accept_ranges = -1;
+    task->resource.validator.etag[0] = '\0';
+    task->resource.validator.last_modified[0] = '\0';
+    task->if_range = NULL;
+    task->whole = 0;
+    task->probe_data = NULL;
+    task->cached = NULL;
+    task->received = 0;
+    task->written = 0;
+    task->crc = 0;
+    task->write_error = 0;
+    task->fd = -1;
+    task->base = 0;
+    memset(&task->timing, 0, sizeof(task->timing));
+    task->worker = -1;
+    task->attempts = 0;
+    task->ready_at = 0;
+    task->mirror = download->origin;
+    task->url = download->mirrors[download->origin].url;
+    task->min_range = min_range;
+    task->max_range = max_range;
+    task->next = NULL;
+    pthread_mutex_init(&task->lock, NULL);
+
+    return task;
+}
+
+void free_task(Scheduler *scheduler, Task *task) {
+    pthread_mutex_destroy(&task->lock);
+    if (task->probe_data) {
+        buffer_pool_put(scheduler->probe_buffers, task->probe_data);
+    }
+    buffer_pool_put(scheduler->tasks, task);
+}
+
+
+/**
+ * Append a task to the end of a pending task list.
+ * @param list - The list to append to
+ * @param task - The task to append
+ */
+void task_list_push(TaskList *list, Task *task) {
+    task->next = NULL;
+    if (list->tail) {
+        list->tail->next = task;
+    } else {
+        list->head = task;
+    }
+    list->tail = task;
+}
+
+
+/**
+ * Remove and return the task at the front of a pending task list.
+ * @param list - The list to remove from
+ * @return The first task in the list, or NULL if the list is empty
+ */
+Task *task_list_pop(TaskList *list) {
+    Task *task = list->head;
+    if (task) {
+        list->head = task->next;
+        if (!list->head) {
+            list->tail = NULL;
+        }
+        task->next = NULL;
+    }
+    return task;
+}
+
+
+/**
+ * Remove and free the chunk tasks of a download from a pending task list.
+ * @param scheduler - The scheduler the tasks came from
+ * @param list - The list to remove from
+ * @param download - The download whose chunks are no longer wanted
+ * @return Number of tasks removed
+ */
+int task_list_drop(Scheduler *scheduler, TaskList *list, Download *download) {
+    Task **link = &list->head;
+    list->tail = NULL;
+    int dropped = 0;
+
+    while (*link) {
+        Task *task = *link;
+        if (task->type == TASK_CHUNK && task->download == download) {
+            *link = task->next;
+            free_task(scheduler, task);
+            ++dropped;
+        } else {
+            list->tail = task;
+            link = &task->next;
+        }
+    }
+
+    return dropped;
+}
+
+
+/**
+ * Drop the retries of a download that are still waiting out their pause.
+ */
+void cancel_retries(Scheduler *scheduler, Download *download) {
+    download->retrying -= task_list_drop(scheduler, &scheduler->retries,
+                                         download);
+}
+
+
+void free_download(Download *download) {
+    free(download->gaps);
+    free(download->parts);
+    for (int i = 0; i < download->num_mirrors; i++) {
+        free(download->mirrors[i].url);
+    }
+    free(download->mirrors);
+    free(download);
+}
+
+
+/**
+ * Whether a token of a line of the url_file is a field of the download
+ * rather than a url: a digest to check it against, crc32c=<8 hex digits>
+ * or sha256=<64 hex digits>, or how it is scheduled, priority=<integer>
+ * or deadline=<seconds into the run>.
+ */
+int is_field(const char *token) {
+    return strncmp(token, "crc32c=", 7) == 0 ||
+           strncmp(token, "sha256=", 7) == 0 ||
+           strncmp(token, "priority=", 9) == 0 ||
+           strncmp(token, "deadline=", 9) == 0;
+}
+
+
+/**
+ * Take a field of a download from its line of the url_file.
+ * @param download - The download
+ * @param token - The token giving the field, for which is_field holds
+ * @return 0 on success, -1 if the value is malformed
+ */
+int parse_field(Download *download, const char *token) {
+    const char *value = strchr(token, '=') + 1;
+    char *end;
+
+    if (strncmp(token, "priority=", 9) == 0) {
+        long priority = strtol(value, &end, 10);
+        if (end == value || *end || priority < INT_MIN ||
+            priority > INT_MAX) {
+            return -1;
+        }
+        download->priority = (int)priority;
+        return 0;
+    }
+
+    if (strncmp(token, "deadline=", 9) == 0) {
+        double deadline = strtod(value, &end);
+        if (end == value || *end || !(deadline > 0)) {
+            return -1;
+        }
+        download->deadline = deadline;
+        return 0;
+    }
+
+    const char *hex = value;
+    if (strncmp(token, "sha256=", 7) == 0) {
+        if (checksum_parse_hex(hex, download->expected_sha,
+                               SHA256_SIZE) != 0) {
+            return -1;
+        }
+        download->check_sha = 1;
+        return 0;
+    }
+
+    // Written as the number, most significant digit first
+    uint8_t bytes[4];
+    if (checksum_parse_hex(hex, bytes, sizeof(bytes)) != 0) {
+        return -1;
+    }
+    download->expected_crc = (uint32_t)bytes[0] << 24 |
+                             (uint32_t)bytes[1] << 16 |
+                             (uint32_t)bytes[2] << 8 | bytes[3];
+    download->check_crc = 1;
+    return 0;
+}
+
+
+/**
+ * Create a download for a line of the url_file: one or more URLs of the
+ * same resource separated by whitespace, every one a mirror of the others,
+ * and optionally fields: the digests to check it against once it is
+ * complete, and its priority or deadline.
+ * The first URL names the download; its destination filename is that url
+ * with forward slashes replaced by underscores.
+ * @param line - The line of the url_file
+ * @return Pointer to the new download, or NULL if the line has no URL or
+ *         a malformed field
+ */
+Download *new_download(const char *line) {
+    char copy[strlen(line) + 1];
+    strcpy(copy, line);
+
+    int num_mirrors = 0;
+    char *saveptr;
+    for (char *url = strtok_r(copy, " \t\r\n", &saveptr); url;
+         url = strtok_r(NULL, " \t\r\n", &saveptr)) {
+        num_mirrors += !is_field(url);
+    }
+    if (num_mirrors == 0) {
+        return NULL;
+    }
+
+    Download *download = malloc(sizeof(Download));
+    Mirror *mirrors = malloc(num_mirrors * sizeof(Mirror));
+    if (!download || !mirrors) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    download->mirrors = mirrors;
+    download->num_mirrors = 0;
+    download->origin = 0;
+    download->check_crc = 0;
+    download->check_sha = 0;
+    download->priority = 0;
+    download->deadline = 0;
+    download->dir = NULL;
+    download->job = NULL;
+
+    strcpy(copy, line);
+    for (char *url = strtok_r(copy, " \t\r\n", &saveptr); url;
+         url = strtok_r(NULL, " \t\r\n", &saveptr)) {
+        if (is_field(url)) {
+            if (parse_field(download, url) != 0) {
+                fprintf(stderr, "malformed field in url_file: %s\n", url);
+                download->gaps = NULL;
+                download->parts = NULL;
+                free_download(download);
+                return NULL;
+            }
+            continue;
+        }
+
+        Mirror *mirror = &download->mirrors[download->num_mirrors++];
+        mirror->url = strdup(url);
+        mirror->throughput = 0;
+        mirror->inflight = 0;
+        mirror->failures = 0;
+        mirror->dropped = 0;
+    }
+    download->url = download->mirrors[0].url;
+
+    // Named without the scheme, so https://host/page lands where host/page
+    // does
+    const char *name = strstr(download->url, "://");
+    name = name ? name + 3 : download->url;
+    snprintf(download->filename, FILE_SIZE, "%s", name);
+    for (int i = 0; download->filename[i]; i++) {
+        if (download->filename[i] == '/') {
+            download->filename[i] = '_';
+        }
+    }
+
+    download->content_length = -1;
+    download->validator.etag[0] = '\0';
+    download->validator.last_modified[0] = '\0';
+    download->single = 0;
+    download->falling_back = 0;
+    download->next_offset = 0;
+    download->range_end = 0;
+    download->gaps = NULL;
+    download->num_gaps = 0;
+    download->next_gap = 0;
+    download->inflight = NULL;
+    download->failed = 0;
+    download->changed = 0;
+    download->restarts = 0;
+    download->retrying = 0;
+    download->error[0] = '\0';
+    clock_gettime(CLOCK_MONOTONIC, &download->started);
+    memset(&download->totals, 0, sizeof(download->totals));
+    download->cached = 0;
+    download->cached_length = -1;
+    sha256_init(&download->sha);
+    download->hashed = 0;
+    download->corrupt = 0;
+    download->fd = -1;
+    download->manifest_saved = 0;
+    download->merging = 0;
+    download->parts = NULL;
+    download->num_parts = 0;
+    download->parts_capacity = 0;
+    download->next = NULL;
+
+    return download;
+}
+
+/**
+ * Note why a download failed, for the report at exit. Only the first
+ * reason is kept, as later failures usually follow from it.
+ * @param download - The download
+ * @param format - printf style format of the reason
+ */
+void note_error(Download *download, const char *format, ...) {
+    if (download->error[0]) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(download->error, ERROR_SIZE, format, args);
+    va_end(args);
+}
+
+
+/**
+ * Record a completed chunk of a download, and for ASSEMBLE_PARTS its part
+ * file.
+ * @param download - The download the chunk belongs to
+ * @param offset - Offset of the chunk in the destination
+ * @param length - Number of bytes of the chunk written
+ * @param crc - CRC32C of those bytes, if has_crc
+ * @param has_crc - Whether the CRC is known
+ */
+void add_part(Download *download, off_t offset, off_t length, uint32_t crc,
+              int has_crc) {
+    if (download->num_parts == download->parts_capacity) {
+        download->parts_capacity = download->parts_capacity ?
+                                   download->parts_capacity * 2 : 8;
+        download->parts = realloc(download->parts,
+                                  download->parts_capacity * sizeof(Part));
+        if (!download->parts) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    download->parts[download->num_parts].offset = offset;
+    download->parts[download->num_parts].length = length;
+    download->parts[download->num_parts].crc = crc;
+    download->parts[download->num_parts].has_crc = has_crc;
+    ++download->num_parts;
+}
+
+
+/**
+ * Create a fresh destination file for a download and preallocate it to the
+ * content length, so chunks can be written straight into place. Falls back
+ * to ftruncate on filesystems without fallocate support.
+ * @param download_dir - The directory to create the file in
+ * @param download - The probed download; its fd is set on success
+ * @return 0 on success, -1 on failure
+ */
+int open_destination(const char *download_dir, Download *download) {
+    char filename[PATH_MAX];
+    snprintf(filename, PATH_MAX, "%s/%s", download_dir, download->filename);
+
+    // An old destination may share its file with the cache, so is replaced
+    // rather than written over
+    unlink(filename);
+
+    // Read back too, to be hashed
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    if (download->content_length > 0 &&
+        fallocate(fd, 0, 0, download->content_length) == -1 &&
+        ftruncate(fd, download->content_length) == -1) {
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+
+    download->fd = fd;
+    return 0;
+}
+
+
+/**
+ * Report on a completed chunk task. The body has already been streamed to
+ * the destination or its part file by the worker.
+ * @param task - The completed chunk task
+ * @return 0 if the whole range of the chunk was received, -1 otherwise
+ */
+int wait_task(Task *task) {
+    if (task->status < 200 || task->status >= 300) {
+        fprintf(stderr, "error downloading: %s (status %d)\n", task->url,
+                task->status);
+        return -1;
+    }
+
+    if (task->received != chunk_length(task)) {
+        fprintf(stderr, "error downloading: %s (%zu of %zu bytes)\n",
+                task->url, task->received, chunk_length(task));
+        return -1;
+    }
+
+    printf("downloaded %zu bytes from %s\n", task->received, task->url);
+    return 0;
+}
+
+
+static int compare_parts(const void *a, const void *b) {
+    off_t x = ((const Part *)a)->offset;
+    off_t y = ((const Part *)b)->offset;
+
+    // A difference of offsets may not fit in an int
+    return (x > y) - (x < y);
+}
+
+
+/**
+ * Remove files caused by chunk downloading
+ * @param dir - The directory holding the chunked files
+ * @param dest - The name of the merged file the chunks belonged to
+ * @param parts - The chunks, whose offsets are the part file names
+ * @param num_parts - The number of chunked files to remove.
+ */
+void remove_chunk_files(char *dir, char *dest, Part *parts, int num_parts) {
+    for (int i = 0; i < num_parts; i++) {
+        char filename[PATH_MAX];
+        snprintf(filename, PATH_MAX, "%s/%s.%lld", dir, dest,
+                 (long long)parts[i].offset);
+        // A chunk whose part file could not be opened has none to remove
+        if (remove(filename) != 0 && errno != ENOENT) {
+            perror("remove");
+        }
+    }
+}
+
+
+/**
+ * Get the time from a monotonic clock.
+ * @return The time in seconds
+ */
+double now_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+/**
+ * Get the path of the manifest recording a download's progress.
+ * @param download_dir - The directory holding the destination
+ * @param download - The download
+ * @param path - Buffer of PATH_MAX bytes to hold the path
+ */
+void manifest_path(const char *download_dir, Download *download, char *path) {
+    snprintf(path, PATH_MAX, "%s/%s.manifest", download_dir,
+             download->filename);
+}
+
+
+/**
+ * Save the progress of a download to its manifest: every completed chunk,
+ * and how much of each chunk in flight has been written so far. Bytes of a
+ * chunk in flight that are not yet written are left out, so the manifest
+ * never claims bytes that are not on disk.
+ * @param download_dir - The directory holding the destination
+ * @param download - The download
+ * @return 0 on success, -1 on failure, if the resource has no validator,
+ *         so a resume could not tell whether it had changed, or if it is
+ *         fetched in a single stream, which can't be resumed
+ */
+int save_manifest(const char *download_dir, Download *download) {
+    if (download->single || (!download->validator.etag[0] &&
+                             !download->validator.last_modified[0])) {
+        return -1;
+    }
+
+    Manifest manifest;
+    manifest_init(&manifest, download->url, download->content_length,
+                  &download->validator);
+
+    for (int i = 0; i < download->num_parts; i++) {
+        Part *part = &download->parts[i];
+        if (part->length > 0) {
+            manifest_add_chunk(&manifest, part->offset, part->length,
+                               part->length);
+        }
+    }
+
+    for (Task *task = download->inflight; task; task = task->next) {
+        pthread_mutex_lock(&task->lock);
+        manifest_add_chunk(&manifest, task->min_range,
+                           task->max_range - task->min_range + 1,
+                           (off_t)task->written);
+        pthread_mutex_unlock(&task->lock);
+    }
+
+    char path[PATH_MAX];
+    manifest_path(download_dir, download, path);
+    int rc = manifest_save(&manifest, path);
+
+    manifest_clear(&manifest);
+    return rc;
+}
+
+
+/**
+ * Save the progress of a download to its manifest, unless it was saved
+ * less than MANIFEST_SAVE_INTERVAL seconds ago. A manifest that is a
+ * little behind is still safe to resume from: it only leaves out bytes,
+ * which the resume fetches again.
+ * @param download_dir - The directory holding the destination
+ * @param download - The download
+ */
+void checkpoint_manifest(const char *download_dir, Download *download) {
+    double now = now_seconds();
+    if (now - download->manifest_saved < MANIFEST_SAVE_INTERVAL) {
+        return;
+    }
+
+    download->manifest_saved = now;
+    save_manifest(download_dir, download);
+}
+
+
+/**
+ * Remove the manifest of a download, if it has one.
+ */
+void remove_manifest(const char *download_dir, Download *download) {
+    char path[PATH_MAX];
+    manifest_path(download_dir, download, path);
+
+    if (unlink(path) != 0 && errno != ENOENT) {
+        perror("unlink");
+    }
+}
+
+
+/**
+ * Clean up after a download once every chunk task has returned and every
+ * part file has been copied into place: close the destination, remove the
+ * part files and the manifest. If any chunk failed, the files and manifest
+ * are kept so that a later run can resume; if that is not possible, or the
+ * resource changed under the download, the incomplete destination is
+ * removed instead, as is one that failed its check.
+ * @param download_dir - The directory holding the part files
+ * @param context - The worker context, giving the assembly mode
+ * @param download - The finished download
+ */
+void finish_download(char *download_dir, Context *context, Download *download) {
+    char filename[PATH_MAX];
+    snprintf(filename, PATH_MAX, "%s/%s", download_dir, download->filename);
+
+    close(download->fd);
+    download->fd = -1;
+
+    if (download->failed && !download->changed && !download->corrupt &&
+        save_manifest(download_dir, download) == 0) {
+        fprintf(stderr, "---Failed to download: %s (run again to resume)---\n",
+                download->url);
+        return;
+    }
+
+    if (context->assembly == ASSEMBLE_PARTS) {
+        remove_chunk_files(download_dir, download->filename, download->parts,
+                           download->num_parts);
+    }
+    remove_manifest(download_dir, download);
+
+    if (download->failed) {
+        unlink(filename);
+        fprintf(stderr, "---Failed to download: %s---\n", download->url);
+    } else if (context->assembly == ASSEMBLE_DIRECT) {
+        printf("---Downloaded successfully to: %s---\n", filename);
+    } else {
+        printf("---Merges files successfully to: %s---\n", filename);
+    }
+}
+
+
+/**
+ * Whether a download still has bytes not given to any chunk. Moves on to
+ * the next gap once the current unassigned range is used up.
+ * @param download - The download
+ * @return 1 if there are unassigned bytes, 0 otherwise
+ */
+int has_unassigned(Download *download) {
+    while (download->next_offset >= download->range_end &&
+           download->next_gap < download->num_gaps) {
+        Part *gap = &download->gaps[download->next_gap++];
+        download->next_offset = gap->offset;
+        download->range_end = gap->offset + gap->length;
+    }
+
+    return download->next_offset < download->range_end;
+}
+
+
+/**
+ * Stop cutting chunks from a download that cannot be completed.
+ * @param download - The download
+ */
+void drop_unassigned(Download *download) {
+    download->next_offset = download->range_end;
+    download->next_gap = download->num_gaps;
+}
+
+
+/**
+ * Set up a probed download to be fetched from scratch.
+ * @param download_dir - The directory to create the destination in
+ * @param download - The download
+ * @return 0 on success, -1 if the destination could not be created
+ */
+int start_download(const char *download_dir, Download *download) {
+    download->next_offset = 0;
+    download->range_end = download->content_length;
+
+    return open_destination(download_dir, download);
+}
+
+
+/**
+ * Work out the gaps between the completed chunks of a resumed download,
+ * which are the ranges still to be fetched.
+ * @param download - The download, with parts set from its manifest
+ */
+void find_gaps(Download *download) {
+    qsort(download->parts, download->num_parts, sizeof(Part), compare_parts);
+
+    download->gaps = malloc((download->num_parts + 1) * sizeof(Part));
+    download->num_gaps = 0;
+    download->next_gap = 0;
+    download->next_offset = 0;
+    download->range_end = 0;
+
+    off_t offset = 0;
+    for (int i = 0; i <= download->num_parts; i++) {
+        off_t end = i < download->num_parts ? download->parts[i].offset
+                                            : download->content_length;
+        if (end > offset) {
+            download->gaps[download->num_gaps].offset = offset;
+            download->gaps[download->num_gaps].length = end - offset;
+            ++download->num_gaps;
+        }
+        if (i < download->num_parts) {
+            offset = end + download->parts[i].length;
+        }
+    }
+}
+
+
+/**
+ * Remove the part files of a download that are not among its parts: those
+ * of chunks an interrupted run started after it last saved the manifest,
+ * and those of a manifest that can't be used.
+ * @param download_dir - The directory holding the part files
+ * @param download - The download, with the parts it keeps
+ */
+void remove_stray_parts(const char *download_dir, Download *download) {
+    DIR *dir = opendir(download_dir);
+    if (!dir) {
+        perror("opendir");
+        return;
+    }
+
+    size_t length = strlen(download->filename);
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        // Part files are named by the offset of their chunk
+        const char *name = entry->d_name;
+        if (strncmp(name, download->filename, length) != 0 ||
+            name[length] != '.') {
+            continue;
+        }
+        char *end;
+        long long offset = strtoll(name + length + 1, &end, 10);
+        if (end == name + length + 1 || *end) {
+            continue;
+        }
+
+        int kept = 0;
+        for (int i = 0; i < download->num_parts && !kept; i++) {
+            kept = download->parts[i].offset == offset;
+        }
+        if (!kept) {
+            char filename[PATH_MAX];
+            snprintf(filename, PATH_MAX, "%s/%s", download_dir, name);
+            unlink(filename);
+        }
+    }
+
+    closedir(dir);
+}
+
+
+/**
+ * Throw away the files of a partial download whose manifest can't be used.
+ */
+void discard_progress(const char *download_dir, Context *context,
+                      Download *download) {
+    if (context->assembly == ASSEMBLE_PARTS) {
+        remove_stray_parts(download_dir, download);
+    }
+    remove_manifest(download_dir, download);
+}
+
+
+/**
+ * Set up a probed download to continue from a manifest left by an earlier
+ * run. The manifest is only used if it is for the same resource, judged by
+ * its length and validators, and its files are still there; otherwise the
+ * partial download is thrown away.
+ * @param download_dir - The directory holding the destination
+ * @param context - The worker context, giving the assembly mode
+ * @param download - The download
+ * @return 0 if the download was resumed, -1 if it must start from scratch
+ */
+int resume_download(const char *download_dir, Context *context,
+                    Download *download) {
+    char path[PATH_MAX];
+    manifest_path(download_dir, download, path);
+
+    Manifest manifest;
+    if (manifest_load(&manifest, path) != 0) {
+        return -1;
+    }
+
+    // Without ranges only the whole resource can be fetched
+    if (download->single) {
+        printf("---%s no longer accepts ranges, starting again---\n",
+               download->url);
+        discard_progress(download_dir, context, download);
+        manifest_clear(&manifest);
+        return -1;
+    }
+
+    if (!manifest_matches(&manifest, download->url, download->content_length,
+                          &download->validator)) {
+        printf("---%s has changed since it was partly downloaded---\n",
+               download->url);
+        discard_progress(download_dir, context, download);
+        manifest_clear(&manifest);
+        return -1;
+    }
+
+    char filename[PATH_MAX];
+    struct stat st;
+
+    if (context->assembly == ASSEMBLE_DIRECT) {
+        snprintf(filename, PATH_MAX, "%s/%s", download_dir,
+                 download->filename);
+        download->fd = open(filename, O_RDWR);
+
+        if (download->fd == -1 || fstat(download->fd, &st) != 0 ||
+            st.st_size != download->content_length) {
+            if (download->fd != -1) {
+                close(download->fd);
+                download->fd = -1;
+            }
+            discard_progress(download_dir, context, download);
+            manifest_clear(&manifest);
+            return -1;
+        }
+    }
+
+    off_t done = 0;
+    for (int i = 0; i < manifest.num_chunks; i++) {
+        ManifestChunk *chunk = &manifest.chunks[i];
+        off_t completed = chunk->completed;
+
+        // Trust no more of a part file than is actually there
+        if (context->assembly == ASSEMBLE_PARTS) {
+            snprintf(filename, PATH_MAX, "%s/%s.%lld", download_dir,
+                     download->filename, (long long)chunk->offset);
+            if (stat(filename, &st) != 0) {
+                completed = 0;
+            } else if (st.st_size < completed) {
+                completed = st.st_size;
+            }
+        }
+
+        if (completed > 0) {
+            add_part(download, chunk->offset, completed, 0, 0);
+            done += completed;
+        }
+    }
+    manifest_clear(&manifest);
+
+    // The manifest is saved now and then, so may be missing the last
+    // chunks started before the interruption, and empty ones are useless
+    if (context->assembly == ASSEMBLE_PARTS) {
+        remove_stray_parts(download_dir, download);
+    }
+
+    // The part files are copied into a fresh destination again
+    if (context->assembly == ASSEMBLE_PARTS &&
+        open_destination(download_dir, download) != 0) {
+        remove_chunk_files((char *)download_dir, download->filename,
+                           download->parts, download->num_parts);
+        remove_manifest(download_dir, download);
+        download->num_parts = 0;
+        return -1;
+    }
+
+    find_gaps(download);
+
+    printf("---Resuming %s: %lld of %lld bytes already downloaded---\n",
+           download->url, (long long)done,
+           (long long)download->content_length);
+    return 0;
+}
+
+
+/**
+ * Create the probe task of a download: a HEAD request, or with get_probe
+ * a ranged GET of the download's first min_chunk bytes. With a copy in
+ * the cache the request is conditional, so if the copy is still current
+ * the server answers 304 and nothing more is fetched.
+ * @param scheduler - The scheduler
+ * @param download - The download to probe
+ * @return The probe task
+ */
+Task *new_probe(Scheduler *scheduler, Download *download) {
+    Task *task;
+
+    if (!scheduler->context->get_probe) {
+        task = new_task(scheduler, TASK_PROBE, download, 0, 0);
+    } else {
+        task = new_task(scheduler, TASK_PROBE, download, 0,
+                        scheduler->min_chunk - 1);
+        task->probe_data = buffer_pool_get(scheduler->probe_buffers);
+    }
+
+    if (download->cached) {
+        task->cached = &download->cached_validator;
+    }
+    return task;
+}
+
+
+/**
+ * Write the first bytes of a download fetched by its GET probe to the
+ * destination, or to the first part file, as its first completed chunk.
+ * @param download_dir - The directory holding the destination
+ * @param context - The worker context, giving the assembly mode
+ * @param download - The download, just started from scratch
+ * @param task - The probe task holding the bytes
+ * @return 0 on success, -1 on failure
+ */
+int store_probe_data(const char *download_dir, Context *context,
+                     Download *download, Task *task) {
+    size_t length = task->received;
+    int fd = download->fd;
+
+    if (context->assembly == ASSEMBLE_PARTS) {
+        char filename[PATH_MAX];
+        snprintf(filename, PATH_MAX, "%s/%s.0", download_dir,
+                 download->filename);
+        fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            perror("open");
+            return -1;
+        }
+    }
+
+    int rc = write_at(fd, task->probe_data, length, 0);
+    if (context->assembly == ASSEMBLE_PARTS) {
+        close(fd);
+    }
+    if (rc != 0) {
+        return -1;
+    }
+
+    uint32_t crc = download->check_crc ?
+                   crc32c_update(0, task->probe_data, length) : 0;
+    add_part(download, 0, length, crc, 1);
+    download->next_offset = length;
+
+    printf("downloaded %zu bytes from %s\n", length, download->url);
+    return 0;
+}
+
+
+/**
+ * Forget the bytes of a download hashed so far, when they are thrown away.
+ */
+void reset_hash(Download *download) {
+    sha256_init(&download->sha);
+    download->hashed = 0;
+}
+
+
+/**
+ * Start a download over after its resource changed part way through, or
+ * it failed its check: throw away what was fetched, and probe it again.
+ * @param scheduler - The scheduler
+ * @param download - The download, with no chunks in flight
+ */
+void restart_download(Scheduler *scheduler, Download *download) {
+    Context *context = scheduler->context;
+
+    if (download->corrupt) {
+        fprintf(stderr, "---%s failed its check, starting again---\n",
+                download->url);
+    } else {
+        fprintf(stderr, "---%s changed while downloading, starting "
+                        "again---\n", download->url);
+    }
+
+    close(download->fd);
+    download->fd = -1;
+    if (context->assembly == ASSEMBLE_PARTS) {
+        remove_chunk_files((char *)download->dir, download->filename,
+                           download->parts, download->num_parts);
+    }
+    remove_manifest(download->dir, download);
+
+    free(download->gaps);
+    download->gaps = NULL;
+    download->num_gaps = 0;
+    download->next_gap = 0;
+    download->next_offset = 0;
+    download->range_end = 0;
+    download->num_parts = 0;
+    download->content_length = -1;
+    download->failed = 0;
+    download->changed = 0;
+    download->corrupt = 0;
+    download->error[0] = '\0';
+    reset_hash(download);
+    ++download->restarts;
+
+    task_list_push(&scheduler->pending, new_probe(scheduler, download));
+}
+
+
+/**
+ * Check whether the validators of a response differ from those a download
+ * was started with. ETags are compared if both have one, otherwise
+ * Last-Modified; with neither to compare, the resource is taken to have
+ * changed.
+ * @param download - The download
+ * @param validator - The validators of the response
+ * @return 1 if the resource changed, 0 otherwise
+ */
+int validator_changed(Download *download, const HttpValidator *validator) {
+    if (download->validator.etag[0] && validator->etag[0]) {
+        return strcmp(download->validator.etag, validator->etag) != 0;
+    }
+    if (download->validator.last_modified[0] && validator->last_modified[0]) {
+        return strcmp(download->validator.last_modified,
+                      validator->last_modified) != 0;
+    }
+    return 1;
+}
+
+
+/**
+ * Give up on fetching a download in chunks, once a ranged request was
+ * answered with the whole resource: cut no more chunks, stop the chunks in
+ * flight where they are, and drop tails stolen but not yet dispatched. The
+ * download starts over in one stream once its chunks have all returned.
+ * @param scheduler - The scheduler
+ * @param download - The download
+ */
+void fall_back(Scheduler *scheduler, Download *download) {
+    fprintf(stderr, "---%s ignores ranges, fetching it in one stream---\n",
+            download->url);
+
+    download->single = 1;
+    download->falling_back = 1;
+    drop_unassigned(download);
+
+    for (Task *task = download->inflight; task; task = task->next) {
+        pthread_mutex_lock(&task->lock);
+        task->max_range = task->min_range + (off_t)task->received - 1;
+        pthread_mutex_unlock(&task->lock);
+    }
+
+    task_list_drop(scheduler, &scheduler->pending, download);
+    cancel_retries(scheduler, download);
+}
+
+
+/**
+ * Start a download over as a single stream, once the chunks in flight when
+ * it fell back have returned: throw away what they fetched, and leave the
+ * whole resource to be cut as one chunk.
+ * @param scheduler - The scheduler
+ * @param download - The download, with no chunks in flight
+ */
+void stream_download(Scheduler *scheduler, Download *download) {
+    // In direct mode the destination is simply overwritten
+    if (scheduler->context->assembly == ASSEMBLE_PARTS) {
+        remove_chunk_files((char *)download->dir, download->filename,
+                           download->parts, download->num_parts);
+    }
+    remove_manifest(download->dir, download);
+
+    free(download->gaps);
+    download->gaps = NULL;
+    download->num_gaps = 0;
+    download->next_gap = 0;
+    download->next_offset = 0;
+    download->range_end = download->content_length;
+    download->num_parts = 0;
+    download->failed = 0;
+    download->error[0] = '\0';
+    download->falling_back = 0;
+    reset_hash(download);
+}
+
+
+/**
+ * Send a line to the submitter of a job, if it is still connected. A
+ * connected submitter gets every line, the last one telling it how the job
+ * went included. One that stops reading is waited on for JOB_SEND_TIMEOUT
+ * seconds at most, so it can't hold up the other jobs for long, then
+ * dropped.
+ * @param job - The job
+ * @param format - printf format of the line, with its newline
+ */
+void job_send(Job *job, const char *format, ...) {
+    if (job->client == -1) {
+        return;
+    }
+
+    char line[FILE_SIZE + ERROR_SIZE + 64];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length >= (int)sizeof(line)) {
+        line[sizeof(line) - 2] = '\n';
+        length = sizeof(line) - 1;
+    }
+
+    for (int sent = 0; sent < length; ) {
+        ssize_t n = send(job->client, line + sent, length - sent,
+                         MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            close(job->client);
+            job->client = -1;
+            return;
+        }
+        sent += n;
+    }
+}
+
+
+/**
+ * Free a job, with any of its downloads not yet admitted, and close its
+ * submitter's socket.
+ * @param job - The job
+ */
+void free_job(Job *job) {
+    while (job->waiting) {
+        Download *next = job->waiting->next;
+        free_download(job->waiting);
+        job->waiting = next;
+    }
+    if (job->client != -1) {
+        close(job->client);
+    }
+    free(job);
+}
+
+
+/**
+ * Tell the submitter of a job that it has finished, and remove it from
+ * the scheduler's jobs and free it.
+ * @param scheduler - The scheduler
+ * @param job - The job, with every download finished
+ */
+void end_job(Scheduler *scheduler, Job *job) {
+    job_send(job, "finished job %d: %d downloads, %d failed\n", job->id,
+             job->total, job->failed);
+
+    Job **link = &scheduler->jobs;
+    while (*link && *link != job) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = job->next;
+    }
+    free_job(job);
+}
+
+
+/**
+ * Add a download to the end of the scheduler's list of active downloads.
+ */
+void add_download(Scheduler *scheduler, Download *download) {
+    Download **link = &scheduler->downloads;
+    while (*link) {
+        link = &(*link)->next;
+    }
+    download->next = NULL;
+    *link = download;
+    ++scheduler->active;
+}
+
+
+/**
+ * Remove a download from the scheduler's list, reporting how it went to
+ * the stats and to the submitter of its job, and free it.
+ */
+void remove_download(Scheduler *scheduler, Download *download) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double seconds = (now.tv_sec - download->started.tv_sec) +
+                     (now.tv_nsec - download->started.tv_nsec) / 1e9;
+
+    const char *error = NULL;
+    if (download->failed || download->content_length < 0) {
+        error = download->error[0] ? download->error : "failed";
+    }
+    stats_download(scheduler->stats, download->url, error,
+                   download->content_length, seconds, &download->totals);
+
+    Job *job = download->job;
+    if (job) {
+        --job->active;
+        ++job->finished;
+        if (error) {
+            ++job->failed;
+            job_send(job, "failed %s: %s\n", download->url, error);
+        } else {
+            job_send(job, "done %s (%lld bytes)\n", download->url,
+                     (long long)download->content_length);
+        }
+    }
+
+    Download **link = &scheduler->downloads;
+    while (*link && *link != download) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = download->next;
+    }
+    free_download(download);
+    --scheduler->active;
+
+    if (job && job->finished == job->total) {
+        end_job(scheduler, job);
+    }
+}
+
+
+/**
+ * Estimate how fast one connection to a mirror of a download goes. A
+ * mirror not measured yet is taken to be as fast as the average of those
+ * that have been, and each failure in a row halves, thirds, ... its speed.
+ * @param download - The download
+ * @param index - Index of the mirror
+ * @return Bytes per second, in units only meaningful between mirrors
+ */
+double mirror_speed(Download *download, int index) {
+    Mirror *mirror = &download->mirrors[index];
+    double speed = mirror->throughput;
+
+    if (speed == 0) {
+        double total = 0;
+        int measured = 0;
+        for (int i = 0; i < download->num_mirrors; i++) {
+            if (download->mirrors[i].throughput > 0) {
+                total += download->mirrors[i].throughput;
+                ++measured;
+            }
+        }
+        speed = measured ? total / measured : 1;
+    }
+
+    return speed / (1 + mirror->failures);
+}
+
+
+/**
+ * Choose the mirror to fetch the next chunk of a download from: the one
+ * expected to get through its share of chunks soonest, counting the chunk
+ * in hand, so faster mirrors are given proportionally more chunks.
+ * @param download - The download
+ * @return Index of the mirror, the origin if every mirror was dropped
+ */
+int pick_mirror(Download *download) {
+    int best = -1;
+    double soonest = 0;
+
+    for (int i = 0; i < download->num_mirrors; i++) {
+        Mirror *mirror = &download->mirrors[i];
+        if (mirror->dropped) {
+            continue;
+        }
+
+        double seconds = (mirror->inflight + 1) / mirror_speed(download, i);
+        if (best == -1 || seconds < soonest) {
+            best = i;
+            soonest = seconds;
+        }
+    }
+
+    return best == -1 ? download->origin : best;
+}
+
+
+/**
+ * Give a mirror of a download no more chunks. A download with only the one
+ * mirror keeps it, having nowhere else to go.
+ * @param download - The download
+ * @param index - Index of the mirror
+ * @param reason - Why, for the message
+ */
+void drop_mirror(Download *download, int index, const char *reason) {
+    Mirror *mirror = &download->mirrors[index];
+    if (mirror->dropped || download->num_mirrors == 1) {
+        return;
+    }
+
+    mirror->dropped = 1;
+    fprintf(stderr, "---dropping mirror %s of %s: %s---\n", mirror->url,
+            download->url, reason);
+}
+
+
+/**
+ * Choose the size of the next chunk of a download. Once the throughput of a
+ * connection has been measured, chunks are sized to take about
+ * TARGET_CHUNK_SECONDS; before that, the file is split evenly across the
+ * workers. Chunks are never smaller than min_chunk, and never leave a
+ * remainder smaller than min_chunk, so small files go in a single request.
+ * @param scheduler - The scheduler
+ * @param download - The download to cut a chunk from
+ * @return Size in bytes of the next chunk
+ */
+off_t next_chunk_size(Scheduler *scheduler, Download *download) {
+    off_t length = download->content_length;
+    off_t remaining = download->range_end - download->next_offset;
+    int num_workers = scheduler->context->num_workers;
+    off_t min_chunk = scheduler->min_chunk;
+
+    if (download->single) {
+        return remaining;
+    }
+
+    // An even split across the workers is the most a chunk should need
+    off_t even = (length + num_workers - 1) / num_workers;
+    off_t max_chunk = even > min_chunk ? even : min_chunk;
+
+    double size = even;
+    if (scheduler->throughput > 0) {
+        size = scheduler->throughput * TARGET_CHUNK_SECONDS;
+    }
+    if (size > max_chunk) {
+        size = max_chunk;
+    }
+    if (size < min_chunk) {
+        size = min_chunk;
+    }
+
+    off_t chunk = (off_t)size;
+    if (remaining - chunk < min_chunk) {
+        chunk = remaining;
+    }
+
+    return chunk;
+}
+
+
+/**
+ * Count the bytes of a download not yet given to any chunk.
+ * @param download - The download, with has_unassigned true
+ * @return Number of bytes
+ */
+off_t unassigned_bytes(Download *download) {
+    off_t bytes = download->range_end - download->next_offset;
+    for (int i = download->next_gap; i < download->num_gaps; i++) {
+        bytes += download->gaps[i].length;
+    }
+    return bytes;
+}
+
+
+/**
+ * Whether one download should be served before another under a policy.
+ * Downloads the policy has no preference between are served in the order
+ * of the url_file.
+ * @param policy - The policy
+ * @param a - A download
+ * @param b - Another download
+ * @return 1 if a goes first, 0 otherwise
+ */
+int download_before(SchedulePolicy policy, Download *a, Download *b) {
+    switch (policy) {
+    case POLICY_SMALLEST:
+        return unassigned_bytes(a) < unassigned_bytes(b);
+    case POLICY_PRIORITY:
+        return a->priority > b->priority;
+    case POLICY_DEADLINE:
+        return a->deadline > 0 &&
+               (b->deadline == 0 || a->deadline < b->deadline);
+    default:
+        return 0;
+    }
+}
+
+
+/**
+ * Count the chunks of a job's downloads in flight.
+ * @param scheduler - The scheduler
+ * @param job - The job
+ * @return Number of chunks
+ */
+int job_chunks(Scheduler *scheduler, Job *job) {
+    int chunks = 0;
+
+    for (Download *download = scheduler->downloads; download;
+         download = download->next) {
+        if (download->job == job) {
+            for (Task *task = download->inflight; task; task = task->next) {
+                ++chunks;
+            }
+        }
+    }
+
+    return chunks;
+}
+
+
+/**
+ * Whether the next chunk goes to one download's job before another's, in
+ * daemon mode: the job with the higher priority goes first, and of jobs
+ * with the same priority the one with fewer chunks in flight, so
+ * concurrent jobs share the connections, and bandwidth, evenly.
+ * @param scheduler - The scheduler
+ * @param a - A download
+ * @param b - Another download
+ * @return 1 if a's job goes first, 0 if not or they are of the same job
+ */
+int job_before(Scheduler *scheduler, Download *a, Download *b) {
+    if (!a->job || !b->job || a->job == b->job) {
+        return 0;
+    }
+    if (a->job->priority != b->job->priority) {
+        return a->job->priority > b->job->priority;
+    }
+    return job_chunks(scheduler, a->job) < job_chunks(scheduler, b->job);
+}
+
+
+/**
+ * Cut the next chunk task from the download the scheduling policy puts
+ * first of those that still have bytes not assigned to any chunk, and mark
+ * it in flight. In daemon mode the download's job is picked first, then
+ * the download among the job's.
+ * @param scheduler - The scheduler
+ * @return The new chunk task, or NULL if every byte is already assigned
+ */
+Task *next_chunk(Scheduler *scheduler) {
+    Download *d = NULL;
+
+    for (Download *other = scheduler->downloads; other; other = other->next) {
+        if (has_unassigned(other) &&
+            (!d || job_before(scheduler, other, d) ||
+             (!job_before(scheduler, d, other) &&
+              download_before(scheduler->policy, other, d)))) {
+            d = other;
+        }
+    }
+
+    if (!d) {
+        return NULL;
+    }
+
+    off_t size = next_chunk_size(scheduler, d);
+    Task *task = new_task(scheduler, TASK_CHUNK, d, d->next_offset,
+                          d->next_offset + size - 1);
+    task->whole = d->single;
+    d->next_offset += size;
+
+    return task;
+}
+
+
+/**
+ * Add a download to the backlog, behind those it doesn't go before.
+ * @param scheduler - The scheduler
+ * @param download - A download of the url_file
+ */
+void add_backlog(Scheduler *scheduler, Download *download) {
+    Download **link = &scheduler->backlog;
+    while (*link && !download_before(scheduler->policy, download, *link)) {
+        link = &(*link)->next;
+    }
+    download->next = *link;
+    *link = download;
+}
+
+
+/**
+ * Take the first download off the backlog.
+ * @param scheduler - The scheduler
+ * @return The download, or NULL if the backlog is empty
+ */
+Download *pop_backlog(Scheduler *scheduler) {
+    Download *download = scheduler->backlog;
+    if (download) {
+        scheduler->backlog = download->next;
+        download->next = NULL;
+    }
+    return download;
+}
+
+
+/**
+ * Hand tasks to the workers until the outstanding limit is reached:
+ * first pending probes and stolen tails, then new chunks. Each chunk goes
+ * to the mirror picked for it as it is handed out. The tasks are put on
+ * the todo queue in one batch.
+ * @param scheduler - The scheduler
+ */
+void dispatch(Scheduler *scheduler) {
+    void *batch[scheduler->capacity];
+    int count = 0;
+
+    while (scheduler->outstanding + count < scheduler->capacity) {
+        Task *task = task_list_pop(&scheduler->pending);
+        if (!task) {
+            task = next_chunk(scheduler);
+        }
+        if (!task) {
+            break;
+        }
+
+        // A single stream stays on the origin, the one known to serve it
+        if (task->type == TASK_CHUNK) {
+            Download *download = task->download;
+            if (!task->whole) {
+                task->mirror = pick_mirror(download);
+                task->url = download->mirrors[task->mirror].url;
+            }
+            ++download->mirrors[task->mirror].inflight;
+
+            task->next = download->inflight;
+            download->inflight = task;
+        }
+
+        batch[count++] = task;
+    }
+
+    // The todo queue holds capacity tasks, so this never blocks for long
+    for (int put = 0; put < count; ) {
+        put += queue_put_many(scheduler->context->todo, &batch[put],
+                              count - put);
+    }
+    scheduler->outstanding += count;
+}
+
+
+/**
+ * Work stealing: while workers would otherwise sit idle with nothing left
+ * to dispatch, split the in-flight chunk expected to take longest to
+ * finish, by the bytes still to come and the speed of its mirror, and hand
+ * its second half to an idle worker as a new chunk, which may go to a
+ * faster mirror. The original worker stops once it reaches the new end of
+ * its range.
+ * @param scheduler - The scheduler
+ */
+void steal_work(Scheduler *scheduler) {
+    int num_workers = scheduler->context->num_workers;
+
+    while (scheduler->outstanding < num_workers) {
+        Task *victim = NULL;
+        double longest = 0;
+
+        for (Download *d = scheduler->downloads; d; d = d->next) {
+            // A single stream can't be split
+            if (d->single) {
+                continue;
+            }
+
+            for (Task *task = d->inflight; task; task = task->next) {
+                pthread_mutex_lock(&task->lock);
+                off_t left = task->max_range - task->min_range + 1 -
+                             (off_t)task->received;
+                pthread_mutex_unlock(&task->lock);
+
+                // Only split when both halves are still worth a request
+                double seconds = left / mirror_speed(d, task->mirror);
+                if (left >= 2 * scheduler->min_chunk && seconds > longest) {
+                    longest = seconds;
+                    victim = task;
+                }
+            }
+        }
+
+        if (!victim) {
+            return;
+        }
+
+        pthread_mutex_lock(&victim->lock);
+        off_t start = victim->min_range + (off_t)victim->received;
+        off_t end = victim->max_range;
+        off_t split = start + (end - start + 1) / 2;
+        if (split - start < scheduler->min_chunk) {
+            // The victim made progress since it was measured
+            pthread_mutex_unlock(&victim->lock);
+            return;
+        }
+        victim->max_range = split - 1;
+        pthread_mutex_unlock(&victim->lock);
+
+        task_list_push(&scheduler->pending,
+                       new_task(scheduler, TASK_CHUNK, victim->download,
+                                split, end));
+        dispatch(scheduler);
+    }
+}
+
+
+/**
+ * Fold a sample into a running average of throughput, which is 0 until
+ * the first sample.
+ */
+void average_throughput(double *average, double sample) {
+    if (*average == 0) {
+        *average = sample;
+    } else {
+        *average = THROUGHPUT_ALPHA * sample +
+                   (1 - THROUGHPUT_ALPHA) * *average;
+    }
+}
+
+
+/**
+ * Fold the throughput of a completed chunk into the running average of
+ * per-connection throughput used to size new chunks, and into that of the
+ * mirror it came from, used to share chunks between mirrors.
+ * @param scheduler - The scheduler
+ * @param task - The completed chunk task
+ */
+void update_throughput(Scheduler *scheduler, Task *task) {
+    double elapsed = (task->finished.tv_sec - task->started.tv_sec) +
+                     (task->finished.tv_nsec - task->started.tv_nsec) / 1e9;
+
+    if (task->received == 0 || elapsed <= 0) {
+        return;
+    }
+
+    double sample = task->received / elapsed;
+    average_throughput(&scheduler->throughput, sample);
+    average_throughput(&task->download->mirrors[task->mirror].throughput,
+                       sample);
+}
+
+
+/**
+ * Check whether a request failed in a way that may pass if it is tried
+ * again: no response, a cut off response, or the server overloaded or
+ * broken for now.
+ * @param status - HTTP status of the response, or -1 on failure
+ * @return 1 if the request is worth trying again, 0 otherwise
+ */
+int transient(int status) {
+    return status == -1 || status == 408 || status == 429 || status >= 500;
+}
+
+
+/**
+ * Hold a failed task back for a while before it is dispatched again. The
+ * pause doubles with each attempt, and is jittered so downloads that
+ * failed together don't all retry at the same moment.
+ * @param scheduler - The scheduler
+ * @param task - The task to try again, with attempts already counted
+ * @return The pause in seconds
+ */
+double schedule_retry(Scheduler *scheduler, Task *task) {
+    double delay = RETRY_BASE_DELAY;
+    for (int i = 1; i < task->attempts && delay < RETRY_MAX_DELAY; i++) {
+        delay *= 2;
+    }
+    if (delay > RETRY_MAX_DELAY) {
+        delay = RETRY_MAX_DELAY;
+    }
+
+    // Half of it fixed, half random
+    delay = delay / 2 +
+            delay / 2 * rand_r(&scheduler->seed) / (double)RAND_MAX;
+
+    task->ready_at = now_seconds() + delay;
+    task_list_push(&scheduler->retries, task);
+    ++task->download->retrying;
+
+    return delay;
+}
+
+
+/**
+ * Move the retries whose pause is over to the pending list.
+ * @param scheduler - The scheduler
+ * @return When the next of the rest is ready, in seconds of
+ *         CLOCK_MONOTONIC, or 0 if there are none
+ */
+double release_retries(Scheduler *scheduler) {
+    double now = now_seconds();
+    double next = 0;
+    TaskList waiting = { NULL, NULL };
+
+    Task *task = task_list_pop(&scheduler->retries);
+    while (task) {
+        if (task->ready_at <= now) {
+            --task->download->retrying;
+            task_list_push(&scheduler->pending, task);
+        } else {
+            if (next == 0 || task->ready_at < next) {
+                next = task->ready_at;
+            }
+            task_list_push(&waiting, task);
+        }
+        task = task_list_pop(&scheduler->retries);
+    }
+
+    scheduler->retries = waiting;
+    return next;
+}
+
+
+/**
+ * Try a failed chunk again, if it failed for a reason that may pass and
+ * has tries left. Only the bytes not yet written are asked for; a single
+ * stream, which can't be resumed, starts over.
+ * @param scheduler - The scheduler
+ * @param task - The failed chunk task
+ * @return 0 if a retry was scheduled, -1 otherwise
+ */
+int retry_chunk(Scheduler *scheduler, Task *task) {
+    Download *download = task->download;
+
+    // A short response is as good a reason as a failed one
+    int status_ok = task->status >= 200 && task->status < 300;
+    if (task->write_error || task->attempts >= scheduler->max_retries ||
+        (!status_ok && !transient(task->status))) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&task->lock);
+    off_t start = task->whole ? task->min_range :
+                                task->min_range + (off_t)task->written;
+    off_t end = task->max_range;
+    pthread_mutex_unlock(&task->lock);
+
+    Task *retry = new_task(scheduler, TASK_CHUNK, download, start, end);
+    retry->whole = task->whole;
+    retry->attempts = task->attempts + 1;
+
+    double delay = schedule_retry(scheduler, retry);
+    fprintf(stderr, "retrying %s bytes %lld-%lld in %.2f s "
+                    "(attempt %d of %d)\n", download->url, (long long)start,
+            (long long)end, delay, retry->attempts + 1,
+            scheduler->max_retries + 1);
+    return 0;
+}
+
+
+/**
+ * Hand the bytes of a chunk not yet written to another mirror, after the
+ * one it went to was dropped. Not counted as an attempt, as the range
+ * itself didn't fail.
+ * @param scheduler - The scheduler
+ * @param task - The returned chunk task
+ */
+void reassign_chunk(Scheduler *scheduler, Task *task) {
+    pthread_mutex_lock(&task->lock);
+    off_t start = task->min_range + (off_t)task->written;
+    off_t end = task->max_range;
+    pthread_mutex_unlock(&task->lock);
+
+    Task *retry = new_task(scheduler, TASK_CHUNK, task->download, start, end);
+    retry->attempts = task->attempts;
+    task_list_push(&scheduler->pending, retry);
+}
+
+
+/**
+ * Probe a download again after its probe failed, if it has tries left and
+ * failed for a reason that may pass, or has other mirrors to try.
+ * @param scheduler - The scheduler
+ * @param task - The failed probe task
+ * @return 0 if a retry was scheduled, -1 otherwise
+ */
+int retry_probe(Scheduler *scheduler, Task *task) {
+    Download *download = task->download;
+
+    if (task->attempts >= scheduler->max_retries ||
+        (!transient(task->status) && download->num_mirrors == 1)) {
+        return -1;
+    }
+
+    // Each try goes to the next mirror, as the origin may be what failed
+    download->origin = (download->origin + 1) % download->num_mirrors;
+
+    Task *retry = new_probe(scheduler, download);
+    retry->attempts = task->attempts + 1;
+
+    double delay = schedule_retry(scheduler, retry);
+    fprintf(stderr, "retrying probe of %s in %.2f s (attempt %d of %d)\n",
+            retry->url, delay, retry->attempts + 1,
+            scheduler->max_retries + 1);
+    return 0;
+}
+
+
+/**
+ * Queue a completed part file of a download to be copied into the
+ * destination by the writer thread, for ASSEMBLE_PARTS.
+ * @param scheduler - The scheduler
+ * @param download - The download
+ * @param offset - Offset of the part in the destination, naming its file
+ * @param length - Bytes in the part file
+ */
+void queue_merge(Scheduler *scheduler, Download *download, off_t offset,
+                 off_t length) {
+    Task *task = new_task(scheduler, TASK_MERGE, download, offset,
+                          offset + length - 1);
+    task->fd = download->fd;
+
+    task_list_push(&scheduler->merges, task);
+    ++download->merging;
+}
+
+
+/**
+ * Hand queued merges to the writer thread while the merge queue has room.
+ * @param scheduler - The scheduler
+ */
+void dispatch_merges(Scheduler *scheduler) {
+    while (scheduler->merging < MERGE_QUEUE_SIZE) {
+        Task *task = task_list_pop(&scheduler->merges);
+        if (!task) {
+            break;
+        }
+
+        queue_put(scheduler->context->merges, task);
+        ++scheduler->merging;
+    }
+}
+
+
+/**
+ * Hand the writer thread the bytes of a download with a SHA-256 to check
+ * that have become contiguous with those hashed already. For
+ * ASSEMBLE_PARTS the merges of those bytes were queued first.
+ * @param scheduler - The scheduler
+ * @param download - The download
+ */
+void queue_hashing(Scheduler *scheduler, Download *download) {
+    off_t end = download->hashed;
+
+    // Chunks complete roughly in order, so this rarely takes many passes
+    int advanced = 1;
+    while (advanced) {
+        advanced = 0;
+        for (int i = 0; i < download->num_parts; i++) {
+            Part *part = &download->parts[i];
+            if (part->offset <= end && part->offset + part->length > end) {
+                end = part->offset + part->length;
+                advanced = 1;
+            }
+        }
+    }
+
+    if (end == download->hashed) {
+        return;
+    }
+
+    Task *task = new_task(scheduler, TASK_HASH, download, download->hashed,
+                          end - 1);
+    task->fd = download->fd;
+    task_list_push(&scheduler->merges, task);
+    ++download->merging;
+    download->hashed = end;
+}
+
+
+/**
+ * Read back the CRC32C of a range of a download's destination, for a chunk
+ * resumed from an earlier run.
+ * @return 0 on success, -1 if the destination could not be read
+ */
+int read_crc(Download *download, off_t offset, off_t length, uint32_t *crc) {
+    char buffer[MERGE_BUF_SIZE];
+    *crc = 0;
+
+    while (length > 0) {
+        size_t want = length < MERGE_BUF_SIZE ? length : MERGE_BUF_SIZE;
+        ssize_t bytes_read = pread(download->fd, buffer, want, offset);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            perror("pread");
+            return -1;
+        }
+        *crc = crc32c_update(*crc, buffer, bytes_read);
+        offset += bytes_read;
+        length -= bytes_read;
+    }
+    return 0;
+}
+
+
+/**
+ * Combine the CRC32Cs of a download's chunks, in offset order, into that
+ * of the whole destination.
+ * @param download - The download, with every byte in place
+ * @param crc - Set to the CRC32C of the destination
+ * @return 0 on success, -1 if the chunks don't cover the destination
+ *         exactly or a resumed one could not be read back
+ */
+int combine_crcs(Download *download, uint32_t *crc) {
+    qsort(download->parts, download->num_parts, sizeof(Part), compare_parts);
+
+    off_t end = 0;
+    *crc = 0;
+    for (int i = 0; i < download->num_parts; i++) {
+        Part *part = &download->parts[i];
+        if (part->length == 0) {
+            continue;
+        }
+        if (part->offset != end) {
+            return -1;
+        }
+
+        if (!part->has_crc &&
+            read_crc(download, part->offset, part->length, &part->crc) != 0) {
+            return -1;
+        }
+        part->has_crc = 1;
+
+        *crc = crc32c_combine(*crc, part->crc, part->length);
+        end += part->length;
+    }
+
+    return end == download->content_length ? 0 : -1;
+}
+
+
+/**
+ * Mark a download whose bytes don't match a digest from its line of the
+ * url_file as corrupt.
+ */
+void mark_corrupt(Download *download, const char *kind, const char *expected,
+                  const char *got) {
+    fprintf(stderr, "---%s failed its %s check (expected %s, got %s)---\n",
+            download->url, kind, expected, got);
+    note_error(download, "its %s did not match", kind);
+    download->corrupt = 1;
+    download->failed = 1;
+}
+
+
+/**
+ * Check a download with every byte in place against the digests from its
+ * line of the url_file, marking it corrupt on a mismatch.
+ * @param download - The download, with its hashing finished
+ */
+void verify_download(Download *download) {
+    if (download->check_crc) {
+        uint32_t crc;
+        char expected[9], got[9];
+        snprintf(expected, sizeof(expected), "%08x", download->expected_crc);
+
+        if (combine_crcs(download, &crc) != 0) {
+            mark_corrupt(download, "crc32c", expected, "no crc of every byte");
+        } else if (crc != download->expected_crc) {
+            snprintf(got, sizeof(got), "%08x", crc);
+            mark_corrupt(download, "crc32c", expected, got);
+        } else {
+            printf("---%s matches its crc32c---\n", download->url);
+        }
+    }
+
+    if (download->check_sha) {
+        uint8_t digest[SHA256_SIZE];
+        char expected[SHA256_SIZE * 2 + 1], got[SHA256_SIZE * 2 + 1];
+        sha256_final(&download->sha, digest);
+        checksum_format_hex(download->expected_sha, SHA256_SIZE, expected);
+        checksum_format_hex(digest, SHA256_SIZE, got);
+
+        if (download->hashed != download->content_length) {
+            mark_corrupt(download, "sha256", expected, "a hash of part of it");
+        } else if (memcmp(digest, download->expected_sha, SHA256_SIZE) != 0) {
+            mark_corrupt(download, "sha256", expected, got);
+        } else {
+            printf("---%s matches its sha256---\n", download->url);
+        }
+    }
+}
+
+
+/**
+ * Finish a download from its cached copy, once its probe found the copy
+ * still current. If the copy can't be put in place, the download is probed
+ * again without it.
+ * @param scheduler - The scheduler
+ * @param download - The probed download
+ */
+void use_cached(Scheduler *scheduler, Download *download) {
+    char filename[PATH_MAX];
+    snprintf(filename, PATH_MAX, "%s/%s", download->dir,
+             download->filename);
+
+    if (cache_place(scheduler->cache_dir, download->url, filename) != 0) {
+        fprintf(stderr, "---could not copy %s from the cache, fetching it "
+                        "again---\n", download->url);
+        download->cached = 0;
+        task_list_push(&scheduler->pending, new_probe(scheduler, download));
+        return;
+    }
+
+    // Left by an earlier run that was interrupted
+    remove_manifest(download->dir, download);
+
+    download->content_length = download->cached_length;
+    printf("---%s is unchanged, copied from the cache to: %s---\n",
+           download->url, filename);
+    remove_download(scheduler, download);
+}
+
+
+/**
+ * Keep a download that has just finished in the cache, for later runs to
+ * revalidate.
+ * @param scheduler - The scheduler
+ * @param download - The finished download
+ */
+void store_in_cache(Scheduler *scheduler, Download *download) {
+    char filename[PATH_MAX];
+    snprintf(filename, PATH_MAX, "%s/%s", download->dir,
+             download->filename);
+
+    cache_store(scheduler->cache_dir, download->url, filename,
+                download->content_length, &download->validator);
+}
+
+
+/**
+ * Move a download on after one of its tasks has returned. Once every byte
+ * has been assigned, every chunk has returned and every part is in place
+ * and hashed, it is checked against its digests, then started over or
+ * finished; until then its manifest is saved every
+ * MANIFEST_SAVE_INTERVAL seconds.
+ * @param scheduler - The scheduler
+ * @param download - The download
+ */
+void check_download(Scheduler *scheduler, Download *download) {
+    if (download->check_sha && !download->failed && !download->falling_back) {
+        queue_hashing(scheduler, download);
+    }
+
+    if (download->inflight || download->retrying || download->merging ||
+        has_unassigned(download)) {
+        // Keep the manifest close to current, for a resume if we are
+        // interrupted, without rewriting it as every chunk returns
+        checkpoint_manifest(download->dir, download);
+        return;
+    }
+
+    if (download->falling_back) {
+        stream_download(scheduler, download);
+        return;
+    }
+
+    if (!download->failed && (download->check_crc || download->check_sha)) {
+        verify_download(download);
+    }
+
+    // A bad mirror or proxy may have corrupted it, so it is fetched once
+    // more
+    if ((download->changed || download->corrupt) && download->restarts == 0) {
+        restart_download(scheduler, download);
+    } else {
+        finish_download((char *)download->dir, scheduler->context,
+                        download);
+        if (scheduler->cache_dir && !download->failed) {
+            store_in_cache(scheduler, download);
+        }
+
+        double late = now_seconds() - scheduler->started - download->deadline;
+        if (download->deadline > 0 && late > 0) {
+            printf("---%s missed its deadline by %.2f s---\n", download->url,
+                   late);
+        }
+        remove_download(scheduler, download);
+    }
+}
+
+
+/**
+ * Handle a chunk task returned by a worker, finishing its download once
+ * every byte has been assigned, every chunk has returned and every part is
+ * in place.
+ * @param scheduler - The scheduler
+ * @param task - The completed chunk task
+ */
+void complete_chunk(Scheduler *scheduler, Task *task) {
+    Download *download = task->download;
+
+    Task **link = &download->inflight;
+    while (*link && *link != task) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = task->next;
+    }
+
+    Mirror *mirror = &download->mirrors[task->mirror];
+    --mirror->inflight;
+
+    // A range answered in full has its body left unread. With If-Range
+    // that is how a changed resource answers; otherwise, or if the
+    // validators are unchanged, the server ignores ranges. Only the origin
+    // is fallen back to one stream for; another mirror is left out.
+    if (download->falling_back) {
+        // What the chunk fetched is thrown away
+    } else if (task->status == 200 && !task->whole &&
+               task->mirror != download->origin) {
+        drop_mirror(download, task->mirror, "it ignores ranges");
+        reassign_chunk(scheduler, task);
+    } else if (task->status == 206 && task->mirror != download->origin &&
+               task->resource.length >= 0 &&
+               task->resource.length != download->content_length) {
+        // Its bytes are from some other resource, so none are kept
+        drop_mirror(download, task->mirror, "its copy has another length");
+        pthread_mutex_lock(&task->lock);
+        task->written = 0;
+        pthread_mutex_unlock(&task->lock);
+        reassign_chunk(scheduler, task);
+    } else if (task->status == 200 && !task->whole) {
+        if (task->if_range &&
+            validator_changed(download, &task->resource.validator)) {
+            fprintf(stderr, "resource changed while downloading: %s\n",
+                    task->url);
+            note_error(download, "the resource changed while downloading");
+            download->changed = 1;
+            download->failed = 1;
+            drop_unassigned(download);
+            cancel_retries(scheduler, download);
+        } else {
+            fall_back(scheduler, download);
+        }
+    } else if (wait_task(task) == 0) {
+        update_throughput(scheduler, task);
+        mirror->failures = 0;
+    } else {
+        if (++mirror->failures >= MIRROR_MAX_FAILURES) {
+            drop_mirror(download, task->mirror, "too many failures");
+        }
+
+        if (retry_chunk(scheduler, task) == 0) {
+            // A single stream starts over, overwriting what this one wrote
+            if (task->whole) {
+                return;
+            }
+        } else {
+            note_error(download, "bytes %lld-%lld failed after %d attempts "
+                                 "(status %d)", (long long)task->min_range,
+                       (long long)task->max_range, task->attempts + 1,
+                       task->status);
+            download->failed = 1;
+            drop_unassigned(download);
+        }
+    }
+
+    add_part(download, task->min_range, (off_t)task->written, task->crc, 1);
+
+    // Copy the part into place while the other chunks are still arriving
+    if (scheduler->context->assembly == ASSEMBLE_PARTS && task->written > 0 &&
+        !download->failed && !download->falling_back) {
+        queue_merge(scheduler, download, task->min_range,
+                    (off_t)task->written);
+    }
+
+    check_download(scheduler, download);
+}
+
+
+/**
+ * Handle a probe task returned by a worker: start splitting the download
+ * into chunks, or drop it if the probe failed.
+ * @param scheduler - The scheduler
+ * @param task - The completed probe task
+ */
+void complete_probe(Scheduler *scheduler, Task *task) {
+    Download *download = task->download;
+    Context *context = scheduler->context;
+
+    download->content_length = task->content_length;
+    download->validator = task->resource.validator;
+    // A GET probe that kept the first bytes got a 206, so ranges work
+    // whatever Accept-Ranges says
+    download->single = task->resource.accept_ranges == 0 &&
+                       task->received == 0;
+
+    // A server ignoring the conditions may still show the same length and
+    // validators as the cached copy
+    if (download->cached &&
+        (task->status == 304 ||
+         (download->content_length == download->cached_length &&
+          !validator_changed(download, &download->cached_validator)))) {
+        use_cached(scheduler, download);
+        return;
+    }
+
+    // A server ignoring the GET probe's range may still give the length
+    // in answer to HEAD
+    if (download->content_length < 0 && task->probe_data &&
+        task->resource.accept_ranges == 0) {
+        task_list_push(&scheduler->pending,
+                       new_task(scheduler, TASK_PROBE, download, 0, 0));
+        return;
+    }
+
+    if (download->content_length < 0) {
+        if (retry_probe(scheduler, task) == 0) {
+            return;
+        }
+        fprintf(stderr, "error probing: %s\n", download->url);
+        note_error(download, "probe failed after %d attempts (status %d)",
+                   task->attempts + 1, task->status);
+        remove_download(scheduler, download);
+        return;
+    }
+
+    int resumed = resume_download(download->dir, context,
+                                  download) == 0;
+
+    if (!resumed && start_download(download->dir, download) != 0) {
+        fprintf(stderr, "error creating destination for: %s\n",
+                download->url);
+        note_error(download, "the destination could not be created");
+        remove_download(scheduler, download);
+        return;
+    }
+
+    // A resumed download already has, or will fetch, the GET probe's bytes
+    if (!resumed && task->received > 0 &&
+        store_probe_data(download->dir, context, download,
+                         task) != 0) {
+        note_error(download, "writing the first chunk failed");
+        download->failed = 1;
+        drop_unassigned(download);
+    }
+
+    // The parts so far are the probe's bytes or those of an earlier run
+    if (context->assembly == ASSEMBLE_PARTS && !download->failed) {
+        for (int i = 0; i < download->num_parts; i++) {
+            queue_merge(scheduler, download, download->parts[i].offset,
+                        download->parts[i].length);
+        }
+    }
+
+    // Finished if it was empty, fetched whole by the probe, or complete
+    // from an earlier run; otherwise chunks are cut from it by dispatch
+    check_download(scheduler, download);
+}
+
+
+/**
+ * Handle a merge or hash task returned by the writer thread, finishing its
+ * download if it was the last thing the download was waiting for.
+ * @param scheduler - The scheduler
+ * @param task - The completed merge or hash task
+ */
+void complete_merge(Scheduler *scheduler, Task *task) {
+    Download *download = task->download;
+
+    --download->merging;
+    if (task->write_error) {
+        note_error(download, "%s bytes %lld-%lld failed",
+                   task->type == TASK_HASH ? "hashing" : "copying into place",
+                   (long long)task->min_range, (long long)task->max_range);
+        download->failed = 1;
+        drop_unassigned(download);
+    }
+
+    check_download(scheduler, download);
+}
+
+
+/**
+ * Add a task returned by a worker to the totals of its download, and of
+ * its worker and the whole run.
+ * @param scheduler - The scheduler
+ * @param task - The returned task
+ */
+void record_task(Scheduler *scheduler, Task *task) {
+    // A GET probe's body is kept too, unless the range was ignored
+    long long bytes = task->type == TASK_CHUNK ? (long long)task->written :
+                                                 (long long)task->received;
+
+    totals_add(&task->download->totals, &task->timing, bytes);
+    if (task->download->job) {
+        task->download->job->bytes += bytes;
+    }
+    stats_request(scheduler->stats, task->worker, &task->timing, bytes);
+}
+
+
+/**
+ * Count the body bytes chunks still in flight have written so far.
+ * @param scheduler - The scheduler
+ * @param job - Only count the chunks of this job's downloads, or NULL to
+ *              count every chunk
+ * @return Number of bytes
+ */
+long long bytes_in_flight(Scheduler *scheduler, Job *job) {
+    long long bytes = 0;
+
+    for (Download *download = scheduler->downloads; download;
+         download = download->next) {
+        if (job && download->job != job) {
+            continue;
+        }
+        for (Task *task = download->inflight; task; task = task->next) {
+            pthread_mutex_lock(&task->lock);
+            bytes += task->written;
+            pthread_mutex_unlock(&task->lock);
+        }
+    }
+
+    return bytes;
+}
+
+
+/**
+ * Get back every result that is ready, waiting for at least one, though
+ * no later than a deadline.
+ * @param scheduler - The scheduler
+ * @param results - Filled in with the returned tasks
+ * @param deadline - When to stop waiting, in seconds of CLOCK_MONOTONIC,
+ *                   or 0 to wait for as long as it takes
+ * @return Number of results, 0 if the deadline passed first
+ */
+int collect_results(Scheduler *scheduler, void **results, double deadline) {
+    Queue *done = scheduler->context->done;
+
+    if (deadline == 0) {
+        return queue_get_many(done, results, scheduler->capacity);
+    }
+
+    double wait = deadline - now_seconds();
+    if (wait <= 0 ||
+        queue_get_timed(done, &results[0], (int)(wait * 1000) + 1) != 0) {
+        return 0;
+    }
+
+    int n = 1;
+    while (n < scheduler->capacity && queue_try_get(done, &results[n]) == 0) {
+        ++n;
+    }
+    return n;
+}
+
+
+/**
+ * Print a progress line if one is due, and send one to the submitter of
+ * each job in daemon mode, and work out when the next is.
+ * @param scheduler - The scheduler
+ * @param progress - Seconds between progress lines, 0 for none
+ * @param next_progress - When the next progress line is due, in seconds
+ *                        of CLOCK_MONOTONIC
+ */
+void report_progress(Scheduler *scheduler, double progress,
+                     double *next_progress) {
+    if (progress <= 0 || now_seconds() < *next_progress) {
+        return;
+    }
+
+    stats_progress(scheduler->stats, stderr, bytes_in_flight(scheduler, NULL),
+                   scheduler->active);
+    for (Job *job = scheduler->jobs; job; job = job->next) {
+        job_send(job, "progress job %d: %d of %d downloads, %lld bytes\n",
+                 job->id, job->finished, job->total,
+                 job->bytes + bytes_in_flight(scheduler, job));
+    }
+
+    // Skip intervals missed while main was busy
+    double now = now_seconds();
+    while (*next_progress <= now) {
+        *next_progress += progress;
+    }
+}
+
+
+/**
+ * Sleep until a deadline, if it is set and still to come.
+ * @param deadline - In seconds of CLOCK_MONOTONIC, or 0 for none
+ */
+void sleep_until(double deadline) {
+    double wait = deadline - now_seconds();
+    if (deadline == 0 || wait <= 0) {
+        return;
+    }
+
+    struct timespec pause;
+    pause.tv_sec = (time_t)wait;
+    pause.tv_nsec = (long)((wait - pause.tv_sec) * 1e9);
+    while (nanosleep(&pause, &pause) == -1 && errno == EINTR) {
+    }
+}
+
+
+// A destination already named in the url_file, in a bucket's list
+typedef struct SeenUrl {
+    struct SeenUrl *next;
+    char filename[];
+} SeenUrl;
+
+
+/**
+ * Remember the destination of a line of the url_file.
+ * @param seen - The SEEN_BUCKETS buckets of destinations seen so far
+ * @param filename - The destination
+ * @return 1 if an earlier line had the same destination, 0 otherwise
+ */
+int mark_seen(SeenUrl **seen, const char *filename) {
+    // djb2 hash of the destination
+    unsigned long hash = 5381;
+    for (const char *c = filename; *c; c++) {
+        hash = hash * 33 + (unsigned char)*c;
+    }
+
+    SeenUrl **bucket = &seen[hash % SEEN_BUCKETS];
+    for (SeenUrl *entry = *bucket; entry; entry = entry->next) {
+        if (strcmp(entry->filename, filename) == 0) {
+            return 1;
+        }
+    }
+
+    SeenUrl *entry = malloc(sizeof(SeenUrl) + strlen(filename) + 1);
+    if (!entry) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(entry->filename, filename);
+    entry->next = *bucket;
+    *bucket = entry;
+
+    return 0;
+}
+
+
+void free_seen(SeenUrl **seen) {
+    for (int i = 0; i < SEEN_BUCKETS; i++) {
+        while (seen[i]) {
+            SeenUrl *next = seen[i]->next;
+            free(seen[i]);
+            seen[i] = next;
+        }
+    }
+}
+
+
+/**
+ * Read the next download from the url_file, skipping lines with no URL or
+ * a malformed field, those whose destination's path would be longer than
+ * PATH_MAX, and those with the same destination as an earlier line, which
+ * would write over each other.
+ * @param fp - The url_file
+ * @param line - The getline buffer
+ * @param len - Its size
+ * @param seen - The destinations of the lines read so far
+ * @param dir - The directory the download is written in
+ * @return The download, or NULL at the end of the file
+ */
+Download *read_download(FILE *fp, char **line, size_t *len, SeenUrl **seen,
+                        const char *dir) {
+    while (getline(line, len, fp) != -1) {
+        Download *download = new_download(*line);
+        if (!download) {
+            continue;
+        }
+        download->dir = dir;
+
+        // Checked once here, so no path of the download is cut short
+        if (strlen(dir) + 1 + strlen(download->filename) + PATH_SUFFIX_SIZE >
+            PATH_MAX) {
+            printf("---skipping %s, the path of its destination is too "
+                   "long---\n", download->url);
+            free_download(download);
+            continue;
+        }
+
+        if (mark_seen(seen, download->filename)) {
+            printf("---skipping %s, it has the same destination as an "
+                   "earlier line---\n", download->url);
+            free_download(download);
+            continue;
+        }
+        return download;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Reply to a submitter whose job is turned down, and close its socket.
+ * @param client - The submitter's socket
+ * @param reason - Why the job is turned down
+ */
+void reject_job(int client, const char *reason) {
+    dprintf(client, "error: %s\n", reason);
+    close(client);
+}
+
+
+/**
+ * Read a job from a submitter: a header of "dir <absolute path>" and
+ * optionally "priority <integer>" lines ended by a blank line, then the
+ * lines of a url_file until the submitter shuts down its side of the
+ * socket. The download directory is made if it doesn't exist.
+ * @param daemon - The daemon
+ * @param client - The submitter's socket, owned by the job from then on
+ * @return The job, or NULL if it was turned down
+ */
+Job *read_job(Daemon *daemon, int client) {
+    // Don't let a submitter that stops sending hold up the listener, or
+    // one that stops reading hold up the scheduler for long
+    struct timeval timeout = { JOB_READ_TIMEOUT, 0 };
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    struct timeval send_timeout = { JOB_SEND_TIMEOUT, 0 };
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &send_timeout,
+               sizeof(send_timeout));
+
+    int fd = dup(client);
+    FILE *in = fd == -1 ? NULL : fdopen(fd, "r");
+    if (!in) {
+        perror("fdopen");
+        if (fd != -1) {
+            close(fd);
+        }
+        reject_job(client, "out of resources");
+        return NULL;
+    }
+
+    Job *job = calloc(1, sizeof(Job));
+    if (!job) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    job->client = client;
+
+    char *line = NULL;
+    size_t len = 0;
+    const char *error = NULL;
+    int ended = 0;
+
+    while (!error && getline(&line, &len, in) != -1) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *end;
+        if (line[0] == '\0') {
+            ended = 1;
+            break;
+        } else if (strncmp(line, "dir ", 4) == 0) {
+            if (snprintf(job->dir, PATH_MAX, "%s", line + 4) >= PATH_MAX) {
+                error = "dir is too long";
+            }
+        } else if (strncmp(line, "priority ", 9) == 0) {
+            job->priority = (int)strtol(line + 9, &end, 10);
+            if (end == line + 9 || *end) {
+                error = "malformed priority";
+            }
+        } else {
+            error = "unknown field in the job's header";
+        }
+    }
+
+    if (!error && !ended) {
+        error = "the job's header is not finished";
+    } else if (!error && job->dir[0] != '/') {
+        error = "the job needs an absolute dir";
+    } else if (!error && mkdir(job->dir, 0755) == -1 && errno != EEXIST) {
+        error = strerror(errno);
+    }
+
+    if (!error) {
+        SeenUrl *seen[SEEN_BUCKETS] = { NULL };
+        Download **tail = &job->waiting;
+        Download *download;
+        while ((download = read_download(in, &line, &len, seen, job->dir))) {
+            download->job = job;
+            *tail = download;
+            tail = &download->next;
+            ++job->total;
+        }
+        free_seen(seen);
+
+        if (ferror(in)) {
+            error = "the job was not received in time";
+        }
+    }
+
+    free(line);
+    fclose(in);
+
+    if (error) {
+        job->client = -1;
+        free_job(job);
+        reject_job(client, error);
+        return NULL;
+    }
+
+    job->id = daemon->next_id++;
+    return job;
+}
+
+
+/**
+ * Accept jobs on the daemon's socket, passing each to main, until SIGINT
+ * or SIGTERM. Jobs are read one at a time; they are small, and each is
+ * read under a timeout.
+ * @param arg - The daemon
+ */
+void *listener_thread(void *arg) {
+    Daemon *daemon = (Daemon *)arg;
+    struct pollfd fds[2] = {
+        { .fd = daemon->listener, .events = POLLIN },
+        { .fd = daemon->signals, .events = POLLIN }
+    };
+
+    for (;;) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+
+        int client = accept4(daemon->listener, NULL, NULL, SOCK_CLOEXEC);
+        if (client == -1) {
+            perror("accept");
+            continue;
+        }
+
+        Job *job = read_job(daemon, client);
+        if (!job) {
+            continue;
+        }
+
+        pthread_mutex_lock(&daemon->mutex);
+        Job **link = &daemon->inbox;
+        while (*link) {
+            link = &(*link)->next;
+        }
+        *link = job;
+        pthread_mutex_unlock(&daemon->mutex);
+        queue_put(daemon->done, &wake_task);
+    }
+
+    fprintf(stderr, "daemon stopping once its jobs are finished\n");
+    close(daemon->listener);
+    unlink(daemon->path);
+
+    pthread_mutex_lock(&daemon->mutex);
+    daemon->stopping = 1;
+    pthread_mutex_unlock(&daemon->mutex);
+    queue_put(daemon->done, &wake_task);
+
+    return NULL;
+}
+
+
+/**
+ * Block SIGINT and SIGTERM in every thread, so they are only taken by the
+ * daemon's listener thread through a signalfd. Call this before any
+ * threads are spawned.
+ * @return The signalfd
+ */
+int block_stop_signals(void) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    int fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    if (fd == -1) {
+        perror("signalfd");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+
+/**
+ * Listen for jobs on a unix socket, replacing one left behind by an
+ * earlier daemon, and start the listener thread.
+ * @param path - Path of the socket
+ * @param signals - signalfd of the signals that stop the daemon
+ * @param done - The done queue of main, to wake it when a job comes in
+ * @return The daemon
+ */
+Daemon *start_daemon(const char *path, int signals, Queue *done) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "socket path is too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener == -1) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    unlink(path);
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+        listen(listener, SOMAXCONN) == -1) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    Daemon *daemon = calloc(1, sizeof(Daemon));
+    if (!daemon) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    daemon->listener = listener;
+    daemon->path = path;
+    daemon->signals = signals;
+    daemon->done = done;
+    daemon->next_id = 1;
+    pthread_mutex_init(&daemon->mutex, NULL);
+
+    if (pthread_create(&daemon->thread, NULL, listener_thread, daemon) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "daemon listening on %s\n", path);
+    return daemon;
+}
+
+
+/**
+ * Wait for the daemon's listener thread to stop, and free the daemon.
+ * @param daemon - The daemon, with stopping set
+ */
+void stop_daemon(Daemon *daemon) {
+    pthread_join(daemon->thread, NULL);
+    close(daemon->signals);
+    pthread_mutex_destroy(&daemon->mutex);
+    free(daemon);
+}
+
+
+/**
+ * Whether another job already has a download with the same destination,
+ * waiting or active, which the two would write over each other.
+ * @param scheduler - The scheduler
+ * @param download - The download of a job not yet taken
+ * @return 1 if the destination is taken, 0 if not
+ */
+int destination_taken(Scheduler *scheduler, Download *download) {
+    for (Download *other = scheduler->downloads; other; other = other->next) {
+        if (strcmp(other->dir, download->dir) == 0 &&
+            strcmp(other->filename, download->filename) == 0) {
+            return 1;
+        }
+    }
+
+    for (Job *job = scheduler->jobs; job; job = job->next) {
+        for (Download *other = job->waiting; other; other = other->next) {
+            if (strcmp(other->dir, download->dir) == 0 &&
+                strcmp(other->filename, download->filename) == 0) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Take the jobs in the daemon's inbox into the scheduler, failing their
+ * downloads whose destination another job has. A deadline of a download
+ * is counted from when its job is taken, rather than from the start of
+ * the daemon.
+ * @param daemon - The daemon
+ * @param scheduler - The scheduler
+ */
+void take_jobs(Daemon *daemon, Scheduler *scheduler) {
+    pthread_mutex_lock(&daemon->mutex);
+    Job *jobs = daemon->inbox;
+    daemon->inbox = NULL;
+    pthread_mutex_unlock(&daemon->mutex);
+
+    double offset = now_seconds() - scheduler->started;
+
+    while (jobs) {
+        Job *job = jobs;
+        jobs = job->next;
+        job->next = NULL;
+        job_send(job, "accepted job %d: %d downloads\n", job->id, job->total);
+
+        for (Download **link = &job->waiting; *link;) {
+            Download *download = *link;
+            if (destination_taken(scheduler, download)) {
+                job_send(job, "failed %s: another job is downloading it to "
+                         "the same destination\n", download->url);
+                *link = download->next;
+                free_download(download);
+                ++job->finished;
+                ++job->failed;
+                continue;
+            }
+            if (download->deadline > 0) {
+                download->deadline += offset;
+            }
+            link = &download->next;
+        }
+
+        Job **link = &scheduler->jobs;
+        while (*link) {
+            link = &(*link)->next;
+        }
+        *link = job;
+
+        if (job->finished == job->total) {
+            end_job(scheduler, job);
+        }
+    }
+}
+
+
+/**
+ * Take the next download to admit off the jobs: the first waiting one of
+ * the job with the highest priority, and of jobs with the same priority
+ * the one with the fewest downloads active.
+ * @param scheduler - The scheduler
+ * @return The download, or NULL if no job has one waiting
+ */
+Download *next_job_download(Scheduler *scheduler) {
+    Job *job = NULL;
+
+    for (Job *other = scheduler->jobs; other; other = other->next) {
+        if (other->waiting &&
+            (!job || other->priority > job->priority ||
+             (other->priority == job->priority &&
+              other->active < job->active))) {
+            job = other;
+        }
+    }
+
+    if (!job) {
+        return NULL;
+    }
+
+    Download *download = job->waiting;
+    job->waiting = download->next;
+    download->next = NULL;
+    ++job->active;
+    return download;
+}
+
+
+/**
+ * Whether the daemon is still running: until it is stopping, and then
+ * until the jobs it has taken are finished.
+ * @param daemon - The daemon
+ * @param scheduler - The scheduler
+ * @return 1 if it is running, 0 once main can exit
+ */
+int daemon_running(Daemon *daemon, Scheduler *scheduler) {
+    pthread_mutex_lock(&daemon->mutex);
+    int running = !daemon->stopping || daemon->inbox;
+    pthread_mutex_unlock(&daemon->mutex);
+
+    return running || scheduler->jobs;
+}
+
+
+/**
+ * Submit a url_file to a daemon as a job, printing the daemon's replies as
+ * its downloads finish.
+ * @param path - Path of the daemon's socket
+ * @param url_file - The url_file
+ * @param download_dir - Where the daemon writes the downloads, made if it
+ *                       doesn't exist
+ * @param priority - Of the job among the daemon's others, higher served
+ *                   first
+ * @return Exit status: 0 if every download of the job succeeded, 1 if not
+ */
+int submit_job(const char *path, const char *url_file,
+               const char *download_dir, int priority) {
+    FILE *fp = fopen(url_file, "r");
+    if (!fp) {
+        perror(url_file);
+        return 1;
+    }
+
+    create_directory(download_dir);
+    char dir[PATH_MAX];
+    if (!realpath(download_dir, dir)) {
+        perror(download_dir);
+        fclose(fp);
+        return 1;
+    }
+
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1 ||
+        connect(sock, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        perror(path);
+        fclose(fp);
+        return 1;
+    }
+
+    // The daemon may turn the job down before it is all sent
+    signal(SIGPIPE, SIG_IGN);
+    dprintf(sock, "dir %s\npriority %d\n\n", dir, priority);
+    char buf[MERGE_BUF_SIZE];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0 &&
+           write(sock, buf, n) == (ssize_t)n) {
+    }
+    fclose(fp);
+    shutdown(sock, SHUT_WR);
+
+    FILE *in = fdopen(sock, "r");
+    char *line = NULL;
+    size_t len = 0;
+    int status = 1;
+    int total, failed;
+    while (getline(&line, &len, in) != -1) {
+        fputs(line, stdout);
+        fflush(stdout);
+        // The job number is read and ignored
+        if (sscanf(line, "finished job %*d: %d downloads, %d failed", &total,
+                   &failed) == 2) {
+            status = failed != 0;
+        }
+    }
+    free(line);
+    fclose(in);
+
+    return status;
+}
+
+
+void usage(void) {
+    fprintf(stderr, "usage: ./downloader [-d max_downloads] [-a direct|parts] "
+                    "[-k] [-c min_chunk] [-e threads|epoll] [-t engines] "
+                    "[-u] [-g] [-p seconds] [-j summary.json] [-r rate] "
+                    "[-R host_rate] [-C host_connections] [-x retries] "
+                    "[-s cache_dir] [-i] "
+                    "[-o fifo|smallest|priority|deadline] [-T ca_file] "
+                    "[-b receive_buffer] [-w connect_timeout] "
+                    "url_file num_workers download_dir\n"
+                    "       ./downloader [options] -D socket num_workers\n"
+                    "       ./downloader -J socket [-P priority] "
+                    "url_file download_dir\n");
+    exit(1);
+}
+
+
+/**
+ * Parse a rate in bytes per second, with an optional k or m suffix for
+ * KiB/s or MiB/s, e.g. 500k.
+ * @return The rate, or -1 if it is malformed
+ */
+double parse_rate(const char *text) {
+    char *end;
+    double rate = strtod(text, &end);
+
+    if (*end == 'k' || *end == 'K') {
+        rate *= 1024;
+        ++end;
+    } else if (*end == 'm' || *end == 'M') {
+        rate *= 1024 * 1024;
+        ++end;
+    }
+
+    return *end == '\0' && end != text && rate >= 0 ? rate : -1;
+}
+
+
+int main(int argc, char **argv) {
+    int max_downloads = DEFAULT_MAX_DOWNLOADS;
+    AssemblyMode assembly = ASSEMBLE_DIRECT;
+    int min_chunk = DEFAULT_MIN_CHUNK;
+    WorkerMode mode = WORKERS_THREADS;
+    int num_engines = 1;
+    int splice = 1;
+    int get_probe = 0;
+    double progress = 0;
+    const char *summary = NULL;
+    double rate = 0;
+    double host_rate = 0;
+    int host_connections = 0;
+    int max_retries = DEFAULT_MAX_RETRIES;
+    const char *cache_dir = NULL;
+    int async_io = 0;
+    SchedulePolicy policy = POLICY_FIFO;
+    const char *ca_file = NULL;
+    double receive_buffer = 0;
+    double connect_timeout = DEFAULT_CONNECT_TIMEOUT;
+    const char *daemon_path = NULL;
+    const char *job_path = NULL;
+    int job_priority = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv,
+                         "d:a:kc:e:t:ugp:j:r:R:C:x:s:io:T:b:w:D:J:P:")) != -1) {
+        switch (opt) {
+        case 'd':
+            max_downloads = atoi(optarg);
+            break;
+        case 'a':
+            if (strcmp(optarg, "direct") == 0) {
+                assembly = ASSEMBLE_DIRECT;
+            } else if (strcmp(optarg, "parts") == 0) {
+                assembly = ASSEMBLE_PARTS;
+            } else {
+                usage();
+            }
+            break;
+        case 'k':
+            http_set_version(HTTP_1_1);
+            break;
+        case 'c':
+            min_chunk = atoi(optarg);
+            break;
+        case 'e':
+            if (strcmp(optarg, "threads") == 0) {
+                mode = WORKERS_THREADS;
+            } else if (strcmp(optarg, "epoll") == 0) {
+                mode = WORKERS_EPOLL;
+            } else {
+                usage();
+            }
+            break;
+        case 't':
+            num_engines = atoi(optarg);
+            break;
+        case 'u':
+            // Copy bodies through user space, for comparison
+            splice = 0;
+            break;
+        case 'g':
+            // Probe with a ranged GET of the first chunk instead of HEAD
+            get_probe = 1;
+            break;
+        case 'p':
+            // Print a progress line this often
+            progress = atof(optarg);
+            break;
+        case 'j':
+            // Write a JSON summary of the run at exit
+            summary = optarg;
+            break;
+        case 'r':
+            // Most bytes per second read over all hosts
+            rate = parse_rate(optarg);
+            break;
+        case 'R':
+            // Most bytes per second read from each host
+            host_rate = parse_rate(optarg);
+            break;
+        case 'C':
+            // Most connections to each host at once
+            host_connections = atoi(optarg);
+            break;
+        case 'x':
+            // Times a failed chunk or probe is tried again
+            max_retries = atoi(optarg);
+            break;
+        case 's':
+            // Keep completed downloads here, and revalidate them next run
+            cache_dir = optarg;
+            break;
+        case 'i':
+            // Write chunk bodies in the background through io_uring
+            async_io = 1;
+            break;
+        case 'o':
+            // The order downloads are served in
+            if (strcmp(optarg, "fifo") == 0) {
+                policy = POLICY_FIFO;
+            } else if (strcmp(optarg, "smallest") == 0) {
+                policy = POLICY_SMALLEST;
+            } else if (strcmp(optarg, "priority") == 0) {
+                policy = POLICY_PRIORITY;
+            } else if (strcmp(optarg, "deadline") == 0) {
+                policy = POLICY_DEADLINE;
+            } else {
+                usage();
+            }
+            break;
+        case 'T':
+            // Check https servers against these certificates instead
+            ca_file = optarg;
+            break;
+        case 'b':
+            // Size of each socket's kernel receive buffer
+            receive_buffer = parse_rate(optarg);
+            break;
+        case 'w':
+            // Most seconds spent connecting to a server, 0 for no limit
+            connect_timeout = atof(optarg);
+            break;
+        case 'D':
+            // Run as a daemon, taking jobs on this unix socket
+            daemon_path = optarg;
+            break;
+        case 'J':
+            // Submit the url_file as a job to the daemon on this socket
+            job_path = optarg;
+            break;
+        case 'P':
+            // Priority of the job submitted, higher served first
+            job_priority = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (job_path) {
+        if (daemon_path || argc - optind != 2) {
+            usage();
+        }
+        return submit_job(job_path, argv[optind], argv[optind + 1],
+                          job_priority);
+    }
+
+    if (argc - optind != (daemon_path ? 1 : 3) || max_downloads < 1 ||
+        min_chunk < 1 || num_engines < 1 || progress < 0 || rate < 0 ||
+        host_rate < 0 || host_connections < 0 || max_retries < 0 ||
+        receive_buffer < 0 || receive_buffer > INT_MAX ||
+        connect_timeout < 0) {
+        usage();
+    }
+    http_set_limits(rate, host_rate, host_connections);
+    http_set_socket_options((int)receive_buffer, connect_timeout);
+    if (ca_file && http_set_ca_file(ca_file) != 0) {
+        exit(1);
+    }
+
+    char *url_file = daemon_path ? NULL : argv[optind];
+    int num_workers = atoi(argv[daemon_path ? optind : optind + 1]);
+    char *download_dir = daemon_path ? NULL : argv[optind + 2];
+
+    if (cache_dir) {
+        create_directory(cache_dir);
+    }
+    FILE *fp = NULL;
+    char *line = NULL;
+    size_t len = 0;
+    int stop_signals = -1;
+
+    if (daemon_path) {
+        // Taken by the listener thread, so blocked before any are spawned
+        stop_signals = block_stop_signals();
+        // Submitters may go away before their jobs finish
+        signal(SIGPIPE, SIG_IGN);
+        // Its log is read as it runs, not once it exits
+        setvbuf(stdout, NULL, _IOLBF, 0);
+    } else {
+        create_directory(download_dir);
+        fp = fopen(url_file, "r");
+        if (fp == NULL) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // spawn threads and create work queue(s)
+    Context *context = spawn_workers(num_workers, mode, num_engines);
+    context->assembly = assembly;
+    context->splice = splice;
+    context->get_probe = get_probe;
+    spawn_writer(context);
+    if (async_io) {
+        context->disk = async_writer_alloc(ASYNC_BUFFERS, ASYNC_BUFFER_SIZE);
+        if (!context->disk) {
+            fprintf(stderr, "io_uring is not available, writing chunks as "
+                            "they arrive\n");
+        }
+    }
+
+    Scheduler scheduler = { 0 };
+    scheduler.context = context;
+    scheduler.cache_dir = cache_dir;
+    scheduler.policy = policy;
+    scheduler.started = now_seconds();
+    scheduler.max_downloads = max_downloads;
+    scheduler.capacity = num_workers * 2;
+    scheduler.min_chunk = min_chunk;
+    scheduler.max_retries = max_retries;
+    scheduler.seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+
+    // Enough for every task handed out, plus a few pending at once
+    scheduler.tasks = buffer_pool_alloc(sizeof(Task),
+                                        scheduler.capacity + max_downloads);
+    if (get_probe) {
+        // At most one probe per active download
+        scheduler.probe_buffers = buffer_pool_alloc(min_chunk, max_downloads);
+    }
+
+    // One worker per thread, or per engine with its share of connections
+    int *slots = malloc(context->num_threads * sizeof(int));
+    for (int i = 0; i < context->num_threads; i++) {
+        slots[i] = context->num_engines == 0 ? 1 :
+                   num_workers / context->num_engines +
+                   (i < num_workers % context->num_engines);
+    }
+    scheduler.stats = stats_alloc(context->num_threads, slots);
+    free(slots);
+
+    double next_progress = now_seconds() + progress;
+
+    void **results = malloc(scheduler.capacity * sizeof(void *));
+    SeenUrl *seen[SEEN_BUCKETS] = { NULL };
+    int eof = 0;
+
+    // The daemon keeps its workers, connections and cache between jobs
+    Daemon *daemon = NULL;
+    if (daemon_path) {
+        daemon = start_daemon(daemon_path, stop_signals, context->done);
+        eof = 1;
+    }
+
+    // These policies admit urls in their order, so need to see them all
+    if (!daemon && (policy == POLICY_PRIORITY || policy == POLICY_DEADLINE)) {
+        Download *download;
+        while ((download = read_download(fp, &line, &len, seen,
+                                         download_dir))) {
+            add_backlog(&scheduler, download);
+        }
+        eof = 1;
+    }
+
+    while (daemon ? daemon_running(daemon, &scheduler) :
+           !eof || scheduler.backlog || scheduler.active > 0) {
+        if (daemon) {
+            take_jobs(daemon, &scheduler);
+        }
+
+        // Admit new urls while there is room in the pipeline.
+        while (scheduler.active < scheduler.max_downloads) {
+            Download *download = daemon ? next_job_download(&scheduler) :
+                                          pop_backlog(&scheduler);
+            if (!download && !eof) {
+                download = read_download(fp, &line, &len, seen, download_dir);
+                eof = !download;
+            }
+            if (!download) {
+                break;
+            }
+
+            if (cache_dir &&
+                cache_lookup(cache_dir, download->url,
+                             &download->cached_length,
+                             &download->cached_validator) == 0) {
+                download->cached = 1;
+            }
+            add_download(&scheduler, download);
+            task_list_push(&scheduler.pending,
+                           new_probe(&scheduler, download));
+        }
+
+        double next_retry = release_retries(&scheduler);
+        dispatch(&scheduler);
+        dispatch_merges(&scheduler);
+        steal_work(&scheduler);
+        report_progress(&scheduler, progress, &next_progress);
+
+        // Wake for the next retry or progress line, whichever comes first
+        double deadline = next_retry;
+        if (progress > 0 && (deadline == 0 || next_progress < deadline)) {
+            deadline = next_progress;
+        }
+
+        if (scheduler.outstanding == 0 && scheduler.merging == 0 && !daemon) {
+            // Nothing to wait for but the clock
+            sleep_until(deadline);
+            continue;
+        }
+
+        // Get back every result that is ready
+        int n = collect_results(&scheduler, results, deadline);
+
+        for (int i = 0; i < n; i++) {
+            Task *task = (Task *)results[i];
+            if (task == &wake_task) {
+                // A job came in, or the daemon is stopping
+                continue;
+            }
+            if (task->type == TASK_MERGE || task->type == TASK_HASH) {
+                --scheduler.merging;
+                complete_merge(&scheduler, task);
+                free_task(&scheduler, task);
+                continue;
+            }
+
+            --scheduler.outstanding;
+            record_task(&scheduler, task);
+            if (task->type == TASK_PROBE) {
+                complete_probe(&scheduler, task);
+            } else {
+                complete_chunk(&scheduler, task);
+            }
+
+            free_task(&scheduler, task);
+        }
+    }
+
+
+    //cleanup
+    if (daemon) {
+        stop_daemon(daemon);
+    } else {
+        fclose(fp);
+    }
+    free(line);
+    free(results);
+    free_seen(seen);
+
+    stats_report_failures(scheduler.stats, stderr);
+    if (summary) {
+        QueueStats todo, done;
+        queue_stats(context->todo, &todo);
+        queue_stats(context->done, &done);
+        stats_write_json(scheduler.stats, summary, &todo, &done);
+    }
+    stats_free(scheduler.stats);
 
     free_workers(context);
+    http_cleanup();
+
+    buffer_pool_free(scheduler.tasks);
+    if (scheduler.probe_buffers) {
+        buffer_pool_free(scheduler.probe_buffers);
+    }
 
     return 0;
 }
@@ -0,0 +1,1227 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#include "engine.h"
+#include "http_private.h"
+#include "buffer_pool.h"
+#include "tls.h"
+
+#define HOST_SIZE     1024
+#define REQUEST_SIZE  4096
+#define MAX_ADDRS     8
+#define MAX_EVENTS    64
+
+// Largest response header accepted
+#define HEADER_MAX_SIZE (16 * 1024)
+
+// Most bytes read at once while the header is incomplete when the body is
+// to be spliced, so little of the body is read into user space with it
+#define HEADER_READ_SIZE 4096
+
+// Buffer shared by all connections of an engine for reading bodies
+#define READ_BUF_SIZE (64 * 1024)
+
+// Most body bytes moved through a connection's pipe by one splice; the
+// default capacity of a pipe
+#define SPLICE_SIZE (64 * 1024)
+
+// How often a request waiting for one of its host's connection slots
+// tries again, in seconds; slots may be freed by other engines or threads
+#define SLOT_RETRY 0.005
+
+#define handle_error(msg) \
+        do { perror(msg); exit(EXIT_FAILURE); } while (0)
+
+
+typedef enum {
+    CONN_WAITING,    // waiting for a connection slot for the host
+    CONN_CONNECTING, // waiting for one of the connect attempts to complete
+    CONN_HANDSHAKE,  // carrying out the TLS handshake of an https request
+    CONN_SENDING,    // writing the request
+    CONN_HEADER,     // reading the response header
+    CONN_BODY        // reading the response body
+} ConnectionState;
+
+
+// The state of one request in flight on the engine
+typedef struct Connection {
+    EngineRequest *request;
+    ConnectionState state;
+
+    char host[HOST_SIZE];     // host, with the page split off after it
+    char *page;
+    int port;
+    int secure;               // https, over TLS
+    int sock;
+    Tls *tls;                 // the socket's TLS session, or NULL
+    uint32_t events;          // what the socket is watched for
+    int reused;               // the socket came from the keep-alive pool
+    int has_slot;             // holds one of the host's connection slots
+    double resume_at;         // while deferred, when to carry on
+
+    DnsAddress addrs[MAX_ADDRS];
+    int num_addrs;
+    int next_addr;            // next address to try connecting to
+    int attempts[MAX_ADDRS];  // sockets of the connects under way, raced
+    int num_attempts;
+    int timer;                // timerfd for the next attempt or the connect
+                              // timeout, or -1
+    double connect_deadline;  // when connecting gives up, 0 for never
+
+    char out[REQUEST_SIZE];   // the formatted request
+    size_t out_length;
+    size_t sent;
+
+    HttpParser parser;        // parses the header as it is read
+    size_t filled;            // header bytes read so far
+    ChunkDecoder decoder;
+    size_t remaining;         // body bytes left, when framed by length
+    int until_eof;            // body ends when the server closes
+    int pipe[2];              // pipe the body is spliced through, or -1
+
+    double connect_at;        // when connecting began, 0 until it has
+    double handshake_at;      // when the TLS handshake began
+    double sent_at;           // when the request was sent
+    double first_byte_at;     // when the response began, 0 until it has
+
+    struct Connection *next;  // link in the engine's inbox, or its deferred
+                              // list
+} Connection;
+
+
+/*
+ * Engine - an event-driven HTTP client.
+ * Submitted requests are placed in inbox and the loop thread is woken
+ * through wake, an eventfd registered with epoll alongside the sockets.
+ * slots counts how many more requests may be submitted before
+ * engine_submit blocks.
+ */
+typedef struct EngineStruct {
+    int epoll_fd;
+    int wake;                 // eventfd signalling new requests or stop
+    sem_t slots;              // requests that may still be submitted
+    pthread_mutex_t mutex;    // protects inbox and stopping
+    Connection *inbox;        // submitted requests not yet started
+    Connection *deferred;     // requests held back by the limiter, loop
+                              // thread only
+    int stopping;
+    pthread_t thread;
+    BufferPool *connections;  // one Connection for each request slot
+    char buf[READ_BUF_SIZE];  // shared body read buffer, loop thread only
+    struct epoll_event events[MAX_EVENTS];
+    int num_events;           // events of the batch being handled
+    int next_event;           // the next of them to handle
+} Engine;
+
+
+static void start_connect(Engine *engine, Connection *c);
+
+
+/**
+ * Close a connection's socket, and free its TLS session if it has one.
+ */
+static void close_socket(Connection *c) {
+    if (c->tls) {
+        tls_free(c->tls, 0);
+        c->tls = NULL;
+    }
+    close(c->sock);
+    c->sock = -1;
+}
+
+
+/**
+ * Finish a request: stop watching its socket, keep the socket for reuse if
+ * the response was fully read, and report the result to the submitter.
+ * @param engine - The engine
+ * @param c - The connection of the finished request
+ * @param status - HTTP status of the response, or -1 on failure
+ * @param reusable - Whether the socket can carry another request
+ */
+static void finish(Engine *engine, Connection *c, int status, int reusable) {
+    ConnectionPool *pool = http_connection_pool();
+
+    if (c->sock != -1) {
+        epoll_ctl(engine->epoll_fd, EPOLL_CTL_DEL, c->sock, NULL);
+
+        if (status >= 0 && reusable && pool) {
+            // Pooled sockets are shared with the blocking query path
+            int flags = fcntl(c->sock, F_GETFL);
+            fcntl(c->sock, F_SETFL, flags & ~O_NONBLOCK);
+            pool_checkin(pool, c->host, c->port, c->sock, c->tls);
+        } else {
+            close_socket(c);
+        }
+    }
+
+    if (c->pipe[0] != -1) {
+        close(c->pipe[0]);
+        close(c->pipe[1]);
+    }
+
+    if (c->has_slot) {
+        limiter_release(http_limiter(), c->host, c->port);
+    }
+
+    EngineRequest *request = c->request;
+    if (c->first_byte_at > 0) {
+        request->timing.first_byte = c->first_byte_at - c->sent_at;
+        request->timing.transfer = http_now() - c->first_byte_at;
+    }
+    buffer_pool_put(engine->connections, c);
+
+    request->done(request, status);
+    sem_post(&engine->slots);
+}
+
+
+/**
+ * Work out the events a connection's socket has to be watched for: those
+ * its state waits on, unless its TLS session has to write to go on.
+ */
+static uint32_t wanted_events(Connection *c) {
+    if (c->state == CONN_CONNECTING || c->state == CONN_SENDING ||
+        (c->tls && tls_wants_write(c->tls))) {
+        return EPOLLOUT;
+    }
+    return EPOLLIN;
+}
+
+
+/**
+ * Watch a connection's socket for the events its state waits on.
+ * @return 0 on success, -1 on failure
+ */
+static int watch(Engine *engine, Connection *c, int op) {
+    struct epoll_event event;
+    event.events = wanted_events(c);
+    event.data.ptr = c;
+
+    if (epoll_ctl(engine->epoll_fd, op, c->sock, &event) == -1) {
+        perror("epoll_ctl");
+        return -1;
+    }
+
+    c->events = event.events;
+    return 0;
+}
+
+
+/**
+ * Wait for a connection's socket once it would block, rewatching it if
+ * its TLS session now waits differently than before, e.g. to write in the
+ * middle of a read. The request fails if the socket can't be watched.
+ */
+static void wait_socket(Engine *engine, Connection *c) {
+    if (wanted_events(c) != c->events &&
+        watch(engine, c, EPOLL_CTL_MOD) == -1) {
+        finish(engine, c, -1, 0);
+    }
+}
+
+
+/**
+ * Read bytes of the response from a connection's socket, decrypting them
+ * for https.
+ * @return Number of bytes read, 0 at the end of the stream, or -1 with
+ *         errno set
+ */
+static ssize_t read_socket(Connection *c, void *data, size_t length) {
+    if (c->tls) {
+        return tls_read(c->tls, data, length);
+    }
+    return read(c->sock, data, length);
+}
+
+
+/**
+ * Resolve the host of a connection into its addresses, timing the lookup.
+ * @return Number of addresses, or -1 on failure
+ */
+static int resolve(Connection *c) {
+    double start = http_now();
+    c->num_addrs = http_resolve(c->host, c->port, c->addrs, MAX_ADDRS);
+    c->request->timing.dns += http_now() - start;
+    return c->num_addrs;
+}
+
+
+/**
+ * Count bytes of the response just read from the socket, noting when the
+ * first of them arrived. If they take a rate limit over, the connection is
+ * due a pause before reading more.
+ */
+static void clock_read(Connection *c, size_t length) {
+    double now = http_now();
+    if (c->first_byte_at == 0) {
+        c->first_byte_at = now;
+    }
+    c->request->timing.bytes += length;
+
+    Limiter *limiter = http_limiter();
+    if (limiter) {
+        double wait = limiter_consume(limiter, c->host, c->port, length);
+        if (wait > 0) {
+            c->resume_at = now + wait;
+        }
+    }
+}
+
+
+/**
+ * Hold a connection back until resume_at, keeping it out of epoll_wait.
+ */
+static void defer(Engine *engine, Connection *c) {
+    c->next = engine->deferred;
+    engine->deferred = c;
+}
+
+
+/**
+ * Stop reading a connection whose last read took a rate limit over, until
+ * the limiter allows it more.
+ * @return 1 if the connection was paused, 0 otherwise
+ */
+static int throttled(Engine *engine, Connection *c) {
+    if (c->resume_at == 0) {
+        return 0;
+    }
+
+    struct epoll_event event;
+    event.events = 0;
+    event.data.ptr = c;
+    if (epoll_ctl(engine->epoll_fd, EPOLL_CTL_MOD, c->sock, &event) == -1) {
+        perror("epoll_ctl");
+        c->resume_at = 0;
+        return 0;
+    }
+
+    defer(engine, c);
+    return 1;
+}
+
+
+/**
+ * Note that a connection's connect has completed. An https request goes on
+ * to its TLS handshake before sending.
+ */
+static void connected(Connection *c) {
+    double now = http_now();
+    c->request->timing.connect += now - c->connect_at;
+    c->handshake_at = now;
+    c->state = c->secure ? CONN_HANDSHAKE : CONN_SENDING;
+}
+
+
+/**
+ * Give up on a pooled socket that turned out to be closed by the server,
+ * and start again on a fresh connection.
+ */
+static void retry_fresh(Engine *engine, Connection *c) {
+    epoll_ctl(engine->epoll_fd, EPOLL_CTL_DEL, c->sock, NULL);
+    close_socket(c);
+    c->reused = 0;
+    c->sent = 0;
+    c->filled = 0;
+    c->first_byte_at = 0;
+    c->request->timing.reused = 0;
+    c->request->timing.bytes = 0;
+    http_parser_init(&c->parser);
+
+    if (resolve(c) == -1) {
+        finish(engine, c, -1, 0);
+        return;
+    }
+    c->next_addr = 0;
+    start_connect(engine, c);
+}
+
+
+/**
+ * Drop the events still to be handled in this batch for a connection, which
+ * may be for a socket or timer it has just closed. Its socket is watched
+ * level-triggered, so whatever it is ready for is reported again.
+ */
+static void forget_events(Engine *engine, Connection *c) {
+    for (int i = engine->next_event; i < engine->num_events; i++) {
+        if (engine->events[i].data.ptr == c) {
+            engine->events[i].events = 0;
+        }
+    }
+}
+
+
+/**
+ * Stop connecting: close the sockets of the connect attempts other than
+ * keep, and the timer.
+ */
+static void stop_attempts(Engine *engine, Connection *c, int keep) {
+    for (int i = 0; i < c->num_attempts; i++) {
+        if (c->attempts[i] != keep) {
+            epoll_ctl(engine->epoll_fd, EPOLL_CTL_DEL, c->attempts[i], NULL);
+            close(c->attempts[i]);
+        }
+    }
+    c->num_attempts = 0;
+
+    if (c->timer != -1) {
+        epoll_ctl(engine->epoll_fd, EPOLL_CTL_DEL, c->timer, NULL);
+        close(c->timer);
+        c->timer = -1;
+    }
+
+    forget_events(engine, c);
+}
+
+
+/**
+ * Give up connecting and fail the request.
+ */
+static void fail_connect(Engine *engine, Connection *c) {
+    stop_attempts(engine, c, -1);
+    http_invalidate(c->host, c->port);
+    finish(engine, c, -1, 0);
+}
+
+
+/**
+ * Keep the socket of the connect attempt that completed first, closing the
+ * others.
+ * @param watched - Non-zero if the socket is already watched, for the
+ *                  completion of its connect
+ * @return 0 on success, -1 if the request failed
+ */
+static int won(Engine *engine, Connection *c, int sock, int watched) {
+    stop_attempts(engine, c, sock);
+    c->sock = sock;
+    c->events = EPOLLOUT;
+    connected(c);
+
+    if (!watched && watch(engine, c, EPOLL_CTL_ADD) == -1) {
+        finish(engine, c, -1, 0);
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Set a connection's timer to go off at a time, creating it if need be.
+ * @param at - http_now time to go off at, or 0 to disarm it
+ * @return 0 on success, -1 on failure
+ */
+static int arm_timer(Engine *engine, Connection *c, double at) {
+    if (c->timer == -1) {
+        c->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (c->timer == -1) {
+            perror("timerfd_create");
+            return -1;
+        }
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = c;
+        if (epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, c->timer,
+                      &event) == -1) {
+            perror("epoll_ctl");
+            return -1;
+        }
+    }
+
+    // http_now reads the same clock
+    struct itimerspec when = { { 0, 0 }, { 0, 0 } };
+    when.it_value.tv_sec = (time_t)at;
+    when.it_value.tv_nsec = (long)((at - (time_t)at) * 1e9);
+    if (timerfd_settime(c->timer, TFD_TIMER_ABSTIME, &when, NULL) == -1) {
+        perror("timerfd_settime");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Start a non-blocking connect to the next untried address of the host,
+ * alongside the attempts already under way, and set the timer for when
+ * the one after it is due. Addresses that refuse immediately are skipped;
+ * once no attempts are left the request fails.
+ */
+static void next_attempt(Engine *engine, Connection *c) {
+    while (c->next_addr < c->num_addrs) {
+        int done;
+        int sock = http_open_socket(&c->addrs[c->next_addr++], &done);
+        if (sock == -1) {
+            continue;
+        }
+        if (done) {
+            won(engine, c, sock, 0);
+            return;
+        }
+
+        struct epoll_event event;
+        event.events = EPOLLOUT;
+        event.data.ptr = c;
+        if (epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, sock, &event) == -1) {
+            perror("epoll_ctl");
+            close(sock);
+            continue;
+        }
+        c->attempts[c->num_attempts++] = sock;
+        break;
+    }
+
+    if (c->num_attempts == 0) {
+        fail_connect(engine, c);
+        return;
+    }
+
+    double at = c->connect_deadline;
+    if (c->next_addr < c->num_addrs) {
+        double due = http_now() + HTTP_ATTEMPT_DELAY;
+        if (at == 0 || due < at) {
+            at = due;
+        }
+    }
+    if (arm_timer(engine, c, at) == -1) {
+        fail_connect(engine, c);
+    }
+}
+
+
+/**
+ * Connect to the host, racing its addresses as in happy eyeballs: each
+ * attempt is given HTTP_ATTEMPT_DELAY before the next starts alongside
+ * it, or none once it fails, and the first to connect is kept.
+ */
+static void start_connect(Engine *engine, Connection *c) {
+    double now = http_now();
+    double timeout = http_connect_timeout();
+
+    if (c->connect_at == 0) {
+        c->connect_at = now;
+    }
+    c->connect_deadline = timeout > 0 ? now + timeout : 0;
+    c->state = CONN_CONNECTING;
+
+    next_attempt(engine, c);
+}
+
+
+/**
+ * See how the connect attempts are going, after one of their sockets or
+ * the timer woke the loop. The first attempt to connect wins; a failed one
+ * or the timer going off starts the next, until the connect timeout.
+ * @return 1 once connected, 0 while still connecting or if the request
+ *         failed
+ */
+static int check_attempts(Engine *engine, Connection *c) {
+    struct pollfd ready[MAX_ADDRS];
+    int n = c->num_attempts;
+    int failed = 0;
+
+    for (int i = 0; i < n; i++) {
+        ready[i].fd = c->attempts[i];
+        ready[i].events = POLLOUT;
+        ready[i].revents = 0;
+    }
+    poll(ready, n, 0);
+
+    for (int i = 0; i < n; i++) {
+        if (ready[i].revents == 0) {
+            continue;
+        }
+
+        int error = 0;
+        socklen_t error_length = sizeof(error);
+        getsockopt(ready[i].fd, SOL_SOCKET, SO_ERROR, &error, &error_length);
+        if (error == 0) {
+            return won(engine, c, ready[i].fd, 1) == 0;
+        }
+
+        errno = error;
+        perror("connect");
+        epoll_ctl(engine->epoll_fd, EPOLL_CTL_DEL, ready[i].fd, NULL);
+        close(ready[i].fd);
+        for (int j = 0; j < c->num_attempts; j++) {
+            if (c->attempts[j] == ready[i].fd) {
+                c->attempts[j] = c->attempts[--c->num_attempts];
+                break;
+            }
+        }
+        failed = 1;
+    }
+
+    uint64_t expirations;
+    int expired = read(c->timer, &expirations, sizeof(expirations)) > 0;
+
+    if (c->connect_deadline > 0 && http_now() >= c->connect_deadline) {
+        fprintf(stderr, "connect %s:%d: timed out\n", c->host, c->port);
+        fail_connect(engine, c);
+    } else if (failed || expired) {
+        next_attempt(engine, c);
+    }
+
+    return 0;
+}
+
+
+/**
+ * Take one of the host's connection slots for a request and open its
+ * connection: use an idle keep-alive socket for the host if there is one,
+ * otherwise resolve the host and connect. Without a free slot the request
+ * is deferred, to try again shortly.
+ */
+static void admit(Engine *engine, Connection *c) {
+    Limiter *limiter = http_limiter();
+    if (limiter) {
+        if (limiter_try_acquire(limiter, c->host, c->port) != 0) {
+            c->state = CONN_WAITING;
+            c->resume_at = http_now() + SLOT_RETRY;
+            defer(engine, c);
+            return;
+        }
+        c->has_slot = 1;
+    }
+
+    ConnectionPool *pool = http_connection_pool();
+    if (pool) {
+        c->sock = pool_checkout(pool, c->host, c->port,
+                                c->secure ? &c->tls : NULL);
+        if (c->sock != -1) {
+            c->reused = 1;
+            c->request->timing.reused = 1;
+            fcntl(c->sock, F_SETFL, fcntl(c->sock, F_GETFL) | O_NONBLOCK);
+            c->state = CONN_SENDING;
+            if (watch(engine, c, EPOLL_CTL_ADD) == -1) {
+                finish(engine, c, -1, 0);
+            }
+            return;
+        }
+    }
+
+    if (resolve(c) == -1) {
+        finish(engine, c, -1, 0);
+        return;
+    }
+    start_connect(engine, c);
+}
+
+
+/**
+ * Begin a submitted request: format it, and open a connection for it once
+ * the host has a slot free.
+ */
+static void start_request(Engine *engine, Connection *c) {
+    EngineRequest *request = c->request;
+
+    c->sock = -1;
+    http_parser_init(&c->parser);
+    c->page = split_url(request->url, c->host, HOST_SIZE, &c->port,
+                        &c->secure);
+    if (!c->page) {
+        finish(engine, c, -1, 0);
+        return;
+    }
+
+    int length = format_http_request(c->out, REQUEST_SIZE, request->method,
+                                     c->host, c->page, request->range,
+                                     request->if_range, request->cached);
+    if (length == -1) {
+        finish(engine, c, -1, 0);
+        return;
+    }
+    c->out_length = length;
+
+    admit(engine, c);
+}
+
+
+/**
+ * Pass body bytes to the request's sink according to the response framing,
+ * and finish the request once the end of the body has been reached.
+ * @return 1 if the request finished, 0 if more body is expected
+ */
+static int feed_body(Engine *engine, Connection *c, const char *data,
+                     size_t length) {
+    EngineRequest *request = c->request;
+
+    if (c->parser.head.chunked) {
+        ssize_t consumed = chunk_decode(&c->decoder, data, length,
+                                        request->sink, request->arg);
+        if (consumed == -1) {
+            finish(engine, c, -1, 0);
+            return 1;
+        }
+        if (c->decoder.state == CHUNK_DONE) {
+            finish(engine, c, c->parser.head.status,
+                   c->parser.head.keep_alive && (size_t)consumed == length);
+            return 1;
+        }
+        return 0;
+    }
+
+    size_t take = length < c->remaining ? length : c->remaining;
+    if (take > 0 && request->sink(request->arg, data, take) != 0) {
+        finish(engine, c, -1, 0);
+        return 1;
+    }
+    c->remaining -= take;
+
+    if (!c->until_eof && c->remaining == 0) {
+        finish(engine, c, c->parser.head.status,
+               c->parser.head.keep_alive && take == length);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Act on a parsed response header: set up framing of the body, and feed
+ * any body bytes that arrived with the header.
+ * @param body - Body bytes read along with the header
+ * @param leftover - Number of bytes in body
+ * @return 1 if the request finished, 0 if more body is expected
+ */
+static int header_complete(Engine *engine, Connection *c, char *body,
+                           size_t leftover) {
+    EngineRequest *request = c->request;
+
+    request->content_length = c->parser.head.content_length;
+    if (request->resource) {
+        http_get_resource(&c->parser.head, request->resource);
+    }
+
+    int status = c->parser.head.status;
+    if (strcmp(request->method, "HEAD") == 0 || status / 100 == 1 ||
+        status == 204 || status == 304) {
+        finish(engine, c, status, c->parser.head.keep_alive && leftover == 0);
+        return 1;
+    }
+
+    // A range is answered in full once the resource has changed since
+    // If-Range, or by a server that ignores ranges; if the sink only
+    // expects the range, drop the connection rather than read the body.
+    // The same goes for an error page.
+    int ranged = request->range && request->range[0];
+    if (request->range_only &&
+        (status / 100 != 2 || (ranged && status == 200))) {
+        finish(engine, c, status, 0);
+        return 1;
+    }
+
+    if (ranged && status == 206 &&
+        !http_range_matches(&c->parser.head, request->range)) {
+        fprintf(stderr, "Content-Range does not match requested range %s\n",
+                request->range);
+        finish(engine, c, -1, 0);
+        return 1;
+    }
+
+    chunk_decoder_init(&c->decoder);
+    ResponseHead *head = &c->parser.head;
+    c->until_eof = !head->chunked && head->content_length < 0;
+    c->remaining = c->until_eof ? (size_t)-1 : (size_t)head->content_length;
+    c->state = CONN_BODY;
+
+    // Splice the rest of the body if the request asks for it; without a
+    // pipe it is read through the shared buffer instead, as it has to be
+    // when it is decrypted
+    if (request->splice_sink && !c->parser.head.chunked && !c->tls &&
+        pipe2(c->pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+        c->pipe[0] = c->pipe[1] = -1;
+    }
+
+    if (leftover > 0) {
+        return feed_body(engine, c, body, leftover);
+    }
+    if (!c->until_eof && !c->parser.head.chunked && c->remaining == 0) {
+        finish(engine, c, status, c->parser.head.keep_alive);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Advance a connection whose socket is ready, as far as it can go without
+ * blocking.
+ */
+static void handle_event(Engine *engine, Connection *c, uint32_t events) {
+    if (c->state == CONN_CONNECTING && !check_attempts(engine, c)) {
+        return;
+    }
+
+    if (c->state == CONN_HANDSHAKE) {
+        if (!c->tls) {
+            c->tls = tls_open(c->sock, c->host, c->port);
+            if (!c->tls) {
+                finish(engine, c, -1, 0);
+                return;
+            }
+        }
+
+        int rc = tls_handshake(c->tls);
+        if (rc == TLS_WANT_READ || rc == TLS_WANT_WRITE) {
+            wait_socket(engine, c);
+            return;
+        }
+        c->request->timing.tls += http_now() - c->handshake_at;
+        if (rc != 0) {
+            finish(engine, c, -1, 0);
+            return;
+        }
+        c->request->timing.resumed = tls_resumed(c->tls);
+        c->state = CONN_SENDING;
+    }
+
+    if (c->state == CONN_SENDING) {
+        while (c->sent < c->out_length) {
+            ssize_t n;
+            if (c->tls) {
+                n = tls_write(c->tls, &c->out[c->sent],
+                              c->out_length - c->sent);
+            } else {
+                n = send(c->sock, &c->out[c->sent], c->out_length - c->sent,
+                         MSG_NOSIGNAL);
+            }
+            if (n == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    wait_socket(engine, c);
+                    return;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (c->reused) {
+                    retry_fresh(engine, c);
+                } else {
+                    perror("send");
+                    finish(engine, c, -1, 0);
+                }
+                return;
+            }
+            c->sent += n;
+        }
+
+        c->sent_at = http_now();
+        c->state = CONN_HEADER;
+        if (watch(engine, c, EPOLL_CTL_MOD) == -1) {
+            finish(engine, c, -1, 0);
+        }
+        return;
+    }
+
+    if (c->state == CONN_HEADER) {
+        size_t want = c->request->splice_sink ? HEADER_READ_SIZE
+                                              : READ_BUF_SIZE;
+        for (;;) {
+            if (c->filled >= HEADER_MAX_SIZE) {
+                fprintf(stderr, "response header too large\n");
+                finish(engine, c, -1, 0);
+                return;
+            }
+
+            ssize_t n = read_socket(c, engine->buf, want);
+            if (n == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    wait_socket(engine, c);
+                    return;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (c->filled == 0 && c->reused) {
+                    retry_fresh(engine, c);
+                    return;
+                }
+                perror("read");
+                finish(engine, c, -1, 0);
+                return;
+            }
+            if (n == 0) {
+                if (c->filled == 0 && c->reused) {
+                    retry_fresh(engine, c);
+                    return;
+                }
+                fprintf(stderr, "connection closed before end of header\n");
+                finish(engine, c, -1, 0);
+                return;
+            }
+            clock_read(c, n);
+
+            // Only the newly read bytes are parsed, and none past the header
+            ssize_t consumed = http_parser_feed(&c->parser, engine->buf, n);
+            if (consumed == -1) {
+                fprintf(stderr, "malformed response header\n");
+                finish(engine, c, -1, 0);
+                return;
+            }
+            c->filled += consumed;
+
+            if (c->parser.state == PARSE_DONE) {
+                if (header_complete(engine, c, engine->buf + consumed,
+                                    n - consumed)) {
+                    return;
+                }
+                break;
+            }
+            if (throttled(engine, c)) {
+                return;
+            }
+        }
+    }
+
+    if (throttled(engine, c)) {
+        return;
+    }
+
+    // CONN_BODY: drain what the socket has, through the pipe if there is one
+    while (c->pipe[0] != -1) {
+        size_t want = c->remaining < SPLICE_SIZE ? c->remaining : SPLICE_SIZE;
+
+        ssize_t n = splice(c->sock, NULL, c->pipe[1], NULL, want,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("splice");
+            finish(engine, c, -1, 0);
+            return;
+        }
+        if (n == 0) {
+            if (c->until_eof) {
+                finish(engine, c, c->parser.head.status, 0);
+            } else {
+                fprintf(stderr, "connection closed before end of body\n");
+                finish(engine, c, -1, 0);
+            }
+            return;
+        }
+
+        clock_read(c, n);
+        if (c->request->splice_sink(c->request->arg, c->pipe[0], n) != 0) {
+            finish(engine, c, -1, 0);
+            return;
+        }
+        c->remaining -= n;
+
+        if (!c->until_eof && c->remaining == 0) {
+            finish(engine, c, c->parser.head.status, c->parser.head.keep_alive);
+            return;
+        }
+        if (throttled(engine, c)) {
+            return;
+        }
+    }
+
+    for (;;) {
+        size_t want = c->remaining < READ_BUF_SIZE ? c->remaining
+                                                   : READ_BUF_SIZE;
+        if (c->parser.head.chunked) {
+            want = READ_BUF_SIZE;
+        }
+
+        ssize_t n = read_socket(c, engine->buf, want);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                wait_socket(engine, c);
+                return;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            finish(engine, c, -1, 0);
+            return;
+        }
+        if (n == 0) {
+            if (c->until_eof) {
+                finish(engine, c, c->parser.head.status, 0);
+            } else {
+                fprintf(stderr, "connection closed before end of body\n");
+                finish(engine, c, -1, 0);
+            }
+            return;
+        }
+
+        clock_read(c, n);
+        if (feed_body(engine, c, engine->buf, n) || throttled(engine, c)) {
+            return;
+        }
+    }
+}
+
+
+/**
+ * Take every request waiting in the inbox and start it.
+ * @return 1 if the engine has been asked to stop, 0 otherwise
+ */
+static int drain_inbox(Engine *engine) {
+    uint64_t count;
+    if (read(engine->wake, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("read eventfd");
+    }
+
+    pthread_mutex_lock(&engine->mutex);
+    Connection *inbox = engine->inbox;
+    engine->inbox = NULL;
+    int stopping = engine->stopping;
+    pthread_mutex_unlock(&engine->mutex);
+
+    // The inbox is newest first; start requests in submission order
+    Connection *ordered = NULL;
+    while (inbox) {
+        Connection *next = inbox->next;
+        inbox->next = ordered;
+        ordered = inbox;
+        inbox = next;
+    }
+
+    while (ordered) {
+        Connection *next = ordered->next;
+        start_request(engine, ordered);
+        ordered = next;
+    }
+
+    return stopping;
+}
+
+
+/**
+ * Carry on with the deferred requests that are due: try again for a
+ * connection slot, or start reading again after a pause.
+ * @return Milliseconds until the next deferred request is due, or -1 if
+ *         none are left
+ */
+static int resume_deferred(Engine *engine) {
+    double now = http_now();
+    Connection *due = NULL;
+    Connection **link = &engine->deferred;
+
+    while (*link) {
+        Connection *c = *link;
+        if (c->resume_at <= now) {
+            *link = c->next;
+            c->next = due;
+            due = c;
+        } else {
+            link = &c->next;
+        }
+    }
+
+    while (due) {
+        Connection *c = due;
+        due = c->next;
+        c->resume_at = 0;
+
+        if (c->state == CONN_WAITING) {
+            admit(engine, c);
+        } else if (watch(engine, c, EPOLL_CTL_MOD) == -1) {
+            finish(engine, c, -1, 0);
+        } else if (c->tls && tls_pending(c->tls)) {
+            // What the session already holds won't wake epoll_wait
+            handle_event(engine, c, EPOLLIN);
+        }
+    }
+
+    // Those that are still waiting, or were just deferred again
+    double next = 0;
+    for (Connection *c = engine->deferred; c; c = c->next) {
+        if (next == 0 || c->resume_at < next) {
+            next = c->resume_at;
+        }
+    }
+    if (next == 0) {
+        return -1;
+    }
+
+    double wait = next - http_now();
+    return wait > 0 ? (int)(wait * 1000) + 1 : 0;
+}
+
+
+static void *event_loop(void *arg) {
+    Engine *engine = (Engine *)arg;
+
+    for (;;) {
+        int timeout = resume_deferred(engine);
+        int n = epoll_wait(engine->epoll_fd, engine->events, MAX_EVENTS,
+                           timeout);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            handle_error("epoll_wait");
+        }
+
+        engine->num_events = n;
+        for (engine->next_event = 0; engine->next_event < n; ) {
+            struct epoll_event *event = &engine->events[engine->next_event++];
+            if (event->events == 0) {
+                // Forgotten by forget_events
+            } else if (event->data.ptr == NULL) {
+                if (drain_inbox(engine)) {
+                    return NULL;
+                }
+            } else {
+                handle_event(engine, (Connection *)event->data.ptr,
+                             event->events);
+            }
+        }
+        engine->num_events = 0;
+    }
+}
+
+
+/**
+ * Allocate an engine and start its event loop thread
+ * @param max_connections - The most requests the engine runs at once
+ * @return engine - Pointer to the allocated engine
+ */
+Engine *engine_alloc(int max_connections) {
+    Engine *engine = malloc(sizeof(Engine));
+    if (!engine) {
+        handle_error("malloc");
+    }
+
+    engine->inbox = NULL;
+    engine->deferred = NULL;
+    engine->stopping = 0;
+    engine->num_events = 0;
+    engine->next_event = 0;
+    engine->connections = buffer_pool_alloc(sizeof(Connection),
+                                            max_connections);
+
+    engine->epoll_fd = epoll_create1(0);
+    if (engine->epoll_fd == -1) {
+        handle_error("epoll_create1");
+    }
+
+    engine->wake = eventfd(0, EFD_NONBLOCK);
+    if (engine->wake == -1) {
+        handle_error("eventfd");
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, engine->wake,
+                  &event) == -1) {
+        handle_error("epoll_ctl");
+    }
+
+    if (sem_init(&engine->slots, 0, max_connections) != 0) {
+        handle_error("sem_init slots");
+    }
+
+    if (pthread_mutex_init(&engine->mutex, NULL) != 0) {
+        handle_error("pthread_mutex_init");
+    }
+
+    if (pthread_create(&engine->thread, NULL, event_loop, engine) != 0) {
+        handle_error("pthread_create");
+    }
+
+    return engine;
+}
+
+
+/**
+ * Wake the event loop thread to look at the inbox.
+ */
+static void wake_engine(Engine *engine) {
+    uint64_t one = 1;
+    if (write(engine->wake, &one, sizeof(one)) == -1) {
+        perror("write eventfd");
+    }
+}
+
+
+/**
+ * Stop an engine's event loop thread and free it
+ *
+ * Don't call this function while requests are still in flight.
+ *
+ * @param engine - Pointer to the engine to free
+ */
+void engine_free(Engine *engine) {
+    pthread_mutex_lock(&engine->mutex);
+    engine->stopping = 1;
+    pthread_mutex_unlock(&engine->mutex);
+    wake_engine(engine);
+
+    if (pthread_join(engine->thread, NULL) != 0) {
+        handle_error("pthread_join");
+    }
+
+    close(engine->wake);
+    close(engine->epoll_fd);
+    sem_destroy(&engine->slots);
+    pthread_mutex_destroy(&engine->mutex);
+    buffer_pool_free(engine->connections);
+    free(engine);
+}
+
+
+/**
+ * Hand a request to the engine. If the engine is already running
+ * max_connections requests, blocks until one of them finishes.
+ *
+ * @param engine - Pointer to the engine
+ * @param request - The request to run
+ */
+void engine_submit(Engine *engine, EngineRequest *request) {
+    while (sem_wait(&engine->slots) == -1 && errno == EINTR) {
+    }
+
+    // Each slot has a Connection in the pool, recycled from a finished
+    // request; the rest of it is set as it is used
+    Connection *c = buffer_pool_get(engine->connections);
+    c->request = request;
+    c->tls = NULL;
+    c->reused = 0;
+    c->has_slot = 0;
+    c->resume_at = 0;
+    c->next_addr = 0;
+    c->num_attempts = 0;
+    c->timer = -1;
+    c->sent = 0;
+    c->filled = 0;
+    c->pipe[0] = c->pipe[1] = -1;
+    c->connect_at = 0;
+    c->first_byte_at = 0;
+    request->content_length = -1;
+    memset(&request->timing, 0, sizeof(request->timing));
+    if (request->resource) {
+        request->resource->status = -1;
+        request->resource->length = -1;
+    }
+
+    pthread_mutex_lock(&engine->mutex);
+    c->next = engine->inbox;
+    engine->inbox = c;
+    pthread_mutex_unlock(&engine->mutex);
+
+    wake_engine(engine);
+}
@@ -0,0 +1,78 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "http.h"
+
+
+/*
+ * Engine - an event-driven HTTP client. One thread drives many non-blocking
+ * sockets through epoll, so the number of concurrent connections is not
+ * tied to the number of threads. Requests are submitted from any thread
+ * and completed by a callback on the engine's thread.
+ * The implementation is hidden from the outside.
+ */
+typedef struct EngineStruct Engine;
+
+
+/*
+ * A request to run on an engine. Filled in by the caller, who must keep it
+ * alive until done has been called for it.
+ */
+typedef struct EngineRequest {
+    const char *url;       // e.g. i.imgur.com/xlLjV00.jpg
+    const char *method;    // "GET" or "HEAD"
+    const char *range;     // byte range e.g. 0-500, or NULL for none;
+                           // a 206 must answer with a Content-Range
+                           // within it, from its start
+    const char *if_range;  // validator to send as If-Range, or NULL
+    const HttpValidator *cached; // validators of a cached copy, sent as
+                           // If-None-Match and If-Modified-Since, or NULL
+    int range_only;        // sink only expects the range: a 200 carrying
+                           // the whole resource, or a response outside
+                           // 2xx, finishes without its body
+    HttpResource *resource; // if not NULL, filled in from the response
+    BodySink sink;         // receives body data, on the engine's thread
+    SpliceSink splice_sink; // if not NULL, receives unchunked body data
+                           // through a pipe instead of sink, except bytes
+                           // read along with the header
+    void *arg;             // passed through to the sinks
+
+    // Called on the engine's thread once the request has finished, with
+    // the HTTP status code of the response or -1 on failure
+    void (*done)(struct EngineRequest *request, int status);
+
+    off_t content_length;  // set before done: Content-Length of the
+                           // response, or -1 if it had none
+    HttpTiming timing;     // set before done: where the request's time went
+} EngineRequest;
+
+
+/**
+ * Allocate an engine and start its event loop thread
+ * @param max_connections - The most requests the engine runs at once
+ * @return engine - Pointer to the allocated engine
+ */
+Engine *engine_alloc(int max_connections);
+
+
+/**
+ * Stop an engine's event loop thread and free it
+ *
+ * Don't call this function while requests are still in flight.
+ *
+ * @param engine - Pointer to the engine to free
+ */
+void engine_free(Engine *engine);
+
+
+/**
+ * Hand a request to the engine. If the engine is already running
+ * max_connections requests, blocks until one of them finishes.
+ *
+ * @param engine - Pointer to the engine
+ * @param request - The request to run
+ */
+void engine_submit(Engine *engine, EngineRequest *request);
+
+
+#endif
@@ -1,146 +1,1219 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <netdb.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <time.h>
+
+#include "http.h"
+#include "http_private.h"
+#include "tls.h"
+
+#define BUF_SIZE  1024
+#define HTTP_PORT 80
+#define HTTPS_PORT 443
+
+// Size of the fixed buffer used by streaming queries. The response header
+// must fit in this buffer.
+#define STREAM_BUF_SIZE (64 * 1024)
+
+// Most bytes read at once while the header is incomplete when the body is
+// to be spliced, so little of the body is read into user space with it
+#define HEADER_READ_SIZE 4096
+
+// Most body bytes moved through the pipe by one splice; the default
+// capacity of a pipe
+#define SPLICE_SIZE (64 * 1024)
+
+// Limits of the keep-alive connection pool used with HTTP_1_1
+#define POOL_MAX_IDLE     32
+#define POOL_IDLE_TIMEOUT 30
+
+// Seconds resolved host addresses are cached for, and the most addresses
+// of one host that connect_to_server will try
+#define DNS_TTL       60
+#define DNS_MAX_ADDRS 8
+
+// Seconds a new connection may take, unless set with
+// http_set_socket_options
+#define DEFAULT_CONNECT_TIMEOUT 10
+
+// Returned by receive_message when the connection was closed before any of
+// the response arrived, which on a reused socket means it went stale
+#define HTTP_STALE -2
+
+
+static HttpVersion http_version = HTTP_1_0;
+static ConnectionPool *connection_pool = NULL;
+static Limiter *limiter = NULL;
+static int socket_receive_buffer = 0;
+static double socket_connect_timeout = DEFAULT_CONNECT_TIMEOUT;
+
+static DnsCache *dns_cache = NULL;
+static pthread_once_t dns_once = PTHREAD_ONCE_INIT;
+
+
+// Timings of the query in progress, or last made, on each thread, and the
+// times its steps started at, to work them out from
+typedef struct {
+    HttpTiming timing;
+    double sent_at;       // when the request was sent
+    double first_byte_at; // when the first byte of the response arrived,
+                          // or 0 until it has
+} QueryClock;
+
+static __thread QueryClock query_clock;
+
+// Host and port of the query in progress on each thread, that reads are
+// charged to by the limiter
+static __thread const char *query_host;
+static __thread int query_port;
+
+
+// A connection to a server: its socket, and for https the TLS session over
+// it that requests and responses pass through
+typedef struct {
+    int sock;
+    Tls *tls;    // or NULL for plain HTTP
+} Transport;
+
+
+/*
+ * Callback receiving the header of a response: the raw bytes from the
+ * status line up to and including the blank line, and the parsed fields.
+ * Return 0 to continue, non-zero to abort.
+ */
+typedef int (*HeaderSink)(void *arg, const char *header, size_t length,
+                          const ResponseHead *head);
+
+
+/**
+ * Select the HTTP version used by all following queries.
+ * With HTTP_1_1, connections are kept alive after each response and
+ * returned to a pool shared by all threads, to be reused by the next query
+ * to the same host. Call this before any queries are started.
+ * @param version - HTTP_1_0 (default) or HTTP_1_1
+ */
+void http_set_version(HttpVersion version) {
+    http_version = version;
+
+    if (version == HTTP_1_1 && !connection_pool) {
+        connection_pool = pool_alloc(POOL_MAX_IDLE, POOL_IDLE_TIMEOUT);
+    }
+}
+
+
+/**
+ * Limit how hard all following queries push the servers, whether made
+ * here or on an engine. Reads pause while a rate is exceeded, and a query
+ * waits for a free slot when its host already has host_connections queries
+ * in flight. Call this before any queries are started.
+ * @param rate - Most bytes per second read over all hosts, 0 for no limit
+ * @param host_rate - Most bytes per second read from each host, 0 for no
+ *                    limit
+ * @param host_connections - Most queries to each host in flight at once,
+ *                           0 for no limit
+ */
+void http_set_limits(double rate, double host_rate, int host_connections) {
+    if (limiter) {
+        limiter_free(limiter);
+        limiter = NULL;
+    }
+
+    if (rate > 0 || host_rate > 0 || host_connections > 0) {
+        limiter = limiter_alloc(rate, host_rate, host_connections);
+    }
+}
+
+
+/**
+ * Tune the sockets of all following connections, whether made here or on
+ * an engine. Call this before any queries are started.
+ * @param receive_buffer - Bytes of each socket's kernel receive buffer,
+ *                         or 0 to leave its size to the kernel
+ * @param connect_timeout - Most seconds spent connecting to a server, 0
+ *                          for no limit
+ */
+void http_set_socket_options(int receive_buffer, double connect_timeout) {
+    socket_receive_buffer = receive_buffer;
+    socket_connect_timeout = connect_timeout;
+}
+
+
+/**
+ * Select the certificate authorities that the certificates of https
+ * servers are checked against, instead of the system's. Call this before
+ * any queries are started.
+ * @param ca_file - PEM file of trusted certificates, or NULL for the
+ *                  system's own
+ * @return 0 on success, -1 if the file could not be loaded
+ */
+int http_set_ca_file(const char *ca_file) {
+    return tls_set_ca_file(ca_file);
+}
+
+
+/**
+ * Close any pooled keep-alive connections. Call this once all queries have
+ * finished.
+ */
+void http_cleanup(void) {
+    if (connection_pool) {
+        pool_free(connection_pool);
+        connection_pool = NULL;
+    }
+    tls_cleanup();
+
+    if (limiter) {
+        limiter_free(limiter);
+        limiter = NULL;
+    }
+
+    if (dns_cache) {
+        dns_free(dns_cache);
+        dns_cache = NULL;
+    }
+}
+
+
+static void dns_init(void) {
+    dns_cache = dns_alloc(DNS_TTL, AF_UNSPEC);
+}
+
+
+/**
+ * Resolve a host through the DNS cache shared by all queries.
+ * @return Number of addresses copied into addrs, or -1 on failure
+ */
+int http_resolve(const char *host, int port, DnsAddress *addrs, int max_addrs) {
+    pthread_once(&dns_once, dns_init);
+
+    return dns_resolve(dns_cache, host, port, addrs, max_addrs);
+}
+
+
+/**
+ * Drop the shared DNS cache's addresses of a host after none of them could
+ * be connected to.
+ */
+void http_invalidate(const char *host, int port) {
+    pthread_once(&dns_once, dns_init);
+
+    dns_invalidate(dns_cache, host, port);
+}
+
+
+/**
+ * Create a non-blocking stream socket for an address, tuned as selected
+ * with http_set_socket_options, and start connecting it.
+ * @param addr - The address to connect to
+ * @param done - Set to 1 if the connect completed at once, 0 if it is
+ *               still in progress
+ * @return The socket, or -1 on failure
+ */
+int http_open_socket(const DnsAddress *addr, int *done) {
+    int sock = socket(addr->family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sock == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    // A request is written whole, so there is nothing for Nagle's
+    // algorithm to coalesce; it would only hold back a keep-alive
+    // connection's next request until the last was acknowledged
+    int on = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    // Set before connecting, as the window scale is agreed on then
+    if (socket_receive_buffer > 0 &&
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &socket_receive_buffer,
+                   sizeof(socket_receive_buffer)) == -1) {
+        perror("setsockopt SO_RCVBUF");
+    }
+
+    int rc = connect(sock, (struct sockaddr *)&addr->addr, addr->length);
+    if (rc == -1 && errno != EINPROGRESS) {
+        perror("connect");
+        close(sock);
+        return -1;
+    }
+
+    *done = rc == 0;
+    return sock;
+}
+
+
+/**
+ * Get the most seconds spent connecting to a server.
+ * @return The timeout, or 0 for no limit
+ */
+double http_connect_timeout(void) {
+    return socket_connect_timeout;
+}
+
+
+/**
+ * Get the keep-alive pool shared by all queries.
+ * @return The pool, or NULL unless HTTP_1_1 has been selected
+ */
+ConnectionPool *http_connection_pool(void) {
+    return connection_pool;
+}
+
+
+/**
+ * Get the limiter shared by all queries.
+ * @return The limiter, or NULL unless limits have been set with
+ *         http_set_limits
+ */
+Limiter *http_limiter(void) {
+    return limiter;
+}
+
+
+/**
+ * Get the time from a monotonic clock, for timing queries.
+ * @return The time in seconds
+ */
+double http_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+/**
+ * Count bytes of the response just read from the socket, noting when the
+ * first of them arrived. If they take a rate limit over, the thread holds
+ * off reading more until the limiter allows it.
+ */
+static void clock_read(size_t length) {
+    if (query_clock.first_byte_at == 0) {
+        query_clock.first_byte_at = http_now();
+    }
+    query_clock.timing.bytes += length;
+
+    if (limiter) {
+        double wait = limiter_consume(limiter, query_host, query_port, length);
+        if (wait > 0) {
+            struct timespec pause;
+            pause.tv_sec = (time_t)wait;
+            pause.tv_nsec = (long)((wait - pause.tv_sec) * 1e9);
+            while (nanosleep(&pause, &pause) == -1 && errno == EINTR) {
+            }
+        }
+    }
+}
+
+
+/**
+ * Work out the times of the response once it has been received, or has
+ * failed.
+ */
+static void clock_response(void) {
+    if (query_clock.first_byte_at > 0) {
+        query_clock.timing.first_byte = query_clock.first_byte_at -
+                                        query_clock.sent_at;
+        query_clock.timing.transfer = http_now() - query_clock.first_byte_at;
+    }
+}
+
+
+/**
+ * Get the timings of the last query made by the calling thread, with any
+ * of the functions above. Each thread keeps its own, so instrumenting a
+ * query needs no extra argument.
+ * @param timing - Filled in with the timings
+ */
+void http_last_timing(HttpTiming *timing) {
+    *timing = query_clock.timing;
+}
+
+
+/**
+ * Attempts to create a new stream socket and connect it to the server with
+ * the given host name and port number. The host is resolved through the
+ * shared DNS cache, and its addresses are raced as in happy eyeballs
+ * (RFC 8305): each is given HTTP_ATTEMPT_DELAY to connect before the next
+ * is tried alongside it, or none once it fails, and the first to connect
+ * is kept. Returns the new socket file descriptor on success, -1 if none
+ * of the addresses accepted the connection within the connect timeout.
+ *
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param port - The port number e.g. 80
+ * @return File descriptor of the new socket, or -1 on failure.
+ */
+int connect_to_server(char* host, int port) {
+    DnsAddress addrs[DNS_MAX_ADDRS];
+    double start = http_now();
+    int num_addrs = http_resolve(host, port, addrs, DNS_MAX_ADDRS);
+    double resolved = http_now();
+    query_clock.timing.dns += resolved - start;
+    if (num_addrs == -1) {
+        return -1;
+    }
+
+    struct pollfd attempts[DNS_MAX_ADDRS];
+    int num_attempts = 0;
+    int next = 0;
+    int sock = -1;
+    double deadline = socket_connect_timeout > 0 ?
+                      resolved + socket_connect_timeout : 0;
+    double next_at = resolved;
+
+    while (sock == -1 && (next < num_addrs || num_attempts > 0)) {
+        double now = http_now();
+        if (deadline > 0 && now >= deadline) {
+            fprintf(stderr, "connect %s:%d: timed out\n", host, port);
+            break;
+        }
+
+        // Start on the next address once the attempts under way have had
+        // their head start
+        if (next < num_addrs && (num_attempts == 0 || now >= next_at)) {
+            int done;
+            int attempt = http_open_socket(&addrs[next++], &done);
+            if (attempt != -1 && done) {
+                sock = attempt;
+            } else if (attempt != -1) {
+                attempts[num_attempts].fd = attempt;
+                attempts[num_attempts].events = POLLOUT;
+                ++num_attempts;
+                next_at = now + HTTP_ATTEMPT_DELAY;
+            }
+            continue;
+        }
+
+        double wake = next < num_addrs ? next_at : 0;
+        if (deadline > 0 && (wake == 0 || deadline < wake)) {
+            wake = deadline;
+        }
+        int timeout = wake > 0 ? (int)((wake - now) * 1000) + 1 : -1;
+
+        if (poll(attempts, num_attempts, timeout) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+
+        for (int i = 0; i < num_attempts; ) {
+            if (attempts[i].revents == 0) {
+                ++i;
+                continue;
+            }
+
+            int error = 0;
+            socklen_t error_length = sizeof(error);
+            getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &error,
+                       &error_length);
+            int fd = attempts[i].fd;
+            attempts[i] = attempts[--num_attempts];
+
+            if (error == 0) {
+                sock = fd;
+                break;
+            }
+
+            // The next address needn't wait out the failed one's head start
+            errno = error;
+            perror("connect");
+            close(fd);
+            next_at = now;
+        }
+    }
+
+    for (int i = 0; i < num_attempts; i++) {
+        close(attempts[i].fd);
+    }
+    query_clock.timing.connect += http_now() - resolved;
+
+    if (sock == -1) {
+        // None of the addresses worked; they may have changed
+        http_invalidate(host, port);
+        return -1;
+    }
+
+    // Queries read and write the socket blocking
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+
+    return sock;
+}
+
+
+/**
+ * Format a request for the given page and byte range, using the version
+ * selected with http_set_version.
+ * @param request - Buffer to write the request into
+ * @param size - Size of the buffer
+ * @param method - The request method e.g. GET or HEAD
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param page - The page to request e.g. index.html
+ * @param range - Byte range e.g. 0-500, or empty string or NULL for none
+ * @param if_range - Validator to send as If-Range with the range, or NULL
+ * @param cached - Validators of a cached copy, sent as If-None-Match and
+ *                 If-Modified-Since so the server answers 304 if it is
+ *                 still current; or NULL for none
+ * @return Length of the request, or -1 if it does not fit
+ */
+int format_http_request(char *request, size_t size, const char *method,
+                        const char *host, const char *page, const char *range,
+                        const char *if_range, const HttpValidator *cached) {
+    char range_string[BUF_SIZE] = {0};  // empty string
+    if (range && strlen(range) > 0) {
+        if (if_range) {
+            snprintf(range_string, BUF_SIZE,
+                     "Range: bytes=%s\r\nIf-Range: %s\r\n", range, if_range);
+        } else {
+            snprintf(range_string, BUF_SIZE, "Range: bytes=%s\r\n", range);
+        }
+    }
+
+    char etag_string[HTTP_VALIDATOR_SIZE + 32] = {0};
+    char date_string[HTTP_VALIDATOR_SIZE + 32] = {0};
+    if (cached && cached->etag[0]) {
+        snprintf(etag_string, sizeof(etag_string), "If-None-Match: %s\r\n",
+                 cached->etag);
+    }
+    if (cached && cached->last_modified[0]) {
+        snprintf(date_string, sizeof(date_string),
+                 "If-Modified-Since: %s\r\n", cached->last_modified);
+    }
+
+    // An IPv6 address is bracketed again in the Host header
+    int ipv6 = strchr(host, ':') != NULL;
+    int length = snprintf(request, size,
+             "%s /%s HTTP/%s\r\nHost: %s%s%s\r\n%s%s%s"
+             "User-Agent: getter\r\n\r\n",
+             method, page, http_version == HTTP_1_1 ? "1.1" : "1.0",
+             ipv6 ? "[" : "", host, ipv6 ? "]" : "", range_string,
+             etag_string, date_string);
+
+    if (length < 0 || (size_t)length >= size) {
+        fprintf(stderr, "request too long for %s/%s\n", host, page);
+        return -1;
+    }
+
+    return length;
+}
+
+
+/**
+ * Read bytes of a response from a connection, decrypting them for https.
+ * @return Number of bytes read, 0 at the end of the stream, or -1 on
+ *         failure with errno set
+ */
+static ssize_t transport_read(Transport *transport, void *data,
+                              size_t length) {
+    if (transport->tls) {
+        return tls_read(transport->tls, data, length);
+    }
+    return read(transport->sock, data, length);
+}
+
+
+/**
+ * Close a connection, and free its TLS session if it has one.
+ */
+static void transport_close(Transport *transport) {
+    if (transport->tls) {
+        tls_free(transport->tls, 0);
+        transport->tls = NULL;
+    }
+    close(transport->sock);
+}
+
+
+/**
+ * Constructs an HTTP request for the given page and byte range, and
+ * sends this request via the given connection. The request uses the
+ * version selected with http_set_version. Returns 0 on success, -1 on
+ * failure.
+ *
+ * @param transport - The connection to send the request through.
+ * @param method - The request method e.g. GET or HEAD
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param page - The page to request e.g. index.html
+ * @param range - Byte range e.g. 0-500 (can be empty string or NULL if no
+ *                range)
+ * @param if_range - Validator to send as If-Range with the range, or NULL
+ * @param cached - Validators of a cached copy to revalidate, or NULL
+ * @return 0 on success, -1 on failure.
+ */
+int send_http_request(Transport *transport, const char *method, char* host,
+                      char* page, const char* range, const char *if_range,
+                      const HttpValidator *cached) {
+    // Construct the request
+    char request[BUF_SIZE * 4];
+
+    int length = format_http_request(request, sizeof(request), method, host,
+                                     page, range, if_range, cached);
+    if (length == -1) {
+        return -1;
+    }
+
+    // Write the request to the socket. MSG_NOSIGNAL so that a pooled
+    // connection closed by the server gives EPIPE rather than SIGPIPE; the
+    // TLS session sends its records the same way.
+    ssize_t sent;
+    if (transport->tls) {
+        sent = tls_write(transport->tls, request, length);
+    } else {
+        sent = send(transport->sock, request, length, MSG_NOSIGNAL);
+    }
+    if (sent == -1) {
+        if (errno != EPIPE && errno != ECONNRESET) {
+            perror("send");
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Reset a chunked transfer-encoding decoder to the start of a body.
+ * @param decoder - The decoder to reset
+ */
+void chunk_decoder_init(ChunkDecoder *decoder) {
+    memset(decoder, 0, sizeof(ChunkDecoder));
+    decoder->state = CHUNK_SIZE;
+}
+
+
+/**
+ * Feeds bytes of a chunked body through the decoder, passing chunk data to
+ * sink. Decoding state is kept between calls, so the body may be split
+ * across reads at any point.
+ *
+ * @param decoder - The decoder state
+ * @param data - Bytes of the body just read
+ * @param length - Number of bytes in data
+ * @param sink - Callback to pass decoded body data to
+ * @param arg - Argument passed through to sink
+ * @return Number of bytes of data consumed (less than length only once the
+ *         end of the body has been reached), or -1 on a malformed body or
+ *         the sink aborting.
+ */
+ssize_t chunk_decode(ChunkDecoder *decoder, const char *data, size_t length,
+                     BodySink sink, void *arg) {
+    size_t i = 0;
+
+    while (i < length && decoder->state != CHUNK_DONE) {
+        char c = data[i];
+
+        switch (decoder->state) {
+        case CHUNK_SIZE:
+            ++i;
+            if (c == '\n') {
+                if (decoder->digits == 0) {
+                    return -1;
+                }
+                decoder->remaining = decoder->size;
+                decoder->state = decoder->size ? CHUNK_DATA : CHUNK_TRAILER;
+                decoder->size = 0;
+                decoder->digits = 0;
+                decoder->in_extension = 0;
+                decoder->line_length = 0;
+            } else if (decoder->in_extension || c == '\r') {
+                // ignore chunk extensions and the line ending
+            } else if (c == ';' || c == ' ' || c == '\t') {
+                decoder->in_extension = 1;
+            } else {
+                int digit;
+                if (c >= '0' && c <= '9') {
+                    digit = c - '0';
+                } else if (c >= 'a' && c <= 'f') {
+                    digit = c - 'a' + 10;
+                } else if (c >= 'A' && c <= 'F') {
+                    digit = c - 'A' + 10;
+                } else {
+                    return -1;
+                }
+                if (++decoder->digits > 15) {
+                    return -1;
+                }
+                decoder->size = decoder->size * 16 + digit;
+            }
+            break;
+
+        case CHUNK_DATA: {
+            size_t available = length - i;
+            size_t take = available < decoder->remaining ?
+                          available : decoder->remaining;
+
+            if (sink(arg, &data[i], take) != 0) {
+                return -1;
+            }
+
+            i += take;
+            decoder->remaining -= take;
+            if (decoder->remaining == 0) {
+                decoder->state = CHUNK_DATA_END;
+            }
+            break;
+        }
+
+        case CHUNK_DATA_END:
+            ++i;
+            if (c == '\n') {
+                decoder->state = CHUNK_SIZE;
+            } else if (c != '\r') {
+                return -1;
+            }
+            break;
+
+        case CHUNK_TRAILER:
+            ++i;
+            if (c == '\n') {
+                if (decoder->line_length == 0) {
+                    decoder->state = CHUNK_DONE;
+                }
+                decoder->line_length = 0;
+            } else if (c != '\r') {
+                ++decoder->line_length;
+            }
+            break;
+
+        case CHUNK_DONE:
+            break;
+        }
+    }
+
+    return i;
+}
+
+
+/**
+ * Move body bytes from a socket to splice_sink through a pipe, so that they
+ * stay in the kernel, until remaining is used up or the server closes the
+ * connection.
+ * @param sock - File descriptor of the socket to receive data from
+ * @param remaining - Body bytes still to come, updated as they are moved
+ * @param splice_sink - Callback to pass the pipe to
+ * @param arg - Argument passed through to splice_sink
+ * @return 0 on success, 1 if the socket can't be spliced and nothing was
+ *         moved, -1 on failure
+ */
+static int splice_body(int sock, size_t *remaining, SpliceSink splice_sink,
+                       void *arg) {
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+        return 1;
+    }
+
+    int rc = 0;
+    int moved = 0;
+
+    while (*remaining > 0) {
+        size_t want = *remaining < SPLICE_SIZE ? *remaining : SPLICE_SIZE;
+
+        ssize_t n = splice(sock, NULL, pipe_fds[1], NULL, want,
+                           SPLICE_F_MOVE);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL && !moved) {
+                rc = 1;
+            } else {
+                perror("splice");
+                rc = -1;
+            }
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        moved = 1;
+        clock_read(n);
+        if (splice_sink(arg, pipe_fds[0], n) != 0) {
+            rc = -1;
+            break;
+        }
+        *remaining -= n;
+    }
+
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    return rc;
+}
+
+
+/**
+ * Receives one HTTP response from the given socket. The header is
+ * accumulated in a fixed size buffer, scanning only newly read bytes for
+ * its terminator, and passed to header_sink. The body is then framed by
+ * Transfer-Encoding: chunked, Content-Length, or the connection closing,
+ * and passed to body_sink as soon as it is read.
+ *
+ * @param transport - The connection to receive data from.
+ * @param head - Non-zero if the request was a HEAD, which has no body
+ * @param range - The byte range requested, or NULL or empty for none. The
+ *                Content-Range of a 206 must lie within it, from its start.
+ * @param range_only - Non-zero if body_sink only expects the range. A 200,
+ *                     carrying the whole resource because it has changed
+ *                     since If-Range or the server ignores ranges, is then
+ *                     returned without passing its body on, as is any
+ *                     response outside 2xx.
+ * @param header_sink - Callback to pass the header to, or NULL
+ * @param body_sink - Callback to pass body data to
+ * @param splice_sink - If not NULL, the body after any bytes read with the
+ *                      header is passed to this through a pipe instead,
+ *                      unless it is chunked or has to be decrypted
+ * @param arg - Argument passed through to the sinks
+ * @param reusable - Set to 1 if the response was fully read and the
+ *                   connection can carry another request, 0 otherwise
+ * @return The HTTP status code of the response, HTTP_STALE if the
+ *         connection closed before any data arrived, or -1 on failure.
+ */
+static int receive_message(Transport *transport, int head, const char *range,
+                           int range_only,
+                           HeaderSink header_sink, BodySink body_sink,
+                           SpliceSink splice_sink, void *arg,
+                           int *reusable) {
+    char buf[STREAM_BUF_SIZE];
+    size_t filled = 0;
+    char *body = NULL;
+    ssize_t bytes_read;
+    HttpParser parser;
+
+    *reusable = 0;
+    http_parser_init(&parser);
+
+    // What comes over TLS is decrypted in user space, so can't be spliced
+    if (transport->tls) {
+        splice_sink = NULL;
+    }
+
+    // Read until the parser has seen the blank line ending the header
+    while (parser.state != PARSE_DONE) {
+        if (filled == STREAM_BUF_SIZE) {
+            fprintf(stderr, "response header too large\n");
+            return -1;
+        }
+
+        size_t want = STREAM_BUF_SIZE - filled;
+        if (splice_sink && want > HEADER_READ_SIZE) {
+            want = HEADER_READ_SIZE;
+        }
+
+        bytes_read = transport_read(transport, &buf[filled], want);
+        if (bytes_read == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (filled == 0 && errno == ECONNRESET) {
+                return HTTP_STALE;
+            }
+            perror("read");
+            return -1;
+        }
+        if (bytes_read == 0) {
+            if (filled == 0) {
+                return HTTP_STALE;
+            }
+            fprintf(stderr, "connection closed before end of header\n");
+            return -1;
+        }
+        clock_read(bytes_read);
+
+        // Only the newly read bytes are parsed, and none past the header
+        ssize_t consumed = http_parser_feed(&parser, &buf[filled], bytes_read);
+        if (consumed == -1) {
+            fprintf(stderr, "malformed response header\n");
+            return -1;
+        }
+        body = &buf[filled + consumed];
+        filled += bytes_read;
+    }
+
+    size_t header_length = body - buf;
+    ResponseHead *response_head = &parser.head;
+
+    if (header_sink && header_sink(arg, buf, header_length, response_head)) {
+        return -1;
+    }
+
+    int status = response_head->status;
+    int keep_alive = response_head->keep_alive;
+    off_t content_length = response_head->content_length;
+    int chunked = response_head->chunked;
+
+    size_t leftover = &buf[filled] - body;
+
+    // Responses that never carry a body
+    if (head || status / 100 == 1 || status == 204 || status == 304) {
+        *reusable = keep_alive && leftover == 0;
+        return status;
+    }
+
+    int ranged = range && range[0];
+
+    // Neither an error page nor the whole resource answering a range is
+    // what a range_only sink expects; the unread body makes the connection
+    // unusable
+    if (range_only && (status / 100 != 2 || (ranged && status == 200))) {
+        return status;
+    }
+
+    if (ranged && status == 206 && !http_range_matches(response_head, range)) {
+        fprintf(stderr, "Content-Range does not match requested range %s\n",
+                range);
+        return -1;
+    }
+
+    if (chunked) {
+        ChunkDecoder decoder;
+        chunk_decoder_init(&decoder);
+        char *data = body;
+        size_t length = leftover;
+
+        for (;;) {
+            ssize_t consumed = chunk_decode(&decoder, data, length,
+                                            body_sink, arg);
+            if (consumed == -1) {
+                fprintf(stderr, "malformed chunked body\n");
+                return -1;
+            }
+            if (decoder.state == CHUNK_DONE) {
+                *reusable = keep_alive && (size_t)consumed == length;
+                return status;
+            }
+
+            do {
+                bytes_read = transport_read(transport, buf, STREAM_BUF_SIZE);
+            } while (bytes_read == -1 && errno == EINTR);
+
+            if (bytes_read <= 0) {
+                if (bytes_read == -1) {
+                    perror("read");
+                }
+                fprintf(stderr, "connection closed in chunked body\n");
+                return -1;
+            }
+            clock_read(bytes_read);
+            data = buf;
+            length = bytes_read;
+        }
+    }
+
+    // Without a length the body ends when the server closes the connection
+    size_t remaining = content_length >= 0 ? (size_t)content_length : SIZE_MAX;
+    size_t take = leftover < remaining ? leftover : remaining;
+
+    if (take > 0 && body_sink(arg, body, take) != 0) {
+        return -1;
+    }
+    remaining -= take;
+
+    // Falls back to the buffer below if the socket can't be spliced
+    if (splice_sink && remaining > 0 &&
+        splice_body(transport->sock, &remaining, splice_sink, arg) == -1) {
+        return -1;
+    }
 
-#include "http.h"
+    // Stream the rest of the body through the same buffer
+    while (remaining > 0) {
+        size_t want = remaining < STREAM_BUF_SIZE ? remaining : STREAM_BUF_SIZE;
 
-#define BUF_SIZE  1024
-#define HTTP_PORT 80
+        bytes_read = transport_read(transport, buf, want);
+        if (bytes_read == 0) {
+            break;
+        }
+        if (bytes_read == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            return -1;
+        }
+        clock_read(bytes_read);
+        if (body_sink(arg, buf, bytes_read) != 0) {
+            return -1;
+        }
+        remaining -= bytes_read;
+    }
+
+    if (content_length >= 0) {
+        if (remaining > 0) {
+            fprintf(stderr, "connection closed before end of body\n");
+            return -1;
+        }
+        *reusable = keep_alive && leftover <= (size_t)content_length;
+    }
+
+    return status;
+}
 
 
 /**
- * Attempts to create a new stream socket and connect it to the server with
- * the given host name and port number. Returns the new socket file
- * descriptor on success, -1 otherwise.
- *
- * @param host - The host name e.g. www.canterbury.ac.nz
- * @param port - The port number e.g. 80
- * @return File descriptor of the new socket, or -1 on failure.
+ * Start the TLS session of a new https connection, timing its handshake.
+ * The connection is closed if the handshake fails.
+ * @return 0 on success, -1 on failure
  */
-int connect_to_server(char* host, int port) {
-    // Convert port number to a string
-    char port_string[BUF_SIZE];
-    snprintf(port_string, BUF_SIZE, "%d", port);
-
-    // Use getaddrinfo to get the server address from host and port.
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-
-    struct addrinfo* server_addr;
-    int status;
-    if ((status = getaddrinfo(host, port_string, &hints, &server_addr)) != 0) {
-        fprintf(stderr, "getaddrinfo %s: %s\n", host, gai_strerror(status));
+static int start_tls(char *host, int port, Transport *transport) {
+    double start = http_now();
+    transport->tls = tls_open(transport->sock, host, port);
+    int rc = transport->tls ? tls_handshake(transport->tls) : -1;
+    query_clock.timing.tls += http_now() - start;
+
+    if (rc != 0) {
+        transport_close(transport);
         return -1;
     }
+    query_clock.timing.resumed = tls_resumed(transport->tls);
+    return 0;
+}
 
-    // Create a stream socket
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == -1) {
-        perror("socket");
-        return -1;
+
+/**
+ * Gets a connection to the given host, reusing an idle pooled one when
+ * keep-alive is enabled. A new https connection has its TLS handshake done
+ * before it is returned.
+ * @param secure - Non-zero for an https connection
+ * @param reused - Set to 1 if the connection came from the pool
+ * @param transport - Filled in with the connection
+ * @return 0 on success, -1 on failure
+ */
+static int acquire_connection(char *host, int port, int secure, int *reused,
+                              Transport *transport) {
+    *reused = 0;
+    transport->tls = NULL;
+
+    if (connection_pool) {
+        transport->sock = pool_checkout(connection_pool, host, port,
+                                        secure ? &transport->tls : NULL);
+        if (transport->sock != -1) {
+            *reused = 1;
+            return 0;
+        }
     }
 
-    // Connect to the server
-    if (connect(sock, server_addr->ai_addr, server_addr->ai_addrlen) == -1) {
-        perror("connect");
+    transport->sock = connect_to_server(host, port);
+    if (transport->sock == -1) {
         return -1;
     }
 
-    freeaddrinfo(server_addr);
+    return secure ? start_tls(host, port, transport) : 0;
+}
 
-    return sock;
+
+/**
+ * Hands a connection back after a request, returning it to the pool if it
+ * can carry another request, and closing it otherwise.
+ */
+static void release_connection(char *host, int port, Transport *transport,
+                               int reusable) {
+    if (connection_pool && http_version == HTTP_1_1 && reusable) {
+        pool_checkin(connection_pool, host, port, transport->sock,
+                     transport->tls);
+    } else {
+        transport_close(transport);
+    }
 }
 
 
 /**
- * Constructs an HTTP GET request for the given page and byte range, and
- * sends this request via the given socket. Returns 0 on success, -1 on
- * failure.
- *
- * @param sock - File descriptor of the socket to send the request through.
- * @param host - The host name e.g. www.canterbury.ac.nz
- * @param page - The page to request e.g. index.html
- * @param range - Byte range e.g. 0-500 (can be empty string or NULL if no range)
- * @return 0 on success, -1 on failure.
+ * Sends one request and receives its response. A pooled socket that turns
+ * out to have been closed by the server is replaced by a fresh connection.
+ * @return The HTTP status code of the response, or -1 on failure
  */
-int send_http_request(int sock, char* host, char* page, const char* range) {
-    // Construct a GET request
-    char request[BUF_SIZE];
+static int exchange(const char *method, char *host, char *page,
+                    const char *range, const char *if_range,
+                    const HttpValidator *cached, int range_only,
+                    int port, int secure, HeaderSink header_sink,
+                    BodySink body_sink, SpliceSink splice_sink, void *arg) {
+    int head = strcmp(method, "HEAD") == 0;
 
-    char range_string[BUF_SIZE] = {0};  // empty string
-    if (range && strlen(range) > 0) {
-        snprintf(range_string, BUF_SIZE, "Range: bytes=%s\r\n", range);
+    for (;;) {
+        int reused, reusable;
+        Transport transport;
+        if (acquire_connection(host, port, secure, &reused, &transport) != 0) {
+            return -1;
+        }
+        query_clock.timing.reused = reused;
+
+        if (send_http_request(&transport, method, host, page, range, if_range,
+                              cached) != 0) {
+            transport_close(&transport);
+            if (reused) {
+                continue;
+            }
+            return -1;
+        }
+        query_clock.sent_at = http_now();
+
+        int status = receive_message(&transport, head, range, range_only,
+                                     header_sink, body_sink, splice_sink, arg,
+                                     &reusable);
+        clock_response();
+        if (status == HTTP_STALE && reused) {
+            transport_close(&transport);
+            continue;
+        }
+        if (status < 0) {
+            transport_close(&transport);
+            if (status == HTTP_STALE) {
+                fprintf(stderr, "connection closed without a response\n");
+            }
+            return -1;
+        }
+
+        release_connection(host, port, &transport, reusable);
+        return status;
     }
+}
 
-    snprintf(request, BUF_SIZE,
-             "GET /%s HTTP/1.0\r\nHost: %s\r\n%sUser-Agent: getter\r\n\r\n",
-             page, host, range_string);
 
-    // Write the request to the socket
-    if (write(sock, request, strlen(request)) == -1) {
-        perror("write");
-        return -1;
+/**
+ * Runs one query, within the limits set with http_set_limits: it waits
+ * for one of its host's connection slots, and holds it until it is done.
+ * @return The HTTP status code of the response, or -1 on failure
+ */
+static int http_exchange(const char *method, char *host, char *page,
+                         const char *range, const char *if_range,
+                         const HttpValidator *cached, int range_only,
+                         int port, int secure, HeaderSink header_sink,
+                         BodySink body_sink, SpliceSink splice_sink,
+                         void *arg) {
+    memset(&query_clock, 0, sizeof(query_clock));
+    query_host = host;
+    query_port = port;
+
+    if (limiter) {
+        limiter_acquire(limiter, host, port);
     }
 
-    return 0;
+    int status = exchange(method, host, page, range, if_range, cached,
+                          range_only, port, secure, header_sink, body_sink,
+                          splice_sink, arg);
+
+    if (limiter) {
+        limiter_release(limiter, host, port);
+    }
+    return status;
 }
 
 
+// Growable buffer collecting a whole response for http_query
+typedef struct {
+    Buffer *buffer;
+    size_t capacity;
+} BufferSink;
+
+
 /**
- * Receives an HTTP response from the given socket, reading data until EOF
- * occurs. On success, returns a pointer to a buffer holding the response
- * data, otherwise returns NULL.
- *
- * @param sock - File descriptor of the socket to receive data from.
- * @return Pointer to a buffer holding the response data from the query,
- *         or NULL on failure.
+ * Makes room in a BufferSink for length more bytes. Its capacity is at
+ * least doubled, so appends in small pieces are amortised, but grows to
+ * just what is needed for a larger reservation.
+ * @return 0 on success, -1 on failure
  */
-Buffer* receive_response(int sock) {
-    // Create a Buffer to hold the response
-    Buffer* response = malloc(sizeof(Buffer));
-    response->data = (char*)malloc(BUF_SIZE);
-    response->length = 0;
-
-    // Receive and write data to the buffer, calling realloc as needed.
-    char temp[BUF_SIZE];  // temporary buffer to read data into
-    int bytes_read;
-    int buffer_size = BUF_SIZE;   // current size of response->data
+static int buffer_reserve(BufferSink *sink, size_t length) {
+    Buffer *buffer = sink->buffer;
 
-    do {
-        bytes_read = read(sock, temp, BUF_SIZE);
-        if (bytes_read == -1) {
-            perror("read");
-            return NULL;
+    if (sink->capacity - buffer->length < length) {
+        size_t capacity = sink->capacity * 2;
+        if (capacity - buffer->length < length) {
+            capacity = buffer->length + length;
         }
 
-        // Check if we have enough space left in response->data
-        if (buffer_size - response->length < bytes_read) {
-            response->data = (char*)realloc(response->data, buffer_size * 2);
-            buffer_size *= 2;
+        char *data = (char*)realloc(buffer->data, capacity);
+        if (!data) {
+            perror("realloc");
+            return -1;
         }
+        buffer->data = data;
+        sink->capacity = capacity;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Appends data to a BufferSink, growing it as needed.
+ * Used as the body sink of http_query.
+ */
+static int buffer_append(void *arg, const char *data, size_t length) {
+    BufferSink *sink = (BufferSink *)arg;
+    Buffer *buffer = sink->buffer;
+
+    if (buffer_reserve(sink, length) != 0) {
+        return -1;
+    }
+
+    memcpy(&buffer->data[buffer->length], data, length);
+    buffer->length += length;
+    return 0;
+}
+
+
+/**
+ * HeaderSink appending the raw header to a BufferSink, for http_query. The
+ * buffer is grown once to fit a body of known length, so that appending
+ * the body never reallocs.
+ */
+static int buffer_append_header(void *arg, const char *header, size_t length,
+                                const ResponseHead *head) {
+    if (buffer_append(arg, header, length) != 0) {
+        return -1;
+    }
+
+    if (!head->chunked && head->content_length > 0 &&
+        buffer_reserve((BufferSink *)arg, head->content_length) != 0) {
+        return -1;
+    }
+    return 0;
+}
 
-        memcpy(&response->data[response->length], temp, bytes_read);
-        response->length += bytes_read;
 
-    } while (bytes_read > 0);
+/**
+ * Runs a GET like http_query, over TLS if secure is set.
+ * @return Buffer holding the response, or NULL on failure
+ */
+static Buffer *buffer_query(char *host, char *page, const char *range,
+                            int port, int secure) {
+    // Create a Buffer to hold the response
+    BufferSink sink;
+    sink.buffer = malloc(sizeof(Buffer));
+    sink.buffer->data = (char*)malloc(BUF_SIZE);
+    sink.buffer->length = 0;
+    sink.capacity = BUF_SIZE;
+
+    if (http_exchange("GET", host, page, range, NULL, NULL, 0, port, secure,
+                      buffer_append_header, buffer_append, NULL,
+                      &sink) == -1) {
+        buffer_free(sink.buffer);
+        return NULL;
+    }
 
-    return response;
+    return sink.buffer;
 }
 
 
 /**
- * Perform an HTTP 1.0 query to a given host and page and port number.
+ * Perform an HTTP query to a given host and page and port number.
  * host is a hostname and page is a path on the remote server. The query
  * will attempt to retrieve content in the given byte range.
  * User is responsible for freeing the memory.
- * 
+ *
  * @param host - The host name e.g. www.canterbury.ac.nz
  * @param page - e.g. /index.html
  * @param range - Byte range e.g. 0-500. NOTE: A server may not respect this
@@ -149,16 +1222,125 @@ Buffer* receive_response(int sock) {
  *                  NULL is returned on failure.
  */
 Buffer* http_query(char *host, char *page, const char *range, int port) {
-    int sock = connect_to_server(host, port);
-    if (sock == -1) {
-        return NULL;
+    return buffer_query(host, page, range, port, 0);
+}
+
+
+// The caller's sinks of a query, and where to copy the resource fields of
+// the response header for it
+typedef struct {
+    HttpResource *resource;  // or NULL if not wanted
+    BodySink sink;
+    SpliceSink splice_sink;
+    void *arg;
+} ResourceSinks;
+
+
+/**
+ * HeaderSink copying the resource fields of a response header out.
+ */
+static int resource_header(void *arg, const char *header, size_t length,
+                           const ResponseHead *head) {
+    ResourceSinks *sinks = (ResourceSinks *)arg;
+
+    if (sinks->resource) {
+        http_get_resource(head, sinks->resource);
     }
+    return 0;
+}
 
-    if (send_http_request(sock, host, page, range) != 0) {
-        return NULL;
+
+/**
+ * BodySink passing body data on to the caller's sink.
+ */
+static int resource_body(void *arg, const char *data, size_t length) {
+    ResourceSinks *sinks = (ResourceSinks *)arg;
+    return sinks->sink(sinks->arg, data, length);
+}
+
+
+/**
+ * SpliceSink passing body data on to the caller's splice sink.
+ */
+static int resource_splice(void *arg, int pipe_fd, size_t length) {
+    ResourceSinks *sinks = (ResourceSinks *)arg;
+    return sinks->splice_sink(sinks->arg, pipe_fd, length);
+}
+
+
+/**
+ * Sends a GET like http_exchange, passing the body to the caller's sinks
+ * and copying the resource fields of the header into resource.
+ */
+static int resource_exchange(char *host, char *page, const char *range,
+                             const char *if_range,
+                             const HttpValidator *cached, int range_only,
+                             int port, int secure, HttpResource *resource,
+                             BodySink sink, SpliceSink splice_sink,
+                             void *arg) {
+    ResourceSinks sinks = { resource, sink, splice_sink, arg };
+
+    if (resource) {
+        resource->status = -1;
+        resource->length = -1;
+        resource->accept_ranges = -1;
     }
+    return http_exchange("GET", host, page, range, if_range, cached,
+                         range_only, port, secure, resource_header,
+                         resource_body, splice_sink ? resource_splice : NULL,
+                         &sinks);
+}
+
+
+/**
+ * Perform an HTTP query like http_query, but without buffering the
+ * response. The header is read into a fixed size buffer, then body bytes
+ * are passed to sink as they are read from the socket, so memory use does
+ * not depend on the size of the response.
+ *
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param page - e.g. /index.html
+ * @param range - Byte range e.g. 0-500. NOTE: A server may not respect this
+ * @param if_range - Validator sent as If-Range with the range, so that the
+ *                   server sends the whole resource (status 200) instead if
+ *                   it has changed; or NULL for none
+ * @param port - e.g. 80
+ * @param sink - Callback to pass body data to
+ * @param arg - Argument passed through to sink
+ * @return The HTTP status code of the response, or -1 on failure
+ *         (including sink aborting the transfer)
+ */
+int http_query_stream(char *host, char *page, const char *range,
+                      const char *if_range, int port, BodySink sink,
+                      void *arg) {
+    return http_exchange("GET", host, page, range, if_range, NULL, 1, port,
+                         0, NULL, sink, NULL, arg);
+}
+
 
-    return receive_response(sock);
+/**
+ * Perform a streaming HTTP query like http_query_stream, but move the body
+ * from the socket to splice_sink through a pipe, so that it never passes
+ * through user space. Body bytes read along with the header, and chunked
+ * bodies, which must be decoded, still go to sink.
+ *
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param page - e.g. /index.html
+ * @param range - Byte range e.g. 0-500. NOTE: A server may not respect this
+ * @param if_range - Validator to send as If-Range, or NULL for none
+ * @param port - e.g. 80
+ * @param resource - If not NULL, filled in from the response header
+ * @param sink - Callback to pass body data read into user space to
+ * @param splice_sink - Callback to pass the pipe holding body data to
+ * @param arg - Argument passed through to the sinks
+ * @return The HTTP status code of the response, or -1 on failure
+ *         (including a sink aborting the transfer)
+ */
+int http_query_splice(char *host, char *page, const char *range,
+                      const char *if_range, int port, HttpResource *resource,
+                      BodySink sink, SpliceSink splice_sink, void *arg) {
+    return resource_exchange(host, page, range, if_range, NULL, 1, port, 0,
+                             resource, sink, splice_sink, arg);
 }
 
 
@@ -166,16 +1348,20 @@ Buffer* http_query(char *host, char *page, const char *range, int port) {
  * Separate the content from the header of an http request.
  * NOTE: returned string is an offset into the response, so
  * should not be freed by the user. Do not copy the data.
- * @param response - Buffer containing the HTTP response to separate 
+ * @param response - Buffer containing the HTTP response to separate
  *                   content from
  * @return string response or NULL on failure (buffer is not HTTP response)
  */
 char* http_get_content(Buffer *response) {
+    HttpParser parser;
+    http_parser_init(&parser);
 
-    char* header_end = strstr(response->data, "\r\n\r\n");
+    // The parser stops at the end of the header, and never reads the body
+    ssize_t consumed = http_parser_feed(&parser, response->data,
+                                        response->length);
 
-    if (header_end) {
-        return header_end + 4;
+    if (consumed != -1 && parser.state == PARSE_DONE) {
+        return response->data + consumed;
     } else {
         return response->data;
     }
@@ -184,85 +1370,291 @@ char* http_get_content(Buffer *response) {
 
 /**
  * Splits an HTTP url into host, page. On success, calls http_query
- * to execute the query against the url. 
+ * to execute the query against the url.
  * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
  * @param range - The desired byte range of data to retrieve from the page
  * @return Buffer pointer holding raw string data or NULL on failure
  */
 Buffer *http_url(const char *url, const char *range) {
     char host[BUF_SIZE];
-    strncpy(host, url, BUF_SIZE);
+    int port, secure;
+    char *page = split_url(url, host, BUF_SIZE, &port, &secure);
 
-    char *page = strstr(host, "/");
-    
-    if (page) {
-        page[0] = '\0';
-        ++page;
-        return http_query(host, page, range, HTTP_PORT);
-    } else {
-        fprintf(stderr, "could not split url into host/page %s\n", url);
+    if (!page) {
         return NULL;
     }
+    return buffer_query(host, page, range, port, secure);
 }
 
 
 /**
- * Makes a HEAD request to a given URL and gets the content length
- * Then determines max_chunk_size and number of split downloads needed
- * @param url   The URL of the resource to download
- * @param threads   The number of threads to be used for the download
- * @return int  The number of downloads needed satisfying max_chunk_size
- *              to download the resource
+ * Splits an HTTP url into host, page. On success, calls http_query_stream
+ * to stream the body of the url to sink.
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param range - The desired byte range of data to retrieve from the page
+ * @param if_range - Validator to send as If-Range, or NULL for none
+ * @param sink - Callback to pass body data to
+ * @param arg - Argument passed through to sink
+ * @return The HTTP status code of the response, or -1 on failure
  */
-int get_num_tasks(char *url, int threads) {
-    // Extract the hostname and page from the given url
+int http_url_stream(const char *url, const char *range, const char *if_range,
+                    BodySink sink, void *arg) {
+    char host[BUF_SIZE];
+    int port, secure;
+    char *page = split_url(url, host, BUF_SIZE, &port, &secure);
+
+    if (!page) {
+        return -1;
+    }
+    return http_exchange("GET", host, page, range, if_range, NULL, 1, port,
+                         secure, NULL, sink, NULL, arg);
+}
+
+
+/**
+ * Splits an HTTP url into host, page. On success, calls http_query_splice
+ * to move the body of the url to splice_sink.
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param range - The desired byte range of data to retrieve from the page
+ * @param if_range - Validator to send as If-Range, or NULL for none
+ * @param resource - If not NULL, filled in from the response header
+ * @param sink - Callback to pass body data read into user space to
+ * @param splice_sink - Callback to pass the pipe holding body data to
+ * @param arg - Argument passed through to the sinks
+ * @return The HTTP status code of the response, or -1 on failure
+ */
+int http_url_splice(const char *url, const char *range, const char *if_range,
+                    HttpResource *resource, BodySink sink,
+                    SpliceSink splice_sink, void *arg) {
     char host[BUF_SIZE];
-    strncpy(host, url, BUF_SIZE);
-    char* page = strstr(host, "/");
+    int port, secure;
+    char *page = split_url(url, host, BUF_SIZE, &port, &secure);
+
+    if (!page) {
+        return -1;
+    }
+    return resource_exchange(host, page, range, if_range, NULL, 1, port,
+                             secure, resource, sink, splice_sink, arg);
+}
+
+
+/**
+ * Split a url into its host, port and page. A url starting with https://
+ * is fetched over TLS; one starting with http://, or with no scheme at all,
+ * over plain HTTP. The host may be followed by a port, e.g.
+ * https://example.com:8443/index.html, else the scheme's own is used.
+ * @param url - e.g. learn.canterbury.ac.nz/profile
+ * @param host - Buffer of host_size bytes to copy the url into; the host
+ *               part is left NUL terminated in it
+ * @param host_size - Size of the host buffer
+ * @param port - Set to the port to connect to
+ * @param secure - Set to 1 for https, 0 for plain HTTP
+ * @return Pointer to the page within host, or NULL if the url has no '/'
+ *         or a malformed port
+ */
+char *split_url(const char *url, char *host, size_t host_size, int *port,
+                int *secure) {
+    const char *rest = url;
+    *secure = 0;
+    if (strncasecmp(rest, "https://", 8) == 0) {
+        *secure = 1;
+        rest += 8;
+    } else if (strncasecmp(rest, "http://", 7) == 0) {
+        rest += 7;
+    }
+    snprintf(host, host_size, "%s", rest);
 
+    char *page = strstr(host, "/");
     if (!page) {
         fprintf(stderr, "could not split url into host/page %s\n", url);
-        exit(1);
+        return NULL;
+    }
+    page[0] = '\0';
+
+    // An IPv6 address is bracketed, to tell its colons from the port's
+    char *close = NULL;
+    char *colon;
+    if (host[0] == '[') {
+        close = strchr(host, ']');
+        if (!close || close == host + 1 || (close[1] && close[1] != ':')) {
+            fprintf(stderr, "bad address in url %s\n", url);
+            return NULL;
+        }
+        colon = close[1] ? close + 1 : NULL;
     } else {
-        page[0] = 0;
-        page++;
+        colon = strrchr(host, ':');
     }
 
-    // Create a socket and connect to the server
-    int sock = connect_to_server(host, HTTP_PORT);
-    if (sock == -1) {
-        fprintf(stderr, "failed to connect to server\n");
-        exit(1);
+    *port = *secure ? HTTPS_PORT : HTTP_PORT;
+    if (colon) {
+        char *end;
+        long number = strtol(colon + 1, &end, 10);
+        if (end == colon + 1 || *end || number <= 0 || number > 65535) {
+            fprintf(stderr, "bad port in url %s\n", url);
+            return NULL;
+        }
+        colon[0] = '\0';
+        *port = number;
     }
 
-    // Construct and send a HEAD request
-    char request[BUF_SIZE];
-    snprintf(request, BUF_SIZE,
-             "HEAD /%s HTTP/1.0\r\nHost: %s\r\nUser-Agent: getter\r\n\r\n",
-             page, host);
+    // The brackets are not part of the address itself
+    if (close) {
+        close[0] = '\0';
+        memmove(host, host + 1, close - host);
+    }
+
+    return page + 1;
+}
+
+
+off_t max_chunk_size;
+
+
+/**
+ * BodySink for requests whose body is not wanted.
+ */
+static int discard_sink(void *arg, const char *data, size_t length) {
+    return 0;
+}
+
+
+/**
+ * Chooses the validator to send as If-Range: the ETag if it is a strong
+ * one, otherwise Last-Modified.
+ * @param validator - The validators of a resource
+ * @return The value to send, or NULL if the resource has no usable one
+ */
+const char *http_if_range(const HttpValidator *validator) {
+    // If-Range only allows strong comparison, which weak ETags never pass
+    if (validator->etag[0] && strncmp(validator->etag, "W/", 2) != 0) {
+        return validator->etag;
+    }
+    if (validator->last_modified[0]) {
+        return validator->last_modified;
+    }
+    return NULL;
+}
+
+
+/**
+ * Makes a HEAD request to a given URL and returns the content length.
+ * Unlike get_num_tasks, this does not touch any global state and reports
+ * failure to the caller rather than exiting, so it is safe to call from
+ * worker threads.
+ * @param url   The URL of the resource to probe
+ * @return The content length in bytes, or -1 on failure
+ */
+off_t http_content_length(const char *url) {
+    return http_probe(url, NULL, NULL);
+}
+
+
+/**
+ * Makes a HEAD request to a given URL like http_content_length, also
+ * collecting whether it accepts ranges and its validators.
+ * @param url   The URL of the resource to probe
+ * @param cached   Validators of a cached copy of the resource, sent so that
+ *                 the server answers 304 if it is still current; or NULL
+ * @param resource   If not NULL, filled in from the response header, with
+ *                   its status -1 if there was no response
+ * @return The content length in bytes, or -1 on failure, including a 304
+ */
+off_t http_probe(const char *url, const HttpValidator *cached,
+                 HttpResource *resource) {
+    // Extract the hostname, port and page from the given url
+    char host[BUF_SIZE];
+    int port, secure;
+    char *page = split_url(url, host, BUF_SIZE, &port, &secure);
+
+    if (!page) {
+        return -1;
+    }
 
-    if (write(sock, request, strlen(request)) == -1) {
-        perror("write");
-        exit(1);
+    HttpResource result = { .status = -1, .length = -1, .accept_ranges = -1 };
+    ResourceSinks sinks = { &result, discard_sink, NULL, NULL };
+    int status = http_exchange("HEAD", host, page, NULL, NULL, cached, 0,
+                               port, secure, resource_header, resource_body,
+                               NULL, &sinks);
+    result.status = status;
+    if (resource) {
+        *resource = result;
     }
 
-    // Receive the response from the server
-    Buffer* response = receive_response(sock);
-    if (!response) {
+    if (status == -1) {
         fprintf(stderr, "error receiving response from server\n");
-        exit(1);
+        return -1;
+    }
+
+    // A 304 has no length to give: the cached copy has it
+    if (status == 304) {
+        return -1;
     }
 
-    // Extract the content length
-    char* content_length_field = strstr(response->data, "Content-Length:");
-    if (!content_length_field) {
+    // The length of an error page isn't that of the resource
+    if (status < 200 || status >= 300) {
+        fprintf(stderr, "HEAD %s returned status %d\n", url, status);
+        return -1;
+    }
+
+    if (result.length == -1) {
         fprintf(stderr, "No Content-Length field in response from: %s\n", url);
-        exit(1);
+        return -1;
+    }
+
+    return result.length;
+}
+
+
+/**
+ * Perform a ranged GET like http_url_stream, also reporting the length of
+ * the whole resource and its validators from the response header. This
+ * lets the first chunk of a download double as its probe, instead of
+ * spending a round trip on a HEAD request.
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param range - The byte range of the first chunk e.g. 0-262143. A
+ *                server that ignores it sends the whole resource with a
+ *                200, whose body is passed to sink as well.
+ * @param cached - Validators of a cached copy of the resource, sent so that
+ *                 the server answers 304, with no body, if it is still
+ *                 current; or NULL
+ * @param resource - Filled in from the response header; its length is -1
+ *                   until the header has been read
+ * @param sink - Callback to pass body data to
+ * @param arg - Argument passed through to sink
+ * @return The HTTP status code of the response, or -1 on failure
+ *         (including sink aborting the transfer)
+ */
+int http_probe_range(const char *url, const char *range,
+                     const HttpValidator *cached, HttpResource *resource,
+                     BodySink sink, void *arg) {
+    char host[BUF_SIZE];
+    int port, secure;
+    char *page = split_url(url, host, BUF_SIZE, &port, &secure);
+
+    resource->status = -1;
+    resource->length = -1;
+    if (!page) {
+        return -1;
     }
 
-    int content_length = atoi(content_length_field + strlen("Content-Length: "));
+    return resource_exchange(host, page, range, NULL, cached, 0, port,
+                             secure, resource, sink, NULL, arg);
+}
+
 
-    buffer_free(response);
+/**
+ * Makes a HEAD request to a given URL and gets the content length
+ * Then determines max_chunk_size and number of split downloads needed
+ * @param url   The URL of the resource to download
+ * @param threads   The number of threads to be used for the download
+ * @return int  The number of downloads needed satisfying max_chunk_size
+ *              to download the resource, or -1 if the length is unknown
+ */
+int get_num_tasks(char *url, int threads) {
+    off_t content_length = http_content_length(url);
+    if (content_length == -1) {
+        return -1;
+    }
 
     // To get the chunk size, divide total length by number of threads,
     // rounding up
@@ -272,6 +1664,6 @@ int get_num_tasks(char *url, int threads) {
     return threads;
 }
 
-int get_max_chunk_size() {
+off_t get_max_chunk_size() {
     return max_chunk_size;
 }
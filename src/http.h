@@ -1,6 +1,9 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#include <stdlib.h>
+#include <sys/types.h>
+
 
 // A buffer object with data, and a length
 typedef struct {
@@ -10,8 +13,121 @@ typedef struct {
 } Buffer;
 
 
+// Size of the buffers holding the validators of a resource
+#define HTTP_VALIDATOR_SIZE 128
+
+
+/*
+ * The validators of a resource, used to check that it has not changed
+ * between requests, e.g. before resuming a download.
+ */
+typedef struct {
+    char etag[HTTP_VALIDATOR_SIZE];          // ETag, or empty if none
+    char last_modified[HTTP_VALIDATOR_SIZE]; // Last-Modified, or empty
+} HttpValidator;
+
+
+/*
+ * What a response header tells about the resource it is for, used to plan
+ * and check a download.
+ */
+typedef struct {
+    int status;              // HTTP status of the response, or -1 if none
+    off_t length;            // length of the whole resource, or -1
+    int accept_ranges;       // Accept-Ranges: 1 for bytes, 0 for none, -1 if
+                             // not given
+    HttpValidator validator;
+} HttpResource;
+
+
+/*
+ * Where the time of one query went, for instrumentation. Times are in
+ * seconds; those of a step that didn't happen are 0.
+ */
+typedef struct {
+    double dns;         // resolving the host
+    double connect;     // connecting to the server
+    double tls;         // the TLS handshake of a new https connection
+    double first_byte;  // from sending the request to the first byte of the
+                        // response
+    double transfer;    // from the first byte to the end of the response
+    size_t bytes;       // response bytes read from the socket, header too
+    int reused;         // the socket came from the keep-alive pool
+    int resumed;        // the TLS handshake resumed a cached session
+} HttpTiming;
+
+
+// HTTP protocol version used for requests
+typedef enum {
+    HTTP_1_0,  // one request per connection, body ends at EOF
+    HTTP_1_1   // keep-alive connections reused through a per-host pool
+} HttpVersion;
+
+
+/**
+ * Select the HTTP version used by all following queries.
+ * With HTTP_1_1, connections are kept alive after each response and
+ * returned to a pool shared by all threads, to be reused by the next query
+ * to the same host. Call this before any queries are started.
+ * @param version - HTTP_1_0 (default) or HTTP_1_1
+ */
+void http_set_version(HttpVersion version);
+
+
+/**
+ * Limit how hard all following queries push the servers, whether made
+ * here or on an engine. Reads pause while a rate is exceeded, and a query
+ * waits for a free slot when its host already has host_connections queries
+ * in flight. Call this before any queries are started.
+ * @param rate - Most bytes per second read over all hosts, 0 for no limit
+ * @param host_rate - Most bytes per second read from each host, 0 for no
+ *                    limit
+ * @param host_connections - Most queries to each host in flight at once,
+ *                           0 for no limit
+ */
+void http_set_limits(double rate, double host_rate, int host_connections);
+
+
+/**
+ * Tune the sockets of all following connections, whether made here or on
+ * an engine. Every socket has Nagle's algorithm turned off, so a request
+ * goes out as soon as it is written. A host's addresses, IPv6 and IPv4
+ * alike, are raced as in happy eyeballs (RFC 8305), and connecting gives
+ * up once connect_timeout has passed without any of them accepting. Call
+ * this before any queries are started.
+ * @param receive_buffer - Bytes of each socket's kernel receive buffer,
+ *                         or 0 (default) to leave its size to the kernel
+ * @param connect_timeout - Most seconds spent connecting to a server
+ *                          (default 10), 0 for no limit
+ */
+void http_set_socket_options(int receive_buffer, double connect_timeout);
+
+
 /**
- * Perform an HTTP 1.0 query to a given host and page and port number.
+ * Select the certificate authorities that the certificates of https
+ * servers are checked against, instead of the system's. Urls given to the
+ * functions below, or to an engine, that start with https:// are fetched
+ * over TLS, on port 443 unless another follows the host, e.g.
+ * https://example.com:8443/index.html. Their sessions are resumed by later
+ * connections to the same server, and with HTTP_1_1 their connections are
+ * kept alive in the same pool as plain ones. Call this before any queries
+ * are started.
+ * @param ca_file - PEM file of trusted certificates, or NULL for the
+ *                  system's own
+ * @return 0 on success, -1 if the file could not be loaded
+ */
+int http_set_ca_file(const char *ca_file);
+
+
+/**
+ * Close any pooled keep-alive connections. Call this once all queries have
+ * finished.
+ */
+void http_cleanup(void);
+
+
+/**
+ * Perform an HTTP query to a given host and page and port number.
  * host is a hostname and page is a path on the remote server. The query
  * will attempt to retrieve content in the given byte range.
  * User is responsible for freeing the memory.
@@ -26,6 +142,72 @@ typedef struct {
 Buffer* http_query(char *host, char *page, const char *range, int port);
 
 
+/*
+ * Callback receiving body data from a streaming query as it arrives.
+ * data is only valid for the duration of the call.
+ * Return 0 to continue the transfer, or non-zero to abort it.
+ */
+typedef int (*BodySink)(void *arg, const char *data, size_t length);
+
+
+/*
+ * Callback moving body data from a streaming query into a file without it
+ * passing through user space. length bytes of body are waiting in the pipe
+ * pipe_fd, and should be spliced out of it.
+ * Return 0 to continue the transfer, or non-zero to abort it.
+ */
+typedef int (*SpliceSink)(void *arg, int pipe_fd, size_t length);
+
+
+/**
+ * Perform an HTTP query like http_query, but without buffering the
+ * response. The header is read into a fixed size buffer, then body bytes
+ * are passed to sink as they are read from the socket, so memory use does
+ * not depend on the size of the response.
+ *
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param page - e.g. /index.html
+ * @param range - Byte range e.g. 0-500. A server may not respect this, and
+ *                send the whole resource with a 200 instead. That body is
+ *                not passed to sink, which only expects the range, and 200
+ *                is returned. The Content-Range of a 206 is checked to lie
+ *                within the range, from its start.
+ * @param if_range - Validator sent as If-Range with the range, so that the
+ *                   server sends the whole resource (status 200) instead if
+ *                   it has changed; or NULL for none
+ * @param port - e.g. 80
+ * @param sink - Callback to pass body data to
+ * @param arg - Argument passed through to sink
+ * @return The HTTP status code of the response, or -1 on failure
+ *         (including sink aborting the transfer)
+ */
+int http_query_stream(char *host, char *page, const char *range,
+                      const char *if_range, int port, BodySink sink, void *arg);
+
+
+/**
+ * Perform a streaming HTTP query like http_query_stream, but move the body
+ * from the socket to splice_sink through a pipe, so that it never passes
+ * through user space. Body bytes read along with the header, and chunked
+ * bodies, which must be decoded, still go to sink.
+ *
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param page - e.g. /index.html
+ * @param range - Byte range e.g. 0-500. NOTE: A server may not respect this
+ * @param if_range - Validator to send as If-Range, or NULL for none
+ * @param port - e.g. 80
+ * @param resource - If not NULL, filled in from the response header
+ * @param sink - Callback to pass body data read into user space to
+ * @param splice_sink - Callback to pass the pipe holding body data to
+ * @param arg - Argument passed through to the sinks
+ * @return The HTTP status code of the response, or -1 on failure
+ *         (including a sink aborting the transfer)
+ */
+int http_query_splice(char *host, char *page, const char *range,
+                      const char *if_range, int port, HttpResource *resource,
+                      BodySink sink, SpliceSink splice_sink, void *arg);
+
+
 /**
  * Separate the content from the header of an http request.
  * NOTE: returned string is an offset into the response, so
@@ -47,6 +229,37 @@ char* http_get_content(Buffer *response);
 Buffer *http_url(const char *url, const char *range);
 
 
+/**
+ * Splits an HTTP url into host, page. On success, calls http_query_stream
+ * to stream the body of the url to sink.
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param range - The desired byte range of data to retrieve from the page
+ * @param if_range - Validator to send as If-Range, or NULL for none
+ * @param sink - Callback to pass body data to
+ * @param arg - Argument passed through to sink
+ * @return The HTTP status code of the response, or -1 on failure
+ */
+int http_url_stream(const char *url, const char *range, const char *if_range,
+                    BodySink sink, void *arg);
+
+
+/**
+ * Splits an HTTP url into host, page. On success, calls http_query_splice
+ * to move the body of the url to splice_sink.
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param range - The desired byte range of data to retrieve from the page
+ * @param if_range - Validator to send as If-Range, or NULL for none
+ * @param resource - If not NULL, filled in from the response header
+ * @param sink - Callback to pass body data read into user space to
+ * @param splice_sink - Callback to pass the pipe holding body data to
+ * @param arg - Argument passed through to the sinks
+ * @return The HTTP status code of the response, or -1 on failure
+ */
+int http_url_splice(const char *url, const char *range, const char *if_range,
+                    HttpResource *resource, BodySink sink,
+                    SpliceSink splice_sink, void *arg);
+
+
 /**
  * Free a buffer
  * @param buffer - Pointer to a buffer to free
@@ -63,12 +276,79 @@ inline static void buffer_free(Buffer *buffer) {
  * @param url   The URL of the resource to download
  * @param threads   The number of threads to be used for the download
  * @return int  The number of downloads needed satisfying maxByteSize
- *              to download the resource
+ *              to download the resource, or -1 if the length is unknown
  */
 int get_num_tasks(char *url, int threads);
 
-int max_chunk_size; // The maximum size in bytes of a chunk to download
 
-int get_max_chunk_size(void);
+/**
+ * Makes a HEAD request to a given URL and returns the content length.
+ * Unlike get_num_tasks, this does not touch any global state and reports
+ * failure to the caller rather than exiting, so it is safe to call from
+ * worker threads.
+ * @param url   The URL of the resource to probe
+ * @return The content length in bytes, or -1 on failure
+ */
+off_t http_content_length(const char *url);
+
+
+/**
+ * Makes a HEAD request to a given URL like http_content_length, also
+ * collecting whether it accepts ranges and its validators.
+ * @param url   The URL of the resource to probe
+ * @param cached   Validators of a cached copy of the resource, sent so that
+ *                 the server answers 304 if it is still current; or NULL
+ * @param resource   If not NULL, filled in from the response header, with
+ *                   its status -1 if there was no response
+ * @return The content length in bytes, or -1 on failure, including a 304
+ */
+off_t http_probe(const char *url, const HttpValidator *cached,
+                 HttpResource *resource);
+
+
+/**
+ * Chooses the validator to send as If-Range: the ETag if it is a strong
+ * one, otherwise Last-Modified.
+ * @param validator - The validators of a resource
+ * @return The value to send, or NULL if the resource has no usable one
+ */
+const char *http_if_range(const HttpValidator *validator);
+
+
+/**
+ * Perform a ranged GET like http_url_stream, also reporting the length of
+ * the whole resource and its validators from the response header. This
+ * lets the first chunk of a download double as its probe, instead of
+ * spending a round trip on a HEAD request.
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param range - The byte range of the first chunk e.g. 0-262143. A
+ *                server that ignores it sends the whole resource with a
+ *                200, whose body is passed to sink as well.
+ * @param cached - Validators of a cached copy of the resource, sent so that
+ *                 the server answers 304, with no body, if it is still
+ *                 current; or NULL
+ * @param resource - Filled in from the response header; its length is -1
+ *                   until the header has been read
+ * @param sink - Callback to pass body data to
+ * @param arg - Argument passed through to sink
+ * @return The HTTP status code of the response, or -1 on failure
+ *         (including sink aborting the transfer)
+ */
+int http_probe_range(const char *url, const char *range,
+                     const HttpValidator *cached, HttpResource *resource,
+                     BodySink sink, void *arg);
+
+/**
+ * Get the timings of the last query made by the calling thread, with any
+ * of the functions above. Each thread keeps its own, so instrumenting a
+ * query needs no extra argument.
+ * @param timing - Filled in with the timings
+ */
+void http_last_timing(HttpTiming *timing);
+
+
+extern off_t max_chunk_size; // The maximum size in bytes of a chunk to download
+
+off_t get_max_chunk_size(void);
 
 #endif
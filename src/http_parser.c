@@ -0,0 +1,377 @@
+#include "http_parser.h"
+
+#include <string.h>
+#include <strings.h>
+
+
+/**
+ * Reset a parser to the start of a response.
+ * @param parser - The parser to reset
+ */
+void http_parser_init(HttpParser *parser) {
+    parser->state = PARSE_STATUS_LINE;
+    parser->line_length = 0;
+    parser->close = 0;
+    parser->keep_alive = 0;
+
+    ResponseHead *head = &parser->head;
+    head->status = -1;
+    head->minor_version = 0;
+    head->keep_alive = 0;
+    head->content_length = -1;
+    head->chunked = 0;
+    head->range_start = -1;
+    head->range_end = -1;
+    head->range_total = -1;
+    head->accept_ranges = -1;
+    head->location[0] = '\0';
+    head->validator.etag[0] = '\0';
+    head->validator.last_modified[0] = '\0';
+}
+
+
+/**
+ * Parses a non-negative decimal number that is not NUL terminated.
+ * @return The number, or -1 if the text is empty, not a number, or too
+ *         large.
+ */
+static off_t parse_number(const char *text, size_t length) {
+    off_t number = 0;
+
+    if (length == 0 || length > 18) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < length; i++) {
+        if (text[i] < '0' || text[i] > '9') {
+            return -1;
+        }
+        number = number * 10 + (text[i] - '0');
+    }
+
+    return number;
+}
+
+
+/**
+ * Checks whether a comma separated list of tokens, e.g. the value of
+ * Connection, contains a token. Tokens are compared case insensitively.
+ * @param last - If non-zero, only the last token of the list is checked
+ */
+static int has_token(const char *value, size_t length, const char *token,
+                     int last) {
+    size_t token_length = strlen(token);
+    const char *end = value + length;
+    int found = 0;
+
+    while (value < end) {
+        const char *comma = memchr(value, ',', end - value);
+        const char *item_end = comma ? comma : end;
+
+        while (value < item_end && (*value == ' ' || *value == '\t')) {
+            ++value;
+        }
+        const char *trimmed = item_end;
+        while (trimmed > value && (trimmed[-1] == ' ' || trimmed[-1] == '\t')) {
+            --trimmed;
+        }
+
+        found = (size_t)(trimmed - value) == token_length &&
+                strncasecmp(value, token, token_length) == 0;
+        if (found && !last) {
+            return 1;
+        }
+
+        value = comma ? comma + 1 : end;
+    }
+
+    return found;
+}
+
+
+/**
+ * Copy a field's value into a NUL terminated buffer, or leave the buffer
+ * empty if the value is too long to be used.
+ */
+static void copy_value(const char *value, size_t length, char *copy,
+                       size_t size) {
+    copy[0] = '\0';
+    if (length < size) {
+        memcpy(copy, value, length);
+        copy[length] = '\0';
+    }
+}
+
+
+/**
+ * Parses the value of Content-Range, e.g. "bytes 0-499/1234". The fields
+ * are left at -1 where the value does not give them, or is malformed.
+ */
+static void parse_content_range(ResponseHead *head, const char *value,
+                                size_t length) {
+    const char *end = value + length;
+
+    if (length < 6 || strncasecmp(value, "bytes ", 6) != 0) {
+        return;
+    }
+    value += 6;
+
+    const char *slash = memchr(value, '/', end - value);
+    if (!slash) {
+        return;
+    }
+
+    off_t start = -1, last = -1;
+    if (!(slash - value == 1 && *value == '*')) {
+        const char *dash = memchr(value, '-', slash - value);
+        if (!dash) {
+            return;
+        }
+        start = parse_number(value, dash - value);
+        last = parse_number(dash + 1, slash - dash - 1);
+        if (start == -1 || last == -1 || last < start) {
+            return;
+        }
+    }
+
+    off_t total = -1;
+    if (!(end - slash == 2 && slash[1] == '*')) {
+        total = parse_number(slash + 1, end - slash - 1);
+        if (total == -1) {
+            return;
+        }
+    }
+
+    head->range_start = start;
+    head->range_end = last;
+    head->range_total = total;
+}
+
+
+/**
+ * Parses the status line, e.g. "HTTP/1.1 206 Partial Content".
+ * @return 0 on success, -1 if the status line is malformed
+ */
+static int parse_status_line(HttpParser *parser) {
+    const char *line = parser->line;
+    size_t length = parser->line_length;
+
+    if (length < 12 || strncmp(line, "HTTP/", 5) != 0 ||
+        line[5] < '0' || line[5] > '9' || line[6] != '.' ||
+        line[7] < '0' || line[7] > '9' || line[8] != ' ') {
+        return -1;
+    }
+
+    long status = parse_number(&line[9], 3);
+    if (status == -1 || (length > 12 && line[12] != ' ')) {
+        return -1;
+    }
+
+    parser->head.status = (int)status;
+    parser->head.minor_version = line[7] - '0';
+    return 0;
+}
+
+
+/**
+ * Parses a header field line, keeping the value of the fields in
+ * ResponseHead. Other fields are skipped.
+ * @return 0 on success, -1 if a field is malformed
+ */
+static int parse_field(HttpParser *parser) {
+    ResponseHead *head = &parser->head;
+    const char *line = parser->line;
+    size_t length = parser->line_length;
+
+    // Continuation lines of obsolete line folding are skipped
+    if (length == 0 || line[0] == ' ' || line[0] == '\t') {
+        return 0;
+    }
+
+    const char *colon = memchr(line, ':', length);
+    if (!colon) {
+        return 0;
+    }
+
+    const char *name = line;
+    size_t name_length = colon - line;
+    const char *value = colon + 1;
+    const char *value_end = line + length;
+
+    while (value < value_end && (*value == ' ' || *value == '\t')) {
+        ++value;
+    }
+    while (value_end > value && (value_end[-1] == ' ' ||
+           value_end[-1] == '\t')) {
+        --value_end;
+    }
+    size_t value_length = value_end - value;
+
+#define FIELD_IS(field) \
+        (name_length == sizeof(field) - 1 && \
+         strncasecmp(name, field, name_length) == 0)
+
+    if (FIELD_IS("Content-Length")) {
+        off_t content_length = parse_number(value, value_length);
+
+        // Differing lengths leave the framing of the body unknown
+        if (content_length == -1 || (head->content_length != -1 &&
+                                     head->content_length != content_length)) {
+            return -1;
+        }
+        head->content_length = content_length;
+    } else if (FIELD_IS("Transfer-Encoding")) {
+        head->chunked = has_token(value, value_length, "chunked", 1);
+    } else if (FIELD_IS("Connection")) {
+        parser->close |= has_token(value, value_length, "close", 0);
+        parser->keep_alive |= has_token(value, value_length, "keep-alive", 0);
+    } else if (FIELD_IS("Content-Range")) {
+        parse_content_range(head, value, value_length);
+    } else if (FIELD_IS("Accept-Ranges")) {
+        head->accept_ranges = has_token(value, value_length, "bytes", 0);
+    } else if (FIELD_IS("Location")) {
+        copy_value(value, value_length, head->location, HTTP_LOCATION_SIZE);
+    } else if (FIELD_IS("ETag")) {
+        copy_value(value, value_length, head->validator.etag,
+                   HTTP_VALIDATOR_SIZE);
+    } else if (FIELD_IS("Last-Modified")) {
+        copy_value(value, value_length, head->validator.last_modified,
+                   HTTP_VALIDATOR_SIZE);
+    }
+
+#undef FIELD_IS
+
+    return 0;
+}
+
+
+/**
+ * Handle a complete line of the header, without its line ending.
+ * @return 0 on success, -1 if the line is malformed
+ */
+static int parse_line(HttpParser *parser) {
+    if (parser->state == PARSE_STATUS_LINE) {
+        parser->state = PARSE_FIELDS;
+        return parse_status_line(parser);
+    }
+
+    if (parser->line_length > 0) {
+        return parse_field(parser);
+    }
+
+    // The blank line ends the header. HTTP/1.1 connections persist unless
+    // closed; HTTP/1.0 ones must opt in.
+    ResponseHead *head = &parser->head;
+    head->keep_alive = head->minor_version == 0 ? parser->keep_alive
+                                                : !parser->close;
+    parser->state = PARSE_DONE;
+    return 0;
+}
+
+
+/**
+ * Feeds bytes of a response through the parser. Parsing state is kept
+ * between calls, so the header may be split across reads at any point.
+ * Once parser->state is PARSE_DONE, parser->head holds the parsed fields.
+ *
+ * @param parser - The parser state
+ * @param data - Bytes of the response just read
+ * @param length - Number of bytes in data
+ * @return Number of bytes of data consumed (less than length only once the
+ *         end of the header has been reached, the rest being body), or -1
+ *         on a malformed header.
+ */
+ssize_t http_parser_feed(HttpParser *parser, const char *data, size_t length) {
+    size_t consumed = 0;
+
+    while (consumed < length && parser->state != PARSE_DONE) {
+        const char *start = &data[consumed];
+        const char *newline = memchr(start, '\n', length - consumed);
+        size_t take = newline ? (size_t)(newline - start)
+                              : length - consumed;
+
+        if (parser->line_length + take >= HTTP_LINE_SIZE) {
+            return -1;
+        }
+        memcpy(&parser->line[parser->line_length], start, take);
+        parser->line_length += take;
+        consumed += take;
+
+        if (!newline) {
+            break;
+        }
+        ++consumed;
+
+        // Lines end in CRLF, or a bare LF from lenient servers
+        if (parser->line_length > 0 &&
+            parser->line[parser->line_length - 1] == '\r') {
+            --parser->line_length;
+        }
+
+        if (parse_line(parser) == -1) {
+            return -1;
+        }
+        parser->line_length = 0;
+    }
+
+    return consumed;
+}
+
+
+/**
+ * Get the length of the whole resource a response header describes: the
+ * total of its Content-Range for a 206 or a 416 (range not satisfiable),
+ * or its Content-Length for a 200.
+ * @param head - The parsed response header
+ * @return The length in bytes, or -1 if the header doesn't give it
+ */
+off_t http_resource_length(const ResponseHead *head) {
+    if (head->status == 206 || head->status == 416) {
+        return head->range_total;
+    }
+    if (head->status == 200) {
+        return head->content_length;
+    }
+    return -1;
+}
+
+
+/**
+ * Copy what a response header tells about its resource.
+ * @param head - The parsed response header
+ * @param resource - Filled in with the status, the length of the whole
+ *                   resource, Accept-Ranges and the validators
+ */
+void http_get_resource(const ResponseHead *head, HttpResource *resource) {
+    resource->status = head->status;
+    resource->length = http_resource_length(head);
+    resource->accept_ranges = head->accept_ranges;
+    resource->validator = head->validator;
+}
+
+
+/**
+ * Check the Content-Range of a 206 against the range that was requested:
+ * it must start where the range starts and end no later than it does.
+ * @param head - The parsed response header
+ * @param range - The requested range e.g. 0-499, or 500- for the rest
+ * @return 1 if the Content-Range matches, 0 otherwise
+ */
+int http_range_matches(const ResponseHead *head, const char *range) {
+    const char *dash = strchr(range, '-');
+    if (!dash || head->range_start == -1) {
+        return 0;
+    }
+
+    off_t start = parse_number(range, dash - range);
+    if (start != head->range_start) {
+        return 0;
+    }
+
+    // An open ended range may be answered to the end of the resource
+    if (dash[1] == '\0') {
+        return 1;
+    }
+    off_t end = parse_number(dash + 1, strlen(dash + 1));
+    return end != -1 && head->range_end <= end;
+}
@@ -0,0 +1,114 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "http.h"
+
+// Longest header line the parser accepts
+#define HTTP_LINE_SIZE 8192
+
+// Size of the buffer holding the Location of a response
+#define HTTP_LOCATION_SIZE 1024
+
+
+// The fields of a response header that the downloader acts on
+typedef struct {
+    int status;          // HTTP status code
+    int minor_version;   // 0 for HTTP/1.0, 1 for HTTP/1.1
+    int keep_alive;      // the connection may carry another request
+
+    off_t content_length; // Content-Length, or -1 if not given
+    int chunked;         // Transfer-Encoding ends in chunked
+
+    // Content-Range: bytes range_start-range_end/range_total. The start and
+    // end are -1 if not given or unsatisfied (bytes */total), and the total
+    // is -1 if not given or unknown (bytes start-end/*)
+    off_t range_start;
+    off_t range_end;
+    off_t range_total;
+
+    int accept_ranges;   // Accept-Ranges: 1 for bytes, 0 for none, -1 if
+                         // not given
+
+    char location[HTTP_LOCATION_SIZE]; // Location, or empty if none
+    HttpValidator validator;           // ETag and Last-Modified
+} ResponseHead;
+
+
+// States of a response header parser
+typedef enum {
+    PARSE_STATUS_LINE, // reading the status line
+    PARSE_FIELDS,      // reading header fields
+    PARSE_DONE         // the blank line ending the header has been read
+} ParseState;
+
+
+/*
+ * HttpParser - parses a response header incrementally, as its bytes are
+ * read, one line at a time. Each byte is looked at once, and nothing past
+ * the blank line ending the header is consumed.
+ */
+typedef struct {
+    ParseState state;
+    char line[HTTP_LINE_SIZE];  // the line being read, without its CRLF
+    size_t line_length;
+    int close;                  // Connection: close was seen
+    int keep_alive;             // Connection: keep-alive was seen
+    ResponseHead head;          // the fields parsed so far
+} HttpParser;
+
+
+/**
+ * Reset a parser to the start of a response.
+ * @param parser - The parser to reset
+ */
+void http_parser_init(HttpParser *parser);
+
+
+/**
+ * Feeds bytes of a response through the parser. Parsing state is kept
+ * between calls, so the header may be split across reads at any point.
+ * Once parser->state is PARSE_DONE, parser->head holds the parsed fields.
+ *
+ * @param parser - The parser state
+ * @param data - Bytes of the response just read
+ * @param length - Number of bytes in data
+ * @return Number of bytes of data consumed (less than length only once the
+ *         end of the header has been reached, the rest being body), or -1
+ *         on a malformed header.
+ */
+ssize_t http_parser_feed(HttpParser *parser, const char *data, size_t length);
+
+
+/**
+ * Get the length of the whole resource a response header describes: the
+ * total of its Content-Range for a 206 or a 416 (range not satisfiable),
+ * or its Content-Length for a 200.
+ * @param head - The parsed response header
+ * @return The length in bytes, or -1 if the header doesn't give it
+ */
+off_t http_resource_length(const ResponseHead *head);
+
+
+/**
+ * Copy what a response header tells about its resource.
+ * @param head - The parsed response header
+ * @param resource - Filled in with the status, the length of the whole
+ *                   resource, Accept-Ranges and the validators
+ */
+void http_get_resource(const ResponseHead *head, HttpResource *resource);
+
+
+/**
+ * Check the Content-Range of a 206 against the range that was requested:
+ * it must start where the range starts and end no later than it does.
+ * @param head - The parsed response header
+ * @param range - The requested range e.g. 0-499, or 500- for the rest
+ * @return 1 if the Content-Range matches, 0 otherwise
+ */
+int http_range_matches(const ResponseHead *head, const char *range);
+
+
+#endif
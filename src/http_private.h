@@ -0,0 +1,163 @@
+#ifndef HTTP_PRIVATE_H
+#define HTTP_PRIVATE_H
+
+/*
+ * Building blocks of http.c shared with the event-driven engine, which
+ * speaks the same protocol over non-blocking sockets. Not part of the
+ * public http.h interface.
+ */
+
+#include <sys/types.h>
+
+#include "http.h"
+#include "http_parser.h"
+#include "pool.h"
+#include "dns.h"
+#include "limiter.h"
+
+
+// Seconds a connection attempt to one of a host's addresses is given
+// before the next address is tried alongside it, as in happy eyeballs
+#define HTTP_ATTEMPT_DELAY 0.25
+
+
+// States of a chunked transfer-encoding decoder
+typedef enum {
+    CHUNK_SIZE,     // reading a chunk size line
+    CHUNK_DATA,     // passing chunk data to the sink
+    CHUNK_DATA_END, // reading the CRLF after chunk data
+    CHUNK_TRAILER,  // reading trailer fields after the last chunk
+    CHUNK_DONE      // the blank line ending the body has been read
+} ChunkState;
+
+
+typedef struct {
+    ChunkState state;
+    size_t remaining;   // bytes left in the current chunk
+    size_t size;        // size parsed so far from a chunk size line
+    int digits;         // hex digits read on the current size line
+    int in_extension;   // past the size, in a chunk extension
+    size_t line_length; // characters on the current trailer line
+} ChunkDecoder;
+
+
+/**
+ * Reset a chunked transfer-encoding decoder to the start of a body.
+ * @param decoder - The decoder to reset
+ */
+void chunk_decoder_init(ChunkDecoder *decoder);
+
+
+/**
+ * Feeds bytes of a chunked body through the decoder, passing chunk data to
+ * sink. Decoding state is kept between calls, so the body may be split
+ * across reads at any point.
+ *
+ * @param decoder - The decoder state
+ * @param data - Bytes of the body just read
+ * @param length - Number of bytes in data
+ * @param sink - Callback to pass decoded body data to
+ * @param arg - Argument passed through to sink
+ * @return Number of bytes of data consumed (less than length only once the
+ *         end of the body has been reached), or -1 on a malformed body or
+ *         the sink aborting.
+ */
+ssize_t chunk_decode(ChunkDecoder *decoder, const char *data, size_t length,
+                     BodySink sink, void *arg);
+
+
+/**
+ * Format a request for the given page and byte range, using the version
+ * selected with http_set_version.
+ * @param request - Buffer to write the request into
+ * @param size - Size of the buffer
+ * @param method - The request method e.g. GET or HEAD
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param page - The page to request e.g. index.html
+ * @param range - Byte range e.g. 0-500, or empty string or NULL for none
+ * @param if_range - Validator to send as If-Range with the range, or NULL
+ * @param cached - Validators of a cached copy, sent as If-None-Match and
+ *                 If-Modified-Since so the server answers 304 if it is
+ *                 still current; or NULL for none
+ * @return Length of the request, or -1 if it does not fit
+ */
+int format_http_request(char *request, size_t size, const char *method,
+                        const char *host, const char *page, const char *range,
+                        const char *if_range, const HttpValidator *cached);
+
+
+/**
+ * Split a url into its host, port and page. A url starting with https://
+ * is fetched over TLS; one starting with http://, or with no scheme at all,
+ * over plain HTTP. The host may be followed by a port, e.g.
+ * https://example.com:8443/index.html, else the scheme's own is used. An
+ * IPv6 address is written in brackets, e.g. http://[::1]:8080/index.html,
+ * and copied into host without them.
+ * @param url - e.g. learn.canterbury.ac.nz/profile
+ * @param host - Buffer of host_size bytes to copy the url into; the host
+ *               part is left NUL terminated in it
+ * @param host_size - Size of the host buffer
+ * @param port - Set to the port to connect to
+ * @param secure - Set to 1 for https, 0 for plain HTTP
+ * @return Pointer to the page within host, or NULL if the url has no '/'
+ *         or a malformed port
+ */
+char *split_url(const char *url, char *host, size_t host_size, int *port,
+                int *secure);
+
+
+/**
+ * Resolve a host through the DNS cache shared by all queries.
+ * @return Number of addresses copied into addrs, or -1 on failure
+ */
+int http_resolve(const char *host, int port, DnsAddress *addrs, int max_addrs);
+
+
+/**
+ * Drop the shared DNS cache's addresses of a host after none of them could
+ * be connected to.
+ */
+void http_invalidate(const char *host, int port);
+
+
+/**
+ * Create a non-blocking stream socket for an address, tuned as selected
+ * with http_set_socket_options, and start connecting it.
+ * @param addr - The address to connect to
+ * @param done - Set to 1 if the connect completed at once, 0 if it is
+ *               still in progress
+ * @return The socket, or -1 on failure
+ */
+int http_open_socket(const DnsAddress *addr, int *done);
+
+
+/**
+ * Get the most seconds spent connecting to a server.
+ * @return The timeout, or 0 for no limit
+ */
+double http_connect_timeout(void);
+
+
+/**
+ * Get the keep-alive pool shared by all queries.
+ * @return The pool, or NULL unless HTTP_1_1 has been selected
+ */
+ConnectionPool *http_connection_pool(void);
+
+
+/**
+ * Get the limiter shared by all queries.
+ * @return The limiter, or NULL unless limits have been set with
+ *         http_set_limits
+ */
+Limiter *http_limiter(void);
+
+
+/**
+ * Get the time from a monotonic clock, for timing queries.
+ * @return The time in seconds
+ */
+double http_now(void);
+
+
+#endif
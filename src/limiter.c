@@ -0,0 +1,258 @@
+#include "limiter.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define HOST_SIZE 256
+
+// A bucket holds at most this many seconds' worth of bytes, the burst
+// allowed after reading has been idle
+#define BURST_SECONDS 0.25
+
+#define handle_error(msg) \
+        do { perror(msg); exit(EXIT_FAILURE); } while (0)
+
+
+// A token bucket filling at rate bytes per second, up to burst bytes
+typedef struct {
+    double rate;     // 0 for no limit
+    double burst;
+    double tokens;   // bytes that may be read now; negative when in debt
+    double updated;  // when tokens was last brought up to date
+} Bucket;
+
+
+// The limits of one host, created when it is first seen
+typedef struct Host {
+    char host[HOST_SIZE];
+    int port;
+    Bucket bucket;
+    int connections;       // slots in use
+    struct Host *next;
+} Host;
+
+
+/*
+ * Limiter - limits on reading from servers.
+ * Hosts are kept in a single list; a run talks to few of them.
+ */
+typedef struct LimiterStruct {
+    Bucket bucket;         // all hosts together
+    double host_rate;
+    int host_connections;
+    Host *hosts;
+    pthread_mutex_t mutex; // for mutual exclusion of accessing the buckets
+    pthread_cond_t freed;  // signalled when a connection slot is given back
+} Limiter;
+
+
+static double now_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+static void bucket_init(Bucket *bucket, double rate, double now) {
+    bucket->rate = rate;
+    bucket->burst = rate * BURST_SECONDS;
+    bucket->tokens = bucket->burst;
+    bucket->updated = now;
+}
+
+
+/**
+ * Take bytes from a bucket, after filling it for the time since it was
+ * last used.
+ * @return Seconds until the bucket is out of debt, 0 if it isn't in debt
+ */
+static double bucket_take(Bucket *bucket, size_t length, double now) {
+    if (bucket->rate <= 0) {
+        return 0;
+    }
+
+    bucket->tokens += (now - bucket->updated) * bucket->rate;
+    if (bucket->tokens > bucket->burst) {
+        bucket->tokens = bucket->burst;
+    }
+    bucket->updated = now;
+
+    bucket->tokens -= length;
+    return bucket->tokens < 0 ? -bucket->tokens / bucket->rate : 0;
+}
+
+
+/**
+ * Find the limits of a host, adding them if it hasn't been seen before.
+ * Call with the mutex held.
+ */
+static Host *find_host(Limiter *limiter, const char *host, int port) {
+    for (Host *entry = limiter->hosts; entry; entry = entry->next) {
+        if (entry->port == port && strcmp(entry->host, host) == 0) {
+            return entry;
+        }
+    }
+
+    Host *entry = malloc(sizeof(Host));
+    if (!entry) {
+        handle_error("malloc");
+    }
+
+    snprintf(entry->host, HOST_SIZE, "%s", host);
+    entry->port = port;
+    bucket_init(&entry->bucket, limiter->host_rate, now_seconds());
+    entry->connections = 0;
+    entry->next = limiter->hosts;
+    limiter->hosts = entry;
+
+    return entry;
+}
+
+
+/**
+ * Allocate a limiter
+ * @param rate - Most bytes per second read over all hosts, 0 for no limit
+ * @param host_rate - Most bytes per second read from each host, 0 for no
+ *                    limit
+ * @param host_connections - Most connections to each host in use at once,
+ *                           0 for no limit
+ * @return limiter - Pointer to the allocated limiter
+ */
+Limiter *limiter_alloc(double rate, double host_rate, int host_connections) {
+    Limiter *limiter = malloc(sizeof(Limiter));
+    if (!limiter) {
+        handle_error("malloc");
+    }
+
+    bucket_init(&limiter->bucket, rate, now_seconds());
+    limiter->host_rate = host_rate;
+    limiter->host_connections = host_connections;
+    limiter->hosts = NULL;
+
+    if (pthread_mutex_init(&limiter->mutex, NULL) != 0) {
+        handle_error("pthread_mutex_init");
+    }
+    if (pthread_cond_init(&limiter->freed, NULL) != 0) {
+        handle_error("pthread_cond_init");
+    }
+
+    return limiter;
+}
+
+
+/**
+ * Free a limiter
+ *
+ * Don't call this function while the limiter is still in use.
+ *
+ * @param limiter - Pointer to the limiter to free
+ */
+void limiter_free(Limiter *limiter) {
+    Host *entry = limiter->hosts;
+
+    while (entry) {
+        Host *next = entry->next;
+        free(entry);
+        entry = next;
+    }
+
+    pthread_cond_destroy(&limiter->freed);
+    pthread_mutex_destroy(&limiter->mutex);
+    free(limiter);
+}
+
+
+/**
+ * Take one of a host's connection slots, blocking until one is free.
+ * @param limiter - Pointer to the limiter
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param port - The port number e.g. 80
+ */
+void limiter_acquire(Limiter *limiter, const char *host, int port) {
+    pthread_mutex_lock(&limiter->mutex);
+    Host *entry = find_host(limiter, host, port);
+
+    while (limiter->host_connections > 0 &&
+           entry->connections >= limiter->host_connections) {
+        pthread_cond_wait(&limiter->freed, &limiter->mutex);
+    }
+    ++entry->connections;
+
+    pthread_mutex_unlock(&limiter->mutex);
+}
+
+
+/**
+ * Take one of a host's connection slots if one is free, without blocking.
+ * @param limiter - Pointer to the limiter
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param port - The port number e.g. 80
+ * @return 0 on success, -1 if the host is at its limit
+ */
+int limiter_try_acquire(Limiter *limiter, const char *host, int port) {
+    int rc = 0;
+
+    pthread_mutex_lock(&limiter->mutex);
+    Host *entry = find_host(limiter, host, port);
+
+    if (limiter->host_connections > 0 &&
+        entry->connections >= limiter->host_connections) {
+        rc = -1;
+    } else {
+        ++entry->connections;
+    }
+
+    pthread_mutex_unlock(&limiter->mutex);
+    return rc;
+}
+
+
+/**
+ * Give back a connection slot taken with limiter_acquire or
+ * limiter_try_acquire.
+ * @param limiter - Pointer to the limiter
+ * @param host - The host the slot was taken for
+ * @param port - The port the slot was taken for
+ */
+void limiter_release(Limiter *limiter, const char *host, int port) {
+    pthread_mutex_lock(&limiter->mutex);
+    Host *entry = find_host(limiter, host, port);
+    if (entry->connections > 0) {
+        --entry->connections;
+    }
+
+    // Waiters may be for any host
+    pthread_cond_broadcast(&limiter->freed);
+    pthread_mutex_unlock(&limiter->mutex);
+}
+
+
+/**
+ * Charge bytes just read from a host to the global and the host's buckets.
+ * @param limiter - Pointer to the limiter
+ * @param host - The host the bytes came from
+ * @param port - The port the bytes came from
+ * @param length - Number of bytes read
+ * @return Seconds to wait before reading more, 0 if reading can go on
+ */
+double limiter_consume(Limiter *limiter, const char *host, int port,
+                       size_t length) {
+    double now = now_seconds();
+
+    pthread_mutex_lock(&limiter->mutex);
+    double wait = bucket_take(&limiter->bucket, length, now);
+
+    if (limiter->host_rate > 0) {
+        Host *entry = find_host(limiter, host, port);
+        double host_wait = bucket_take(&entry->bucket, length, now);
+        if (host_wait > wait) {
+            wait = host_wait;
+        }
+    }
+    pthread_mutex_unlock(&limiter->mutex);
+
+    return wait;
+}
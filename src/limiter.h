@@ -0,0 +1,81 @@
+#ifndef LIMITER_H
+#define LIMITER_H
+
+#include <stddef.h>
+
+
+/*
+ * Limiter - thread-safe limits on how hard the servers are pushed: token
+ * buckets capping the bytes per second read over all hosts and from each
+ * host, and a cap on the connections to each host in use at once.
+ * Bytes are charged after they are read, so a bucket can go into debt;
+ * the reader then holds off until it is paid back.
+ * The implementation is hidden from the outside.
+ */
+typedef struct LimiterStruct Limiter;
+
+
+/**
+ * Allocate a limiter
+ * @param rate - Most bytes per second read over all hosts, 0 for no limit
+ * @param host_rate - Most bytes per second read from each host, 0 for no
+ *                    limit
+ * @param host_connections - Most connections to each host in use at once,
+ *                           0 for no limit
+ * @return limiter - Pointer to the allocated limiter
+ */
+Limiter *limiter_alloc(double rate, double host_rate, int host_connections);
+
+
+/**
+ * Free a limiter
+ *
+ * Don't call this function while the limiter is still in use.
+ *
+ * @param limiter - Pointer to the limiter to free
+ */
+void limiter_free(Limiter *limiter);
+
+
+/**
+ * Take one of a host's connection slots, blocking until one is free.
+ * @param limiter - Pointer to the limiter
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param port - The port number e.g. 80
+ */
+void limiter_acquire(Limiter *limiter, const char *host, int port);
+
+
+/**
+ * Take one of a host's connection slots if one is free, without blocking.
+ * @param limiter - Pointer to the limiter
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param port - The port number e.g. 80
+ * @return 0 on success, -1 if the host is at its limit
+ */
+int limiter_try_acquire(Limiter *limiter, const char *host, int port);
+
+
+/**
+ * Give back a connection slot taken with limiter_acquire or
+ * limiter_try_acquire.
+ * @param limiter - Pointer to the limiter
+ * @param host - The host the slot was taken for
+ * @param port - The port the slot was taken for
+ */
+void limiter_release(Limiter *limiter, const char *host, int port);
+
+
+/**
+ * Charge bytes just read from a host to the global and the host's buckets.
+ * @param limiter - Pointer to the limiter
+ * @param host - The host the bytes came from
+ * @param port - The port the bytes came from
+ * @param length - Number of bytes read
+ * @return Seconds to wait before reading more, 0 if reading can go on
+ */
+double limiter_consume(Limiter *limiter, const char *host, int port,
+                       size_t length);
+
+
+#endif
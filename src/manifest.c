@@ -0,0 +1,219 @@
+
+#include "manifest.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#define LINE_SIZE (MANIFEST_URL_SIZE + 16)
+
+#define handle_error(msg) \
+        do { perror(msg); exit(EXIT_FAILURE); } while (0)
+
+
+/**
+ * Start a manifest with no chunks
+ * @param manifest - The manifest to fill in
+ * @param url - The url being downloaded
+ * @param content_length - Length of the resource in bytes
+ * @param validator - Validators of the resource
+ */
+void manifest_init(Manifest *manifest, const char *url, off_t content_length,
+                   const HttpValidator *validator) {
+    snprintf(manifest->url, MANIFEST_URL_SIZE, "%s", url);
+    manifest->content_length = content_length;
+    manifest->validator = *validator;
+    manifest->chunks = NULL;
+    manifest->num_chunks = 0;
+    manifest->capacity = 0;
+}
+
+
+/**
+ * Free the chunks of a manifest
+ * @param manifest - The manifest to clear
+ */
+void manifest_clear(Manifest *manifest) {
+    free(manifest->chunks);
+    manifest->chunks = NULL;
+    manifest->num_chunks = 0;
+    manifest->capacity = 0;
+}
+
+
+/**
+ * Record a chunk in a manifest
+ * @param manifest - The manifest to add to
+ * @param offset - Start of the chunk in the destination
+ * @param length - Bytes in the chunk's range
+ * @param completed - Bytes of the range written to disk
+ */
+void manifest_add_chunk(Manifest *manifest, off_t offset, off_t length,
+                        off_t completed) {
+    if (manifest->num_chunks == manifest->capacity) {
+        manifest->capacity = manifest->capacity ? manifest->capacity * 2 : 8;
+        manifest->chunks = realloc(manifest->chunks,
+                                   manifest->capacity * sizeof(ManifestChunk));
+        if (!manifest->chunks) {
+            handle_error("realloc");
+        }
+    }
+
+    ManifestChunk *chunk = &manifest->chunks[manifest->num_chunks++];
+    chunk->offset = offset;
+    chunk->length = length;
+    chunk->completed = completed;
+}
+
+
+/**
+ * Write a manifest to a file. The file is replaced atomically, so a crash
+ * leaves either the old manifest or the new one.
+ *
+ * The format is one field per line, "name value", then one line per chunk:
+ *     url i.imgur.com/xlLjV00.jpg
+ *     length 146515
+ *     etag "5c3e-4f1"
+ *     last-modified Tue, 01 Jan 2019 00:00:00 GMT
+ *     chunk 0 65536 65536
+ *
+ * @param manifest - The manifest to write
+ * @param path - The file to write it to
+ * @return 0 on success, -1 on failure
+ */
+int manifest_save(const Manifest *manifest, const char *path) {
+    char temp_path[PATH_MAX];
+    if (snprintf(temp_path, PATH_MAX, "%s.tmp", path) >= PATH_MAX) {
+        fprintf(stderr, "manifest path too long: %s\n", path);
+        return -1;
+    }
+
+    FILE *file = fopen(temp_path, "w");
+    if (!file) {
+        perror("fopen");
+        return -1;
+    }
+
+    fprintf(file, "url %s\nlength %lld\netag %s\nlast-modified %s\n",
+            manifest->url, (long long)manifest->content_length,
+            manifest->validator.etag, manifest->validator.last_modified);
+
+    for (int i = 0; i < manifest->num_chunks; i++) {
+        const ManifestChunk *chunk = &manifest->chunks[i];
+        fprintf(file, "chunk %lld %lld %lld\n", (long long)chunk->offset,
+                (long long)chunk->length, (long long)chunk->completed);
+    }
+
+    if (fclose(file) != 0) {
+        perror("fclose");
+        remove(temp_path);
+        return -1;
+    }
+
+    if (rename(temp_path, path) != 0) {
+        perror("rename");
+        remove(temp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * If line starts with the field name followed by a space, copy the rest of
+ * the line (without its newline) into value.
+ * @return 1 if the line is that field, 0 otherwise
+ */
+static int read_field(const char *line, const char *name, char *value,
+                      size_t size) {
+    size_t name_length = strlen(name);
+    if (strncmp(line, name, name_length) != 0 || line[name_length] != ' ') {
+        return 0;
+    }
+
+    snprintf(value, size, "%s", line + name_length + 1);
+    value[strcspn(value, "\n")] = '\0';
+    return 1;
+}
+
+
+/**
+ * Read a manifest written by manifest_save
+ * @param manifest - Filled in from the file; clear it when done
+ * @param path - The file to read
+ * @return 0 on success, -1 if the file is missing or malformed
+ */
+int manifest_load(Manifest *manifest, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+
+    HttpValidator validator = { "", "" };
+    manifest_init(manifest, "", -1, &validator);
+
+    char line[LINE_SIZE];
+    char number[32];
+    int have_url = 0;
+
+    while (fgets(line, LINE_SIZE, file)) {
+        long long offset, length, completed;
+
+        if (read_field(line, "url", manifest->url, MANIFEST_URL_SIZE)) {
+            have_url = 1;
+        } else if (read_field(line, "length", number, sizeof(number))) {
+            manifest->content_length = strtoll(number, NULL, 10);
+        } else if (read_field(line, "etag", manifest->validator.etag,
+                              HTTP_VALIDATOR_SIZE) ||
+                   read_field(line, "last-modified",
+                              manifest->validator.last_modified,
+                              HTTP_VALIDATOR_SIZE)) {
+            continue;
+        } else if (sscanf(line, "chunk %lld %lld %lld", &offset, &length,
+                          &completed) == 3 && offset >= 0 &&
+                   completed >= 0 && completed <= length) {
+            manifest_add_chunk(manifest, offset, length, completed);
+        } else {
+            fprintf(stderr, "malformed manifest line in %s: %s", path, line);
+            fclose(file);
+            manifest_clear(manifest);
+            return -1;
+        }
+    }
+
+    fclose(file);
+
+    if (!have_url || manifest->content_length < 0) {
+        fprintf(stderr, "incomplete manifest: %s\n", path);
+        manifest_clear(manifest);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Check that a manifest describes the resource as it is now: the same url
+ * and length, and a matching ETag, or Last-Modified if either side has no
+ * ETag. A resource without validators never matches, since there is no way
+ * to tell whether it changed.
+ * @return 1 if the manifest can be resumed from, 0 otherwise
+ */
+int manifest_matches(const Manifest *manifest, const char *url,
+                     off_t content_length, const HttpValidator *validator) {
+    if (strcmp(manifest->url, url) != 0 ||
+        manifest->content_length != content_length) {
+        return 0;
+    }
+
+    if (manifest->validator.etag[0] && validator->etag[0]) {
+        return strcmp(manifest->validator.etag, validator->etag) == 0;
+    }
+
+    return manifest->validator.last_modified[0] &&
+           strcmp(manifest->validator.last_modified,
+                  validator->last_modified) == 0;
+}
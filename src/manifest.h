@@ -0,0 +1,94 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdlib.h>
+
+#include "http.h"
+
+// Longest url a manifest can record
+#define MANIFEST_URL_SIZE 1024
+
+
+// A chunk of a download and how much of it has reached the disk
+typedef struct {
+    off_t offset;     // start of the chunk in the destination
+    off_t length;     // bytes in the chunk's range
+    off_t completed;  // bytes from the start of the range written to disk
+} ManifestChunk;
+
+
+/*
+ * Manifest - the progress of a download, persisted next to its destination
+ * so that a later run can fetch only the missing bytes. The validators
+ * tell whether the resource is still the one the chunks came from.
+ */
+typedef struct {
+    char url[MANIFEST_URL_SIZE];
+    off_t content_length;
+    HttpValidator validator;
+    ManifestChunk *chunks;
+    int num_chunks;
+    int capacity;
+} Manifest;
+
+
+/**
+ * Start a manifest with no chunks
+ * @param manifest - The manifest to fill in
+ * @param url - The url being downloaded
+ * @param content_length - Length of the resource in bytes
+ * @param validator - Validators of the resource
+ */
+void manifest_init(Manifest *manifest, const char *url, off_t content_length,
+                   const HttpValidator *validator);
+
+
+/**
+ * Free the chunks of a manifest
+ * @param manifest - The manifest to clear
+ */
+void manifest_clear(Manifest *manifest);
+
+
+/**
+ * Record a chunk in a manifest
+ * @param manifest - The manifest to add to
+ * @param offset - Start of the chunk in the destination
+ * @param length - Bytes in the chunk's range
+ * @param completed - Bytes of the range written to disk
+ */
+void manifest_add_chunk(Manifest *manifest, off_t offset, off_t length,
+                        off_t completed);
+
+
+/**
+ * Write a manifest to a file. The file is replaced atomically, so a crash
+ * leaves either the old manifest or the new one.
+ * @param manifest - The manifest to write
+ * @param path - The file to write it to
+ * @return 0 on success, -1 on failure
+ */
+int manifest_save(const Manifest *manifest, const char *path);
+
+
+/**
+ * Read a manifest written by manifest_save
+ * @param manifest - Filled in from the file; clear it when done
+ * @param path - The file to read
+ * @return 0 on success, -1 if the file is missing or malformed
+ */
+int manifest_load(Manifest *manifest, const char *path);
+
+
+/**
+ * Check that a manifest describes the resource as it is now: the same url
+ * and length, and a matching ETag, or Last-Modified if either side has no
+ * ETag. A resource without validators never matches, since there is no way
+ * to tell whether it changed.
+ * @return 1 if the manifest can be resumed from, 0 otherwise
+ */
+int manifest_matches(const Manifest *manifest, const char *url,
+                     off_t content_length, const HttpValidator *validator);
+
+
+#endif
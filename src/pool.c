@@ -0,0 +1,219 @@
+
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define HOST_SIZE 256
+
+#define handle_error(msg) \
+        do { perror(msg); exit(EXIT_FAILURE); } while (0)
+
+
+// An idle socket waiting in the pool
+typedef struct Connection {
+    char host[HOST_SIZE];    // host the socket is connected to
+    int port;                // port the socket is connected to
+    int sock;                // the connected socket
+    Tls *tls;                // its TLS session, or NULL for plain HTTP
+    time_t idle_since;       // when the socket was returned to the pool
+    struct Connection *next;
+} Connection;
+
+
+/*
+ * ConnectionPool - a thread-safe pool of idle keep-alive sockets.
+ * Idle sockets are kept in a single list, most recently returned first, so
+ * checkout hands out the warmest socket for a host.
+ */
+typedef struct ConnectionPoolStruct {
+    Connection *idle;      // list of idle sockets, newest first
+    int max_idle;          // maximum idle sockets kept per host
+    int idle_timeout;      // seconds before an idle socket is stale
+    pthread_mutex_t mutex; // for mutual exclusion of accessing the list
+} ConnectionPool;
+
+
+/**
+ * Allocate a connection pool
+ * @param max_idle - The maximum number of idle sockets kept per host;
+ *                   sockets returned beyond this are closed
+ * @param idle_timeout - Seconds a socket may sit idle before it is
+ *                       considered stale and closed instead of reused
+ * @return pool - Pointer to the allocated pool
+ */
+ConnectionPool *pool_alloc(int max_idle, int idle_timeout) {
+    ConnectionPool *pool = malloc(sizeof(ConnectionPool));
+    if (!pool) {
+        handle_error("malloc");
+    }
+
+    pool->idle = NULL;
+    pool->max_idle = max_idle;
+    pool->idle_timeout = idle_timeout;
+
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0) {
+        handle_error("pthread_mutex_init");
+    }
+
+    return pool;
+}
+
+
+/**
+ * Close a socket that won't be reused, with its TLS session if it has one.
+ * @param notify - Non-zero to tell the server a TLS session is closing,
+ *                 while the connection is still healthy
+ */
+static void close_idle(int sock, Tls *tls, int notify) {
+    if (tls) {
+        tls_free(tls, notify);
+    }
+    close(sock);
+}
+
+
+/**
+ * Close every idle socket in the pool and free it
+ *
+ * Don't call this function while the pool is still in use.
+ *
+ * @param pool - Pointer to the pool to free
+ */
+void pool_free(ConnectionPool *pool) {
+    Connection *connection = pool->idle;
+
+    while (connection) {
+        Connection *next = connection->next;
+        close_idle(connection->sock, connection->tls, 1);
+        free(connection);
+        connection = next;
+    }
+
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+
+/**
+ * Checks whether an idle socket is still usable. A readable idle socket
+ * means the server has either closed it or sent data we did not ask for;
+ * neither can be reused. The same goes for data its TLS session holds.
+ * @param sock - The idle socket
+ * @param tls - Its TLS session, or NULL
+ * @return 1 if the socket can be reused, 0 otherwise
+ */
+static int connection_alive(int sock, Tls *tls) {
+    char byte;
+    ssize_t n = recv(sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+           !(tls && tls_pending(tls));
+}
+
+
+/**
+ * Take an idle socket connected to the given host and port out of the pool.
+ * Sockets the server has closed while idle are discarded. The caller owns
+ * the returned socket until it is given back with pool_checkin or closed.
+ *
+ * @param pool - Pointer to the pool
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param port - The port number e.g. 80
+ * @param tls - NULL to take a plain socket, or where to store the TLS
+ *              session of a socket carrying one, which the caller then
+ *              owns along with it
+ * @return A connected socket, or -1 if there is no idle socket for the host
+ */
+int pool_checkout(ConnectionPool *pool, const char *host, int port,
+                  Tls **tls) {
+    time_t now = time(NULL);
+    int sock = -1;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    Connection **link = &pool->idle;
+    while (*link && sock == -1) {
+        Connection *connection = *link;
+
+        if (connection->port != port || strcmp(connection->host, host) != 0 ||
+            !connection->tls != !tls) {
+            link = &connection->next;
+            continue;
+        }
+
+        // Matching host: unlink it, and either hand it out or drop it
+        *link = connection->next;
+
+        if (now - connection->idle_since <= pool->idle_timeout &&
+            connection_alive(connection->sock, connection->tls)) {
+            sock = connection->sock;
+            if (tls) {
+                *tls = connection->tls;
+            }
+        } else {
+            close_idle(connection->sock, connection->tls, 0);
+        }
+        free(connection);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    return sock;
+}
+
+
+/**
+ * Return a socket to the pool so later requests to the same host can reuse
+ * it. Only sockets whose last response was fully read and did not ask for
+ * the connection to be closed should be returned.
+ *
+ * @param pool - Pointer to the pool
+ * @param host - The host the socket is connected to
+ * @param port - The port the socket is connected to
+ * @param sock - The socket to return
+ * @param tls - The socket's TLS session, or NULL for a plain socket
+ */
+void pool_checkin(ConnectionPool *pool, const char *host, int port, int sock,
+                  Tls *tls) {
+    if (strlen(host) >= HOST_SIZE) {
+        close_idle(sock, tls, 1);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+
+    int count = 0;
+    for (Connection *c = pool->idle; c; c = c->next) {
+        if (c->port == port && strcmp(c->host, host) == 0) {
+            ++count;
+        }
+    }
+
+    if (count >= pool->max_idle) {
+        pthread_mutex_unlock(&pool->mutex);
+        close_idle(sock, tls, 1);
+        return;
+    }
+
+    Connection *connection = malloc(sizeof(Connection));
+    if (!connection) {
+        handle_error("malloc");
+    }
+
+    strcpy(connection->host, host);
+    connection->port = port;
+    connection->sock = sock;
+    connection->tls = tls;
+    connection->idle_since = time(NULL);
+    connection->next = pool->idle;
+    pool->idle = connection;
+
+    pthread_mutex_unlock(&pool->mutex);
+}
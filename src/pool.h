@@ -0,0 +1,72 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "tls.h"
+
+
+/*
+ * ConnectionPool - a thread-safe pool of idle keep-alive sockets, keyed by
+ * host and port. Worker threads check a socket out for the duration of one
+ * request and return it afterwards, so consecutive requests to the same host
+ * skip the TCP handshake and start on a warm congestion window. Sockets of
+ * https connections are kept along with their TLS sessions, and are only
+ * handed to requests that ask for one, so neither handshake is repeated.
+ * The implementation is hidden from the outside.
+ */
+typedef struct ConnectionPoolStruct ConnectionPool;
+
+
+/**
+ * Allocate a connection pool
+ * @param max_idle - The maximum number of idle sockets kept per host;
+ *                   sockets returned beyond this are closed
+ * @param idle_timeout - Seconds a socket may sit idle before it is
+ *                       considered stale and closed instead of reused
+ * @return pool - Pointer to the allocated pool
+ */
+ConnectionPool *pool_alloc(int max_idle, int idle_timeout);
+
+
+/**
+ * Close every idle socket in the pool and free it
+ *
+ * Don't call this function while the pool is still in use.
+ *
+ * @param pool - Pointer to the pool to free
+ */
+void pool_free(ConnectionPool *pool);
+
+
+/**
+ * Take an idle socket connected to the given host and port out of the pool.
+ * Sockets the server has closed while idle are discarded. The caller owns
+ * the returned socket until it is given back with pool_checkin or closed.
+ *
+ * @param pool - Pointer to the pool
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param port - The port number e.g. 80
+ * @param tls - NULL to take a plain socket, or where to store the TLS
+ *              session of a socket carrying one, which the caller then
+ *              owns along with it
+ * @return A connected socket, or -1 if there is no idle socket for the host
+ */
+int pool_checkout(ConnectionPool *pool, const char *host, int port,
+                  Tls **tls);
+
+
+/**
+ * Return a socket to the pool so later requests to the same host can reuse
+ * it. Only sockets whose last response was fully read and did not ask for
+ * the connection to be closed should be returned.
+ *
+ * @param pool - Pointer to the pool
+ * @param host - The host the socket is connected to
+ * @param port - The port the socket is connected to
+ * @param sock - The socket to return
+ * @param tls - The socket's TLS session, or NULL for a plain socket
+ */
+void pool_checkin(ConnectionPool *pool, const char *host, int port, int sock,
+                  Tls *tls);
+
+
+#endif
@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
 
 #define handle_error_en(en, msg) \
         do { errno = en; perror(msg); exit(EXIT_FAILURE); } while (0)
@@ -24,9 +25,18 @@ typedef struct QueueStruct {
     void** elements; // circular buffer of void*, each representing an element in the queue
     int read_index;  // index of the next element to be read
     int write_index; // index where the next element should be read from
+    int count;       // number of elements in the queue
+    int closed;      // queue_close has been called
     sem_t mutex;     // for mutual exclusion of accessing queue
     sem_t sem_read;  // number of elements available for reading
     sem_t sem_write; // number of elements for which there is space in the queue
+
+    long puts;         // items put, under mutex
+    long gets;         // items got, under mutex
+    long put_waits;    // blocked puts, and nanoseconds spent blocked in
+    long put_wait_ns;  // them; updated atomically
+    long get_waits;
+    long get_wait_ns;
 } Queue;
 
 
@@ -48,6 +58,14 @@ Queue *queue_alloc(int size) {
 
     queue->read_index = 0;
     queue->write_index = 0;
+    queue->count = 0;
+    queue->closed = 0;
+    queue->puts = 0;
+    queue->gets = 0;
+    queue->put_waits = 0;
+    queue->put_wait_ns = 0;
+    queue->get_waits = 0;
+    queue->get_wait_ns = 0;
 
     if (sem_init(&queue->mutex, 0, 1) != 0) {
         handle_error("sem_init mutex");
@@ -80,6 +98,107 @@ void queue_free(Queue *queue) {
 }
 
 
+static long elapsed_ns(const struct timespec *start,
+                       const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000000000L +
+           (end->tv_nsec - start->tv_nsec);
+}
+
+
+/**
+ * Take a token of a semaphore, blocking until there is one. A token that
+ * is already there is taken without reading the clock; otherwise the wait
+ * is counted, and its length added to wait_ns.
+ * @param sem - sem_read or sem_write
+ * @param waits - Counter of blocked waits
+ * @param wait_ns - Total nanoseconds spent blocked
+ */
+static void wait_token(sem_t *sem, long *waits, long *wait_ns) {
+    if (sem_trywait(sem) == 0) {
+        return;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    sem_wait(sem);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    __atomic_add_fetch(waits, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(wait_ns, elapsed_ns(&start, &end), __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Put items into the spaces whose sem_write tokens the caller holds.
+ * @param queue - Pointer to the queue
+ * @param items - The items to put
+ * @param tokens - Number of sem_write tokens held, and items to put
+ * @return Number of items put, or -1 if the queue has been closed
+ */
+static int put_held(Queue *queue, void **items, int tokens) {
+    sem_wait(&queue->mutex);
+
+    if (queue->closed) {
+        sem_post(&queue->mutex);
+
+        // Give the tokens back, so the next blocked producer wakes too
+        for (int i = 0; i < tokens; i++) {
+            sem_post(&queue->sem_write);
+        }
+        return -1;
+    }
+
+    for (int i = 0; i < tokens; i++) {
+        queue->elements[queue->write_index] = items[i];
+        queue->write_index = (queue->write_index + 1) % queue->size;
+    }
+    queue->count += tokens;
+    queue->puts += tokens;
+
+    sem_post(&queue->mutex);
+
+    for (int i = 0; i < tokens; i++) {
+        sem_post(&queue->sem_read);
+    }
+
+    return tokens;
+}
+
+
+/**
+ * Take items for the sem_read tokens the caller holds. Once the queue is
+ * closed there is one token more than there are items, so that every
+ * blocked consumer is woken in turn; a consumer holding it finds no item
+ * and passes it on.
+ * @param queue - Pointer to the queue
+ * @param items - Array to store the items in
+ * @param tokens - Number of sem_read tokens held, and capacity of items
+ * @return Number of items taken
+ */
+static int get_held(Queue *queue, void **items, int tokens) {
+    sem_wait(&queue->mutex);
+
+    int n = tokens < queue->count ? tokens : queue->count;
+    for (int i = 0; i < n; i++) {
+        items[i] = queue->elements[queue->read_index];
+        queue->read_index = (queue->read_index + 1) % queue->size;
+    }
+    queue->count -= n;
+    queue->gets += n;
+
+    sem_post(&queue->mutex);
+
+    for (int i = n; i < tokens; i++) {
+        sem_post(&queue->sem_read);
+    }
+    for (int i = 0; i < n; i++) {
+        sem_post(&queue->sem_write);
+    }
+
+    return n;
+}
+
+
 /**
  * Place an item into the concurrent queue.
  * If no space available then queue will block
@@ -90,16 +209,12 @@ void queue_free(Queue *queue) {
  * @param item - An item to add to queue. Uses void* to hold an arbitrary
  *               type. User's responsibility to manage memory and ensure
  *               it is correctly typed.
+ * @return 0 on success, -1 if the queue has been closed
  */
-void queue_put(Queue *queue, void *item) {
-    sem_wait(&queue->sem_write);
-    sem_wait(&queue->mutex);
-
-    queue->elements[queue->write_index] = item;
-    queue->write_index = (queue->write_index + 1) % queue->size;
+int queue_put(Queue *queue, void *item) {
+    wait_token(&queue->sem_write, &queue->put_waits, &queue->put_wait_ns);
 
-    sem_post(&queue->mutex);
-    sem_post(&queue->sem_read);
+    return put_held(queue, &item, 1) == 1 ? 0 : -1;
 }
 
 
@@ -115,15 +230,187 @@ void queue_put(Queue *queue, void *item) {
  *                arbitrary 
  */
 void *queue_get(Queue *queue) {
-    sem_wait(&queue->sem_read);
-    sem_wait(&queue->mutex);
+    wait_token(&queue->sem_read, &queue->get_waits, &queue->get_wait_ns);
+
+    void* item;
+    return get_held(queue, &item, 1) == 1 ? item : NULL;
+}
+
+
+/**
+ * Place several items into the concurrent queue at once.
+ * Blocks until there is space for at least one item, then puts as many of
+ * the items as fit, in order, under a single acquisition of the queue.
+ *
+ * @param queue - Pointer to the queue to add items to
+ * @param items - Array of items to add
+ * @param count - Number of items in the array
+ * @return The number of items put, from the front of items, or -1 if the
+ *         queue has been closed
+ */
+int queue_put_many(Queue *queue, void **items, int count) {
+    wait_token(&queue->sem_write, &queue->put_waits, &queue->put_wait_ns);
+
+    int tokens = 1;
+    while (tokens < count && sem_trywait(&queue->sem_write) == 0) {
+        ++tokens;
+    }
+
+    return put_held(queue, items, tokens);
+}
+
 
-    void* item = queue->elements[queue->read_index];
-    queue->read_index = (queue->read_index + 1) % queue->size;
+/**
+ * Get several items from the concurrent queue at once.
+ * Blocks until at least one item is available, then takes as many items
+ * as are available up to max_items under a single acquisition of the queue.
+ *
+ * @param queue - Pointer to the queue to get items from
+ * @param items - Array to store items in
+ * @param max_items - Capacity of the array
+ * @return The number of items stored in items, or 0 if the queue has been
+ *         closed and is empty
+ */
+int queue_get_many(Queue *queue, void **items, int max_items) {
+    wait_token(&queue->sem_read, &queue->get_waits, &queue->get_wait_ns);
+
+    int tokens = 1;
+    while (tokens < max_items && sem_trywait(&queue->sem_read) == 0) {
+        ++tokens;
+    }
+
+    return get_held(queue, items, tokens);
+}
+
+
+/**
+ * Place an item into the concurrent queue if there is space, without
+ * blocking.
+ *
+ * @param queue - Pointer to the queue to add an item to
+ * @param item - An item to add to queue
+ * @return 0 on success, -1 if the queue is full or has been closed
+ */
+int queue_try_put(Queue *queue, void *item) {
+    if (sem_trywait(&queue->sem_write) != 0) {
+        return -1;
+    }
+
+    return put_held(queue, &item, 1) == 1 ? 0 : -1;
+}
+
+
+/**
+ * Get an item from the concurrent queue if one is available, without
+ * blocking.
+ *
+ * @param queue - Pointer to queue to get item from
+ * @param item - Set to the item retrieved, or to NULL if the queue has been
+ *               closed and is empty
+ * @return 0 on success, -1 if the queue is empty
+ */
+int queue_try_get(Queue *queue, void **item) {
+    if (sem_trywait(&queue->sem_read) != 0) {
+        return -1;
+    }
+
+    if (get_held(queue, item, 1) == 0) {
+        *item = NULL;
+    }
+    return 0;
+}
+
+
+/**
+ * Get an item from the concurrent queue, blocking for at most timeout_ms
+ * milliseconds until one becomes available.
+ *
+ * @param queue - Pointer to queue to get item from
+ * @param item - Set to the item retrieved, or to NULL if the queue has been
+ *               closed and is empty
+ * @param timeout_ms - The longest time to wait in milliseconds
+ * @return 0 on success, -1 if no item arrived in time
+ */
+int queue_get_timed(Queue *queue, void **item, int timeout_ms) {
+    if (queue_try_get(queue, item) == 0) {
+        return 0;
+    }
+
+    struct timespec start, end, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    int rc = 0;
+    while (sem_timedwait(&queue->sem_read, &deadline) != 0) {
+        if (errno != EINTR) {
+            rc = -1;
+            break;
+        }
+    }
 
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    __atomic_add_fetch(&queue->get_waits, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&queue->get_wait_ns, elapsed_ns(&start, &end),
+                       __ATOMIC_RELAXED);
+    if (rc != 0) {
+        return -1;
+    }
+
+    if (get_held(queue, item, 1) == 0) {
+        *item = NULL;
+    }
+    return 0;
+}
+
+
+/**
+ * Close the concurrent queue, waking every thread blocked on it.
+ *
+ * Items already in the queue can still be retrieved; once it is empty,
+ * queue_get returns NULL instead of blocking. Putting into a closed queue
+ * fails. This lets consumers be shut down without one sentinel per thread.
+ *
+ * @param queue - Pointer to the queue to close
+ */
+void queue_close(Queue *queue) {
+    sem_wait(&queue->mutex);
+    int was_closed = queue->closed;
+    queue->closed = 1;
     sem_post(&queue->mutex);
-    sem_post(&queue->sem_write);
 
-    return item;
+    if (!was_closed) {
+        // One token each side; every thread woken by it passes it on
+        sem_post(&queue->sem_read);
+        sem_post(&queue->sem_write);
+    }
 }
 
+
+
+/**
+ * Get the counters of a queue. They are kept up to date as the queue is
+ * used, so may be read at any time, though not as one atomic snapshot.
+ * Only blocking costs any time to measure.
+ *
+ * @param queue - Pointer to the queue
+ * @param stats - Filled in with the counters
+ */
+void queue_stats(Queue *queue, QueueStats *stats) {
+    sem_wait(&queue->mutex);
+    stats->puts = queue->puts;
+    stats->gets = queue->gets;
+    sem_post(&queue->mutex);
+
+    stats->put_waits = __atomic_load_n(&queue->put_waits, __ATOMIC_RELAXED);
+    stats->get_waits = __atomic_load_n(&queue->get_waits, __ATOMIC_RELAXED);
+    stats->put_wait_time = __atomic_load_n(&queue->put_wait_ns,
+                                           __ATOMIC_RELAXED) / 1e9;
+    stats->get_wait_time = __atomic_load_n(&queue->get_wait_ns,
+                                           __ATOMIC_RELAXED) / 1e9;
+}
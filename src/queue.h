@@ -40,8 +40,9 @@ void queue_free(Queue *queue);
  * @param item - An item to add to queue. Uses void* to hold an arbitrary
  *               type. User's responsibility to manage memory and ensure
  *               it is correctly typed.
+ * @return 0 on success, -1 if the queue has been closed
  */
-void queue_put(Queue *queue, void *item);
+int queue_put(Queue *queue, void *item);
 
 
 /**
@@ -58,5 +59,106 @@ void queue_put(Queue *queue, void *item);
 void *queue_get(Queue *queue);
 
 
+/**
+ * Place several items into the concurrent queue at once.
+ * Blocks until there is space for at least one item, then puts as many of
+ * the items as fit, in order, under a single acquisition of the queue.
+ *
+ * @param queue - Pointer to the queue to add items to
+ * @param items - Array of items to add
+ * @param count - Number of items in the array
+ * @return The number of items put, from the front of items, or -1 if the
+ *         queue has been closed
+ */
+int queue_put_many(Queue *queue, void **items, int count);
+
+
+/**
+ * Get several items from the concurrent queue at once.
+ * Blocks until at least one item is available, then takes as many items
+ * as are available up to max_items under a single acquisition of the queue.
+ *
+ * @param queue - Pointer to the queue to get items from
+ * @param items - Array to store items in
+ * @param max_items - Capacity of the array
+ * @return The number of items stored in items, or 0 if the queue has been
+ *         closed and is empty
+ */
+int queue_get_many(Queue *queue, void **items, int max_items);
+
+
+/**
+ * Place an item into the concurrent queue if there is space, without
+ * blocking.
+ *
+ * @param queue - Pointer to the queue to add an item to
+ * @param item - An item to add to queue
+ * @return 0 on success, -1 if the queue is full or has been closed
+ */
+int queue_try_put(Queue *queue, void *item);
+
+
+/**
+ * Get an item from the concurrent queue if one is available, without
+ * blocking.
+ *
+ * @param queue - Pointer to queue to get item from
+ * @param item - Set to the item retrieved, or to NULL if the queue has been
+ *               closed and is empty
+ * @return 0 on success, -1 if the queue is empty
+ */
+int queue_try_get(Queue *queue, void **item);
+
+
+/**
+ * Get an item from the concurrent queue, blocking for at most timeout_ms
+ * milliseconds until one becomes available.
+ *
+ * @param queue - Pointer to queue to get item from
+ * @param item - Set to the item retrieved, or to NULL if the queue has been
+ *               closed and is empty
+ * @param timeout_ms - The longest time to wait in milliseconds
+ * @return 0 on success, -1 if no item arrived in time
+ */
+int queue_get_timed(Queue *queue, void **item, int timeout_ms);
+
+
+/*
+ * Counters of a queue's use, for instrumentation. A wait is a put that
+ * found the queue full, or a get that found it empty, and had to block.
+ */
+typedef struct {
+    long puts;             // items put
+    long gets;             // items got
+    long put_waits;        // puts that blocked for space
+    long get_waits;        // gets that blocked for an item
+    double put_wait_time;  // seconds spent blocked in puts
+    double get_wait_time;  // seconds spent blocked in gets
+} QueueStats;
+
+
+/**
+ * Get the counters of a queue. They are kept up to date as the queue is
+ * used, so may be read at any time, though not as one atomic snapshot.
+ * Only blocking costs any time to measure.
+ *
+ * @param queue - Pointer to the queue
+ * @param stats - Filled in with the counters
+ */
+void queue_stats(Queue *queue, QueueStats *stats);
+
+
+/**
+ * Close the concurrent queue, waking every thread blocked on it.
+ *
+ * Items already in the queue can still be retrieved; once it is empty,
+ * queue_get returns NULL instead of blocking. Putting into a closed queue
+ * fails. This lets consumers be shut down without one sentinel per thread.
+ *
+ * @param queue - Pointer to the queue to close
+ */
+void queue_close(Queue *queue);
+
+
 #endif
 
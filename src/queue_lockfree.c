@@ -0,0 +1,582 @@
+#define _GNU_SOURCE
+
+#include "queue.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define handle_error(msg) \
+        do { perror(msg); exit(EXIT_FAILURE); } while (0)
+
+#define CACHE_LINE 64
+
+// Attempts made with a busy wait before a thread parks on a futex. Only
+// used on multiprocessors: with one CPU the other side can't make progress
+// while we spin.
+#define SPIN_LIMIT 128
+
+
+// One element of the ring. sequence says whose turn the slot is: it equals
+// the position of the put that may fill it, or that position + 1 once the
+// item is ready for the get at that position.
+typedef struct {
+    size_t sequence;
+    void *item;
+} Slot;
+
+
+// Where blocked threads of one side park until the other side makes progress
+typedef struct {
+    unsigned int epoch;   // futex word, bumped on every wake
+    unsigned int waiters; // threads parked or about to park
+    char pad[CACHE_LINE - 2 * sizeof(unsigned int)];
+} WaitPoint;
+
+
+/*
+ * Queue - a bounded lock-free multi-producer multi-consumer ring buffer.
+ * Producers claim a position by advancing head and consumers by advancing
+ * tail, each with a single compare-and-swap; per-slot sequence numbers
+ * hand each slot back and forth between them. head and tail live on their
+ * own cache lines so producers and consumers don't contend for one line.
+ * The capacity is rounded up to a power of two so an index is a mask away
+ * from its position.
+ */
+typedef struct QueueStruct {
+    size_t head;             // position of the next put
+    char pad_head[CACHE_LINE - sizeof(size_t)];
+    size_t tail;             // position of the next get
+    char pad_tail[CACHE_LINE - sizeof(size_t)];
+    WaitPoint not_empty;     // consumers waiting for an item
+    WaitPoint not_full;      // producers waiting for space
+    size_t mask;             // capacity - 1
+    int spin_limit;          // busy wait attempts before parking
+    int closed;              // queue_close has been called
+    Slot *slots;
+
+    // Blocked puts and gets, and nanoseconds spent blocked in them, including
+    // the busy wait; updated atomically, off the fast path
+    long put_waits;
+    long put_wait_ns;
+    long get_waits;
+    long get_wait_ns;
+} Queue;
+
+
+/**
+ * Allocate a concurrent queue of a specific size
+ * @param size - The size of memory to allocate to the queue
+ *               (number of elements the queue can contain, rounded up to
+ *               a power of two)
+ * @return queue - Pointer to the allocated queue
+ */
+Queue *queue_alloc(int size) {
+    Queue *queue;
+    if (posix_memalign((void **)&queue, CACHE_LINE, sizeof(Queue)) != 0) {
+        handle_error("posix_memalign");
+    }
+
+    size_t capacity = 1;
+    while (capacity < (size_t)size) {
+        capacity <<= 1;
+    }
+
+    queue->slots = (Slot *)malloc(capacity * sizeof(Slot));
+    if (!queue->slots) {
+        handle_error("malloc");
+    }
+
+    for (size_t i = 0; i < capacity; i++) {
+        queue->slots[i].sequence = i;
+    }
+
+    queue->mask = capacity - 1;
+    queue->spin_limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_LIMIT : 0;
+    queue->head = 0;
+    queue->tail = 0;
+    queue->closed = 0;
+    queue->not_empty.epoch = 0;
+    queue->not_empty.waiters = 0;
+    queue->not_full.epoch = 0;
+    queue->not_full.waiters = 0;
+    queue->put_waits = 0;
+    queue->put_wait_ns = 0;
+    queue->get_waits = 0;
+    queue->get_wait_ns = 0;
+
+    return queue;
+}
+
+
+/**
+ * Free a concurrent queue and associated memory
+ *
+ * Don't call this function while the queue is still in use.
+ * (Note, this is a pre-condition to the function and does not need
+ * to be checked)
+ *
+ * @param queue - Pointer to the queue to free
+ */
+void queue_free(Queue *queue) {
+    free(queue->slots);
+    free(queue);
+}
+
+
+/**
+ * Count a put or get that had to wait, and add the time since it first
+ * found the queue full or empty.
+ * @param start - When the wait began
+ */
+static void count_wait(long *waits, long *wait_ns,
+                       const struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    __atomic_add_fetch(waits, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(wait_ns, (end.tv_sec - start->tv_sec) * 1000000000L +
+                                (end.tv_nsec - start->tv_nsec),
+                       __ATOMIC_RELAXED);
+}
+
+
+static void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ __volatile__("pause");
+#endif
+}
+
+
+/**
+ * Wake up to count threads parked on a wait point, if there are any.
+ * Called after count items or spaces have been published.
+ */
+static void wake(WaitPoint *point, int count) {
+    // Pairs with the fence taken by a thread about to park: either it sees
+    // what was just published, or we see it waiting
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&point->waiters, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+
+    __atomic_add_fetch(&point->epoch, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &point->epoch, FUTEX_WAKE_PRIVATE, count,
+            NULL, NULL, 0);
+}
+
+
+static int is_closed(Queue *queue) {
+    return __atomic_load_n(&queue->closed, __ATOMIC_ACQUIRE);
+}
+
+
+// Whether the slot at head looks free, so a put could succeed
+static int can_put(Queue *queue) {
+    size_t pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    Slot *slot = &queue->slots[pos & queue->mask];
+    return __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == pos;
+}
+
+
+// Whether the slot at tail looks filled, so a get could succeed
+static int can_get(Queue *queue) {
+    size_t pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    Slot *slot = &queue->slots[pos & queue->mask];
+    return __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == pos + 1;
+}
+
+
+/**
+ * Park the calling thread on a wait point until it is woken, unless the
+ * queue is closed or ready says the other side made progress since the
+ * caller last tried.
+ * @param queue - Pointer to the queue
+ * @param point - not_full or not_empty
+ * @param ready - can_put or can_get
+ * @param deadline - CLOCK_MONOTONIC time to give up at, or NULL for none
+ * @return 0 once the caller should try again, -1 if the deadline passed
+ */
+static int park(Queue *queue, WaitPoint *point, int (*ready)(Queue *),
+                const struct timespec *deadline) {
+    struct timespec timeout;
+    struct timespec *wait_for = NULL;
+
+    if (deadline) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        timeout.tv_sec = deadline->tv_sec - now.tv_sec;
+        timeout.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+        if (timeout.tv_nsec < 0) {
+            timeout.tv_sec -= 1;
+            timeout.tv_nsec += 1000000000L;
+        }
+        if (timeout.tv_sec < 0) {
+            return -1;
+        }
+        wait_for = &timeout;
+    }
+
+    __atomic_add_fetch(&point->waiters, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    unsigned int epoch = __atomic_load_n(&point->epoch, __ATOMIC_ACQUIRE);
+
+    int rc = 0;
+    if (!is_closed(queue) && !ready(queue)) {
+        if (syscall(SYS_futex, &point->epoch, FUTEX_WAIT_PRIVATE, epoch,
+                    wait_for, NULL, 0) == -1 && errno == ETIMEDOUT) {
+            rc = -1;
+        }
+    }
+
+    __atomic_sub_fetch(&point->waiters, 1, __ATOMIC_RELAXED);
+    return rc;
+}
+
+
+/**
+ * Try to put items without blocking. Claims as many consecutive free slots
+ * as there are items, up to count, with one compare-and-swap.
+ * @return Number of items put, 0 if the queue is full, or -1 if it has
+ *         been closed
+ */
+static int try_put_many(Queue *queue, void **items, int count) {
+    if (is_closed(queue)) {
+        return -1;
+    }
+
+    size_t pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+
+    for (;;) {
+        Slot *slot = &queue->slots[pos & queue->mask];
+        size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+        if (diff < 0) {
+            return 0;
+        }
+        if (diff > 0) {
+            // Another producer claimed pos
+            pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        // Consumers free slots out of order, so check each one
+        int n = 1;
+        while (n < count) {
+            slot = &queue->slots[(pos + n) & queue->mask];
+            if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos + n) {
+                break;
+            }
+            ++n;
+        }
+
+        if (__atomic_compare_exchange_n(&queue->head, &pos, pos + n, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            for (int i = 0; i < n; i++) {
+                slot = &queue->slots[(pos + i) & queue->mask];
+                slot->item = items[i];
+                __atomic_store_n(&slot->sequence, pos + i + 1,
+                                 __ATOMIC_RELEASE);
+            }
+            return n;
+        }
+        // pos was reloaded by the failed exchange
+    }
+}
+
+
+/**
+ * Try to get items without blocking. Claims as many consecutive filled
+ * slots as there are, up to max_items, with one compare-and-swap.
+ * @return Number of items stored in items, 0 if the queue is empty, or -1
+ *         if it is empty and has been closed
+ */
+static int try_get_many(Queue *queue, void **items, int max_items) {
+    // Read before looking, so items put before the queue was closed are seen
+    int closed = is_closed(queue);
+    size_t pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+
+    for (;;) {
+        Slot *slot = &queue->slots[pos & queue->mask];
+        size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+
+        if (diff < 0) {
+            return closed ? -1 : 0;
+        }
+        if (diff > 0) {
+            // Another consumer claimed pos
+            pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        // Producers fill slots out of order, so check each one
+        int n = 1;
+        while (n < max_items) {
+            slot = &queue->slots[(pos + n) & queue->mask];
+            if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) !=
+                pos + n + 1) {
+                break;
+            }
+            ++n;
+        }
+
+        if (__atomic_compare_exchange_n(&queue->tail, &pos, pos + n, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            for (int i = 0; i < n; i++) {
+                slot = &queue->slots[(pos + i) & queue->mask];
+                items[i] = slot->item;
+                __atomic_store_n(&slot->sequence, pos + i + queue->mask + 1,
+                                 __ATOMIC_RELEASE);
+            }
+            return n;
+        }
+    }
+}
+
+
+/**
+ * Place an item into the concurrent queue.
+ * If no space available then queue will block
+ * until a space is available when it will
+ * put the item into the queue and immediately return
+ *
+ * A blocked producer spins briefly before parking on a futex, so a short
+ * wait costs no system calls.
+ *
+ * @param queue - Pointer to the queue to add an item to
+ * @param item - An item to add to queue. Uses void* to hold an arbitrary
+ *               type. User's responsibility to manage memory and ensure
+ *               it is correctly typed.
+ * @return 0 on success, -1 if the queue has been closed
+ */
+int queue_put(Queue *queue, void *item) {
+    return queue_put_many(queue, &item, 1) == 1 ? 0 : -1;
+}
+
+
+/**
+ * Get an item from the concurrent queue
+ *
+ * If there is no item available then queue_get
+ * will block until an item becomes available when
+ * it will immediately return that item.
+ *
+ * @param queue - Pointer to queue to get item from
+ * @return item - item retrieved from queue. void* type since it can be
+ *                arbitrary
+ */
+void *queue_get(Queue *queue) {
+    void *item;
+    return queue_get_many(queue, &item, 1) == 1 ? item : NULL;
+}
+
+
+/**
+ * Place several items into the concurrent queue at once.
+ * Blocks until there is space for at least one item, then puts as many of
+ * the items as fit, in order, under a single acquisition of the queue.
+ *
+ * @param queue - Pointer to the queue to add items to
+ * @param items - Array of items to add
+ * @param count - Number of items in the array
+ * @return The number of items put, from the front of items, or -1 if the
+ *         queue has been closed
+ */
+int queue_put_many(Queue *queue, void **items, int count) {
+    struct timespec start;
+    int n, spin;
+
+    for (spin = 0; (n = try_put_many(queue, items, count)) == 0; spin++) {
+        if (spin == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+        if (spin < queue->spin_limit) {
+            cpu_relax();
+        } else {
+            park(queue, &queue->not_full, can_put, NULL);
+        }
+    }
+
+    if (spin > 0) {
+        count_wait(&queue->put_waits, &queue->put_wait_ns, &start);
+    }
+    if (n > 0) {
+        wake(&queue->not_empty, n);
+    }
+    return n;
+}
+
+
+/**
+ * Get several items from the concurrent queue at once.
+ * Blocks until at least one item is available, then takes as many items
+ * as are available up to max_items under a single acquisition of the queue.
+ *
+ * @param queue - Pointer to the queue to get items from
+ * @param items - Array to store items in
+ * @param max_items - Capacity of the array
+ * @return The number of items stored in items, or 0 if the queue has been
+ *         closed and is empty
+ */
+int queue_get_many(Queue *queue, void **items, int max_items) {
+    struct timespec start;
+    int n, spin;
+
+    for (spin = 0; (n = try_get_many(queue, items, max_items)) == 0; spin++) {
+        if (spin == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+        if (spin < queue->spin_limit) {
+            cpu_relax();
+        } else {
+            park(queue, &queue->not_empty, can_get, NULL);
+        }
+    }
+
+    if (spin > 0) {
+        count_wait(&queue->get_waits, &queue->get_wait_ns, &start);
+    }
+    if (n < 0) {
+        return 0;
+    }
+
+    wake(&queue->not_full, n);
+    return n;
+}
+
+
+/**
+ * Place an item into the concurrent queue if there is space, without
+ * blocking.
+ *
+ * @param queue - Pointer to the queue to add an item to
+ * @param item - An item to add to queue
+ * @return 0 on success, -1 if the queue is full or has been closed
+ */
+int queue_try_put(Queue *queue, void *item) {
+    if (try_put_many(queue, &item, 1) != 1) {
+        return -1;
+    }
+
+    wake(&queue->not_empty, 1);
+    return 0;
+}
+
+
+/**
+ * Get an item from the concurrent queue if one is available, without
+ * blocking.
+ *
+ * @param queue - Pointer to queue to get item from
+ * @param item - Set to the item retrieved, or to NULL if the queue has been
+ *               closed and is empty
+ * @return 0 on success, -1 if the queue is empty
+ */
+int queue_try_get(Queue *queue, void **item) {
+    int n = try_get_many(queue, item, 1);
+
+    if (n == 0) {
+        return -1;
+    }
+
+    if (n < 0) {
+        *item = NULL;
+    } else {
+        wake(&queue->not_full, 1);
+    }
+    return 0;
+}
+
+
+/**
+ * Get an item from the concurrent queue, blocking for at most timeout_ms
+ * milliseconds until one becomes available.
+ *
+ * @param queue - Pointer to queue to get item from
+ * @param item - Set to the item retrieved, or to NULL if the queue has been
+ *               closed and is empty
+ * @param timeout_ms - The longest time to wait in milliseconds
+ * @return 0 on success, -1 if no item arrived in time
+ */
+int queue_get_timed(Queue *queue, void **item, int timeout_ms) {
+    if (queue_try_get(queue, item) == 0) {
+        return 0;
+    }
+
+    struct timespec start, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deadline = start;
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    int rc = 0;
+    for (int spin = 0; queue_try_get(queue, item) != 0; spin++) {
+        if (spin < queue->spin_limit) {
+            cpu_relax();
+        } else if (park(queue, &queue->not_empty, can_get, &deadline) != 0) {
+            rc = queue_try_get(queue, item);
+            break;
+        }
+    }
+
+    count_wait(&queue->get_waits, &queue->get_wait_ns, &start);
+    return rc;
+}
+
+
+/**
+ * Close the concurrent queue, waking every thread blocked on it.
+ *
+ * Items already in the queue can still be retrieved; once it is empty,
+ * queue_get returns NULL instead of blocking. Putting into a closed queue
+ * fails. This lets consumers be shut down without one sentinel per thread.
+ *
+ * @param queue - Pointer to the queue to close
+ */
+void queue_close(Queue *queue) {
+    __atomic_store_n(&queue->closed, 1, __ATOMIC_SEQ_CST);
+
+    // A thread about to park rechecks closed after reading the epoch, so
+    // bumping it here catches those that have not reached the futex yet
+    WaitPoint *points[] = { &queue->not_empty, &queue->not_full };
+    for (int i = 0; i < 2; i++) {
+        __atomic_add_fetch(&points[i]->epoch, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &points[i]->epoch, FUTEX_WAKE_PRIVATE, INT_MAX,
+                NULL, NULL, 0);
+    }
+}
+
+
+/**
+ * Get the counters of a queue. They are kept up to date as the queue is
+ * used, so may be read at any time, though not as one atomic snapshot.
+ * Only blocking costs any time to measure.
+ *
+ * The positions of head and tail count every put and get, so no counter
+ * is touched on the fast path.
+ *
+ * @param queue - Pointer to the queue
+ * @param stats - Filled in with the counters
+ */
+void queue_stats(Queue *queue, QueueStats *stats) {
+    stats->puts = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    stats->gets = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    stats->put_waits = __atomic_load_n(&queue->put_waits, __ATOMIC_RELAXED);
+    stats->get_waits = __atomic_load_n(&queue->get_waits, __ATOMIC_RELAXED);
+    stats->put_wait_time = __atomic_load_n(&queue->put_wait_ns,
+                                           __ATOMIC_RELAXED) / 1e9;
+    stats->get_wait_time = __atomic_load_n(&queue->get_wait_ns,
+                                           __ATOMIC_RELAXED) / 1e9;
+}
@@ -0,0 +1,352 @@
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define handle_error(msg) \
+        do { perror(msg); exit(EXIT_FAILURE); } while (0)
+
+#define MEGABYTE (1024.0 * 1024.0)
+
+
+// A finished download, kept for the summary
+typedef struct {
+    char *url;
+    char *error;    // why it failed, NULL if it succeeded
+    off_t length;   // of the resource, -1 if unknown
+    double seconds;
+    RequestTotals totals;
+} DownloadReport;
+
+
+// The requests run by one worker
+typedef struct {
+    int slots;             // most requests run at once
+    RequestTotals totals;
+} WorkerReport;
+
+
+typedef struct StatsStruct {
+    struct timespec started;   // when the run began
+    RequestTotals totals;      // every request
+
+    WorkerReport *workers;
+    int num_workers;
+
+    DownloadReport *downloads;
+    int num_downloads;
+    int capacity;
+    int num_ok;                // downloads that succeeded
+
+    double last_progress;      // seconds into the run of the last line
+    long long last_bytes;      // bytes at the last line
+} Stats;
+
+
+/**
+ * Add a request to a set of totals.
+ * @param totals - The totals to add to
+ * @param timing - Where the time of the request went
+ * @param bytes - Body bytes of the request that were kept
+ */
+void totals_add(RequestTotals *totals, const HttpTiming *timing,
+                long long bytes) {
+    ++totals->requests;
+    totals->bytes += bytes;
+    totals->read += timing->bytes;
+    totals->dns += timing->dns;
+    totals->connect += timing->connect;
+    totals->tls += timing->tls;
+    totals->handshakes += timing->tls > 0;
+    totals->resumed += timing->resumed;
+    totals->first_byte += timing->first_byte;
+    totals->transfer += timing->transfer;
+}
+
+
+/**
+ * Get the seconds since the run began.
+ */
+static double elapsed(Stats *stats) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - stats->started.tv_sec) +
+           (now.tv_nsec - stats->started.tv_nsec) / 1e9;
+}
+
+
+/**
+ * Allocate the stats of a run, which starts its clock
+ * @param num_workers - Number of workers: threads, or engines
+ * @param slots - For each worker, the most requests it runs at once
+ * @return stats - Pointer to the allocated stats
+ */
+Stats *stats_alloc(int num_workers, const int *slots) {
+    Stats *stats = calloc(1, sizeof(Stats));
+    if (!stats) {
+        handle_error("calloc");
+    }
+
+    stats->workers = calloc(num_workers, sizeof(WorkerReport));
+    if (!stats->workers) {
+        handle_error("calloc");
+    }
+    for (int i = 0; i < num_workers; i++) {
+        stats->workers[i].slots = slots[i];
+    }
+    stats->num_workers = num_workers;
+
+    clock_gettime(CLOCK_MONOTONIC, &stats->started);
+    return stats;
+}
+
+
+/**
+ * Free the stats of a run
+ * @param stats - Pointer to the stats to free
+ */
+void stats_free(Stats *stats) {
+    for (int i = 0; i < stats->num_downloads; i++) {
+        free(stats->downloads[i].url);
+        free(stats->downloads[i].error);
+    }
+    free(stats->downloads);
+    free(stats->workers);
+    free(stats);
+}
+
+
+/**
+ * Record a finished request.
+ * @param stats - Pointer to the stats
+ * @param worker - Index of the worker that ran the request
+ * @param timing - Where the time of the request went
+ * @param bytes - Body bytes of the request that were kept
+ */
+void stats_request(Stats *stats, int worker, const HttpTiming *timing,
+                   long long bytes) {
+    totals_add(&stats->totals, timing, bytes);
+    if (worker >= 0 && worker < stats->num_workers) {
+        totals_add(&stats->workers[worker].totals, timing, bytes);
+    }
+}
+
+
+/**
+ * Record a finished download, successful or not.
+ * @param stats - Pointer to the stats
+ * @param url - The url downloaded
+ * @param error - Why the download failed, or NULL if the whole resource
+ *                was downloaded
+ * @param length - Length of the resource, or -1 if unknown
+ * @param seconds - Time from the download starting to finishing
+ * @param totals - The download's requests
+ */
+void stats_download(Stats *stats, const char *url, const char *error,
+                    off_t length, double seconds,
+                    const RequestTotals *totals) {
+    if (stats->num_downloads == stats->capacity) {
+        stats->capacity = stats->capacity ? stats->capacity * 2 : 16;
+        stats->downloads = realloc(stats->downloads,
+                                   stats->capacity * sizeof(DownloadReport));
+        if (!stats->downloads) {
+            handle_error("realloc");
+        }
+    }
+
+    DownloadReport *report = &stats->downloads[stats->num_downloads++];
+    report->url = strdup(url);
+    if (!report->url) {
+        handle_error("strdup");
+    }
+    report->error = NULL;
+    if (error) {
+        report->error = strdup(error);
+        if (!report->error) {
+            handle_error("strdup");
+        }
+    }
+    report->length = length;
+    report->seconds = seconds;
+    report->totals = *totals;
+
+    stats->num_ok += !error;
+}
+
+
+/**
+ * Print a line of progress: downloads finished and active, bytes so far,
+ * and the rate since the last progress line.
+ * @param stats - Pointer to the stats
+ * @param out - The stream to print to, e.g. stderr
+ * @param in_flight - Body bytes kept by requests still in flight
+ * @param active - Number of downloads in progress
+ */
+void stats_progress(Stats *stats, FILE *out, long long in_flight,
+                    int active) {
+    double now = elapsed(stats);
+    long long bytes = stats->totals.bytes + in_flight;
+
+    double interval = now - stats->last_progress;
+    double rate = interval > 0 ? (bytes - stats->last_bytes) / interval : 0;
+
+    fprintf(out, "progress: %.1f s, %d done, %d failed, %d active, "
+                 "%.1f MB, %.1f MB/s\n", now, stats->num_ok,
+            stats->num_downloads - stats->num_ok, active, bytes / MEGABYTE,
+            rate / MEGABYTE);
+
+    stats->last_progress = now;
+    stats->last_bytes = bytes;
+}
+
+
+/**
+ * Print the downloads that failed, one per line with the reason, after a
+ * line counting them. Prints nothing if none failed.
+ * @param stats - Pointer to the stats
+ * @param out - The stream to print to, e.g. stderr
+ */
+void stats_report_failures(Stats *stats, FILE *out) {
+    int failed = stats->num_downloads - stats->num_ok;
+    if (failed == 0) {
+        return;
+    }
+
+    fprintf(out, "%d of %d downloads failed:\n", failed, stats->num_downloads);
+    for (int i = 0; i < stats->num_downloads; i++) {
+        DownloadReport *report = &stats->downloads[i];
+        if (report->error) {
+            fprintf(out, "  %s: %s\n", report->url, report->error);
+        }
+    }
+}
+
+
+/**
+ * Write a string as a JSON string literal, escaping what must be escaped.
+ */
+static void write_json_string(FILE *file, const char *string) {
+    fputc('"', file);
+    for (const unsigned char *c = (const unsigned char *)string; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(file, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(file, "\\u%04x", *c);
+        } else {
+            fputc(*c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+
+/**
+ * Get the seconds a set of requests spent on the wire.
+ */
+static double worker_busy(const RequestTotals *totals) {
+    return totals->dns + totals->connect + totals->tls + totals->first_byte +
+           totals->transfer;
+}
+
+
+static void write_totals(FILE *file, const RequestTotals *totals) {
+    fprintf(file, "{\"count\": %d, \"bytes\": %lld, \"read\": %lld, "
+                  "\"dns\": %.6f, \"connect\": %.6f, \"tls\": %.6f, "
+                  "\"handshakes\": %d, \"resumed\": %d, "
+                  "\"first_byte\": %.6f, \"transfer\": %.6f}",
+            totals->requests, totals->bytes, totals->read, totals->dns,
+            totals->connect, totals->tls, totals->handshakes,
+            totals->resumed, totals->first_byte, totals->transfer);
+}
+
+
+static void write_queue(FILE *file, const QueueStats *queue) {
+    fprintf(file, "{\"puts\": %ld, \"gets\": %ld, \"put_waits\": %ld, "
+                  "\"put_wait\": %.6f, \"get_waits\": %ld, "
+                  "\"get_wait\": %.6f}",
+            queue->puts, queue->gets, queue->put_waits, queue->put_wait_time,
+            queue->get_waits, queue->get_wait_time);
+}
+
+
+/**
+ * Write the summary of the run as JSON: totals and throughput, each
+ * download, each worker with its utilisation, and the work queues.
+ * @param stats - Pointer to the stats
+ * @param path - The file to write
+ * @param todo - Counters of the queue tasks are handed to workers on
+ * @param done - Counters of the queue results come back on
+ * @return 0 on success, -1 on failure
+ */
+int stats_write_json(Stats *stats, const char *path, const QueueStats *todo,
+                     const QueueStats *done) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        perror("fopen");
+        return -1;
+    }
+
+    double seconds = elapsed(stats);
+
+    fprintf(file, "{\n  \"elapsed\": %.6f,\n  \"bytes\": %lld,\n"
+                  "  \"mb_per_s\": %.3f,\n",
+            seconds, stats->totals.bytes,
+            seconds > 0 ? stats->totals.bytes / MEGABYTE / seconds : 0.0);
+    fprintf(file, "  \"completed\": %d,\n  \"failed\": %d,\n",
+            stats->num_ok, stats->num_downloads - stats->num_ok);
+    fprintf(file, "  \"requests\": ");
+    write_totals(file, &stats->totals);
+
+    fprintf(file, ",\n  \"downloads\": [");
+    for (int i = 0; i < stats->num_downloads; i++) {
+        DownloadReport *report = &stats->downloads[i];
+        double rate = report->seconds > 0 ?
+                      report->totals.bytes / MEGABYTE / report->seconds : 0;
+
+        fprintf(file, "%s\n    {\"url\": ", i ? "," : "");
+        write_json_string(file, report->url);
+        fprintf(file, ", \"ok\": %s, \"error\": ",
+                report->error ? "false" : "true");
+        if (report->error) {
+            write_json_string(file, report->error);
+        } else {
+            fprintf(file, "null");
+        }
+        fprintf(file, ", \"length\": %lld, \"seconds\": %.6f, "
+                      "\"mb_per_s\": %.3f,\n     \"requests\": ",
+                (long long)report->length, report->seconds, rate);
+        write_totals(file, &report->totals);
+        fprintf(file, "}");
+    }
+    fprintf(file, "%s],\n", stats->num_downloads ? "\n  " : "");
+
+    // A worker is fully utilised when all of its slots always have a
+    // request on the wire
+    fprintf(file, "  \"workers\": [");
+    for (int i = 0; i < stats->num_workers; i++) {
+        WorkerReport *worker = &stats->workers[i];
+        double capacity = seconds * worker->slots;
+        double busy = worker_busy(&worker->totals);
+
+        fprintf(file, "%s\n    {\"id\": %d, \"slots\": %d, "
+                      "\"utilization\": %.4f,\n     \"requests\": ",
+                i ? "," : "", i, worker->slots,
+                capacity > 0 ? busy / capacity : 0.0);
+        write_totals(file, &worker->totals);
+        fprintf(file, "}");
+    }
+    fprintf(file, "%s],\n", stats->num_workers ? "\n  " : "");
+
+    fprintf(file, "  \"queues\": {\n    \"todo\": ");
+    write_queue(file, todo);
+    fprintf(file, ",\n    \"done\": ");
+    write_queue(file, done);
+    fprintf(file, "\n  }\n}\n");
+
+    if (fclose(file) != 0) {
+        perror("fclose");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,120 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+#include "http.h"
+#include "queue.h"
+
+
+// Sums over a set of requests of where their time went
+typedef struct {
+    int requests;
+    long long bytes;    // body bytes kept, i.e. written to disk
+    long long read;     // response bytes read from sockets, headers too
+    double dns;         // seconds resolving hosts
+    double connect;     // seconds connecting
+    double tls;         // seconds in TLS handshakes
+    int handshakes;     // TLS handshakes of new https connections
+    int resumed;        // of those, the ones that resumed a session
+    double first_byte;  // seconds waiting for the first byte of responses
+    double transfer;    // seconds receiving responses
+} RequestTotals;
+
+
+/**
+ * Add a request to a set of totals.
+ * @param totals - The totals to add to
+ * @param timing - Where the time of the request went
+ * @param bytes - Body bytes of the request that were kept
+ */
+void totals_add(RequestTotals *totals, const HttpTiming *timing,
+                long long bytes);
+
+
+/*
+ * Stats - counters and timings of a run of the downloader, per worker and
+ * per download, reported as a progress line while it runs and written as
+ * a JSON summary at the end. Only updated from one thread.
+ * The implementation is hidden from the outside.
+ */
+typedef struct StatsStruct Stats;
+
+
+/**
+ * Allocate the stats of a run, which starts its clock
+ * @param num_workers - Number of workers: threads, or engines
+ * @param slots - For each worker, the most requests it runs at once
+ * @return stats - Pointer to the allocated stats
+ */
+Stats *stats_alloc(int num_workers, const int *slots);
+
+
+/**
+ * Free the stats of a run
+ * @param stats - Pointer to the stats to free
+ */
+void stats_free(Stats *stats);
+
+
+/**
+ * Record a finished request.
+ * @param stats - Pointer to the stats
+ * @param worker - Index of the worker that ran the request
+ * @param timing - Where the time of the request went
+ * @param bytes - Body bytes of the request that were kept
+ */
+void stats_request(Stats *stats, int worker, const HttpTiming *timing,
+                   long long bytes);
+
+
+/**
+ * Record a finished download, successful or not.
+ * @param stats - Pointer to the stats
+ * @param url - The url downloaded
+ * @param error - Why the download failed, or NULL if the whole resource
+ *                was downloaded
+ * @param length - Length of the resource, or -1 if unknown
+ * @param seconds - Time from the download starting to finishing
+ * @param totals - The download's requests
+ */
+void stats_download(Stats *stats, const char *url, const char *error,
+                    off_t length, double seconds,
+                    const RequestTotals *totals);
+
+
+/**
+ * Print a line of progress: downloads finished and active, bytes so far,
+ * and the rate since the last progress line.
+ * @param stats - Pointer to the stats
+ * @param out - The stream to print to, e.g. stderr
+ * @param in_flight - Body bytes kept by requests still in flight
+ * @param active - Number of downloads in progress
+ */
+void stats_progress(Stats *stats, FILE *out, long long in_flight,
+                    int active);
+
+
+/**
+ * Print the downloads that failed, one per line with the reason, after a
+ * line counting them. Prints nothing if none failed.
+ * @param stats - Pointer to the stats
+ * @param out - The stream to print to, e.g. stderr
+ */
+void stats_report_failures(Stats *stats, FILE *out);
+
+
+/**
+ * Write the summary of the run as JSON: totals and throughput, each
+ * download, each worker with its utilisation, and the work queues.
+ * @param stats - Pointer to the stats
+ * @param path - The file to write
+ * @param todo - Counters of the queue tasks are handed to workers on
+ * @param done - Counters of the queue results come back on
+ * @return 0 on success, -1 on failure
+ */
+int stats_write_json(Stats *stats, const char *path, const QueueStats *todo,
+                     const QueueStats *done);
+
+
+#endif
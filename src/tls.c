@@ -0,0 +1,501 @@
+#include "tls.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#define KEY_SIZE 300
+
+#define handle_error(msg) \
+        do { perror(msg); exit(EXIT_FAILURE); } while (0)
+
+#define handle_tls_error(msg) \
+        do { fprintf(stderr, "%s\n", msg); ERR_print_errors_fp(stderr); \
+             exit(EXIT_FAILURE); } while (0)
+
+
+// The last resumable session of a host and port
+typedef struct CachedSession {
+    char key[KEY_SIZE];      // host:port
+    SSL_SESSION *session;    // holds a reference
+    struct CachedSession *next;
+} CachedSession;
+
+
+/*
+ * Tls - a TLS client session over a connected socket.
+ * The session reads and writes its socket through a BIO of its own rather
+ * than OpenSSL's socket BIO, which writes with write(): a server closing
+ * the connection would raise SIGPIPE in whatever thread was sending.
+ */
+typedef struct TlsStruct {
+    SSL *ssl;
+    int sock;
+    int want_write;          // the last call had to wait to write
+    int eof;                 // the server has closed the socket
+    char key[KEY_SIZE];      // host:port, that its session is cached under
+} Tls;
+
+
+static SSL_CTX *context = NULL;
+static BIO_METHOD *socket_method = NULL;
+static pthread_once_t context_once = PTHREAD_ONCE_INIT;
+
+// Whether tls_set_ca_file chose the trusted certificates; otherwise the
+// system's are loaded as the first connection is opened
+static int custom_trust = 0;
+static pthread_once_t trust_once = PTHREAD_ONCE_INIT;
+
+static CachedSession *sessions = NULL;
+static pthread_mutex_t sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Send bytes of a session's records, without raising SIGPIPE.
+ */
+static int socket_write(BIO *bio, const char *data, int length) {
+    Tls *tls = BIO_get_data(bio);
+    ssize_t n;
+
+    BIO_clear_retry_flags(bio);
+    do {
+        n = send(tls->sock, data, length, MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        BIO_set_retry_write(bio);
+    }
+    return n;
+}
+
+
+/**
+ * Receive bytes of a session's records.
+ */
+static int socket_read(BIO *bio, char *data, int length) {
+    Tls *tls = BIO_get_data(bio);
+    ssize_t n;
+
+    BIO_clear_retry_flags(bio);
+    do {
+        n = recv(tls->sock, data, length, 0);
+    } while (n == -1 && errno == EINTR);
+
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        BIO_set_retry_read(bio);
+    }
+    if (n == 0) {
+        tls->eof = 1;
+    }
+    return n;
+}
+
+
+static long socket_ctrl(BIO *bio, int command, long number, void *pointer) {
+    Tls *tls = BIO_get_data(bio);
+
+    switch (command) {
+    case BIO_CTRL_FLUSH:
+        // Records are sent as they are written
+        return 1;
+    case BIO_CTRL_EOF:
+        // Tells an unexpected EOF from a failed read
+        return tls->eof;
+    default:
+        return 0;
+    }
+}
+
+
+/**
+ * Keep a session the server has just issued, replacing the one cached for
+ * its host and port, so the next connection to the server can resume it.
+ * @return 1 if the session was kept, 0 if not
+ */
+static int cache_session(SSL *ssl, SSL_SESSION *session) {
+    Tls *tls = SSL_get_app_data(ssl);
+    if (!tls || !SSL_SESSION_is_resumable(session)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&sessions_mutex);
+
+    CachedSession *cached = sessions;
+    while (cached && strcmp(cached->key, tls->key) != 0) {
+        cached = cached->next;
+    }
+
+    if (cached) {
+        SSL_SESSION_free(cached->session);
+    } else {
+        cached = malloc(sizeof(CachedSession));
+        if (!cached) {
+            handle_error("malloc");
+        }
+        strcpy(cached->key, tls->key);
+        cached->next = sessions;
+        sessions = cached;
+    }
+    cached->session = session;
+
+    pthread_mutex_unlock(&sessions_mutex);
+    return 1;
+}
+
+
+static void context_init(void) {
+    context = SSL_CTX_new(TLS_client_method());
+    if (!context) {
+        handle_tls_error("SSL_CTX_new");
+    }
+
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+    SSL_CTX_set_verify(context, SSL_VERIFY_PEER, NULL);
+
+    // Servers often close without a close_notify once a body framed by
+    // its length has been sent. That must read as the end of the stream;
+    // a body cut short is still caught by its framing.
+    SSL_CTX_set_options(context, SSL_OP_IGNORE_UNEXPECTED_EOF);
+
+    // Sessions are kept per server by cache_session, not in the context
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_CLIENT |
+                                            SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(context, cache_session);
+
+    socket_method = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK,
+                                 "socket without SIGPIPE");
+    if (!socket_method) {
+        handle_tls_error("BIO_meth_new");
+    }
+    BIO_meth_set_write(socket_method, socket_write);
+    BIO_meth_set_read(socket_method, socket_read);
+    BIO_meth_set_ctrl(socket_method, socket_ctrl);
+}
+
+
+static void trust_init(void) {
+    if (!custom_trust && SSL_CTX_set_default_verify_paths(context) != 1) {
+        fprintf(stderr, "could not load the system's certificates\n");
+    }
+}
+
+
+/**
+ * Select the certificate authorities that server certificates are checked
+ * against, instead of the system's. Call this before any connections are
+ * opened.
+ * @param ca_file - PEM file of trusted certificates, or NULL for the
+ *                  system's own
+ * @return 0 on success, -1 if the file could not be loaded
+ */
+int tls_set_ca_file(const char *ca_file) {
+    pthread_once(&context_once, context_init);
+
+    if (!ca_file) {
+        return 0;
+    }
+
+    if (SSL_CTX_load_verify_locations(context, ca_file, NULL) != 1) {
+        fprintf(stderr, "could not load certificates from %s\n", ca_file);
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+
+    custom_trust = 1;
+    return 0;
+}
+
+
+/**
+ * Free the shared context and the cached sessions. Call this once every
+ * connection has been freed.
+ */
+void tls_cleanup(void) {
+    pthread_mutex_lock(&sessions_mutex);
+    while (sessions) {
+        CachedSession *next = sessions->next;
+        SSL_SESSION_free(sessions->session);
+        free(sessions);
+        sessions = next;
+    }
+    pthread_mutex_unlock(&sessions_mutex);
+
+    if (context) {
+        SSL_CTX_free(context);
+        context = NULL;
+        BIO_meth_free(socket_method);
+        socket_method = NULL;
+    }
+}
+
+
+/**
+ * Checks whether a host is written as an address rather than a name.
+ */
+static int is_address(const char *host) {
+    unsigned char addr[sizeof(struct in6_addr)];
+
+    return inet_pton(AF_INET, host, addr) == 1 ||
+           inet_pton(AF_INET6, host, addr) == 1;
+}
+
+
+/**
+ * Start a TLS session over a connected socket. The server name is sent
+ * for its virtual hosting and checked against its certificate, and a
+ * cached session of the same host and port is offered for resumption.
+ * Nothing is sent until tls_handshake is called.
+ * @param sock - The connected socket, which stays owned by the caller
+ * @param host - The host name e.g. www.canterbury.ac.nz, or an address
+ * @param port - The port number e.g. 443
+ * @return tls - Pointer to the new session, or NULL on failure
+ */
+Tls *tls_open(int sock, const char *host, int port) {
+    pthread_once(&context_once, context_init);
+    pthread_once(&trust_once, trust_init);
+    if (!context) {
+        return NULL;
+    }
+
+    Tls *tls = malloc(sizeof(Tls));
+    if (!tls) {
+        handle_error("malloc");
+    }
+
+    tls->sock = sock;
+    tls->want_write = 0;
+    tls->eof = 0;
+    int key_length = snprintf(tls->key, KEY_SIZE, "%s:%d", host, port);
+
+    tls->ssl = SSL_new(context);
+    BIO *bio = BIO_new(socket_method);
+    if (key_length >= KEY_SIZE || !tls->ssl || !bio) {
+        fprintf(stderr, "could not start a TLS session with %s\n", host);
+        BIO_free(bio);
+        SSL_free(tls->ssl);
+        free(tls);
+        return NULL;
+    }
+
+    BIO_set_data(bio, tls);
+    BIO_set_init(bio, 1);
+    SSL_set_bio(tls->ssl, bio, bio);
+    SSL_set_app_data(tls->ssl, tls);
+
+    // Names are sent and checked as DNS names, addresses as addresses
+    int named;
+    if (is_address(host)) {
+        named = X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(tls->ssl),
+                                              host) == 1;
+    } else {
+        named = SSL_set_tlsext_host_name(tls->ssl, host) == 1 &&
+                SSL_set1_host(tls->ssl, host) == 1;
+    }
+    if (!named) {
+        fprintf(stderr, "could not check the certificate of %s\n", host);
+        tls_free(tls, 0);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&sessions_mutex);
+    for (CachedSession *cached = sessions; cached; cached = cached->next) {
+        if (strcmp(cached->key, tls->key) == 0) {
+            SSL_set_session(tls->ssl, cached->session);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sessions_mutex);
+
+    return tls;
+}
+
+
+/**
+ * Free a session. The socket is left open for the caller to close.
+ * @param tls - Pointer to the session to free
+ * @param notify - Non-zero to tell the server the session is closing
+ *                 first, for a connection that is still healthy
+ */
+void tls_free(Tls *tls, int notify) {
+    if (notify) {
+        // Only sends the close_notify; the server's isn't waited for
+        SSL_shutdown(tls->ssl);
+    } else {
+        // Freeing a session that wasn't shut down would mark it as not to
+        // be resumed, though a connection dropped after a response, or cut
+        // off, leaves nothing wrong with it
+        SSL_set_shutdown(tls->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    }
+
+    SSL_free(tls->ssl);
+    free(tls);
+}
+
+
+/**
+ * Work out what a call on a session that did not succeed means.
+ * @param rc - What the call returned
+ * @return TLS_WANT_READ or TLS_WANT_WRITE if the call has to wait for the
+ *         socket, 0 if the server closed the session, or -1 on failure
+ */
+static int session_error(Tls *tls, int rc) {
+    switch (SSL_get_error(tls->ssl, rc)) {
+    case SSL_ERROR_WANT_READ:
+        tls->want_write = 0;
+        return TLS_WANT_READ;
+    case SSL_ERROR_WANT_WRITE:
+        tls->want_write = 1;
+        return TLS_WANT_WRITE;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        // The socket failed, and errno says why, if it was set at all
+        if (errno == 0) {
+            errno = EIO;
+        }
+        ERR_clear_error();
+        return -1;
+    default:
+        ERR_print_errors_fp(stderr);
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+
+/**
+ * Carry out the handshake of a session, or as much of it as the socket
+ * allows without blocking.
+ * @param tls - The session
+ * @return 0 once the handshake is done, TLS_WANT_READ or TLS_WANT_WRITE
+ *         if it has to wait for the socket, or -1 on failure, including
+ *         a certificate that does not check out
+ */
+int tls_handshake(Tls *tls) {
+    errno = 0;
+    int rc = SSL_connect(tls->ssl);
+    if (rc == 1) {
+        tls->want_write = 0;
+        return 0;
+    }
+
+    long verified = SSL_get_verify_result(tls->ssl);
+    if (verified != X509_V_OK) {
+        fprintf(stderr, "certificate of %s rejected: %s\n", tls->key,
+                X509_verify_cert_error_string(verified));
+        ERR_clear_error();
+        return -1;
+    }
+
+    rc = session_error(tls, rc);
+    if (rc == 0 || rc == -1) {
+        if (rc == -1 && errno != EPROTO) {
+            perror("TLS handshake");
+        }
+        fprintf(stderr, "TLS handshake with %s failed\n", tls->key);
+        return -1;
+    }
+    return rc;
+}
+
+
+/**
+ * Read decrypted bytes of a session.
+ * @param tls - The session, with its handshake done
+ * @param data - Buffer to read into
+ * @param length - Most bytes to read
+ * @return Number of bytes read, 0 once the server has closed the
+ *         connection, or -1 on failure with errno set; EAGAIN if a
+ *         non-blocking socket has to be waited for
+ */
+ssize_t tls_read(Tls *tls, void *data, size_t length) {
+    if (length > INT_MAX) {
+        length = INT_MAX;
+    }
+
+    errno = 0;
+    int n = SSL_read(tls->ssl, data, length);
+    if (n > 0) {
+        tls->want_write = 0;
+        return n;
+    }
+
+    int rc = session_error(tls, n);
+    if (rc > 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return rc;
+}
+
+
+/**
+ * Encrypt and send bytes over a session.
+ * @param tls - The session, with its handshake done
+ * @param data - The bytes to send
+ * @param length - Number of bytes of data
+ * @return Number of bytes sent, or -1 on failure with errno set; EAGAIN if
+ *         a non-blocking socket has to be waited for, after which the same
+ *         data must be sent again
+ */
+ssize_t tls_write(Tls *tls, const void *data, size_t length) {
+    if (length > INT_MAX) {
+        length = INT_MAX;
+    }
+
+    errno = 0;
+    int n = SSL_write(tls->ssl, data, length);
+    if (n > 0) {
+        tls->want_write = 0;
+        return n;
+    }
+
+    int rc = session_error(tls, n);
+    if (rc > 0) {
+        errno = EAGAIN;
+    } else if (rc == 0) {
+        errno = EPIPE;
+    }
+    return -1;
+}
+
+
+/**
+ * Tell whether the last call on a session had to wait for the socket to
+ * be writable, which a read may have to as well as a write.
+ * @param tls - The session
+ * @return 1 if it waits for the socket to be writable, 0 otherwise
+ */
+int tls_wants_write(Tls *tls) {
+    return tls->want_write;
+}
+
+
+/**
+ * Tell whether a session holds bytes that have already been read from the
+ * socket, which a poll of the socket won't report.
+ * @param tls - The session
+ * @return 1 if tls_read can go on without reading the socket, 0 otherwise
+ */
+int tls_pending(Tls *tls) {
+    return SSL_pending(tls->ssl) > 0 || SSL_has_pending(tls->ssl);
+}
+
+
+/**
+ * Tell whether a session's handshake resumed a cached session.
+ * @param tls - The session, with its handshake done
+ * @return 1 if it was resumed, 0 if it took a full handshake
+ */
+int tls_resumed(Tls *tls) {
+    return SSL_session_reused(tls->ssl);
+}
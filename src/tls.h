@@ -0,0 +1,129 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+
+// What a TLS call that could not finish without blocking is waiting for
+#define TLS_WANT_READ  1
+#define TLS_WANT_WRITE 2
+
+
+/*
+ * Tls - a TLS client session over a connected socket, for https. Sessions
+ * of every connection share one context, whose certificate authorities
+ * are set with tls_set_ca_file, and a cache of the last session ticket of
+ * each host and port, so a later connection to the same server resumes
+ * the session with an abbreviated handshake instead of a full one.
+ *
+ * The socket may be blocking or not; with a non-blocking one, calls that
+ * can't go on return TLS_WANT_READ or TLS_WANT_WRITE, or -1 with errno
+ * EAGAIN, and tls_wants_write tells which way to wait.
+ * The implementation is hidden from the outside.
+ */
+typedef struct TlsStruct Tls;
+
+
+/**
+ * Select the certificate authorities that server certificates are checked
+ * against, instead of the system's. Call this before any connections are
+ * opened.
+ * @param ca_file - PEM file of trusted certificates, or NULL for the
+ *                  system's own
+ * @return 0 on success, -1 if the file could not be loaded
+ */
+int tls_set_ca_file(const char *ca_file);
+
+
+/**
+ * Free the shared context and the cached sessions. Call this once every
+ * connection has been freed.
+ */
+void tls_cleanup(void);
+
+
+/**
+ * Start a TLS session over a connected socket. The server name is sent
+ * for its virtual hosting and checked against its certificate, and a
+ * cached session of the same host and port is offered for resumption.
+ * Nothing is sent until tls_handshake is called.
+ * @param sock - The connected socket, which stays owned by the caller
+ * @param host - The host name e.g. www.canterbury.ac.nz, or an address
+ * @param port - The port number e.g. 443
+ * @return tls - Pointer to the new session, or NULL on failure
+ */
+Tls *tls_open(int sock, const char *host, int port);
+
+
+/**
+ * Free a session. The socket is left open for the caller to close.
+ * @param tls - Pointer to the session to free
+ * @param notify - Non-zero to tell the server the session is closing
+ *                 first, for a connection that is still healthy
+ */
+void tls_free(Tls *tls, int notify);
+
+
+/**
+ * Carry out the handshake of a session, or as much of it as the socket
+ * allows without blocking.
+ * @param tls - The session
+ * @return 0 once the handshake is done, TLS_WANT_READ or TLS_WANT_WRITE
+ *         if it has to wait for the socket, or -1 on failure, including
+ *         a certificate that does not check out
+ */
+int tls_handshake(Tls *tls);
+
+
+/**
+ * Read decrypted bytes of a session.
+ * @param tls - The session, with its handshake done
+ * @param data - Buffer to read into
+ * @param length - Most bytes to read
+ * @return Number of bytes read, 0 once the server has closed the
+ *         connection, or -1 on failure with errno set; EAGAIN if a
+ *         non-blocking socket has to be waited for
+ */
+ssize_t tls_read(Tls *tls, void *data, size_t length);
+
+
+/**
+ * Encrypt and send bytes over a session.
+ * @param tls - The session, with its handshake done
+ * @param data - The bytes to send
+ * @param length - Number of bytes of data
+ * @return Number of bytes sent, or -1 on failure with errno set; EAGAIN if
+ *         a non-blocking socket has to be waited for, after which the same
+ *         data must be sent again
+ */
+ssize_t tls_write(Tls *tls, const void *data, size_t length);
+
+
+/**
+ * Tell whether the last call on a session had to wait for the socket to
+ * be writable, which a read may have to as well as a write.
+ * @param tls - The session
+ * @return 1 if it waits for the socket to be writable, 0 otherwise
+ */
+int tls_wants_write(Tls *tls);
+
+
+/**
+ * Tell whether a session holds bytes that have already been read from the
+ * socket, which a poll of the socket won't report.
+ * @param tls - The session
+ * @return 1 if tls_read can go on without reading the socket, 0 otherwise
+ */
+int tls_pending(Tls *tls);
+
+
+/**
+ * Tell whether a session's handshake resumed a cached session.
+ * @param tls - The session, with its handshake done
+ * @return 1 if it was resumed, 0 if it took a full handshake
+ */
+int tls_resumed(Tls *tls);
+
+
+#endif
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "async_writer.h"
+
+#define PATH "/tmp/async_writer_test"
+
+// Small buffers, so writes are split and merged
+#define NUM_BUFFERS 4
+#define BUFFER_SIZE 1000
+
+
+// What the callbacks saw of a stream
+typedef struct {
+    size_t landed;
+    int done;
+    int error;
+    pthread_mutex_t mutex;
+    pthread_cond_t finished;
+} Result;
+
+
+void landed(AsyncStream *stream, size_t length) {
+    Result *result = stream->arg;
+    result->landed += length;
+}
+
+
+void done(AsyncStream *stream, int error) {
+    Result *result = stream->arg;
+    pthread_mutex_lock(&result->mutex);
+    result->done = 1;
+    result->error = error;
+    pthread_cond_signal(&result->finished);
+    pthread_mutex_unlock(&result->mutex);
+}
+
+
+void wait_done(Result *result) {
+    pthread_mutex_lock(&result->mutex);
+    while (!result->done) {
+        pthread_cond_wait(&result->finished, &result->mutex);
+    }
+    pthread_mutex_unlock(&result->mutex);
+}
+
+
+void init_result(Result *result) {
+    memset(result, 0, sizeof(*result));
+    pthread_mutex_init(&result->mutex, NULL);
+    pthread_cond_init(&result->finished, NULL);
+}
+
+
+int main(int argc, char **argv) {
+    AsyncWriter *writer = async_writer_alloc(NUM_BUFFERS, BUFFER_SIZE);
+    printf("io_uring available: %d, expected: 1\n", writer != NULL);
+    if (!writer) {
+        return 0;
+    }
+
+    // Two streams filling the two halves of one file at once
+    char data[20000];
+    for (int i = 0; i < (int)sizeof(data); i++) {
+        data[i] = 'a' + i % 26;
+    }
+
+    int fd = open(PATH, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    AsyncStream first, second;
+    Result first_result, second_result;
+    init_result(&first_result);
+    init_result(&second_result);
+    async_stream_open(writer, &first, fd, 0, landed, done, &first_result);
+    async_stream_open(writer, &second, fd, 10000, landed, done,
+                      &second_result);
+
+    int rc = 0;
+    for (int offset = 0; offset < 10000; offset += 250) {
+        rc |= async_write(&first, data + offset, 250);
+        rc |= async_write(&second, data + 10000 + offset, 250);
+    }
+    printf("writes: %d, expected: 0\n", rc);
+
+    async_stream_close(&first);
+    async_stream_close(&second);
+    wait_done(&first_result);
+    wait_done(&second_result);
+
+    printf("first error: %d, expected: 0\n", first_result.error);
+    printf("first landed: %zu, expected: 10000\n", first_result.landed);
+    printf("second landed: %zu, expected: 10000\n", second_result.landed);
+
+    char back[sizeof(data)];
+    ssize_t got = pread(fd, back, sizeof(back), 0);
+    printf("file length: %zd, expected: 20000\n", got);
+    printf("contents: %d, expected: 0\n", memcmp(back, data, sizeof(data)));
+    close(fd);
+
+    // Closing a stream with nothing in flight finishes it at once
+    Result empty_result;
+    init_result(&empty_result);
+    AsyncStream empty;
+    async_stream_open(writer, &empty, -1, 0, landed, done, &empty_result);
+    async_stream_close(&empty);
+    printf("empty done: %d, expected: 1\n", empty_result.done);
+
+    // A file that can't be written fails the stream
+    fd = open(PATH, O_RDONLY);
+    Result failed_result;
+    init_result(&failed_result);
+    AsyncStream failed;
+    async_stream_open(writer, &failed, fd, 0, landed, done, &failed_result);
+    async_write(&failed, data, 100);
+    async_stream_close(&failed);
+    wait_done(&failed_result);
+    printf("failed error: %d, expected: 1\n", failed_result.error != 0);
+    printf("failed landed: %zu, expected: 0\n", failed_result.landed);
+    close(fd);
+
+    async_writer_free(writer);
+    unlink(PATH);
+
+    return 0;
+}
@@ -0,0 +1,110 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "buffer_pool.h"
+
+#define NUM_THREADS 8
+#define N 100000
+#define BUFFERS 4
+#define BUFFER_SIZE 100
+
+
+/*
+ * Each thread repeatedly takes a buffer and gives it back. A buffer must
+ * never be handed to two threads at once, which is checked by writing the
+ * thread's mark over it and checking it is still there before returning it.
+ */
+int errors = 0;
+int next_mark = 1;
+pthread_mutex_t errors_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void *churn(void *arg) {
+    BufferPool *pool = (BufferPool*)arg;
+    char mark = (char)__sync_fetch_and_add(&next_mark, 1);
+
+    for (int i = 0; i < N; ++i) {
+        char *buffer = buffer_pool_get(pool);
+        memset(buffer, mark, BUFFER_SIZE);
+
+        for (int j = 0; j < BUFFER_SIZE; ++j) {
+            if (buffer[j] != mark) {
+                pthread_mutex_lock(&errors_mutex);
+                ++errors;
+                pthread_mutex_unlock(&errors_mutex);
+                break;
+            }
+        }
+
+        buffer_pool_put(pool, buffer);
+    }
+
+    return NULL;
+}
+
+
+int main(int argc, char **argv) {
+    BufferPool *pool = buffer_pool_alloc(BUFFER_SIZE, BUFFERS);
+    void *buffers[BUFFERS + 1];
+
+    printf("buffer size: %d, expected: %d\n",
+           (int)buffer_pool_buffer_size(pool), BUFFER_SIZE);
+
+    // The slab's buffers are distinct, aligned and don't overlap
+    int overlaps = 0, misaligned = 0;
+    for (int i = 0; i < BUFFERS; ++i) {
+        buffers[i] = buffer_pool_get(pool);
+        misaligned += (uintptr_t)buffers[i] % 64 != 0;
+        for (int j = 0; j < i; ++j) {
+            intptr_t distance = (char *)buffers[i] - (char *)buffers[j];
+            overlaps += distance < BUFFER_SIZE && distance > -BUFFER_SIZE;
+        }
+    }
+    printf("overlapping buffers: %d, expected: 0\n", overlaps);
+    printf("misaligned buffers: %d, expected: 0\n", misaligned);
+
+    // Once the slab is used up, buffers come from the heap
+    buffers[BUFFERS] = buffer_pool_get(pool);
+    printf("extra buffer: %d, expected: 1\n", buffers[BUFFERS] != NULL);
+    buffer_pool_put(pool, buffers[BUFFERS]);
+
+    // The buffer returned last is handed out next
+    buffer_pool_put(pool, buffers[1]);
+    printf("recycled: %d, expected: 1\n", buffer_pool_get(pool) == buffers[1]);
+
+    // A heap buffer returned to a full slab is freed, not kept
+    void *extra = buffer_pool_get(pool);
+    for (int i = 0; i < BUFFERS; ++i) {
+        buffer_pool_put(pool, buffers[i]);
+    }
+    buffer_pool_put(pool, extra);
+
+    void *refill[BUFFERS];
+    int from_slab = 0;
+    for (int i = 0; i < BUFFERS; ++i) {
+        refill[i] = buffer_pool_get(pool);
+        for (int j = 0; j < BUFFERS; ++j) {
+            from_slab += refill[i] == buffers[j];
+        }
+    }
+    printf("slab buffers after refill: %d, expected: %d\n", from_slab,
+           BUFFERS);
+    for (int i = 0; i < BUFFERS; ++i) {
+        buffer_pool_put(pool, refill[i]);
+    }
+
+    // Concurrent get and put, with more threads than buffers
+    pthread_t thread[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        pthread_create(&thread[i], NULL, churn, pool);
+    }
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        pthread_join(thread[i], NULL);
+    }
+    printf("shared buffers: %d, expected: 0\n", errors);
+
+    buffer_pool_free(pool);
+
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+
+#define CACHE_DIR "/tmp/cache_test"
+#define DOWNLOAD "/tmp/cache_test.download"
+#define PLACED "/tmp/cache_test.placed"
+#define URL "i.imgur.com/xlLjV00.jpg"
+
+
+int write_file(const char *path, const char *contents) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        return -1;
+    }
+    fputs(contents, file);
+    return fclose(file);
+}
+
+
+/*
+ * Remove the cache directory and the entries in it.
+ */
+void remove_cache(void) {
+    DIR *dir = opendir(CACHE_DIR);
+    if (!dir) {
+        return;
+    }
+
+    struct dirent *entry;
+    char path[512];
+    while ((entry = readdir(dir))) {
+        snprintf(path, sizeof(path), "%s/%s", CACHE_DIR, entry->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+    rmdir(CACHE_DIR);
+}
+
+
+int main(int argc, char **argv) {
+    HttpValidator validator = { "\"5c3e-4f1\"",
+                                "Tue, 01 Jan 2019 00:00:00 GMT" };
+    HttpValidator found = { "", "" };
+    off_t length = -1;
+
+    remove_cache();
+    mkdir(CACHE_DIR, 0700);
+    write_file(DOWNLOAD, "0123456789");
+
+    printf("lookup empty: %d, expected: -1\n",
+           cache_lookup(CACHE_DIR, URL, &length, &found));
+
+    printf("store: %d, expected: 0\n",
+           cache_store(CACHE_DIR, URL, DOWNLOAD, 10, &validator));
+    printf("lookup: %d, expected: 0\n",
+           cache_lookup(CACHE_DIR, URL, &length, &found));
+    printf("length: %lld, expected: 10\n", (long long)length);
+    printf("etag: %d, expected: 0\n", strcmp(found.etag, validator.etag));
+    printf("other url: %d, expected: -1\n",
+           cache_lookup(CACHE_DIR, "i.imgur.com/other.jpg", &length, &found));
+
+    // The copy replaces whatever is at the destination
+    write_file(PLACED, "old contents, longer than the copy");
+    printf("place: %d, expected: 0\n", cache_place(CACHE_DIR, URL, PLACED));
+    struct stat st;
+    stat(PLACED, &st);
+    printf("placed length: %lld, expected: 10\n", (long long)st.st_size);
+
+    // Placing over a destination that already shares the copy is harmless
+    printf("place again: %d, expected: 0\n",
+           cache_place(CACHE_DIR, URL, PLACED));
+    printf("no temporary left: %d, expected: -1\n",
+           access(PLACED ".tmp", F_OK));
+
+    // Nothing to revalidate with, so not kept
+    HttpValidator none = { "", "" };
+    printf("store without validators: %d, expected: -1\n",
+           cache_store(CACHE_DIR, "a/b", DOWNLOAD, 10, &none));
+
+    // A length that doesn't match the body means the entry is unusable
+    printf("store wrong length: %d, expected: 0\n",
+           cache_store(CACHE_DIR, URL, DOWNLOAD, 11, &validator));
+    printf("lookup wrong length: %d, expected: -1\n",
+           cache_lookup(CACHE_DIR, URL, &length, &found));
+
+    printf("place missing: %d, expected: -1\n",
+           cache_place(CACHE_DIR, "a/b", PLACED));
+
+    unlink(DOWNLOAD);
+    unlink(PLACED);
+    remove_cache();
+
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "checksum.h"
+
+#define DATA_SIZE 100000
+
+
+int sha256_hex_is(const void *data, size_t length, const char *expected) {
+    Sha256 sha;
+    uint8_t digest[SHA256_SIZE];
+    char hex[SHA256_SIZE * 2 + 1];
+
+    sha256_init(&sha);
+    sha256_update(&sha, data, length);
+    sha256_final(&sha, digest);
+    checksum_format_hex(digest, SHA256_SIZE, hex);
+
+    return strcmp(hex, expected) == 0;
+}
+
+
+/*
+ * SHA-256 of data, added a piece at a time with each piece one byte
+ * longer than the last, so pieces straddle the block boundaries.
+ */
+void sha256_in_pieces(const uint8_t *data, size_t length, uint8_t *digest) {
+    Sha256 sha;
+    sha256_init(&sha);
+
+    size_t piece = 1;
+    for (size_t done = 0; done < length; piece++) {
+        size_t take = length - done < piece ? length - done : piece;
+        sha256_update(&sha, data + done, take);
+        done += take;
+    }
+    sha256_final(&sha, digest);
+}
+
+
+int main(int argc, char **argv) {
+    printf("crc32c check value: %d, expected: 1\n",
+           crc32c_update(0, "123456789", 9) == 0xe3069283);
+    printf("crc32c of nothing: %d, expected: 1\n",
+           crc32c_update(0, "", 0) == 0);
+
+    printf("sha256 of nothing: %d, expected: 1\n", sha256_hex_is("", 0,
+           "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"));
+    printf("sha256 abc: %d, expected: 1\n", sha256_hex_is("abc", 3,
+           "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"));
+    const char *two_blocks =
+        "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    printf("sha256 two blocks: %d, expected: 1\n",
+           sha256_hex_is(two_blocks, strlen(two_blocks),
+           "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"));
+
+    uint8_t *data = malloc(DATA_SIZE);
+    srand(360);
+    for (int i = 0; i < DATA_SIZE; i++) {
+        data[i] = rand();
+    }
+
+    // Pieces continued one after another, or computed apart and combined
+    uint32_t whole = crc32c_update(0, data, DATA_SIZE);
+    uint32_t first = crc32c_update(0, data, 12345);
+    printf("crc32c continued: %d, expected: 1\n",
+           crc32c_update(first, data + 12345, DATA_SIZE - 12345) == whole);
+    uint32_t second = crc32c_update(0, data + 12345, DATA_SIZE - 12345);
+    printf("crc32c combined: %d, expected: 1\n",
+           crc32c_combine(first, second, DATA_SIZE - 12345) == whole);
+    printf("crc32c combined with nothing: %d, expected: 1\n",
+           crc32c_combine(whole, 0, 0) == whole);
+
+    uint8_t digest[SHA256_SIZE], pieces[SHA256_SIZE];
+    Sha256 sha;
+    sha256_init(&sha);
+    sha256_update(&sha, data, DATA_SIZE);
+    sha256_final(&sha, digest);
+    sha256_in_pieces(data, DATA_SIZE, pieces);
+    printf("sha256 in pieces: %d, expected: 0\n",
+           memcmp(digest, pieces, SHA256_SIZE));
+
+    // The CPU's instructions, if it has them, agree with the portable code
+    uint32_t unaligned = crc32c_update(0, data + 3, DATA_SIZE - 3);
+    checksum_use_hardware(0);
+    printf("crc32c portable: %d, expected: 1\n",
+           crc32c_update(0, data + 3, DATA_SIZE - 3) == unaligned);
+    sha256_init(&sha);
+    sha256_update(&sha, data, DATA_SIZE);
+    sha256_final(&sha, pieces);
+    printf("sha256 portable: %d, expected: 0\n",
+           memcmp(digest, pieces, SHA256_SIZE));
+    checksum_use_hardware(1);
+
+    printf("bad hex: %d, expected: -1\n",
+           checksum_parse_hex("e306928g", digest, 4));
+    printf("short hex: %d, expected: -1\n",
+           checksum_parse_hex("e306928", digest, 4));
+    printf("parse hex: %d, expected: 0\n",
+           checksum_parse_hex("E3069283", digest, 4));
+    printf("parsed: %d, expected: 1\n",
+           digest[0] == 0xe3 && digest[3] == 0x83);
+
+    free(data);
+    return 0;
+}
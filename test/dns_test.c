@@ -0,0 +1,83 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "dns.h"
+
+#define NUM_THREADS 16
+#define N 10000
+
+
+/*
+ * Each thread resolves the same host many times; every lookup must
+ * succeed and give back 127.0.0.1.
+ */
+void *resolve_many(void *arg) {
+    DnsCache *cache = (DnsCache*)arg;
+    DnsAddress addrs[4];
+    intptr_t failures = 0;
+
+    for (int i = 0; i < N; ++i) {
+        int n = dns_resolve(cache, "127.0.0.1", 80, addrs, 4);
+        struct sockaddr_in *in = (struct sockaddr_in *)&addrs[0].addr;
+
+        if (n != 1 || in->sin_addr.s_addr != htonl(INADDR_LOOPBACK)) {
+            ++failures;
+        }
+    }
+
+    return (void*)failures;
+}
+
+
+int main(int argc, char **argv) {
+    DnsCache *cache = dns_alloc(60, AF_INET);
+    DnsAddress addrs[4];
+
+    int n = dns_resolve(cache, "127.0.0.1", 8080, addrs, 4);
+    struct sockaddr_in *in = (struct sockaddr_in *)&addrs[0].addr;
+    printf("addresses: %d, expected: 1\n", n);
+    printf("port: %d, expected: 8080\n", ntohs(in->sin_port));
+
+    // Ports are cached separately
+    dns_resolve(cache, "127.0.0.1", 80, addrs, 4);
+    printf("port: %d, expected: 80\n", ntohs(in->sin_port));
+
+    printf("bad host: %d, expected: -1\n",
+           dns_resolve(cache, "bad host name", 80, addrs, 4));
+
+    dns_invalidate(cache, "127.0.0.1", 80);
+    printf("after invalidate: %d, expected: 1\n",
+           dns_resolve(cache, "127.0.0.1", 80, addrs, 4));
+
+    // Families alternate from the first, each keeping its own order
+    DnsAddress mixed[5];
+    int families[] = { AF_INET6, AF_INET6, AF_INET6, AF_INET, AF_INET };
+    for (int i = 0; i < 5; ++i) {
+        mixed[i].family = families[i];
+        mixed[i].length = i + 1;
+    }
+    dns_interleave(mixed, 5);
+    printf("interleaved: %d%d%d%d%d, expected: 14253\n",
+           mixed[0].length, mixed[1].length, mixed[2].length,
+           mixed[3].length, mixed[4].length);
+
+    pthread_t thread[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        pthread_create(&thread[i], NULL, resolve_many, cache);
+    }
+
+    intptr_t value, failures = 0;
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        pthread_join(thread[i], (void**)&value);
+        failures += value;
+    }
+    printf("concurrent failures: %d, expected: 0\n", (int)failures);
+
+    dns_free(cache);
+
+    return 0;
+}
@@ -0,0 +1,802 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define DEFAULT_SIZES "256k,8m"
+#define DEFAULT_COPIES 4
+#define DEFAULT_WORKERS "1,4,16"
+#define DEFAULT_ASSEMBLIES "direct,parts"
+#define DEFAULT_ENGINES "threads,epoll"
+#define DEFAULT_DOWNLOADER "./downloader"
+
+// Most entries in one comma separated option, and most downloader arguments
+#define MAX_LIST 16
+#define MAX_ARGS 64
+
+#define REQUEST_SIZE 8192
+#define SLICE_SIZE (64 * 1024)
+
+// Slices are smaller under a bandwidth cap, so the pacing stays smooth
+#define PACED_SLICE_SIZE (16 * 1024)
+
+
+/*
+ * End-to-end benchmark of the downloader against a local server. The
+ * server runs in this process and serves synthetic files of the given
+ * sizes, with HEAD, keep-alive and byte ranges, and can add latency before
+ * each response, cap each connection's bandwidth, leave out range support
+ * and inject failures. Every combination of worker count, assembly mode,
+ * minimum chunk and engine downloads all the files once, as a separate
+ * downloader process, and is reported as one CSV row: wall time,
+ * throughput, peak RSS, CPU time, requests served and, with -S, syscalls
+ * made. Each downloaded file is checked against what was served.
+ *
+ * usage: download_bench [-s sizes] [-n copies] [-l latency_ms] [-b rate]
+ *                       [-R] [-f every] [-F every] [-w workers]
+ *                       [-a assemblies] [-c min_chunks] [-e engines]
+ *                       [-x extra_args] [-D downloader] [-S] [-H] [label]
+ *   -s sizes       comma separated file sizes, with optional k, m or g
+ *   -n copies      files served of each size
+ *   -l latency_ms  delay before each response
+ *   -b rate        most bytes per second sent over each connection
+ *   -R             ignore Range headers and don't advertise ranges
+ *   -f every       answer every this many requests with 503
+ *   -F every       cut every this many responses off halfway through
+ *   -w workers     comma separated worker counts
+ *   -a assemblies  comma separated assembly modes, direct or parts
+ *   -c min_chunks  comma separated minimum chunk sizes, default the
+ *                  downloader's own
+ *   -e engines     comma separated engines, threads or epoll
+ *   -x extra_args  more downloader arguments, e.g. "-k -i"
+ *   -D downloader  the downloader to run
+ *   -S             count syscalls of each configuration under ptrace, in
+ *                  a second run so they don't slow the timed one
+ *   -H             don't print the CSV header row
+ *   label          name for the first column
+ */
+
+// The files served, and how to misbehave while serving them
+typedef struct {
+    int port;
+    long long sizes[MAX_LIST * MAX_LIST];
+    int num_files;
+    double latency;   // seconds before each response
+    double rate;      // bytes per second of each connection, 0 for no cap
+    int ranges;
+    int fail_every;
+    int cut_every;
+    int requests;     // counted with atomic adds by the connection threads
+    int injected;
+} Server;
+
+
+// A parsed request head
+typedef struct {
+    int head;
+    int index;        // file asked for, -1 if none
+    int has_range;
+    long long first;
+    long long last;   // -1 for the end of the file
+    int keep_alive;
+} Request;
+
+
+static Server server;
+
+
+static double now_seconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+static void sleep_seconds(double seconds) {
+    if (seconds > 0) {
+        struct timespec pause = { (time_t)seconds,
+                                  (long)((seconds - (time_t)seconds) * 1e9) };
+        nanosleep(&pause, NULL);
+    }
+}
+
+
+// Byte i is i % 251, long enough to copy a slice from any phase of it
+static unsigned char pattern[SLICE_SIZE + 251];
+
+
+/*
+ * Fill a buffer with part of a served file. Byte n of file i is
+ * (n + 37 i) % 251, so files differ from each other and don't repeat at
+ * any power of two, and a chunk written at the wrong offset or into the
+ * wrong file shows.
+ */
+static void fill(unsigned char *buffer, int index, long long offset,
+                 size_t length) {
+    memcpy(buffer, pattern + (offset + index * 37) % 251, length);
+}
+
+
+/**
+ * Parse a size in bytes, with an optional k, m or g suffix for KiB, MiB
+ * or GiB, e.g. 256k.
+ * @return The size, or -1 if it is malformed
+ */
+long long parse_size(const char *text) {
+    char *end;
+    double size = strtod(text, &end);
+
+    if (*end == 'k' || *end == 'K') {
+        size *= 1024;
+        ++end;
+    } else if (*end == 'm' || *end == 'M') {
+        size *= 1024 * 1024;
+        ++end;
+    } else if (*end == 'g' || *end == 'G') {
+        size *= 1024 * 1024 * 1024;
+        ++end;
+    }
+
+    return *end == '\0' && end != text && size >= 0 ? (long long)size : -1;
+}
+
+
+/**
+ * Split a comma separated option into its entries, which are kept for the
+ * whole run.
+ * @param text - The option
+ * @param entries - Array of at least MAX_LIST entries to fill
+ * @return Number of entries
+ */
+int split_list(const char *text, char **entries) {
+    int count = 0;
+    char *saved;
+
+    for (char *entry = strtok_r(strdup(text), ",", &saved);
+         entry && count < MAX_LIST; entry = strtok_r(NULL, ",", &saved)) {
+        entries[count++] = entry;
+    }
+
+    return count;
+}
+
+
+/*
+ * Parse a request head. Only what the downloader sends is understood.
+ */
+static void parse_request(char *head, Request *request) {
+    char method[8], path[256];
+    int minor = 0;
+
+    memset(request, 0, sizeof(*request));
+    request->index = -1;
+    request->last = -1;
+
+    if (sscanf(head, "%7s %255s HTTP/1.%d", method, path, &minor) != 3) {
+        return;
+    }
+    request->head = strcmp(method, "HEAD") == 0;
+    request->keep_alive = minor >= 1;
+
+    int index;
+    char rest;
+    if (sscanf(path, "/file%d%c", &index, &rest) == 1 && index >= 0 &&
+        index < server.num_files) {
+        request->index = index;
+    }
+
+    char *saved;
+    for (char *line = strtok_r(head, "\r\n", &saved); line;
+         line = strtok_r(NULL, "\r\n", &saved)) {
+        if (strncasecmp(line, "Range:", 6) == 0) {
+            long long first, last;
+            int fields = sscanf(line + 6, " bytes=%lld-%lld", &first, &last);
+            if (fields >= 1) {
+                request->has_range = 1;
+                request->first = first;
+                request->last = fields == 2 ? last : -1;
+            }
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            if (strcasestr(line, "close")) {
+                request->keep_alive = 0;
+            } else if (strcasestr(line, "keep-alive")) {
+                request->keep_alive = 1;
+            }
+        }
+    }
+}
+
+
+static int send_all(int sock, const void *data, size_t length) {
+    const char *next = data;
+
+    while (length > 0) {
+        ssize_t sent = send(sock, next, length, MSG_NOSIGNAL);
+        if (sent < 0) {
+            return -1;
+        }
+        next += sent;
+        length -= sent;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Send part of a file, held to the server's rate.
+ */
+static int send_body(int sock, int index, long long offset,
+                     long long length) {
+    static __thread unsigned char buffer[SLICE_SIZE];
+    size_t slice = server.rate > 0 ? PACED_SLICE_SIZE : SLICE_SIZE;
+    double start = now_seconds();
+    long long sent = 0;
+
+    while (sent < length) {
+        size_t n = length - sent < (long long)slice ? length - sent : slice;
+        fill(buffer, index, offset + sent, n);
+        if (send_all(sock, buffer, n) != 0) {
+            return -1;
+        }
+        sent += n;
+
+        if (server.rate > 0) {
+            sleep_seconds(start + sent / server.rate - now_seconds());
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * Answer one request.
+ * @return 1 if the connection stays open for another, 0 otherwise
+ */
+static int respond(int sock, Request *request) {
+    int number = __sync_add_and_fetch(&server.requests, 1);
+    char head[512];
+    int keep_alive = request->keep_alive;
+
+    sleep_seconds(server.latency);
+
+    if (server.fail_every && number % server.fail_every == 0) {
+        __sync_add_and_fetch(&server.injected, 1);
+        int length = snprintf(head, sizeof(head), "HTTP/1.1 503 Service "
+                              "Unavailable\r\nContent-Length: 0\r\n"
+                              "Connection: close\r\n\r\n");
+        send_all(sock, head, length);
+        return 0;
+    }
+
+    if (request->index < 0) {
+        int length = snprintf(head, sizeof(head), "HTTP/1.1 404 Not Found\r\n"
+                              "Content-Length: 0\r\nConnection: %s\r\n\r\n",
+                              keep_alive ? "keep-alive" : "close");
+        return send_all(sock, head, length) == 0 && keep_alive;
+    }
+
+    long long size = server.sizes[request->index];
+    long long first = 0, last = size - 1;
+    int partial = server.ranges && request->has_range;
+
+    if (partial) {
+        first = request->first;
+        if (request->last >= 0 && request->last < size) {
+            last = request->last;
+        }
+        if (first >= size || first > last) {
+            int length = snprintf(head, sizeof(head), "HTTP/1.1 416 Range "
+                                  "Not Satisfiable\r\nContent-Range: "
+                                  "bytes */%lld\r\nContent-Length: 0\r\n"
+                                  "Connection: %s\r\n\r\n", size,
+                                  keep_alive ? "keep-alive" : "close");
+            return send_all(sock, head, length) == 0 && keep_alive;
+        }
+    }
+
+    long long length = last - first + 1;
+    int head_length;
+    if (partial) {
+        head_length = snprintf(head, sizeof(head), "HTTP/1.1 206 Partial "
+                               "Content\r\nContent-Range: bytes "
+                               "%lld-%lld/%lld\r\n", first, last, size);
+    } else {
+        head_length = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\n");
+    }
+    head_length += snprintf(head + head_length, sizeof(head) - head_length,
+                            "Content-Length: %lld\r\n%sConnection: %s\r\n\r\n",
+                            length, server.ranges ? "Accept-Ranges: bytes\r\n"
+                                                  : "",
+                            keep_alive ? "keep-alive" : "close");
+
+    if (send_all(sock, head, head_length) != 0) {
+        return 0;
+    }
+    if (request->head) {
+        return keep_alive;
+    }
+
+    if (server.cut_every && number % server.cut_every == 0) {
+        __sync_add_and_fetch(&server.injected, 1);
+        send_body(sock, request->index, first, length / 2);
+        return 0;
+    }
+
+    return send_body(sock, request->index, first, length) == 0 && keep_alive;
+}
+
+
+/*
+ * Serve the requests of one connection until either side closes it.
+ */
+static void *serve(void *arg) {
+    int sock = (int)(long)arg;
+    char buffer[REQUEST_SIZE + 1];
+    size_t have = 0;
+    int open = 1;
+
+    while (open) {
+        char *end;
+        buffer[have] = '\0';
+        while (!(end = strstr(buffer, "\r\n\r\n"))) {
+            ssize_t n = have < REQUEST_SIZE ?
+                        read(sock, buffer + have, REQUEST_SIZE - have) : -1;
+            if (n <= 0) {
+                close(sock);
+                return NULL;
+            }
+            have += n;
+            buffer[have] = '\0';
+        }
+
+        // Keep anything after the head, which is the next request's
+        size_t head_length = end + 4 - buffer;
+        char head[REQUEST_SIZE + 1];
+        memcpy(head, buffer, head_length);
+        head[head_length] = '\0';
+        memmove(buffer, buffer + head_length, have - head_length);
+        have -= head_length;
+
+        Request request;
+        parse_request(head, &request);
+        open = respond(sock, &request);
+    }
+
+    close(sock);
+    return NULL;
+}
+
+
+static void *accept_connections(void *arg) {
+    int listener = (int)(long)arg;
+
+    for (;;) {
+        int sock = accept(listener, NULL, NULL);
+        if (sock < 0) {
+            continue;
+        }
+
+        // A response's header and body go out in separate sends, which
+        // Nagle would hold back for the client's delayed ack
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve, (void *)(long)sock) != 0) {
+            close(sock);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Listen on a free port of the loopback address and serve from a thread.
+ * @return 0 on success, -1 on failure
+ */
+static int start_server(void) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = { 0 };
+    socklen_t length = sizeof(address);
+
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (listener < 0 ||
+        bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(listener, 1024) != 0 ||
+        getsockname(listener, (struct sockaddr *)&address, &length) != 0) {
+        perror("server");
+        return -1;
+    }
+    server.port = ntohs(address.sin_port);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, accept_connections,
+                       (void *)(long)listener) != 0) {
+        perror("server");
+        return -1;
+    }
+    pthread_detach(thread);
+
+    return 0;
+}
+
+
+/*
+ * Start the downloader in a child process, quietly.
+ * @param traced - Non-zero to stop it for a tracer before it runs
+ */
+static pid_t spawn(char **args, int traced) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        if (traced) {
+            ptrace(PTRACE_TRACEME, 0, 0, 0);
+            raise(SIGSTOP);
+        }
+        execv(args[0], args);
+        _exit(127);
+    }
+
+    return pid;
+}
+
+
+/*
+ * Run the downloader under ptrace, following all its threads, and count
+ * the syscalls they enter. Work handed to io_uring isn't counted.
+ * @return Number of syscalls, or -1 if it couldn't be traced
+ */
+static long long count_syscalls(char **args) {
+    int status;
+    pid_t child = spawn(args, 1);
+
+    if (child < 0 || waitpid(child, &status, 0) != child ||
+        !WIFSTOPPED(status)) {
+        return -1;
+    }
+    ptrace(PTRACE_SETOPTIONS, child, 0,
+           PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK |
+           PTRACE_O_TRACEVFORK | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL);
+    if (ptrace(PTRACE_SYSCALL, child, 0, 0) != 0) {
+        kill(child, SIGKILL);
+        waitpid(child, &status, 0);
+        return -1;
+    }
+
+    long long count = 0;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, __WALL)) > 0) {
+        if (!WIFSTOPPED(status)) {
+            continue;
+        }
+
+        int signal = 0;
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+            struct __ptrace_syscall_info info;
+            if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) > 0
+                && info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+                ++count;
+            }
+        } else if (status >> 16 == 0 && WSTOPSIG(status) != SIGSTOP) {
+            // A real signal rather than an event, or a new thread starting
+            signal = WSTOPSIG(status);
+        }
+        ptrace(PTRACE_SYSCALL, pid, 0, signal);
+    }
+
+    return count;
+}
+
+
+static int remove_entry(const char *path, const struct stat *info, int flag,
+                        struct FTW *ftw) {
+    return remove(path);
+}
+
+
+/*
+ * Check each downloaded file holds exactly what was served.
+ * @return 1 if they all do, 0 otherwise
+ */
+static int check_files(const char *out_dir) {
+    static unsigned char buffer[SLICE_SIZE], expected[SLICE_SIZE];
+
+    for (int i = 0; i < server.num_files; i++) {
+        // The downloader names files after the url without its scheme
+        char path[512];
+        snprintf(path, sizeof(path), "%s/127.0.0.1:%d_file%d", out_dir,
+                 server.port, i);
+
+        FILE *file = fopen(path, "rb");
+        if (!file) {
+            return 0;
+        }
+
+        long long offset = 0;
+        size_t n;
+        int same = 1;
+        while (same && (n = fread(buffer, 1, SLICE_SIZE, file)) > 0) {
+            fill(expected, i, offset, n);
+            same = memcmp(buffer, expected, n) == 0;
+            offset += n;
+        }
+        fclose(file);
+
+        if (!same || offset != server.sizes[i]) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+/**
+ * Download every file once with one configuration and print its CSV row.
+ * @param label - Name for the first column
+ * @param downloader - Path of the downloader
+ * @param work_dir - Directory for the url file and the downloads
+ * @param workers - Worker count argument
+ * @param assembly - Assembly mode argument
+ * @param min_chunk - Minimum chunk argument, or NULL for the default
+ * @param engine - Engine argument
+ * @param extra - Extra arguments, or NULL
+ * @param syscalls - Non-zero to count syscalls in a traced run too
+ */
+void run(const char *label, const char *downloader, const char *work_dir,
+         const char *workers, const char *assembly, const char *min_chunk,
+         const char *engine, const char *extra, int syscalls) {
+    char url_file[256], out_dir[256];
+    snprintf(url_file, sizeof(url_file), "%s/urls.txt", work_dir);
+    snprintf(out_dir, sizeof(out_dir), "%s/out", work_dir);
+
+    char *args[MAX_ARGS];
+    int count = 0;
+    args[count++] = (char *)downloader;
+    args[count++] = "-a";
+    args[count++] = (char *)assembly;
+    args[count++] = "-e";
+    args[count++] = (char *)engine;
+    if (min_chunk) {
+        args[count++] = "-c";
+        args[count++] = (char *)min_chunk;
+    }
+
+    char extra_copy[512] = "";
+    if (extra) {
+        snprintf(extra_copy, sizeof(extra_copy), "%s", extra);
+    }
+    char *saved;
+    for (char *arg = strtok_r(extra_copy, " ", &saved);
+         arg && count < MAX_ARGS - 4; arg = strtok_r(NULL, " ", &saved)) {
+        args[count++] = arg;
+    }
+    args[count++] = url_file;
+    args[count++] = (char *)workers;
+    args[count++] = out_dir;
+    args[count] = NULL;
+
+    nftw(out_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    __sync_lock_test_and_set(&server.requests, 0);
+    __sync_lock_test_and_set(&server.injected, 0);
+
+    double start = now_seconds();
+    pid_t child = spawn(args, 0);
+    int status = -1;
+    struct rusage usage = { 0 };
+    if (child > 0) {
+        wait4(child, &status, 0, &usage);
+    }
+    double wall = now_seconds() - start;
+
+    int requests = server.requests;
+    int injected = server.injected;
+    int ok = child > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+             check_files(out_dir);
+    nftw(out_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    long long calls = -1;
+    if (syscalls) {
+        calls = count_syscalls(args);
+        nftw(out_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+
+    long long bytes = 0;
+    for (int i = 0; i < server.num_files; i++) {
+        bytes += server.sizes[i];
+    }
+
+    printf("%s,%s,%s,%s,%s,%s,%d,%lld,%.3f,%.1f,%ld,%.3f,%.3f,%d,%d,",
+           label, workers, assembly, min_chunk ? min_chunk : "default",
+           engine, extra ? extra : "", server.num_files, bytes, wall,
+           bytes / wall / (1024 * 1024), usage.ru_maxrss,
+           usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6,
+           requests, injected);
+    if (calls >= 0) {
+        printf("%lld", calls);
+    }
+    printf(",%s\n", ok ? "ok" : "failed");
+}
+
+
+void usage(const char *program) {
+    fprintf(stderr, "usage: %s [-s sizes] [-n copies] [-l latency_ms] "
+                    "[-b rate] [-R] [-f every] [-F every] [-w workers] "
+                    "[-a assemblies] [-c min_chunks] [-e engines] "
+                    "[-x extra_args] [-D downloader] [-S] [-H] [label]\n",
+            program);
+    exit(1);
+}
+
+
+int main(int argc, char **argv) {
+    const char *sizes = DEFAULT_SIZES;
+    int copies = DEFAULT_COPIES;
+    const char *workers = DEFAULT_WORKERS;
+    const char *assemblies = DEFAULT_ASSEMBLIES;
+    const char *min_chunks = NULL;
+    const char *engines = DEFAULT_ENGINES;
+    const char *extra = NULL;
+    const char *downloader = DEFAULT_DOWNLOADER;
+    int syscalls = 0;
+    int header = 1;
+    int opt;
+
+    server.ranges = 1;
+    for (int i = 0; i < (int)sizeof(pattern); i++) {
+        pattern[i] = i % 251;
+    }
+
+    while ((opt = getopt(argc, argv, "s:n:l:b:Rf:F:w:a:c:e:x:D:SH")) != -1) {
+        switch (opt) {
+        case 's':
+            sizes = optarg;
+            break;
+        case 'n':
+            copies = atoi(optarg);
+            break;
+        case 'l':
+            server.latency = atof(optarg) / 1000;
+            break;
+        case 'b':
+            server.rate = parse_size(optarg);
+            break;
+        case 'R':
+            server.ranges = 0;
+            break;
+        case 'f':
+            server.fail_every = atoi(optarg);
+            break;
+        case 'F':
+            server.cut_every = atoi(optarg);
+            break;
+        case 'w':
+            workers = optarg;
+            break;
+        case 'a':
+            assemblies = optarg;
+            break;
+        case 'c':
+            min_chunks = optarg;
+            break;
+        case 'e':
+            engines = optarg;
+            break;
+        case 'x':
+            extra = optarg;
+            break;
+        case 'D':
+            downloader = optarg;
+            break;
+        case 'S':
+            syscalls = 1;
+            break;
+        case 'H':
+            header = 0;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (copies < 1 || copies > MAX_LIST || server.latency < 0 ||
+        server.rate < 0 || server.fail_every < 0 || server.cut_every < 0) {
+        usage(argv[0]);
+    }
+    const char *label = optind < argc ? argv[optind] : argv[0];
+
+    char *size_list[MAX_LIST], *worker_list[MAX_LIST];
+    char *assembly_list[MAX_LIST], *chunk_list[MAX_LIST];
+    char *engine_list[MAX_LIST];
+    int num_sizes = split_list(sizes, size_list);
+    int num_workers = split_list(workers, worker_list);
+    int num_assemblies = split_list(assemblies, assembly_list);
+    int num_engines = split_list(engines, engine_list);
+    int num_chunks = 1;
+    chunk_list[0] = NULL;
+    if (min_chunks) {
+        num_chunks = split_list(min_chunks, chunk_list);
+    }
+
+    for (int copy = 0; copy < copies; copy++) {
+        for (int s = 0; s < num_sizes; s++) {
+            long long size = parse_size(size_list[s]);
+            if (size < 0) {
+                usage(argv[0]);
+            }
+            server.sizes[server.num_files++] = size;
+        }
+    }
+
+    if (access(downloader, X_OK) != 0) {
+        perror(downloader);
+        exit(1);
+    }
+    if (start_server() != 0) {
+        exit(1);
+    }
+
+    char work_dir[] = "/tmp/download_bench.XXXXXX";
+    if (!mkdtemp(work_dir)) {
+        perror("mkdtemp");
+        exit(1);
+    }
+
+    char url_file[256];
+    snprintf(url_file, sizeof(url_file), "%s/urls.txt", work_dir);
+    FILE *urls = fopen(url_file, "w");
+    for (int i = 0; i < server.num_files; i++) {
+        fprintf(urls, "http://127.0.0.1:%d/file%d\n", server.port, i);
+    }
+    fclose(urls);
+
+    if (header) {
+        printf("label,workers,assembly,min_chunk,engine,extra,files,bytes,"
+               "wall_s,mib_per_s,peak_rss_kib,user_s,sys_s,requests,"
+               "injected,syscalls,check\n");
+    }
+
+    for (int w = 0; w < num_workers; w++) {
+        for (int a = 0; a < num_assemblies; a++) {
+            for (int c = 0; c < num_chunks; c++) {
+                for (int e = 0; e < num_engines; e++) {
+                    run(label, downloader, work_dir, worker_list[w],
+                        assembly_list[a], chunk_list[c], engine_list[e],
+                        extra, syscalls);
+                    fflush(stdout);
+                }
+            }
+        }
+    }
+
+    nftw(work_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    return 0;
+}
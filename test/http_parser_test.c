@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "http_parser.h"
+
+
+static const char *response =
+    "HTTP/1.1 206 Partial Content\r\n"
+    "Content-Length: 500\r\n"
+    "content-range: bytes 0-499/1234\r\n"
+    "Accept-Ranges: bytes\r\n"
+    "ETag: \"5c3e-4f1\"\r\n"
+    "Location:  /elsewhere \r\n"
+    "\r\n"
+    "body\r\n\r\nbytes";
+
+
+int main(int argc, char **argv) {
+    HttpParser parser;
+    size_t length = strlen(response);
+    size_t header_length = strstr(response, "\r\n\r\n") + 4 - response;
+
+    // Whole response at once: stops at the end of the header
+    http_parser_init(&parser);
+    ssize_t consumed = http_parser_feed(&parser, response, length);
+    printf("consumed: %d, expected: %d\n", (int)consumed, (int)header_length);
+    printf("done: %d, expected: 1\n", parser.state == PARSE_DONE);
+    printf("status: %d, expected: 206\n", parser.head.status);
+    printf("keep alive: %d, expected: 1\n", parser.head.keep_alive);
+    printf("content length: %lld, expected: 500\n",
+           (long long)parser.head.content_length);
+    printf("range: %lld-%lld/%lld, expected: 0-499/1234\n",
+           (long long)parser.head.range_start,
+           (long long)parser.head.range_end,
+           (long long)parser.head.range_total);
+    printf("accept ranges: %d, expected: 1\n", parser.head.accept_ranges);
+    printf("etag: %s, expected: \"5c3e-4f1\"\n", parser.head.validator.etag);
+    printf("location: %s, expected: /elsewhere\n", parser.head.location);
+
+    // One byte at a time gives the same result
+    http_parser_init(&parser);
+    size_t fed = 0;
+    while (fed < length && parser.state != PARSE_DONE) {
+        fed += http_parser_feed(&parser, &response[fed], 1);
+    }
+    printf("bytewise consumed: %d, expected: %d\n", (int)fed,
+           (int)header_length);
+    printf("bytewise total: %lld, expected: 1234\n",
+           (long long)parser.head.range_total);
+
+    // The Content-Range must lie within the requested range, from its start
+    printf("range matches: %d, expected: 1\n",
+           http_range_matches(&parser.head, "0-499"));
+    printf("longer range matches: %d, expected: 1\n",
+           http_range_matches(&parser.head, "0-999"));
+    printf("open range matches: %d, expected: 1\n",
+           http_range_matches(&parser.head, "0-"));
+    printf("shorter range matches: %d, expected: 0\n",
+           http_range_matches(&parser.head, "0-399"));
+    printf("other start matches: %d, expected: 0\n",
+           http_range_matches(&parser.head, "100-499"));
+
+    const char *chunked = "HTTP/1.0 200 OK\n"
+                          "Transfer-Encoding: gzip, chunked\n"
+                          "Connection: Keep-Alive\n"
+                          "Accept-Ranges: none\n\n";
+    http_parser_init(&parser);
+    http_parser_feed(&parser, chunked, strlen(chunked));
+    printf("bare LF done: %d, expected: 1\n", parser.state == PARSE_DONE);
+    printf("chunked: %d, expected: 1\n", parser.head.chunked);
+    printf("1.0 keep alive: %d, expected: 1\n", parser.head.keep_alive);
+    printf("no ranges: %d, expected: 0\n", parser.head.accept_ranges);
+    printf("no length: %lld, expected: -1\n",
+           (long long)parser.head.content_length);
+    printf("no range: %lld, expected: -1\n",
+           (long long)parser.head.range_start);
+
+    const char *unsatisfied = "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                              "Content-Range: bytes */1234\r\n"
+                              "Connection: close\r\n\r\n";
+    http_parser_init(&parser);
+    http_parser_feed(&parser, unsatisfied, strlen(unsatisfied));
+    printf("unsatisfied: %lld/%lld, expected: -1/1234\n",
+           (long long)parser.head.range_start,
+           (long long)parser.head.range_total);
+    printf("closed: %d, expected: 0\n", parser.head.keep_alive);
+
+    const char *bad_status = "HTTP/1.1 2x6 Partial\r\n\r\n";
+    http_parser_init(&parser);
+    printf("bad status: %d, expected: -1\n",
+           (int)http_parser_feed(&parser, bad_status, strlen(bad_status)));
+
+    const char *two_lengths = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n"
+                              "Content-Length: 6\r\n\r\n";
+    http_parser_init(&parser);
+    printf("differing lengths: %d, expected: -1\n",
+           (int)http_parser_feed(&parser, two_lengths, strlen(two_lengths)));
+
+    // Offsets past 4 GB, for resources of tens of GB
+    const char *large = "HTTP/1.1 206 Partial Content\r\n"
+                        "Content-Length: 4294967296\r\n"
+                        "Content-Range: bytes 34359738368-38654705663/"
+                        "53687091200\r\n\r\n";
+    http_parser_init(&parser);
+    http_parser_feed(&parser, large, strlen(large));
+    printf("large length: %lld, expected: 4294967296\n",
+           (long long)parser.head.content_length);
+    printf("large range: %lld-%lld/%lld, "
+           "expected: 34359738368-38654705663/53687091200\n",
+           (long long)parser.head.range_start,
+           (long long)parser.head.range_end,
+           (long long)parser.head.range_total);
+    printf("large range matches: %d, expected: 1\n",
+           http_range_matches(&parser.head, "34359738368-38654705663"));
+
+    return 0;
+}
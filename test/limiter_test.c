@@ -0,0 +1,78 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "limiter.h"
+
+
+double now_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+/*
+ * Holds one of example.com's slots for a while before giving it back, so
+ * main's limiter_acquire has to wait for it.
+ */
+void *holder(void *arg) {
+    Limiter *limiter = (Limiter*)arg;
+
+    usleep(50000);
+    limiter_release(limiter, "example.com", 80);
+
+    return NULL;
+}
+
+
+int main(int argc, char **argv) {
+    Limiter *limiter = limiter_alloc(0, 0, 2);
+
+    // Two slots per host, counted separately for each host and port
+    printf("first slot: %d, expected: 0\n",
+           limiter_try_acquire(limiter, "example.com", 80));
+    printf("second slot: %d, expected: 0\n",
+           limiter_try_acquire(limiter, "example.com", 80));
+    printf("third slot: %d, expected: -1\n",
+           limiter_try_acquire(limiter, "example.com", 80));
+    printf("other host: %d, expected: 0\n",
+           limiter_try_acquire(limiter, "example.org", 80));
+    printf("other port: %d, expected: 0\n",
+           limiter_try_acquire(limiter, "example.com", 8080));
+
+    // Without rates, reading never waits
+    printf("unlimited wait: %g, expected: 0\n",
+           limiter_consume(limiter, "example.com", 80, 1 << 30));
+
+    // A blocked acquire goes ahead once another thread releases a slot
+    pthread_t thread;
+    pthread_create(&thread, NULL, holder, limiter);
+    double start = now_seconds();
+    limiter_acquire(limiter, "example.com", 80);
+    double waited = now_seconds() - start;
+    pthread_join(thread, NULL);
+    printf("acquire waited for release: %d, expected: 1\n", waited > 0.04);
+
+    limiter_free(limiter);
+
+    // 1000 bytes/s over all hosts allows a burst of a quarter second
+    limiter = limiter_alloc(1000, 0, 0);
+    printf("within burst: %g, expected: 0\n",
+           limiter_consume(limiter, "example.com", 80, 200));
+    double wait = limiter_consume(limiter, "example.org", 80, 300);
+    printf("global debt wait: %d, expected: 1\n", wait > 0.24 && wait < 0.26);
+    limiter_free(limiter);
+
+    // Each host has its own bucket
+    limiter = limiter_alloc(0, 1000, 0);
+    limiter_consume(limiter, "example.com", 80, 250);
+    wait = limiter_consume(limiter, "example.com", 80, 100);
+    printf("host debt wait: %d, expected: 1\n", wait > 0.09 && wait < 0.11);
+    printf("other host wait: %g, expected: 0\n",
+           limiter_consume(limiter, "example.org", 80, 100));
+    limiter_free(limiter);
+
+    return 0;
+}
@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "manifest.h"
+
+#define PATH "/tmp/manifest_test.manifest"
+
+
+int main(int argc, char **argv) {
+    HttpValidator validator = { "\"5c3e-4f1\"",
+                                "Tue, 01 Jan 2019 00:00:00 GMT" };
+    Manifest manifest, loaded;
+
+    manifest_init(&manifest, "i.imgur.com/xlLjV00.jpg", 300000, &validator);
+    manifest_add_chunk(&manifest, 0, 100000, 100000);
+    manifest_add_chunk(&manifest, 100000, 200000, 5000);
+
+    printf("save: %d, expected: 0\n", manifest_save(&manifest, PATH));
+    printf("load: %d, expected: 0\n", manifest_load(&loaded, PATH));
+
+    printf("url: %d, expected: 0\n", strcmp(loaded.url, manifest.url));
+    printf("length: %lld, expected: 300000\n",
+           (long long)loaded.content_length);
+    printf("last-modified: %d, expected: 0\n",
+           strcmp(loaded.validator.last_modified, validator.last_modified));
+    printf("chunks: %d, expected: 2\n", loaded.num_chunks);
+    printf("completed: %lld, expected: 5000\n",
+           (long long)loaded.chunks[1].completed);
+
+    printf("matches: %d, expected: 1\n",
+           manifest_matches(&loaded, manifest.url, 300000, &validator));
+    printf("other length: %d, expected: 0\n",
+           manifest_matches(&loaded, manifest.url, 300001, &validator));
+
+    HttpValidator changed = validator;
+    strcpy(changed.etag, "\"5c3e-4f2\"");
+    printf("changed etag: %d, expected: 0\n",
+           manifest_matches(&loaded, manifest.url, 300000, &changed));
+
+    // Without an ETag on one side, Last-Modified decides
+    changed.etag[0] = '\0';
+    printf("no etag: %d, expected: 1\n",
+           manifest_matches(&loaded, manifest.url, 300000, &changed));
+
+    HttpValidator none = { "", "" };
+    printf("no validators: %d, expected: 0\n",
+           manifest_matches(&loaded, manifest.url, 300000, &none));
+
+    manifest_clear(&loaded);
+    manifest_clear(&manifest);
+    remove(PATH);
+
+    printf("load missing: %d, expected: -1\n", manifest_load(&loaded, PATH));
+
+    FILE *file = fopen(PATH, "w");
+    fprintf(file, "url a/b\nlength 10\nchunk 0 5 7\n");
+    fclose(file);
+    printf("load malformed: %d, expected: -1\n", manifest_load(&loaded, PATH));
+    remove(PATH);
+
+    // Offsets and lengths past 4 GB survive a save and load
+    off_t gb = 1024 * 1024 * 1024;
+    manifest_init(&manifest, "example.com/data.bin", 50 * gb, &validator);
+    manifest_add_chunk(&manifest, 40 * gb, 10 * gb, 6 * gb);
+    manifest_save(&manifest, PATH);
+    printf("large load: %d, expected: 0\n", manifest_load(&loaded, PATH));
+    printf("large length: %lld, expected: 53687091200\n",
+           (long long)loaded.content_length);
+    printf("large chunk: %lld+%lld, expected: 42949672960+10737418240\n",
+           (long long)loaded.chunks[0].offset,
+           (long long)loaded.chunks[0].length);
+    printf("large completed: %lld, expected: 6442450944\n",
+           (long long)loaded.chunks[0].completed);
+    manifest_clear(&loaded);
+    manifest_clear(&manifest);
+    remove(PATH);
+
+    return 0;
+}
@@ -0,0 +1,129 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "pool.h"
+
+#define NUM_THREADS 8
+#define N 100000
+
+
+/*
+ * Each thread repeatedly checks a socket out and back in. A socket must
+ * never be handed to two threads at once, which is checked by marking it
+ * busy while checked out.
+ */
+int busy[1024];
+int errors = 0;
+pthread_mutex_t errors_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void *churn(void *arg) {
+    ConnectionPool *pool = (ConnectionPool*)arg;
+
+    for (int i = 0; i < N; ++i) {
+        int sock = pool_checkout(pool, "example.com", 80, NULL);
+        if (sock == -1) {
+            continue;
+        }
+
+        if (__sync_lock_test_and_set(&busy[sock], 1)) {
+            pthread_mutex_lock(&errors_mutex);
+            ++errors;
+            pthread_mutex_unlock(&errors_mutex);
+        }
+        __sync_lock_release(&busy[sock]);
+
+        pool_checkin(pool, "example.com", 80, sock, NULL);
+    }
+
+    return NULL;
+}
+
+
+int main(int argc, char **argv) {
+    ConnectionPool *pool = pool_alloc(4, 30);
+    int pair[2], peers[8];
+
+    printf("checkout from empty pool: %d, expected: -1\n",
+           pool_checkout(pool, "example.com", 80, NULL));
+
+    // A socket comes back only for the host and port it was returned under
+    socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    pool_checkin(pool, "example.com", 80, pair[0], NULL);
+    printf("checkout other host: %d, expected: -1\n",
+           pool_checkout(pool, "example.org", 80, NULL));
+    printf("checkout other port: %d, expected: -1\n",
+           pool_checkout(pool, "example.com", 8080, NULL));
+    int sock = pool_checkout(pool, "example.com", 80, NULL);
+    printf("checkout same host: %d, expected: %d\n", sock, pair[0]);
+
+    // A socket carrying a TLS session only goes to a checkout asking for
+    // one, and comes back with its session
+    Tls *tls = NULL;
+    pool_checkin(pool, "example.com", 80, sock, NULL);
+    printf("secure checkout of plain socket: %d, expected: -1\n",
+           pool_checkout(pool, "example.com", 80, &tls));
+    sock = pool_checkout(pool, "example.com", 80, NULL);
+
+    int secure_pair[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, secure_pair);
+    Tls *session = tls_open(secure_pair[0], "example.com", 443);
+    pool_checkin(pool, "example.com", 443, secure_pair[0], session);
+    printf("plain checkout of secure socket: %d, expected: -1\n",
+           pool_checkout(pool, "example.com", 443, NULL));
+    printf("secure checkout: %d, expected: %d\n",
+           pool_checkout(pool, "example.com", 443, &tls), secure_pair[0]);
+    printf("session kept: %d, expected: 1\n", tls == session);
+    tls_free(session, 0);
+    close(secure_pair[0]);
+    close(secure_pair[1]);
+
+    // A socket closed by the peer while idle is discarded
+    pool_checkin(pool, "example.com", 80, sock, NULL);
+    close(pair[1]);
+    printf("checkout closed socket: %d, expected: -1\n",
+           pool_checkout(pool, "example.com", 80, NULL));
+
+    // At most max_idle sockets are kept per host
+    for (int i = 0; i < 8; ++i) {
+        socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+        peers[i] = pair[1];
+        pool_checkin(pool, "example.com", 80, pair[0], NULL);
+    }
+    int kept = 0;
+    int socks[8];
+    while ((sock = pool_checkout(pool, "example.com", 80, NULL)) != -1) {
+        socks[kept++] = sock;
+    }
+    printf("idle sockets kept: %d, expected: 4\n", kept);
+
+    // Concurrent checkout and checkin
+    for (int i = 0; i < kept; ++i) {
+        pool_checkin(pool, "example.com", 80, socks[i], NULL);
+    }
+
+    pthread_t thread[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        pthread_create(&thread[i], NULL, churn, pool);
+    }
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        pthread_join(thread[i], NULL);
+    }
+
+    kept = 0;
+    while ((sock = pool_checkout(pool, "example.com", 80, NULL)) != -1) {
+        close(sock);
+        ++kept;
+    }
+    printf("shared sockets: %d, expected: 0\n", errors);
+    printf("idle sockets after churn: %d, expected: 4\n", kept);
+
+    for (int i = 0; i < 8; ++i) {
+        close(peers[i]);
+    }
+    pool_free(pool);
+
+    return 0;
+}
@@ -0,0 +1,251 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "queue.h"
+
+#define DEFAULT_ITEMS 200000
+
+// Items moved per call in the batch pattern
+#define BATCH 16
+
+// Items put back to back in the bursty pattern, and the pause between bursts
+#define BURST 64
+#define BURST_PAUSE_NS 20000
+
+
+/*
+ * Throughput and latency of the Queue implementation this is linked
+ * against. Each configuration moves a fixed number of items from producer
+ * threads to consumer threads and reports items/s and the 50th and 99th
+ * percentile time from put to get, one CSV row per configuration. Built
+ * once per implementation so results can be compared directly or kept to
+ * catch regressions.
+ *
+ * usage: queue_bench [-n items] [-H] [label]
+ *   -n items  items moved per configuration
+ *   -H        don't print the CSV header row
+ *   label     implementation name for the first column
+ */
+
+typedef enum {
+    PATTERN_STEADY,  // one queue_put/queue_get per item
+    PATTERN_BATCH,   // queue_put_many/queue_get_many of BATCH items
+    PATTERN_BURSTY   // bursts of BURST puts separated by a pause
+} Pattern;
+
+static const char *pattern_names[] = { "steady", "batch", "bursty" };
+
+
+// An item in flight, stamped when it is put
+typedef struct {
+    int64_t put_ns;
+} Item;
+
+
+typedef struct {
+    Queue *queue;
+    Pattern pattern;
+    Item *items;        // this producer's items
+    int count;
+} Producer;
+
+
+typedef struct {
+    Queue *queue;
+    Pattern pattern;
+    int64_t *latencies; // put-to-get time of each item taken, in ns
+    int count;          // number of latencies recorded
+} Consumer;
+
+
+static int64_t now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+
+void *produce(void *arg) {
+    Producer *producer = (Producer*)arg;
+    void *batch[BATCH];
+
+    for (int i = 0; i < producer->count; ) {
+        if (producer->pattern == PATTERN_BATCH) {
+            int n = producer->count - i < BATCH ? producer->count - i : BATCH;
+            int64_t stamp = now_ns();
+            for (int j = 0; j < n; ++j) {
+                producer->items[i + j].put_ns = stamp;
+                batch[j] = &producer->items[i + j];
+            }
+            for (int put = 0; put < n; ) {
+                put += queue_put_many(producer->queue, &batch[put], n - put);
+            }
+            i += n;
+        } else {
+            producer->items[i].put_ns = now_ns();
+            queue_put(producer->queue, &producer->items[i]);
+            ++i;
+
+            if (producer->pattern == PATTERN_BURSTY && i % BURST == 0) {
+                struct timespec pause = { 0, BURST_PAUSE_NS };
+                nanosleep(&pause, NULL);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+void *consume(void *arg) {
+    Consumer *consumer = (Consumer*)arg;
+    void *batch[BATCH];
+    int max = consumer->pattern == PATTERN_BATCH ? BATCH : 1;
+
+    // Runs until the queue is closed and drained
+    int n;
+    while ((n = queue_get_many(consumer->queue, batch, max)) > 0) {
+        int64_t stamp = now_ns();
+        for (int i = 0; i < n; ++i) {
+            Item *item = (Item*)batch[i];
+            consumer->latencies[consumer->count++] = stamp - item->put_ns;
+        }
+    }
+
+    return NULL;
+}
+
+
+static int compare_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+
+/**
+ * Run one configuration and print its CSV row.
+ * @param label - Name of the queue implementation
+ * @param pattern - How items are put and got
+ * @param producers - Number of producer threads
+ * @param consumers - Number of consumer threads
+ * @param size - Queue size
+ * @param items - Total items to move, split evenly over the producers
+ */
+void run(const char *label, Pattern pattern, int producers, int consumers,
+         int size, int items) {
+    Queue *queue = queue_alloc(size);
+    pthread_t producer_threads[producers];
+    pthread_t consumer_threads[consumers];
+    Producer producer_args[producers];
+    Consumer consumer_args[consumers];
+
+    int per_producer = items / producers;
+    int total = per_producer * producers;
+    Item *all_items = malloc(total * sizeof(Item));
+
+    for (int i = 0; i < consumers; ++i) {
+        consumer_args[i].queue = queue;
+        consumer_args[i].pattern = pattern;
+        consumer_args[i].latencies = malloc(total * sizeof(int64_t));
+        consumer_args[i].count = 0;
+    }
+
+    int64_t start = now_ns();
+
+    for (int i = 0; i < consumers; ++i) {
+        pthread_create(&consumer_threads[i], NULL, consume, &consumer_args[i]);
+    }
+
+    for (int i = 0; i < producers; ++i) {
+        producer_args[i].queue = queue;
+        producer_args[i].pattern = pattern;
+        producer_args[i].items = &all_items[i * per_producer];
+        producer_args[i].count = per_producer;
+        pthread_create(&producer_threads[i], NULL, produce, &producer_args[i]);
+    }
+
+    for (int i = 0; i < producers; ++i) {
+        pthread_join(producer_threads[i], NULL);
+    }
+
+    queue_close(queue);
+
+    for (int i = 0; i < consumers; ++i) {
+        pthread_join(consumer_threads[i], NULL);
+    }
+
+    double elapsed = (now_ns() - start) / 1e9;
+    queue_free(queue);
+
+    // Gather every latency to take the percentiles
+    int64_t *latencies = malloc(total * sizeof(int64_t));
+    int received = 0;
+    for (int i = 0; i < consumers; ++i) {
+        memcpy(&latencies[received], consumer_args[i].latencies,
+               consumer_args[i].count * sizeof(int64_t));
+        received += consumer_args[i].count;
+        free(consumer_args[i].latencies);
+    }
+    qsort(latencies, received, sizeof(int64_t), compare_int64);
+
+    int64_t p50 = received ? latencies[received / 2] : 0;
+    int64_t p99 = received ? latencies[(int)(received * 0.99)] : 0;
+
+    printf("%s,%s,%d,%d,%d,%d,%.0f,%lld,%lld,%s\n", label,
+           pattern_names[pattern], producers, consumers, size, total,
+           received / elapsed, (long long)p50, (long long)p99,
+           received == total ? "ok" : "lost");
+
+    free(latencies);
+    free(all_items);
+}
+
+
+int main(int argc, char **argv) {
+    int items = DEFAULT_ITEMS;
+    int header = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:H")) != -1) {
+        switch (opt) {
+        case 'n':
+            items = atoi(optarg);
+            break;
+        case 'H':
+            header = 0;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n items] [-H] [label]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    const char *label = optind < argc ? argv[optind] : argv[0];
+
+    // producers:consumers of 1:1, 1:N, N:1 and N:N
+    int layouts[][2] = { { 1, 1 }, { 1, 4 }, { 4, 1 }, { 4, 4 } };
+    int sizes[] = { 16, 1024 };
+
+    if (header) {
+        printf("queue,pattern,producers,consumers,size,items,items_per_sec,"
+               "p50_ns,p99_ns,check\n");
+    }
+
+    for (int p = PATTERN_STEADY; p <= PATTERN_BURSTY; ++p) {
+        for (int s = 0; s < 2; ++s) {
+            for (int l = 0; l < 4; ++l) {
+                run(label, (Pattern)p, layouts[l][0], layouts[l][1], sizes[s],
+                    items);
+                fflush(stdout);
+            }
+        }
+    }
+
+    return 0;
+}
@@ -30,6 +30,66 @@ void *doSum(void *arg) {
 }
 
 
+// Blocks in queue_get until the queue is closed
+void *waitClosed(void *arg) {
+    return queue_get((Queue*)arg);
+}
+
+
+/*
+ * The batch, non-blocking, timed and close operations, on a queue of four
+ * items (a power of two, so each implementation holds exactly four).
+ */
+void testOperations(void) {
+    Queue *queue = queue_alloc(4);
+    void *item;
+    void *items[8];
+    intptr_t values[6] = { 1, 2, 3, 4, 5, 6 };
+
+    printf("try_get empty: %d, expected: -1\n", queue_try_get(queue, &item));
+    printf("get_timed empty: %d, expected: -1\n",
+           queue_get_timed(queue, &item, 50));
+
+    printf("put_many: %d, expected: 4\n",
+           queue_put_many(queue, (void**)values, 6));
+    printf("try_put full: %d, expected: -1\n", queue_try_put(queue, NULL));
+
+    int n = queue_get_many(queue, items, 8);
+    printf("get_many: %d, expected: 4\n", n);
+    printf("get_many last: %d, expected: 4\n", (int)(intptr_t)items[n - 1]);
+
+    queue_try_put(queue, (void*)values[4]);
+    queue_get_timed(queue, &item, 50);
+    printf("get_timed: %d, expected: 5\n", (int)(intptr_t)item);
+
+    // Items put before closing are still delivered, then NULL
+    queue_put(queue, (void*)values[5]);
+    queue_close(queue);
+    printf("put closed: %d, expected: -1\n", queue_put(queue, NULL));
+    printf("get closed: %d, expected: 6\n", (int)(intptr_t)queue_get(queue));
+    printf("get drained: %p, expected: (nil)\n", queue_get(queue));
+
+    queue_free(queue);
+
+    // Closing wakes every blocked consumer
+    queue = queue_alloc(4);
+    pthread_t thread[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        pthread_create(&thread[i], NULL, waitClosed, queue);
+    }
+    queue_close(queue);
+
+    int woken = 0;
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        pthread_join(thread[i], &item);
+        woken += item == NULL;
+    }
+    printf("woken by close: %d, expected: %d\n", woken, NUM_THREADS);
+
+    queue_free(queue);
+}
+
+
 
 int main(int argc, char **argv) {
 
@@ -64,8 +124,19 @@ int main(int argc, char **argv) {
         sum += value;
     }
 
+    // Every item went through once, and the consumers had to wait at
+    // least once, for the first item
+    QueueStats stats;
+    queue_stats(queue, &stats);
+    printf("stats puts: %ld, expected: %d\n", stats.puts, N + NUM_THREADS);
+    printf("stats gets: %ld, expected: %d\n", stats.gets, N + NUM_THREADS);
+    printf("get waits counted: %d, expected: 1\n",
+           stats.get_waits > 0 && stats.get_wait_time > 0);
+
     queue_free(queue);
 
     printf("total sum: %d, expected sum: %d\n", (int)sum, expected);
+
+    testOperations();
     return 0;
 }
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+#define SUMMARY "stats_test.json"
+
+
+/*
+ * Read a whole file into a string, which the caller frees.
+ */
+char *read_file(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return NULL;
+    }
+
+    static char contents[16384];
+    size_t length = fread(contents, 1, sizeof(contents) - 1, file);
+    contents[length] = '\0';
+    fclose(file);
+
+    return strdup(contents);
+}
+
+
+int main(int argc, char **argv) {
+    int slots[] = { 1, 3 };
+    Stats *stats = stats_alloc(2, slots);
+
+    HttpTiming timing = { 0 };
+    timing.dns = 0.25;
+    timing.connect = 0.5;
+    timing.tls = 0.25;
+    timing.resumed = 1;
+    timing.first_byte = 0.125;
+    timing.transfer = 1;
+    timing.bytes = 1200;
+
+    // Totals of a download's requests
+    RequestTotals totals = { 0 };
+    totals_add(&totals, &timing, 1000);
+    totals_add(&totals, &timing, 500);
+    printf("requests: %d, expected: 2\n", totals.requests);
+    printf("bytes: %lld, expected: 1500\n", totals.bytes);
+    printf("read: %lld, expected: 2400\n", totals.read);
+    printf("transfer: %g, expected: 2\n", totals.transfer);
+    printf("handshakes: %d, expected: 2\n", totals.handshakes);
+    printf("resumed: %d, expected: 2\n", totals.resumed);
+
+    stats_request(stats, 0, &timing, 1000);
+    stats_request(stats, 1, &timing, 500);
+    stats_download(stats, "host/a \"quoted\" name", NULL, 1500, 2.0, &totals);
+    stats_download(stats, "host/missing", "probe failed", -1, 0.5,
+                   &(RequestTotals){ 0 });
+
+    QueueStats todo = { 4, 4, 0, 1, 0, 0.5 };
+    QueueStats done = { 4, 4, 0, 0, 0, 0 };
+    printf("written: %d, expected: 0\n",
+           stats_write_json(stats, SUMMARY, &todo, &done));
+
+    char *json = read_file(SUMMARY);
+    printf("read back: %d, expected: 1\n", json != NULL);
+    if (json) {
+        printf("bytes in summary: %d, expected: 1\n",
+               strstr(json, "\"bytes\": 1500,") != NULL);
+        printf("completed: %d, expected: 1\n",
+               strstr(json, "\"completed\": 1,") != NULL);
+        printf("failed: %d, expected: 1\n",
+               strstr(json, "\"failed\": 1,") != NULL);
+        printf("escaped url: %d, expected: 1\n",
+               strstr(json, "\"host/a \\\"quoted\\\" name\"") != NULL);
+        printf("worker slots: %d, expected: 1\n",
+               strstr(json, "\"id\": 1, \"slots\": 3") != NULL);
+        printf("queue waits: %d, expected: 1\n",
+               strstr(json, "\"get_waits\": 1,") != NULL);
+        printf("failure reason: %d, expected: 1\n",
+               strstr(json, "\"error\": \"probe failed\"") != NULL);
+        free(json);
+    }
+    remove(SUMMARY);
+
+    stats_free(stats);
+
+    return 0;
+}
@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include "tls.h"
+
+#define CA_PATH "/tmp/tls_test.pem"
+
+
+static SSL_CTX *server_context;
+
+
+/*
+ * Make a self-signed certificate for localhost and 127.0.0.1, and a server
+ * context presenting it. The certificate is written to CA_PATH for the
+ * client to trust.
+ */
+void make_server(void) {
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *cert = X509_new();
+
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+    X509_set_pubkey(cert, key);
+
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                               (unsigned char *)"localhost", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+
+    X509V3_CTX v3;
+    X509V3_set_ctx_nodb(&v3);
+    X509V3_set_ctx(&v3, cert, cert, NULL, NULL, 0);
+    X509_EXTENSION *names = X509V3_EXT_conf_nid(NULL, &v3,
+            NID_subject_alt_name, "DNS:localhost,IP:127.0.0.1");
+    X509_add_ext(cert, names, -1);
+    X509_EXTENSION_free(names);
+    X509_sign(cert, key, EVP_sha256());
+
+    FILE *file = fopen(CA_PATH, "w");
+    PEM_write_X509(file, cert);
+    fclose(file);
+
+    server_context = SSL_CTX_new(TLS_server_method());
+    SSL_CTX_use_certificate(server_context, cert);
+    SSL_CTX_use_PrivateKey(server_context, key);
+
+    X509_free(cert);
+    EVP_PKEY_free(key);
+}
+
+
+/*
+ * Serve one connection: answer "ping" with "pong", then close without a
+ * close_notify, as web servers often do.
+ */
+void *serve(void *arg) {
+    int sock = (int)(long)arg;
+    SSL *ssl = SSL_new(server_context);
+    SSL_set_fd(ssl, sock);
+
+    char ping[4];
+    if (SSL_accept(ssl) == 1 && SSL_read(ssl, ping, 4) == 4) {
+        SSL_write(ssl, "pong", 4);
+    }
+
+    SSL_free(ssl);
+    close(sock);
+    return NULL;
+}
+
+
+/*
+ * Connect a client socket to a new server thread.
+ */
+int connect_server(pthread_t *thread) {
+    int pair[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    pthread_create(thread, NULL, serve, (void *)(long)pair[1]);
+    return pair[0];
+}
+
+
+/*
+ * Ping the server over a session and check its answer.
+ * @return 1 if it answered pong, 0 otherwise
+ */
+int ping(Tls *tls) {
+    char pong[5] = { 0 };
+    return tls_write(tls, "ping", 4) == 4 && tls_read(tls, pong, 4) == 4 &&
+           strcmp(pong, "pong") == 0;
+}
+
+
+int main(int argc, char **argv) {
+    // The server writes with write(), and may find the client gone
+    signal(SIGPIPE, SIG_IGN);
+    make_server();
+
+    printf("missing ca file: %d, expected: -1\n",
+           tls_set_ca_file("/nonexistent/ca.pem"));
+    printf("ca file: %d, expected: 0\n", tls_set_ca_file(CA_PATH));
+
+    // A full handshake, then one resuming the session it left behind
+    pthread_t thread;
+    int sock = connect_server(&thread);
+    Tls *tls = tls_open(sock, "localhost", 443);
+    printf("handshake: %d, expected: 0\n", tls_handshake(tls));
+    printf("first resumed: %d, expected: 0\n", tls_resumed(tls));
+    printf("ping: %d, expected: 1\n", ping(tls));
+
+    char byte;
+    printf("closed without notify: %zd, expected: 0\n",
+           tls_read(tls, &byte, 1));
+    tls_free(tls, 0);
+    close(sock);
+    pthread_join(thread, NULL);
+
+    sock = connect_server(&thread);
+    tls = tls_open(sock, "localhost", 443);
+    printf("second handshake: %d, expected: 0\n", tls_handshake(tls));
+    printf("second resumed: %d, expected: 1\n", tls_resumed(tls));
+    printf("second ping: %d, expected: 1\n", ping(tls));
+    tls_free(tls, 1);
+    close(sock);
+    pthread_join(thread, NULL);
+
+    // Sessions are only resumed with the server they came from
+    sock = connect_server(&thread);
+    tls = tls_open(sock, "localhost", 8443);
+    tls_handshake(tls);
+    printf("other port resumed: %d, expected: 0\n", tls_resumed(tls));
+    ping(tls);
+    tls_free(tls, 1);
+    close(sock);
+    pthread_join(thread, NULL);
+
+    // Addresses are checked against the certificate's addresses
+    sock = connect_server(&thread);
+    tls = tls_open(sock, "127.0.0.1", 443);
+    printf("address handshake: %d, expected: 0\n", tls_handshake(tls));
+    ping(tls);
+    tls_free(tls, 1);
+    close(sock);
+    pthread_join(thread, NULL);
+
+    // A certificate for another name is rejected
+    fprintf(stderr, "expect a rejected certificate:\n");
+    sock = connect_server(&thread);
+    tls = tls_open(sock, "example.com", 443);
+    printf("wrong name: %d, expected: -1\n", tls_handshake(tls));
+    tls_free(tls, 0);
+    close(sock);
+    pthread_join(thread, NULL);
+
+    // Over a non-blocking socket the handshake waits on the socket. The
+    // server starts once the first call is made, so it can't answer in time
+    int pair[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    sock = pair[0];
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    tls = tls_open(sock, "localhost", 443);
+    int rc = tls_handshake(tls);
+    printf("handshake waits: %d, expected: %d\n", rc, TLS_WANT_READ);
+    pthread_create(&thread, NULL, serve, (void *)(long)pair[1]);
+    while (rc == TLS_WANT_READ || rc == TLS_WANT_WRITE) {
+        struct pollfd ready = { sock, tls_wants_write(tls) ? POLLOUT : POLLIN };
+        poll(&ready, 1, 1000);
+        rc = tls_handshake(tls);
+    }
+    printf("non-blocking handshake: %d, expected: 0\n", rc);
+
+    printf("nothing pending: %d, expected: 0\n", tls_pending(tls));
+    ssize_t n = tls_read(tls, &byte, 1);
+    printf("read waits: %d, expected: 1\n", n == -1 && errno == EAGAIN);
+
+    // Ping the server again, waiting for its whole answer this time
+    tls_write(tls, "ping", 4);
+    do {
+        struct pollfd ready = { sock, POLLIN };
+        poll(&ready, 1, 1000);
+        n = tls_read(tls, &byte, 1);
+    } while (n == -1 && errno == EAGAIN);
+    printf("rest pending: %d, expected: 1\n", n == 1 && tls_pending(tls));
+    tls_free(tls, 1);
+    close(sock);
+    pthread_join(thread, NULL);
+
+    tls_cleanup();
+    SSL_CTX_free(server_context);
+    unlink(CA_PATH);
+
+    return 0;
+}